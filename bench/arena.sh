@@ -0,0 +1,37 @@
+#!/bin/sh
+#
+# Compare first-packet and steady-state receive times for the ways the
+# server can back its ring storage: allocated per packet (default), or
+# one pre-faulted arena with and without huge pages and mlock. A fresh
+# server is started for each mode so that the first packet always lands
+# in memory the server has not used yet.
+#
+# Usage: bench/arena.sh [packets] [shape]
+#
+# Author: Aleksander Bapst
+
+NPACKETS=${1:-16}
+SHAPE=${2:-2x4096x4096:f32}
+PORT=${PORT:-15299}
+LOG=${TMPDIR:-/tmp}/bench_arena.$$
+
+cd "$(dirname "$0")/.." || exit 1
+[ -x bin/server ] && [ -x bin/client ] || make >/dev/null || exit 1
+trap 'rm -f $LOG' EXIT
+
+echo "mode,first_ms,steady_ms,ratio"
+for mode in "default:" "prefault:-P" "thp:-P -H thp" "thp+mlock:-P -H thp -L" \
+            "hugetlb:-P -H hugetlb"; do
+  name=${mode%%:*}
+  opts=${mode#*:}
+  ./bin/server $PORT $opts >$LOG 2>&1 &
+  server=$!
+  sleep 1
+  ./bin/client 127.0.0.1 $PORT -n $NPACKETS -S $SHAPE >/dev/null 2>&1
+  sleep 1
+  kill -INT $server 2>/dev/null
+  wait $server 2>/dev/null
+  # "Receive time: first packet X ms, steady state Y ms"
+  grep "Receive time" $LOG | \
+    awk -v m="$name" '{f = $5; s = $9; printf "%s,%.1f,%.1f,%.2f\n", m, f, s, (s > 0) ? f/s : 0}'
+done
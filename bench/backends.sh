@@ -0,0 +1,70 @@
+#!/bin/sh
+#
+# Compare the server's I/O backends: epoll, io_uring, and io_uring reading
+# into the registered ring storage arena (-P makes the storage an arena).
+# For each backend and client count, a fresh server is started, that many
+# clients share <total> packets, and the script reports the aggregate
+# throughput, the system calls the I/O threads made per packet (printed
+# by the server on SIGINT) and the server's context switches.
+#
+# Usage: bench/backends.sh [total] [shape] [counts...]
+#
+# Author: Aleksander Bapst
+
+TOTAL=${1:-32}
+SHAPE=${2:-2x4096x4096:f32}
+shift 2 2>/dev/null
+COUNTS=${*:-"1 4 16"}
+PORT=${PORT:-15300}
+LOG=${TMPDIR:-/tmp}/bench_backends.$$
+
+cd "$(dirname "$0")/.." || exit 1
+[ -x bin/server ] && [ -x bin/client ] || make >/dev/null || exit 1
+trap 'rm -f $LOG' EXIT
+
+# voluntary + involuntary context switches of all threads of a process
+ctx_switches() {
+  cat /proc/$1/task/*/status 2>/dev/null | \
+    awk '/ctxt_switches/ {n += $2} END {print n + 0}'
+}
+
+echo "backend,clients,packets,seconds,aggregate_MBps,syscalls_per_packet,ctx_switches"
+for backend in "epoll:" "io_uring:-u" "io_uring+fixed:-u -P"; do
+  name=${backend%%:*}
+  opts=${backend#*:}
+  for n in $COUNTS; do
+    ./bin/server $PORT $opts >$LOG 2>&1 &
+    server=$!
+    sleep 1
+    if [ "$name" != epoll ] && grep -q "using epoll" $LOG; then
+      echo "$name,unavailable" >&2
+      kill -INT $server 2>/dev/null
+      wait $server 2>/dev/null
+      continue 2
+    fi
+    ctx0=$(ctx_switches $server)
+
+    per=$(( (TOTAL + n - 1) / n ))
+    start=$(date +%s.%N)
+    pids=""
+    i=0
+    while [ $i -lt $n ]; do
+      ./bin/client 127.0.0.1 $PORT -n $per -S $SHAPE >/dev/null 2>&1 &
+      pids="$pids $!"
+      i=$((i + 1))
+    done
+    for pid in $pids; do
+      wait $pid
+    done
+    end=$(date +%s.%N)
+    ctx1=$(ctx_switches $server)
+
+    kill -INT $server 2>/dev/null
+    wait $server 2>/dev/null
+    # "I/O system calls: N for P packets, X per packet"
+    calls=$(awk '/I\/O system calls/ {print $8}' $LOG)
+    mb=$(grep "Total data received" $LOG | awk '{s += $4} END {print s + 0}')
+    echo "$name $n $((n * per)) $start $end $mb ${calls:-0} $((ctx1 - ctx0))" | \
+      awk '{t = $5 - $4; printf "%s,%d,%d,%.2f,%.1f,%s,%d\n", $1, $2, $3, t, $6/t, $7, $8}'
+  done
+done
@@ -0,0 +1,46 @@
+#!/bin/sh
+#
+# Measure how the server scales with the number of concurrent clients.
+# For each client count, that many clients connect at once and share a
+# total of <total> packets between them (at least one each); the
+# aggregate throughput is the data sent divided by the wall time until
+# the last client is done.
+#
+# Usage: bench/clients.sh [total] [io_threads] [counts...]
+#
+# Author: Aleksander Bapst
+
+TOTAL=${1:-64}
+IO_THREADS=${2:-1}
+shift 2 2>/dev/null
+COUNTS=${*:-"1 2 4 8 16 32 64 128 256"}
+PORT=${PORT:-15298}
+PACKET_MB=128
+
+cd "$(dirname "$0")/.." || exit 1
+[ -x bin/server ] && [ -x bin/client ] || make >/dev/null || exit 1
+
+./bin/server $PORT -i $IO_THREADS >/dev/null 2>&1 &
+SERVER=$!
+trap 'kill -INT $SERVER 2>/dev/null' EXIT
+sleep 1
+
+echo "clients,packets_per_client,seconds,aggregate_MBps,failed"
+for n in $COUNTS; do
+  per=$(( (TOTAL + n - 1) / n ))
+  start=$(date +%s.%N)
+  pids=""
+  i=0
+  while [ $i -lt $n ]; do
+    ./bin/client 127.0.0.1 $PORT -n $per >/dev/null 2>&1 &
+    pids="$pids $!"
+    i=$((i + 1))
+  done
+  failed=0
+  for pid in $pids; do
+    wait $pid || failed=$((failed + 1))
+  done
+  end=$(date +%s.%N)
+  echo "$n $per $start $end $failed" | \
+    awk -v mb=$PACKET_MB '{t = $4 - $3; printf "%d,%d,%.2f,%.1f,%d\n", $1, $2, t, $1*$2*mb/t, $5}'
+done
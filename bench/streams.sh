@@ -0,0 +1,36 @@
+#!/bin/sh
+#
+# Sweep the number of parallel connections each packet is striped across
+# (client -K). For each stream count, a fresh server is started with as
+# many I/O threads as streams, one client sends <npackets> packets, and the
+# script reports the aggregate throughput the client measured.
+#
+# Usage: bench/streams.sh [npackets] [shape] [counts...]
+#
+# Author: Aleksander Bapst
+
+NPACKETS=${1:-32}
+SHAPE=${2:-2x4096x4096:f32}
+[ $# -ge 2 ] && shift 2 || shift $#
+COUNTS=${*:-"1 2 4 8"}
+PORT=${PORT:-15400}
+LOG=${TMPDIR:-/tmp}/bench_streams.$$
+
+cd "$(dirname "$0")/.." || exit 1
+[ -x bin/server ] && [ -x bin/client ] || make >/dev/null || exit 1
+trap 'rm -f $LOG' EXIT
+
+echo "streams,seconds,aggregate_MBps"
+for k in $COUNTS; do
+  ./bin/server $PORT -i $k -K $k >/dev/null 2>&1 &
+  server=$!
+  sleep 1
+
+  ./bin/client 127.0.0.1 $PORT -n $NPACKETS -S $SHAPE -K $k >$LOG 2>&1
+  kill -INT $server 2>/dev/null
+  wait $server 2>/dev/null
+
+  # "Throughput: X MB/s", "Total data sent: X MB"
+  awk -v k=$k '/Throughput/ {bw = $2} /Total data sent/ {mb = $4}
+    END {printf "%d,%.2f,%.1f\n", k, (bw > 0) ? mb/bw : 0, bw}' $LOG
+done
@@ -0,0 +1,147 @@
+#!/bin/sh
+#
+# End-to-end benchmark suite, run by `make bench`. Starting from a baseline
+# (8 slot ring, 32 MB packets, one client, no checksum, no processing cost)
+# it sweeps one parameter at a time: ring size (server -n), packet shape
+# (client -S), client count, checksum (-c) and processing cost (server -p,
+# us of CPU per MB). Each run starts a fresh server on loopback, and the
+# clients share <packets> packets. For each run it reports the aggregate
+# throughput (total bytes over the wall time until the server has processed
+# the last packet and gone idle), the server's packet wire time
+# and queue residency percentiles, the CPU utilization of the server and
+# clients (percent of one core) and the server's peak RSS.
+#
+# Usage: bench/suite.sh [packets]
+#   FORMAT=csv|json (default csv), and RINGS, SHAPES, CLIENTS, CHECKSUMS
+#   or COSTS to change a sweep, e.g. CLIENTS="1 16"
+#
+# Author: Aleksander Bapst
+
+PACKETS=${1:-32}
+FORMAT=${FORMAT:-csv}
+RINGS=${RINGS:-"2 4 8 16"}
+SHAPES=${SHAPES:-"1x1024x1024:u8 2x1024x1024:f32 2x2048x2048:f32 2x4096x4096:f32"}
+CLIENTS=${CLIENTS:-"1 2 4 8"}
+CHECKSUMS=${CHECKSUMS:-"none crc32c xxh3 md5"}
+COSTS=${COSTS:-"0 1000 10000"}
+PORT=${PORT:-15310}
+LOG=${TMPDIR:-/tmp}/bench_suite.$$
+HZ=$(getconf CLK_TCK)
+
+cd "$(dirname "$0")/.." || exit 1
+[ -x bin/server ] && [ -x bin/client ] || make >/dev/null || exit 1
+trap 'rm -f $LOG $LOG.*' EXIT
+
+FIELDS="sweep value ring shape clients checksum cost_us_per_mb packets seconds MBps \
+wire_p50_us wire_p99_us wire_p999_us queue_p99_us server_cpu_pct client_cpu_pct \
+server_rss_MB failed"
+
+# user + system CPU ticks of a process
+cpu_ticks() {
+  awk '{print $14 + $15}' /proc/$1/stat 2>/dev/null || echo 0
+}
+
+# column of the last row of a stage in the server's latency table
+stage() {
+  awk -v s="$1" -v c="$2" '$1 == s {v = $c} END {print v + 0}' $LOG
+}
+
+# run <sweep> <value> <ring> <shape> <clients> <checksum> <cost>
+run() {
+  ring=$3 shape=$4 n=$5 csum=$6 cost=$7
+  ./bin/server $PORT -n $ring -p $cost -c $csum >$LOG 2>&1 &
+  server=$!
+  sleep 1
+  kill -0 $server 2>/dev/null || { echo "$1,$2,server failed" >&2; return; }
+  cpu0=$(cpu_ticks $server)
+
+  per=$(( (PACKETS + n - 1) / n ))
+  start=$(date +%s.%N)
+  pids=""
+  i=0
+  while [ $i -lt $n ]; do
+    ./bin/client 127.0.0.1 $PORT -n $per -S $shape -c $csum >$LOG.$i 2>&1 &
+    pids="$pids $!"
+    i=$((i + 1))
+  done
+  failed=0
+  for pid in $pids; do
+    wait $pid || failed=$((failed + 1))
+  done
+  # the run ends once the workers have processed every packet
+  while ! grep -q "No packets in processing queue" $LOG && kill -0 $server 2>/dev/null; do
+    sleep 0.02
+  done
+  end=$(date +%s.%N)
+  cpu1=$(cpu_ticks $server)
+  rss=$(awk '/VmHWM/ {print $2}' /proc/$server/status)
+  kill -INT $server 2>/dev/null
+  wait $server 2>/dev/null
+
+  mb=$(awk '/Total data received/ {s += $4} END {print s + 0}' $LOG)
+  ccpu=$(cat $LOG.* | awk '/^CPU time/ {s += $3} END {print s + 0}')
+  failed=$((failed + $(grep -c "Error" $LOG)))
+  echo "$1 $2 $ring $shape $n $csum $cost $((n * per)) $start $end $mb \
+$(stage wire 3) $(stage wire 4) $(stage wire 5) $(stage queue 4) \
+$((cpu1 - cpu0)) $ccpu ${rss:-0} $failed" | \
+    awk -v hz=$HZ -v fmt=$FORMAT -v fields="$FIELDS" '{
+      t = $10 - $9
+      split($1 " " $2 " " $3 " " $4 " " $5 " " $6 " " $7 " " $8, v, " ")
+      v[9] = sprintf("%.2f", t); v[10] = sprintf("%.1f", $11/t)
+      v[11] = $12; v[12] = $13; v[13] = $14; v[14] = $15
+      v[15] = sprintf("%.0f", 100*$16/hz/t); v[16] = sprintf("%.0f", 100*$17/t)
+      v[17] = sprintf("%.1f", $18/1024); v[18] = $19
+      n = split(fields, f, " ")
+      line = ""
+      for (i = 1; i <= n; i++) {
+        if (fmt == "json") {
+          q = (v[i] ~ /^[0-9.]+$/) ? "" : "\""
+          line = line (i > 1 ? ", " : "{") "\"" f[i] "\": " q v[i] q
+        } else {
+          line = line (i > 1 ? "," : "") v[i]
+        }
+      }
+      print line (fmt == "json" ? "}" : "")
+    }'
+}
+
+# the baseline, with one parameter changed
+sweep() {
+  name=$1
+  shift
+  for value in "$@"; do
+    ring=8 shape=2x2048x2048:f32 n=1 csum=none cost=0
+    case $name in
+      ring) ring=$value ;;
+      shape) shape=$value ;;
+      clients) n=$value ;;
+      checksum) csum=$value ;;
+      cost) cost=$value ;;
+    esac
+    # the client exits 0 either way, its message tells an algorithm it
+    # does not know or was built without from a refused connection
+    if [ $csum != none ] && ./bin/client 127.0.0.1 0 -c $csum 2>&1 |
+       grep -q -e "Unknown checksum" -e "algorithm unavailable"; then
+      echo "$name,$value,unavailable" >&2
+      continue
+    fi
+    [ "$FORMAT" = json ] && [ -n "$first" ] && printf ",\n"
+    first=1
+    run $name $value $ring $shape $n $csum $cost | tr -d '\n'
+    [ "$FORMAT" = json ] || echo
+  done
+}
+
+if [ "$FORMAT" = json ]; then
+  echo "["
+else
+  echo $FIELDS | tr ' ' ','
+fi
+first=""
+sweep ring $RINGS
+sweep shape $SHAPES
+sweep clients $CLIENTS
+sweep checksum $CHECKSUMS
+sweep cost $COSTS
+[ "$FORMAT" = json ] && printf "\n]\n"
+exit 0
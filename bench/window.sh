@@ -0,0 +1,36 @@
+#!/bin/sh
+#
+# Compare stop-and-wait (client -W 0) against credit-based streaming
+# (client -W <window>) at several simulated round-trip times. The RTT is
+# injected by the client (-d), which holds every server reply until it is
+# <rtt> ms old, so no netem/root access is needed.
+#
+# Usage: bench/window.sh [npackets] [window] [rtts...]
+#
+# Author: Aleksander Bapst
+
+NPACKETS=${1:-8}
+WINDOW=${2:-4}
+shift 2 2>/dev/null
+RTTS=${*:-"0 1 5 10 20"}
+PORT=${PORT:-15299}
+
+cd "$(dirname "$0")/.." || exit 1
+[ -x bin/server ] && [ -x bin/client ] || make >/dev/null || exit 1
+
+./bin/server $PORT -n $WINDOW >/dev/null 2>&1 &
+SERVER=$!
+trap 'kill -INT $SERVER 2>/dev/null' EXIT
+sleep 1
+
+throughput() {
+  ./bin/client 127.0.0.1 $PORT -n $NPACKETS "$@" 2>/dev/null | \
+    awk '/^Throughput:/ {print $2}'
+}
+
+echo "rtt_ms,lockstep_MBps,window${WINDOW}_MBps"
+for rtt in $RTTS; do
+  lockstep=$(throughput -W 0 -d $rtt)
+  windowed=$(throughput -W $WINDOW -d $rtt)
+  echo "$rtt,$lockstep,$windowed"
+done
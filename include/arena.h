@@ -0,0 +1,41 @@
+/*****************************************************************************
+ * Ring storage arena headers and declarations.
+ *
+ * Author: Aleksander Bapst
+ * **************************************************************************/
+#ifndef __ARENA_H__
+#define __ARENA_H__
+
+#include "safe_wrappers.h"
+
+/* Arena options */
+#define ARENA_HUGETLB  0x1 // explicit huge pages (MAP_HUGETLB, vm.nr_hugepages)
+#define ARENA_THP      0x2 // transparent huge pages (MADV_HUGEPAGE)
+#define ARENA_LOCK     0x4 // mlock the arena so it is never paged out
+#define ARENA_PREFAULT 0x8 // fault every page in at startup
+#define ARENA_SHARED   0x10 // POSIX shm segment local clients can attach to
+
+/* Name of the shared arena of the server with the given id (its pid) */
+#define ARENA_SHM_NAME "/tcp_packet_transfer.%u"
+
+#define HUGE_PAGE_SIZE ((size_t)2 << 20)
+
+/* One mmap'd region backing the image data of every ring slot */
+typedef struct {
+  unsigned char *base;
+  size_t size;
+  size_t map_size; // size of the mapping, rounded up to whole pages
+  int flags; // ARENA_* options that took effect
+  int node; // NUMA node the pages are bound to, -1 if not bound
+  double prefault_s; // seconds spent faulting pages in
+  unsigned int shm_id; // ARENA_SHARED: id in the segment name
+} arena;
+
+void arena_init(arena *a, size_t size, int flags, int node);
+void arena_destroy(arena *a);
+int arena_attach(arena *a, unsigned int id);
+int arena_parse_pages(const char *str);
+void arena_print(arena *a);
+int numa_bind_cpus(int node);
+
+#endif
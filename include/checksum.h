@@ -0,0 +1,60 @@
+/*****************************************************************************
+ * Packet integrity check headers and declarations.
+ *
+ * Author: Aleksander Bapst
+ * **************************************************************************/
+#ifndef __CHECKSUM_H__
+#define __CHECKSUM_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <openssl/md5.h>
+
+#ifdef HAVE_XXHASH
+#include <xxhash.h>
+#endif
+
+/* Checksum algorithms, the id is sent in the handshake and packet header */
+#define CSUM_NONE   0
+#define CSUM_MD5    1
+#define CSUM_CRC32C 2 // SSE4.2 crc32 instruction when available
+#define CSUM_XXH3   3 // 64-bit XXH3, needs libxxhash at build time
+#define CSUM_TREE   4 // MD5 of the MD5s of TREE_LEAF leaves, hashed in parallel
+#define CSUM_COUNT  5
+
+#define CSUM_MAX_LENGTH 16 // largest digest, size of buf_item.checksum
+
+#define TREE_LEAF (1024*1024) // bytes per leaf of the CSUM_TREE digest
+#define TREE_BATCH 256 // leaves handed to the hashing threads at a time
+
+/* Running digest of one of the algorithms above */
+typedef struct {
+  int algo;
+  union {
+    MD5_CTX md5;
+    uint32_t crc; // CRC register (pre/post inverted)
+    struct {
+      MD5_CTX root; // digest of the leaf digests so far
+      MD5_CTX leaf; // digest of the leaf being filled
+      size_t fill; // bytes in that leaf
+    } tree;
+#ifdef HAVE_XXHASH
+    XXH3_state_t *xxh3;
+#endif
+  } u;
+} checksum_ctx;
+
+int checksum_parse(const char *name);
+const char *checksum_name(int algo);
+int checksum_available(int algo);
+int checksum_length(int algo);
+int checksum_batched(int algo);
+void checksum_threads(int nthreads);
+
+void checksum_init(checksum_ctx *ctx, int algo);
+void checksum_update(checksum_ctx *ctx, const void *data, size_t length);
+void checksum_final(checksum_ctx *ctx, unsigned char *digest);
+
+uint32_t crc32c(uint32_t crc, const void *data, size_t length);
+
+#endif
@@ -0,0 +1,100 @@
+/*****************************************************************************
+ * Image data compression headers and declarations.
+ *
+ * Compressed image data is sent as a sequence of chunks, each holding up
+ * to COMP_CHUNK bytes of image data: a 4-byte header (payload length in
+ * network byte order, COMP_STORED set if the payload is not compressed)
+ * followed by the payload. The image data of each chunk is shuffled
+ * before it is compressed, so that the bytes of the elements compress
+ * together.
+ *
+ * With COMP_SPARSE, tiles of COMP_TILE bytes that hold a single value
+ * (zero padding, masked regions) are left out. The header of a chunk
+ * with such tiles has COMP_TILES set, and its payload starts with a
+ * 64-bit map of the elided tiles (bit t = tile t, network byte order)
+ * and the value of each elided tile (one element each, in tile order),
+ * followed by the remaining tiles, stored or compressed as above.
+ *
+ * Author: Aleksander Bapst
+ * **************************************************************************/
+#ifndef __COMPRESS_H__
+#define __COMPRESS_H__
+
+#include "safe_wrappers.h"
+#include <stdatomic.h>
+
+/* Compression codecs, the mode is sent in the handshake */
+#define COMP_NONE  0
+#define COMP_LZ4   1 // needs liblz4 at build time
+#define COMP_ZSTD  2 // needs libzstd at build time
+#define COMP_COUNT 3
+
+/* Byte reordering applied before compression */
+#define SHUF_NONE  0
+#define SHUF_BYTE  1 // byte k of all elements together
+#define SHUF_BIT   2 // bit k of all elements together
+#define SHUF_COUNT 3
+
+/* Codec, shuffle and level packed into one handshake word */
+#define COMP_MODE(codec,shuffle,level) ((codec) | ((shuffle) << 4) | ((level) << 8))
+#define COMP_CODEC(mode) ((mode) & 0xf)
+#define COMP_SHUFFLE(mode) (((mode) >> 4) & 0xf)
+#define COMP_LEVEL(mode) (((mode) >> 8) & 0xff)
+#define COMP_SPARSE 0x10000 // mode: elide constant tiles, with any codec
+
+#define COMP_CHUNK (256*1024) // bytes of image data per chunk
+#define COMP_CHUNK_HDR 4
+#define COMP_STORED 0x80000000u // chunk header: payload sent as is
+#define COMP_TILES  0x40000000u // chunk header: tile map and values first
+#define COMP_LEN_MASK 0x3fffffffu
+#define COMP_TILE 4096 // bytes per tile, 64 tiles per chunk
+
+#define DEFAULT_COMP_THREADS 4
+
+/* Scratch space and codec contexts of one thread */
+typedef struct {
+  int mode;
+  unsigned char *scratch; // COMP_CHUNK bytes for the shuffle
+  unsigned char *dense; // COMP_CHUNK bytes for the tiles kept (COMP_SPARSE)
+  void *cctx, *dctx; // zstd contexts, created on first use
+} comp_ctx;
+
+/* Pool of threads compressing the chunks of a packet in parallel */
+typedef struct {
+  int mode;
+  int nthreads;
+  pthread_t *tids;
+  comp_ctx *ctx; // one per thread
+  sem_t go, done;
+  int stop;
+
+  /* Packet being compressed */
+  const unsigned char *src;
+  size_t size, elem;
+  atomic_size_t next; // next chunk to compress
+  unsigned char *out; // chunk i at i*(COMP_CHUNK_HDR+COMP_CHUNK)
+  size_t *lens; // wire bytes of each chunk
+  size_t max_chunks;
+} compressor;
+
+int compress_parse(const char *str);
+const char *compress_name(int codec);
+int compress_available(int codec);
+int compress_accept(int mode);
+void compress_print(int mode, char *str, size_t len);
+size_t compress_bound(size_t size);
+int compress_shuffles(int mode, size_t elem);
+
+void comp_ctx_init(comp_ctx *c, int mode);
+void comp_ctx_free(comp_ctx *c);
+size_t compress_chunk(comp_ctx *c, size_t elem, const unsigned char *src, size_t len,\
+                      unsigned char *dst);
+int decompress_chunk(comp_ctx *c, size_t elem, const unsigned char *src, size_t zlen,\
+                     uint32_t flags, unsigned char *dst, size_t len);
+
+void compressor_init(compressor *z, int mode, int nthreads, size_t max_size);
+void compressor_start(compressor *z, const unsigned char *src, size_t size, size_t elem);
+size_t compressor_wait(compressor *z);
+void compressor_free(compressor *z);
+
+#endif
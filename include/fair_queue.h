@@ -0,0 +1,63 @@
+/*****************************************************************************
+ * Fair queue headers and declarations.
+ *
+ * Author: Aleksander Bapst
+ * **************************************************************************/
+#ifndef __FAIR_QUEUE_H__
+#define __FAIR_QUEUE_H__
+
+#include "ring_buffer.h"
+
+/* Priority classes of a flow, negotiated in the handshake */
+#define FQ_BULK     0 // shares the workers with the other bulk flows by share
+#define FQ_URGENT   1 // taken before any bulk packet (strict priority)
+#define FQ_NCLASSES 2
+
+#define FQ_MAX_SHARE 16 // largest share a flow may get
+
+/* The packets of one client. Its queued slots are linked through
+ * fair_queue.link, in the order they were finished, or of their tag.seq
+ * if the flow is ordered. */
+typedef struct fq_flow {
+  int prio; // FQ_*
+  int share; // weight against the other flows of its class, 1 to FQ_MAX_SHARE
+  int ordered; // slots are served in tag.seq order (in-order processing)
+  long next_seq; // ordered: tag.seq of the next slot to serve
+  long deficit; // bytes it may still be served this round
+  int head, tail, count; // queued slots
+  int active; // in the round of its class: a slot is queued (and is next
+              // in order if the flow is ordered)
+  struct fq_flow *next_active; // next flow in the round of its class
+  atomic_int held; // slots reserved for it and not yet released
+  atomic_ulong taken; // packets the workers took from it
+} fq_flow;
+
+typedef struct {
+  ring_buffer *buf; // ring the packets are taken from
+  long quantum; // bytes a flow may be served per round and unit of share
+  pthread_mutex_t lock;
+  pthread_cond_t cond; // a slot was queued
+  int *link; // slot queued after each one in its flow, -1 = last
+  fq_flow *first[FQ_NCLASSES], *last[FQ_NCLASSES]; // round of each class
+  fq_flow anon; // slots without an owner
+  atomic_int queued; // slots finished in the ring, not yet taken by a worker
+  atomic_int flows[FQ_NCLASSES]; // connected flows of each class
+  atomic_int shares[FQ_NCLASSES]; // shares of the flows holding slots
+  lat_hist wait[FQ_NCLASSES]; // time the packets of each class waited for a
+                              // worker since they were committed
+} fair_queue;
+
+/* Fair queue functions */
+void fq_init(fair_queue *fq, ring_buffer *buf, long quantum);
+void fq_free(fair_queue *fq);
+void fq_flow_init(fq_flow *f, int prio, int share, int ordered);
+void fq_join(fair_queue *fq, fq_flow *f);
+void fq_leave(fair_queue *fq, fq_flow *f);
+int fq_may_reserve(fair_queue *fq, fq_flow *f);
+void fq_hold(fair_queue *fq, fq_flow *f);
+void fq_drop(fair_queue *fq, fq_flow *f);
+int fq_limit(fair_queue *fq, fq_flow *f);
+buf_item *fq_take(fair_queue *fq, int *slot);
+const char *fq_class_name(int prio);
+
+#endif
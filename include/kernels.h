@@ -0,0 +1,55 @@
+/*****************************************************************************
+ * Image processing kernel headers and declarations.
+ *
+ * Author: Aleksander Bapst
+ * **************************************************************************/
+#ifndef __KERNELS_H__
+#define __KERNELS_H__
+
+#include "ring_buffer.h"
+
+/* Instruction sets a kernel may be built for, picked at run time */
+#define KERNEL_SCALAR 0 // portable C
+#define KERNEL_AVX2   1 // 8 floats at a time
+#define KERNEL_AVX512 2 // 16 floats at a time (AVX-512F)
+#define KERNEL_NISA   3
+#define KERNEL_BEST  -1 // the best the CPU has
+
+#define KERNEL_HIST_BINS 256 // bins of the stats kernel's histograms
+
+/* Product of the stats kernel, one per channel */
+typedef struct {
+  float min, max;
+  double mean;
+  uint32_t hist[KERNEL_HIST_BINS]; // KERNEL_HIST_BINS equal bins over [min, max]
+} image_stats;
+
+/* Processes image data of the given shape at `in` into `out`, which may
+ * be `in`: every kernel can run in place */
+typedef void (*kernel_fn)(const packet_shape *shape, const void *in, void *out);
+
+/* A kernel, found by name. Plugins fill one in and register it. */
+typedef struct kernel {
+  const char *name;
+  const char *desc;
+  int (*accepts)(const packet_shape *shape); // 1 if it can process the shape
+  size_t (*out_size)(const packet_shape *shape); // bytes it writes to out
+  void (*out_shape)(const packet_shape *shape, packet_shape *out); // shape of the
+                                                  // product, NULL if unchanged
+  int (*same)(const packet_shape *shape, const void *a, const void *b); // 1 if two
+                                                  // products agree (tolerance)
+  kernel_fn run[KERNEL_NISA]; // NULL where not implemented, run[0] is required
+  struct kernel *next;
+} kernel;
+
+void kernel_register(kernel *k);
+kernel *kernel_find(const char *name);
+kernel *kernel_parse(const char *spec, int *isa);
+kernel *kernel_first();
+int kernel_isa_best();
+const char *kernel_isa_name(int isa);
+int kernel_isa(const kernel *k, int isa);
+void kernel_out_shape(const kernel *k, const packet_shape *shape, packet_shape *out);
+int kernel_run(const kernel *k, int isa, const packet_shape *shape, const void *in, void *out);
+
+#endif
@@ -0,0 +1,37 @@
+/*****************************************************************************
+ * Latency histogram headers and declarations.
+ *
+ * Author: Aleksander Bapst
+ * **************************************************************************/
+#ifndef __LATENCY_H__
+#define __LATENCY_H__
+
+#include "safe_wrappers.h"
+#include <stdatomic.h>
+#include <stdint.h>
+
+/* Log-linear buckets: LAT_SUB linear sub-buckets per power of two, so a
+ * value is known to within 1/LAT_SUB (3%), from 1 ns up to 2^LAT_MAX_SHIFT
+ * ns (18 minutes, larger values are counted in the last bucket) */
+#define LAT_SUB_SHIFT 5
+#define LAT_SUB (1 << LAT_SUB_SHIFT)
+#define LAT_MAX_SHIFT 40
+#define LAT_BUCKETS ((LAT_MAX_SHIFT-LAT_SUB_SHIFT+1)*LAT_SUB)
+
+/* Histogram of the latencies of one stage, recorded from any thread */
+typedef struct {
+  const char *name;
+  atomic_ulong count;
+  atomic_ulong sum, max; // ns
+  atomic_ulong buckets[LAT_BUCKETS];
+} lat_hist;
+
+uint64_t get_time_ns();
+void lat_init(lat_hist *h, const char *name);
+void lat_record(lat_hist *h, uint64_t ns);
+uint64_t lat_percentile(lat_hist *h, double p);
+void lat_snapshot(lat_hist *h, uint64_t *counts);
+uint64_t lat_count_below(const uint64_t *counts, uint64_t ns);
+void lat_print(lat_hist *hists, int n);
+
+#endif
@@ -0,0 +1,28 @@
+/*****************************************************************************
+ * Metrics endpoint headers and declarations.
+ *
+ * Author: Aleksander Bapst
+ * **************************************************************************/
+#ifndef __METRICS_H__
+#define __METRICS_H__
+
+#include "safe_wrappers.h"
+#include "latency.h"
+
+#define METRICS_TIMEOUT 1 // seconds a scraper has to send its request
+
+/* Page of metrics in the Prometheus text format, built for each scrape */
+typedef struct {
+  char *data;
+  size_t len, cap;
+} metrics_buf;
+
+int metrics_listen(const char *addr);
+void metrics_init(metrics_buf *m);
+void metrics_free(metrics_buf *m);
+void metrics_family(metrics_buf *m, const char *name, const char *type, const char *help);
+void metrics_value(metrics_buf *m, const char *name, const char *labels, double value);
+void metrics_hist(metrics_buf *m, const char *name, const char *labels, lat_hist *h);
+void metrics_reply(metrics_buf *m, int connfd);
+
+#endif
@@ -0,0 +1,58 @@
+/*****************************************************************************
+ * Processing pipeline headers and declarations.
+ *
+ * Author: Aleksander Bapst
+ * **************************************************************************/
+#ifndef __PIPELINE_H__
+#define __PIPELINE_H__
+
+#include "fair_queue.h"
+
+#define MAX_STAGES 8
+
+/* The work a stage does on each packet */
+typedef void (*stage_fn)(buf_item *item, void *arg);
+
+typedef struct stage {
+  char name[32];
+  stage_fn fn;
+  void *arg;
+  int n_workers;
+  int index; // position in the pipeline
+  ring_buffer *in; // input ring, the receive ring for the first stage
+  ring_buffer *out; // input ring of the next stage, NULL for the last one
+  fair_queue *fq; // takes the packets of the input ring by client, NULL = in
+                  // ring order (see pipeline_fair)
+  struct pipeline *pipe;
+
+  /* Counters, updated with relaxed atomic adds by the workers */
+  atomic_ulong packets; // packets processed (discarded slots are passed on)
+  atomic_ulong bytes; // their image data
+  atomic_ulong busy_ns; // time the workers spent processing
+  atomic_ulong idle_ns; // time the workers spent waiting for a packet
+  atomic_int active; // packets the workers hold
+  lat_hist queue; // time packets waited in the input ring
+} stage;
+
+typedef struct pipeline {
+  ring_buffer *buf; // ring the packets are received into, owns them
+  int nstages;
+  stage stages[MAX_STAGES];
+  atomic_int inflight; // packets taken by the first stage, not yet released
+} pipeline;
+
+/* Pipeline functions */
+void pipeline_init(pipeline *p, ring_buffer *buf);
+stage *pipeline_add(pipeline *p, const char *name, stage_fn fn, void *arg, int n_workers);
+int pipeline_workers(pipeline *p);
+int pipeline_used(pipeline *p);
+void pipeline_fair(pipeline *p, fair_queue *fq);
+void pipeline_print(pipeline *p);
+void pipeline_free(pipeline *p);
+buf_item *stage_take(stage *s, int *slot);
+uint64_t stage_run(stage *s, buf_item *item);
+int stage_pass(stage *s, int slot);
+int stage_occupancy(stage *s);
+double stage_busy(stage *s);
+
+#endif
@@ -0,0 +1,149 @@
+/*****************************************************************************
+ * Client/server wire protocol headers and declarations.
+ *
+ * Every message is a fixed-size binary frame header, optionally followed by
+ * `length` bytes of payload. All header and payload integers are sent in
+ * network byte order. Peers that do not start with PROTO_MAGIC speak the
+ * original protocol of MAXLINE-sized text messages, which is still
+ * supported for mixed deployments.
+ *
+ * Author: Aleksander Bapst
+ * **************************************************************************/
+#ifndef __PROTOCOL_H__
+#define __PROTOCOL_H__
+
+#include "safe_wrappers.h"
+#include "ring_buffer.h"
+#include <stdint.h>
+
+#define PROTO_MAGIC 0x5450 // "TP"
+#define PROTO_VERSION 2
+#define FRAME_HDR_SIZE 24 // bytes on the wire
+#define PACKET_DESC_SIZE 16 // packet_shape after a version 2 PACKET header
+
+/* Frame types */
+#define MSG_HELLO     1 // client -> server: clock time, packet count
+#define MSG_WELCOME   2 // server -> client: accepted connection settings
+#define MSG_READY     3 // client -> server: a packet is ready to send
+#define MSG_ACK       4 // server -> client: a slot is reserved, send it (slot)
+#define MSG_PACKET    5 // client -> server: shape, image data and trailer follow
+#define MSG_BANDWIDTH 6 // server -> client: measured packet bandwidth
+#define MSG_FINISHED  7 // client -> server: no more packets
+#define MSG_CREDIT    8 // server -> client: may send N more packets (N, slots)
+#define MSG_JOIN      9 // client -> server: first frame of an extra stream
+                        // of a striped session (token low word, stream
+                        // index, token high word)
+#define MSG_CHUNKS   10 // client -> server: CRC32C of each chunk of the
+                        // packet just sent (chunk repair)
+#define MSG_NACK     11 // server -> client: packet id and (first chunk,
+                        // count) ranges of it that arrived corrupt
+#define MSG_REPAIR   12 // client -> server: the chunks of the ranges of
+                        // packet `seq` a NACK asked for follow
+#define MSG_UNKNOWN   0 // unrecognized legacy text message
+
+/* Frame flags */
+#define FLAG_ORDERED 0x0001 // HELLO: process this client's packets in order
+#define FLAG_SHM     0x0002 // HELLO/WELCOME: shared-memory transport,
+                            // PACKET: the image data is already in the slot
+#define FLAG_COMP    0x0004 // PACKET: the image data is sent as compressed
+                            // chunks (see compress.h), the frame length
+                            // holds their size
+#define FLAG_CSUM(algo) (((algo) & 0xf) << 8) // PACKET: CSUM_* used for it
+#define FRAME_CSUM(flags) (((flags) >> 8) & 0xf)
+
+/* Legacy text protocol messages */
+#define TEXT_READY    "CLIENT_READY"
+#define TEXT_ACK      "ACK"
+#define TEXT_FINISHED "CLIENT_FINISHED"
+
+typedef struct {
+  uint8_t version;
+  uint8_t type;
+  uint16_t flags;
+  uint32_t length; // payload bytes following the header
+  uint32_t seq; // sequence id (packet id for packet frames)
+  int64_t timestamp; // sender wall clock in ms
+} frame_hdr;
+
+/* Payload of HELLO and WELCOME frames. Sent as consecutive 32-bit words,
+ * new fields are appended at the end and read as 0 from older peers. */
+typedef struct {
+  uint32_t npackets;
+  uint32_t packet_size; // largest image data + trailer the sender uses
+                        // (client) or accepts (server)
+  uint32_t window; // max packets in flight (credits), 0 = stop-and-wait
+  uint32_t checksum; // CSUM_* algorithm used to sign packets
+  uint32_t shm_id; // WELCOME with FLAG_SHM: id of the server's shared arena
+  uint32_t streams; // connections each packet is striped across, 0 or 1 = no
+                    // striping (client: wanted, server: accepted)
+  uint32_t session; // WELCOME with streams > 1: low word of the random token
+                    // the extra streams join with
+  uint32_t compress; // COMP_MODE of the image data, COMP_NONE = sent as is
+                     // (client: wanted, server: accepted)
+  uint32_t repair; // chunk size of per-chunk CRCs, 0 = corrupt packets are
+                   // dropped (client: wanted, server: accepted)
+  uint32_t priority; // FQ_* class of the client's packets, 0 = bulk
+                     // (client: wanted, server: accepted)
+  uint32_t share; // weight of the client against the others of its class,
+                  // 0 = 1 (client: wanted, server: accepted)
+  uint32_t session_hi; // WELCOME with streams > 1: high word of the token
+} hello_msg;
+
+/* Most connections one packet can be striped across */
+#define MAX_STREAMS 16
+
+/* Most slots listed in one CREDIT frame (shared-memory transport) */
+#define MAX_CREDIT_SLOTS (MAXBUF/4-1)
+
+/* Most ranges listed in one NACK frame, after the packet id */
+#define MAX_NACK_RANGES ((MAXBUF/4-1)/2)
+
+/* One end of a client/server connection */
+typedef struct {
+  int fd;
+  int binary; // 1 = binary frames, 0 = legacy text messages
+  uint32_t seq; // sequence id of the next control frame we send
+  int delay_ms; // simulated delay applied to received frames (testing)
+  pthread_mutex_t lock; // serializes writers
+  rio_t rio;
+
+  /* Output queue, used instead of blocking writes when `queued` is set */
+  int queued;
+  unsigned char *out;
+  size_t outoff, outlen, outcap;
+} proto_conn;
+
+void proto_init(proto_conn *c, int fd, int binary);
+void proto_queue_writes(proto_conn *c);
+ssize_t proto_flush(proto_conn *c);
+void proto_free(proto_conn *c);
+size_t proto_msg_size(proto_conn *c, int hello, unsigned char *raw, size_t len);
+int proto_parse_hello(proto_conn *c, unsigned char *raw, hello_msg *hello, frame_hdr *hdr);
+int proto_parse_msg(proto_conn *c, unsigned char *raw, frame_hdr *hdr, uint32_t *value);
+int proto_parse_packet(proto_conn *c, unsigned char *raw, frame_hdr *hdr, packet_shape *shape);
+int proto_accept_hello(proto_conn *c, hello_msg *hello, frame_hdr *hdr);
+void proto_send_hello(proto_conn *c, hello_msg *hello, int flags, int64_t timestamp);
+void proto_send_welcome(proto_conn *c, hello_msg *hello, int flags);
+int proto_read_welcome(proto_conn *c, hello_msg *hello, frame_hdr *hdr);
+void proto_send_msg(proto_conn *c, int type);
+int proto_read_msg(proto_conn *c, frame_hdr *hdr, uint32_t *value);
+int proto_read_msg_words(proto_conn *c, frame_hdr *hdr, uint32_t *words, size_t size);
+void proto_send_ack(proto_conn *c, uint32_t slot);
+void proto_send_packet_hdr(proto_conn *c, uint32_t id, packet_shape *shape, int flags, int64_t timestamp,\
+                           size_t wire);
+void proto_send_bandwidth(proto_conn *c, uint32_t id, float bw);
+int proto_read_bandwidth(proto_conn *c, float *bw);
+void proto_send_credit(proto_conn *c, uint32_t ncredits, uint32_t *slots);
+void proto_send_join(proto_conn *c, uint64_t session, uint32_t stream);
+int proto_parse_join(proto_conn *c, unsigned char *raw, uint64_t *session, uint32_t *stream);
+void proto_send_chunks(proto_conn *c, uint32_t *crcs, int nchunks);
+int proto_parse_chunks(proto_conn *c, unsigned char *raw, frame_hdr *hdr, uint32_t *crcs, int nchunks);
+void proto_send_nack(proto_conn *c, uint32_t id, uint32_t *ranges, int nranges);
+void proto_send_repair_hdr(proto_conn *c, uint32_t id, size_t length);
+void proto_stripe(size_t size, int streams, int stream, size_t *off, size_t *len);
+float proto_word_to_float(uint32_t word);
+
+void pack_frame_hdr(unsigned char *raw, frame_hdr *hdr);
+int unpack_frame_hdr(unsigned char *raw, frame_hdr *hdr);
+
+#endif
@@ -7,40 +7,184 @@
 #define __RING_BUFFER_H__
 
 #include "safe_wrappers.h"
-#include <openssl/md5.h>
+#include <stdatomic.h>
+#include "checksum.h"
+#include "compress.h"
+#include "latency.h"
+#include "slab.h"
+#include "arena.h"
 
 #define MEGABYTE 1048576.
 #define DEFAULT_BUFFER_SIZE 8
-#define MAX_CLIENTS 5
 #define DEFAULT_NPACKETS 16
+#define DEFAULT_NWORKERS 1
+#define DEFAULT_NIOTHREADS 1
+#define DEFAULT_WINDOW 4
+#define DEFAULT_MAX_STREAMS 8 // connections a client may stripe packets across
+#define PACKET_CHUNK (256*1024) // bytes hashed per socket read/write
+#define MAX_CHUNKS 2048 // most chunks with their own CRC32C (chunk repair)
+
+/* Ring slot states */
+#define SLOT_FREE      0 // slot is empty and can be reserved
+#define SLOT_RESERVED  1 // slot is being filled by a producer
+#define SLOT_READY     2 // slot holds a valid packet
+#define SLOT_DISCARDED 3 // slot was reserved but its contents are invalid
+
+/* Ring buffer synchronization schemes */
+#define RING_LOCKFREE 0 // atomic head/tail with per-slot sequence numbers
+#define RING_MUTEX    1 // mutex protected indices with counting semaphores
+
+/* Packet element types */
+#define ELEM_U8    0
+#define ELEM_U16   1
+#define ELEM_F32   2
+#define ELEM_F64   3
+#define ELEM_COUNT 4
+
+/* Shape of the image data of a packet, sent in the packet header */
+typedef struct {
+  uint32_t channels;
+  uint32_t width;
+  uint32_t height;
+  uint32_t elem_type; // ELEM_*
+} packet_shape;
+
+/* The original fixed packet: a 2 channel 4096x4096 float SAR image */
+#define LEGACY_SHAPE {2,4096,4096,ELEM_F32}
+#define LEGACY_PAYLOAD ((size_t)2*4096*4096*sizeof(float))
+
+/* On the wire the image data is followed by a trailer holding the
+ * timestamp (8 bytes), checksum (16), id (4) and padding (4), in the
+ * layout of the original struct */
+#define PACKET_TRAILER 32
+#define TRAILER_CHECKSUM 8 // offset of the checksum in the trailer
+#define TRAILER_ID 24 // offset of the id in the trailer
 
 typedef struct {
-  float img_data[2][4096][4096];
+  packet_shape shape;
+  size_t size; // bytes of image data
+  unsigned char *data; // image data
+  int cls; // slab class of data, -1 if it is not from the slab pool
   time_t timestamp; // time since epoch in ms
-  unsigned char checksum[MD5_DIGEST_LENGTH];
+  unsigned char checksum[CSUM_MAX_LENGTH];
   int id;
+  uint64_t ready_ns; // when the packet was published (monotonic, server)
+  uint64_t stage_ns; // when it was passed to its current pipeline stage
 } buf_item;
 
 typedef struct {
-  int read; // index of read pointer
-  int write; // index of write pointer
+  void *owner; // producer-defined tag (e.g. client state), NULL if unused
+  long seq; // producer-defined sequence number within owner
+} slot_tag;
+
+/* Takes the slots of a ring as they are finished, see set_buf_sink */
+typedef void (*slot_sink)(void *arg, int slot);
+
+typedef struct ring_buffer {
+  int type; // RING_LOCKFREE or RING_MUTEX
   int n_items;
+  int *state; // SLOT_* state of each slot
+  slot_tag *tag; // producer tag of each slot
+
+  /* RING_MUTEX fields */
+  int read; // index of read pointer
+  int write; // index of write pointer (next slot to reserve)
+  int publish; // index of publish pointer (next slot to hand to consumers)
+  int reclaim; // index of the next consumed slot to give back to producers
   sem_t countsem, spacesem;
   pthread_mutex_t lock;
+
+  /* RING_LOCKFREE fields */
+  atomic_ulong head; // position of the next slot to reserve
+  atomic_ulong tail; // position of the next slot to dequeue
+  atomic_ulong *seq; // per-slot sequence numbers
+  atomic_int space_ev, count_ev; // futex words bumped on release/commit
+  atomic_int space_waiters, count_waiters; // threads sleeping on each word
+
+  slab_pool pool; // image data of the slots
+  size_t max_payload; // largest image data a slot is guaranteed to get
+  arena arena; // if base is set, slot i owns max_payload bytes at i*max_payload
+
+  slot_sink sink; // takes each slot once finished, NULL = acquire_slot
+  void *sink_arg;
+
+  /* Chained rings (init_buf_chained) hold packets of another ring */
+  struct ring_buffer *src; // ring that owns the packets, NULL if this one does
+  int *origin; // slot of src holding the packet of each slot
+
   buf_item *data[]; // flexible array member, will be malloc'd during init
 } ring_buffer;
 
+/* A packet being received, see packet_rx_init */
+typedef struct {
+  buf_item *item;
+  size_t off; // bytes received so far, image data then trailer
+  unsigned char trailer[PACKET_TRAILER];
+  int inplace; // the image data is already in item->data (shared memory)
+  int algo; // CSUM_* algorithm of the packet
+  checksum_ctx c; // digest of the bytes received so far
+  uint64_t csum_ns; // time spent hashing them
+  size_t wire; // bytes of image data on the wire
+
+  /* Compressed image data, see packet_rx_compressed */
+  comp_ctx *z; // NULL if the image data is sent as is
+  size_t elem; // element size, for the shuffle
+  size_t raw; // image data decompressed so far
+  int stage; // reading a chunk header, a chunk payload or skipping
+  size_t start, end; // wire offsets of the part being read
+  unsigned char zhdr[COMP_CHUNK_HDR];
+  unsigned char *zbuf; // COMP_CHUNK bytes for a chunk payload
+  uint32_t flags; // chunk header flags (COMP_STORED, COMP_TILES)
+  int error; // corrupt compressed data, the rest is skipped
+} packet_rx;
+
 /* Ring buffer functions */
 ring_buffer *init_buf(int n_items);
+ring_buffer *init_buf_type(int n_items, int type, size_t budget);
+ring_buffer *init_buf_chained(ring_buffer *src);
+void init_buf_arena(ring_buffer *buf, int flags, int node);
+void set_buf_sink(ring_buffer *buf, slot_sink sink, void *arg);
 void destroy_buf(ring_buffer *buf);
+void free_buf(ring_buffer *buf);
+buf_item *reserve_slot(ring_buffer *buf, int *slot);
+buf_item *try_reserve_slot(ring_buffer *buf, int *slot);
+int alloc_payload(ring_buffer *buf, int slot, packet_shape *shape);
+void commit_slot(ring_buffer *buf, int slot);
+void discard_slot(ring_buffer *buf, int slot);
 void enqueue(ring_buffer *buf, buf_item *cache_buf);
+buf_item *acquire_slot(ring_buffer *buf, int *slot);
+void release_slot(ring_buffer *buf, int slot);
+void pass_slot(ring_buffer *buf, int slot, ring_buffer *to);
 void dequeue(ring_buffer *buf);
+int buf_used(ring_buffer *buf);
 void print_buffer(ring_buffer *buf);
-void process_item(buf_item *item);
+void process_item(buf_item *item, int us_per_mb);
 
 /* Helper functions */
 time_t get_time_ms(struct timeval *tv);
-int md5checksum(char *item,size_t length);
-void print_checksum(buf_item *item);
+size_t shape_size(packet_shape *shape);
+size_t shape_elem_size(packet_shape *shape);
+int shape_parse(const char *str, packet_shape *shape);
+void shape_print(packet_shape *shape, char *str, size_t len);
+void pack_trailer(unsigned char *raw, buf_item *item);
+void unpack_trailer(unsigned char *raw, buf_item *item);
+int packet_checksum(buf_item *item, int algo);
+void print_checksum(buf_item *item, int algo);
+void packet_rx_init(packet_rx *rx, buf_item *item, int algo);
+void packet_rx_inplace(packet_rx *rx);
+void packet_rx_compressed(packet_rx *rx, comp_ctx *z, unsigned char *zbuf, size_t wire);
+size_t packet_rx_span(packet_rx *rx, size_t off, unsigned char **p, size_t max);
+void packet_rx_advance(packet_rx *rx, size_t n);
+ssize_t packet_rx_read(packet_rx *rx, int fd, size_t max);
+int packet_rx_done(packet_rx *rx);
+int packet_rx_finish(packet_rx *rx);
+void packet_rx_abort(packet_rx *rx);
+void write_packet(int fd, buf_item *item, int algo);
+size_t chunk_size(size_t size);
+int chunk_count(size_t size, size_t chunk);
+void chunk_crcs(const unsigned char *data, size_t size, size_t chunk, uint32_t *crcs);
+int chunk_mismatches(const unsigned char *data, size_t size, size_t chunk, const uint32_t *crcs,\
+                     uint32_t *ranges, int max_ranges);
+void checksum_trailer(checksum_ctx *c, unsigned char *raw);
 
 #endif
@@ -14,6 +14,7 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <sys/mman.h>
+#include <sys/random.h>
 #include <errno.h>
 #include <math.h>
 #include <pthread.h>
@@ -21,6 +22,7 @@
 #include <sys/socket.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 
 /* Default file permissions are DEF_MODE & ~DEF_UMASK */
@@ -37,19 +39,24 @@ typedef struct {
   int rio_cnt;               /* Unread bytes in internal buf */
   char *rio_bufptr;          /* Next unread byte in internal buf */
   char rio_buf[RIO_BUFSIZE]; /* Internal buffer */
+  unsigned long rio_nread;   /* read()/recv() calls made so far */
 } rio_t;
 
+/* Buffered reads of at least this many bytes bypass rio_buf */
+extern size_t rio_direct_min;
+
 typedef void handler_t(int);
 
 #define MAXLINE 8192 /* Max text line length */
 #define MAXBUF  8192 /* Max I/O buffer size */
 #define LISTENQ 1024 /* Second argument to listen() */
 
-int open_clientfd(char *hostname, char *port, struct sockaddr *sa);
-int Open_clientfd(char *hostname, char *port, struct sockaddr *sa);
+int open_clientfd(char *hostname, char *port, struct sockaddr *sa, int sockbuf);
+int Open_clientfd(char *hostname, char *port, struct sockaddr *sa, int sockbuf);
 
-int open_listenfd(char *port);
-int Open_listenfd(char *port);
+int open_listenfd(char *port, int sockbuf);
+int Open_listenfd(char *port, int sockbuf);
+void set_nodelay(int fd);
 
 void Getaddrinfo(const char *node, const char *service,
                  const struct addrinfo *hints, struct addrinfo **res);
@@ -75,6 +82,7 @@ void Pthread_exit(void *retval);
 
 void rio_readinitb(rio_t *rp, int fd);
 void Rio_readinitb(rio_t *rp, int fd);
+ssize_t rio_readnb(rio_t *rp, void *usrbuf, size_t n);
 ssize_t Rio_readnb(rio_t *rp, void *usrbuf, size_t n);
 
 ssize_t rio_writen(int fd, void *usrbuf, size_t n);
@@ -90,6 +98,7 @@ void Getnameinfo(const struct sockaddr *sa, socklen_t salen,
                  char *service, size_t servlen, int flags);
 
 int Accept(int s, struct sockaddr *addr, socklen_t *addrlen);
+void Getrandom(void *buf, size_t len);
 
 void unix_error(char *msg);
 void posix_error(int code, char *msg);
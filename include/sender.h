@@ -0,0 +1,54 @@
+/*****************************************************************************
+ * Client packet transmit paths headers and declarations.
+ *
+ * Author: Aleksander Bapst
+ * **************************************************************************/
+#ifndef __SENDER_H__
+#define __SENDER_H__
+
+#include "ring_buffer.h"
+
+/* Ways of getting the image data of a packet into the socket */
+#define SEND_COPY     0 // write() from the packet buffer
+#define SEND_ZEROCOPY 1 // send(MSG_ZEROCOPY) from the packet buffer
+#define SEND_SENDFILE 2 // sendfile() from an image file, no user space copy
+#define SEND_SHM      3 // copy into the server's ring slot in shared memory
+
+typedef struct {
+  int mode; // SEND_*
+  int fd; // connected socket
+
+  /* SEND_ZEROCOPY */
+  uint32_t zc_next; // id the kernel gives the next zerocopy send
+  uint32_t zc_done; // number of sends the kernel has completed
+  long zc_copied; // completions where the kernel copied after all
+
+  /* SEND_SENDFILE */
+  int src_fd; // image file, one image_size block per image
+  char *src_map; // read-only mapping of the file, for checksums
+  size_t src_size;
+  size_t image_size;
+  int nimages;
+
+  /* SEND_SHM */
+  arena shm; // the server's ring storage
+  size_t slot_size; // bytes of the arena owned by each slot
+
+  /* Compressed image data, any mode but SEND_SHM (sent with write()) */
+  compressor *z; // NULL = send the image data as is
+  checksum_ctx zsum; // digest of the packet being compressed
+} packet_sender;
+
+int sender_init(packet_sender *s, int fd, int mode, char *path, size_t size);
+int sender_attach_shm(packet_sender *s, unsigned int id, size_t slot_size);
+void sender_send(packet_sender *s, buf_item *item, int algo, int slot);
+void sender_send_stripe(packet_sender *s, buf_item *item, size_t off, size_t len);
+void sender_send_trailer(packet_sender *s, buf_item *item, int algo);
+void sender_chunk_crcs(packet_sender *s, buf_item *item, size_t chunk, uint32_t *crcs);
+void sender_compress_init(packet_sender *s, int mode, int nthreads, size_t size);
+size_t sender_compress(packet_sender *s, buf_item *item, int algo);
+void sender_send_compressed(packet_sender *s, buf_item *item, int algo);
+void sender_close(packet_sender *s);
+const char *sender_name(int mode);
+
+#endif
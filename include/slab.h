@@ -0,0 +1,35 @@
+/*****************************************************************************
+ * Size-classed slab pool headers and declarations.
+ *
+ * Author: Aleksander Bapst
+ * **************************************************************************/
+#ifndef __SLAB_H__
+#define __SLAB_H__
+
+#include "safe_wrappers.h"
+
+#define SLAB_MIN_SHIFT 12 // smallest class, 4 KB
+#define SLAB_MAX_SHIFT 34 // largest class, 16 GB
+#define SLAB_NCLASSES (SLAB_MAX_SHIFT-SLAB_MIN_SHIFT+1)
+
+#define SLAB_CLASS_SIZE(cls) ((size_t)1 << ((cls)+SLAB_MIN_SHIFT))
+
+/* Buffers in power-of-two size classes, allocated on demand up to a
+ * byte budget and kept on per-class free lists once released */
+typedef struct {
+  pthread_mutex_t lock;
+  size_t budget; // max bytes allocated at once (free + in use)
+  size_t allocated; // bytes currently allocated
+  size_t in_use; // bytes handed out and not yet freed
+  void *free[SLAB_NCLASSES]; // free lists, linked through the buffers
+  int nfree[SLAB_NCLASSES];
+} slab_pool;
+
+void slab_init(slab_pool *pool, size_t budget);
+void slab_destroy(slab_pool *pool);
+int slab_class(size_t size);
+size_t slab_max_size(slab_pool *pool, int nbufs);
+void *slab_alloc(slab_pool *pool, size_t size, int *cls);
+void slab_free(slab_pool *pool, void *p, int cls);
+
+#endif
@@ -0,0 +1,54 @@
+/*****************************************************************************
+ * Minimal io_uring wrapper headers and declarations.
+ *
+ * Author: Aleksander Bapst
+ * **************************************************************************/
+#ifndef __URING_H__
+#define __URING_H__
+
+#include "safe_wrappers.h"
+
+#ifdef HAVE_IO_URING
+#include <stdatomic.h>
+#include <stdint.h>
+#include <sys/uio.h>
+#include <poll.h>
+#include <linux/io_uring.h>
+
+/* A submission/completion queue pair, set up with raw syscalls (no
+ * liburing). Only the thread that owns the ring may use it. */
+typedef struct {
+  int fd;
+  void *sq_map, *cq_map;
+  size_t sq_map_size, cq_map_size;
+
+  /* Submission queue */
+  atomic_uint *sq_head, *sq_tail;
+  unsigned *sq_mask, *sq_array;
+  unsigned sq_entries;
+  struct io_uring_sqe *sqes;
+  unsigned sq_local_tail; // SQEs handed out, published on submit
+
+  /* Completion queue */
+  atomic_uint *cq_head, *cq_tail;
+  unsigned *cq_mask;
+  struct io_uring_cqe *cqes;
+} uring;
+
+int uring_init(uring *r, unsigned entries);
+void uring_exit(uring *r);
+struct io_uring_sqe *uring_get_sqe(uring *r);
+int uring_submit(uring *r, unsigned wait_nr);
+struct io_uring_cqe *uring_peek_cqe(uring *r);
+void uring_cqe_seen(uring *r);
+int uring_register_buffers(uring *r, struct iovec *iov, unsigned n);
+
+void uring_prep_recv(struct io_uring_sqe *sqe, int fd, void *p, size_t len, int flags);
+void uring_prep_read_fixed(struct io_uring_sqe *sqe, int fd, void *p, size_t len, int buf_index);
+void uring_prep_read(struct io_uring_sqe *sqe, int fd, void *p, size_t len);
+void uring_prep_poll(struct io_uring_sqe *sqe, int fd, unsigned events);
+void uring_prep_multishot_accept(struct io_uring_sqe *sqe, int fd);
+void uring_prep_timeout(struct io_uring_sqe *sqe, struct __kernel_timespec *ts);
+#endif
+
+#endif
@@ -0,0 +1,285 @@
+/******************************************
+ * Ring storage arena.
+ *
+ * By default packet image data is Malloc'd
+ * on demand, and its pages are only faulted
+ * in by the first packet written into them,
+ * which makes the first packets of a run
+ * much slower than the steady state. The
+ * arena is instead one mapping for all ring
+ * slots, set up before any client connects:
+ *
+ *  - backed by explicit (MAP_HUGETLB) or
+ *    transparent huge pages, so a 128 MB
+ *    packet needs 64 TLB entries, not 32768
+ *  - bound to one NUMA node (mbind), the
+ *    node of the NIC and of the threads that
+ *    touch the data
+ *  - pre-faulted and optionally mlock'd, so
+ *    no page fault happens while receiving
+ *  - exported as a POSIX shm segment, which
+ *    clients on the same host attach to and
+ *    write their images into directly
+ *
+ * Options that are not available on this
+ * system are reported and skipped.
+ *
+ * Author: Aleksander Bapst
+ * ****************************************/
+#include "arena.h"
+#include <stdint.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+
+#define MAX_CPUS 1024
+
+/******************************************************
+ * Map `size` bytes aligned to a huge page boundary,
+ * so that transparent huge pages cover all of it
+ * ****************************************************/
+static unsigned char *map_aligned(size_t size)
+{
+  unsigned char *p, *aligned;
+  size_t head;
+
+  p = mmap(NULL,size+HUGE_PAGE_SIZE,PROT_READ|PROT_WRITE,\
+           MAP_PRIVATE|MAP_ANONYMOUS,-1,0);
+  if (p == MAP_FAILED)
+    unix_error("mmap error");
+
+  aligned = (unsigned char *)(((uintptr_t)p + HUGE_PAGE_SIZE-1) & ~(HUGE_PAGE_SIZE-1));
+  head = aligned - p;
+  if (head > 0)
+    munmap(p,head);
+  munmap(aligned+size,HUGE_PAGE_SIZE-head);
+  return aligned;
+}
+
+/******************************************************
+ * Map `size` bytes of a new shm segment, named after
+ * the process id. The name is unlinked when the arena
+ * is destroyed.
+ * ****************************************************/
+static unsigned char *map_shared(arena *a, size_t size)
+{
+  char name[MAXLINE];
+  unsigned char *p;
+  int fd;
+
+  a->shm_id = getpid();
+  snprintf(name,sizeof(name),ARENA_SHM_NAME,a->shm_id);
+  shm_unlink(name); // left over by a killed server with our pid
+  if ((fd = shm_open(name,O_RDWR|O_CREAT|O_EXCL,0600)) < 0)
+    unix_error("shm_open error");
+  if (ftruncate(fd,size) < 0)
+    unix_error("ftruncate error");
+  p = mmap(NULL,size,PROT_READ|PROT_WRITE,MAP_SHARED,fd,0);
+  if (p == MAP_FAILED)
+    unix_error("mmap error");
+  Close(fd);
+  return p;
+}
+
+/******************************************************
+ * Write to every page of the arena so that it is
+ * backed by memory before the first packet arrives
+ * ****************************************************/
+static void prefault(arena *a)
+{
+  size_t page = (a->flags & (ARENA_HUGETLB|ARENA_THP)) ? HUGE_PAGE_SIZE : 4096;
+  size_t off;
+
+#ifdef MADV_POPULATE_WRITE
+  if (madvise(a->base,a->map_size,MADV_POPULATE_WRITE) == 0)
+    return;
+#endif
+  // older kernels: touch the pages ourselves
+  for (off = 0; off < a->map_size; off += page)
+    a->base[off] = 0;
+}
+
+/******************************************************
+ * Set up an arena of `size` bytes with the ARENA_*
+ * options in flags, bound to NUMA node `node` (-1 for
+ * no binding). Options that fail are dropped from
+ * a->flags with a warning.
+ * ****************************************************/
+void arena_init(arena *a, size_t size, int flags, int node)
+{
+  unsigned long mask;
+  struct timespec t0, t1;
+
+  memset(a,0,sizeof(arena));
+  a->size = size;
+  a->flags = flags;
+  a->node = -1;
+
+  /* Huge pages must be mapped in whole huge pages */
+  if (flags & (ARENA_HUGETLB|ARENA_THP))
+    a->map_size = (size + HUGE_PAGE_SIZE-1) & ~(HUGE_PAGE_SIZE-1);
+  else
+    a->map_size = (size + 4095) & ~(size_t)4095;
+  if (a->map_size == 0)
+    a->map_size = 4096;
+
+  if ((flags & (ARENA_HUGETLB|ARENA_SHARED)) == (ARENA_HUGETLB|ARENA_SHARED)) {
+    fprintf(stderr,"hugetlb pages cannot be shared through /dev/shm, "\
+            "using transparent huge pages\n");
+    a->flags = (a->flags & ~ARENA_HUGETLB) | ARENA_THP;
+  }
+
+  if (a->flags & ARENA_SHARED) {
+    a->base = map_shared(a,a->map_size);
+  } else if (flags & ARENA_HUGETLB) {
+    a->base = mmap(NULL,a->map_size,PROT_READ|PROT_WRITE,\
+                   MAP_PRIVATE|MAP_ANONYMOUS|MAP_HUGETLB,-1,0);
+    if (a->base == MAP_FAILED) {
+      fprintf(stderr,"MAP_HUGETLB failed (%s), reserve pages with "\
+              "vm.nr_hugepages; trying transparent huge pages\n",strerror(errno));
+      a->flags = (a->flags & ~ARENA_HUGETLB) | ARENA_THP;
+      a->base = NULL;
+    }
+  }
+  if (!a->base)
+    a->base = map_aligned(a->map_size);
+
+  if ((a->flags & ARENA_THP) && madvise(a->base,a->map_size,MADV_HUGEPAGE) < 0) {
+    fprintf(stderr,"MADV_HUGEPAGE failed: %s\n",strerror(errno));
+    a->flags &= ~ARENA_THP;
+  }
+
+  /* Bind before the first fault, so pages are allocated on the node */
+  if (node >= 0) {
+    if (node >= 8*(int)sizeof(mask)) {
+      fprintf(stderr,"NUMA node %d out of range\n",node);
+    } else {
+      mask = 1UL << node;
+      if (syscall(SYS_mbind,a->base,a->map_size,MPOL_BIND,&mask,\
+                  8*sizeof(mask)+1,0) < 0)
+        fprintf(stderr,"mbind to NUMA node %d failed: %s\n",node,strerror(errno));
+      else
+        a->node = node;
+    }
+  }
+
+  clock_gettime(CLOCK_MONOTONIC,&t0);
+  if (a->flags & ARENA_PREFAULT)
+    prefault(a);
+  if ((a->flags & ARENA_LOCK) && mlock(a->base,a->map_size) < 0) {
+    fprintf(stderr,"mlock failed (%s), raise RLIMIT_MEMLOCK (ulimit -l)\n",\
+            strerror(errno));
+    a->flags &= ~ARENA_LOCK;
+  }
+  clock_gettime(CLOCK_MONOTONIC,&t1);
+  a->prefault_s = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec)/1e9;
+}
+
+void arena_destroy(arena *a)
+{
+  char name[MAXLINE];
+
+  if (a->base)
+    munmap(a->base,a->map_size);
+  a->base = NULL;
+  if (a->flags & ARENA_SHARED) {
+    snprintf(name,sizeof(name),ARENA_SHM_NAME,a->shm_id);
+    shm_unlink(name);
+  }
+}
+
+/******************************************************
+ * Client side: map the shared arena of the server with
+ * the given id. Returns 0 if it cannot be opened, e.g.
+ * because the server is on another host.
+ * ****************************************************/
+int arena_attach(arena *a, unsigned int id)
+{
+  char name[MAXLINE];
+  struct stat st;
+  int fd;
+
+  memset(a,0,sizeof(arena));
+  a->node = -1;
+  snprintf(name,sizeof(name),ARENA_SHM_NAME,id);
+  if ((fd = shm_open(name,O_RDWR,0)) < 0)
+    return 0;
+  if (fstat(fd,&st) < 0 || st.st_size == 0) {
+    Close(fd);
+    return 0;
+  }
+  a->base = mmap(NULL,st.st_size,PROT_READ|PROT_WRITE,MAP_SHARED,fd,0);
+  Close(fd);
+  if (a->base == MAP_FAILED) {
+    a->base = NULL;
+    return 0;
+  }
+  a->size = a->map_size = st.st_size;
+  a->shm_id = id; // not ARENA_SHARED: the server owns the name
+  return 1;
+}
+
+/******************************************************
+ * Parse a huge page option: hugetlb or thp. Returns
+ * the ARENA_* flag, or -1 if the string is unknown.
+ * ****************************************************/
+int arena_parse_pages(const char *str)
+{
+  if (!strcmp(str,"hugetlb"))
+    return ARENA_HUGETLB;
+  if (!strcmp(str,"thp"))
+    return ARENA_THP;
+  return -1;
+}
+
+void arena_print(arena *a)
+{
+  printf("Ring storage arena: %.2f MB",a->map_size/1048576.);
+  if (a->flags & ARENA_HUGETLB)
+    printf(", hugetlb pages");
+  if (a->flags & ARENA_THP)
+    printf(", transparent huge pages");
+  if (a->flags & ARENA_SHARED)
+    printf(", shared as "ARENA_SHM_NAME,a->shm_id);
+  if (a->node >= 0)
+    printf(", NUMA node %d",a->node);
+  if (a->flags & ARENA_LOCK)
+    printf(", locked");
+  if (a->flags & (ARENA_PREFAULT|ARENA_LOCK))
+    printf(", pre-faulted in %.2f s",a->prefault_s);
+  printf("\n");
+}
+
+/******************************************************
+ * Restrict the calling thread, and the threads it
+ * creates afterwards, to the CPUs of a NUMA node.
+ * Returns 0 if the node's CPU list cannot be read.
+ * ****************************************************/
+int numa_bind_cpus(int node)
+{
+  char path[MAXLINE], list[MAXBUF], *tok, *save;
+  unsigned long cpus[MAX_CPUS/(8*sizeof(long))];
+  int lo, hi, cpu, fd, ncpus = 0;
+  ssize_t n;
+
+  snprintf(path,sizeof(path),"/sys/devices/system/node/node%d/cpulist",node);
+  if ((fd = open(path,O_RDONLY)) < 0)
+    return 0;
+  n = read(fd,list,sizeof(list)-1);
+  Close(fd);
+  if (n <= 0)
+    return 0;
+  list[n] = 0;
+
+  /* e.g. "0-7,16-23" */
+  memset(cpus,0,sizeof(cpus));
+  for (tok = strtok_r(list,",\n",&save); tok; tok = strtok_r(NULL,",\n",&save)) {
+    if (sscanf(tok,"%d-%d",&lo,&hi) == 1)
+      hi = lo;
+    for (cpu = lo; cpu >= 0 && cpu <= hi && cpu < MAX_CPUS; cpu++, ncpus++)
+      cpus[cpu/(8*sizeof(long))] |= 1UL << (cpu % (8*sizeof(long)));
+  }
+  // raw syscall, the glibc wrapper needs _GNU_SOURCE
+  if (ncpus == 0 || syscall(SYS_sched_setaffinity,0,sizeof(cpus),cpus) < 0)
+    return 0;
+  return 1;
+}
@@ -0,0 +1,190 @@
+/***************************************************************************
+ * Benchmark of image data compression. A synthetic SAR-like image (a
+ * smooth field with speckle, bands of zero padding) is compressed with
+ * every codec and shuffle built in, with and without tile elision, by
+ * the client's compressor threads, then decompressed chunk by chunk as
+ * the server does. Reports the ratio and the compression and
+ * decompression throughput, and checks that every mode gives the image
+ * data back bit for bit. Codecs that were not compiled in are listed as
+ * such (make HAVE_LZ4=1 HAVE_ZSTD=1 forces them in).
+ *
+ * Author: Aleksander Bapst
+ * ************************************************************************/
+
+#include "ring_buffer.h"
+
+static const char *shuffle_names[SHUF_COUNT] = {"none","byte","bit"};
+
+void make_image(unsigned char *image, packet_shape *shape);
+int run_bench(int mode, unsigned char *image, size_t size, size_t elem, int runs,\
+              int nthreads, double *ratio, double *zrate, double *rate);
+void print_usage();
+
+int main(int argc, char **argv)
+{
+  int opt, codec, shuffle, sparse, mode, ok, runs = 4, failed = 0;
+  int nthreads = DEFAULT_COMP_THREADS;
+  packet_shape shape = {1,2048,2047,ELEM_F32}; // ends in a partial chunk
+  char name[64], spec[32];
+  double ratio, zrate, rate;
+  unsigned char *image;
+  size_t size;
+
+  while ((opt = getopt(argc, argv, "k:S:j:h")) != -1) {
+    switch(opt) {
+      case 'k':
+        runs = atoi(optarg);
+        if (runs < 1)
+          runs = 1;
+        break;
+      case 'S':
+        if (!shape_parse(optarg,&shape)) {
+          fprintf(stderr,"Invalid shape: %s\n",optarg);
+          exit(0);
+        }
+        break;
+      case 'j':
+        nthreads = atoi(optarg);
+        break;
+      case 'h':
+      default:
+        print_usage();
+        exit(0);
+    }
+  }
+
+  size = shape_size(&shape);
+  image = (unsigned char *)Malloc(size ? size : 1);
+  make_image(image,&shape);
+  shape_print(&shape,name,sizeof(name));
+
+  printf("----------------------------------------------------------------\n");
+  printf("Compression benchmark: %d runs over a %s image (%.2f MB), %d threads\n",\
+         runs,name,size/MEGABYTE,nthreads);
+  for (codec = COMP_NONE+1; codec < COMP_COUNT; codec++) {
+    if (!compress_available(codec))
+      printf("%s: not compiled in\n",compress_name(codec));
+  }
+  printf("----------------------------------------------------------------\n");
+  printf("%-40s | ratio | comp (GB/s) | decomp (GB/s) | check\n","mode");
+
+  for (codec = COMP_NONE; codec < COMP_COUNT; codec++) {
+    if (!compress_available(codec))
+      continue;
+    for (shuffle = 0; shuffle < SHUF_COUNT; shuffle++) {
+      if (codec == COMP_NONE && shuffle > 0) // nothing to shuffle for
+        break;
+      for (sparse = 0; sparse <= 1; sparse++) {
+        snprintf(spec,sizeof(spec),"%s,%s",compress_name(codec),shuffle_names[shuffle]);
+        mode = compress_parse(spec) | (sparse ? COMP_SPARSE : 0);
+        ok = run_bench(mode,image,size,shape_elem_size(&shape),runs,nthreads,\
+                       &ratio,&zrate,&rate);
+        failed += !ok;
+        compress_print(mode,name,sizeof(name));
+        printf("%-40s | %5.2f | %11.2f | %13.2f | %s\n",name,ratio,zrate,rate,\
+               ok ? "ok" : "MISMATCH");
+      }
+    }
+  }
+  printf("----------------------------------------------------------------\n");
+
+  Free(image);
+  exit(failed ? 1 : 0);
+}
+
+/*******************************************************
+ * A smooth field with speckle, scaled to the element
+ * type, and a band of zeros every 64 rows (masked
+ * regions, padding) for tile elision to find
+ * ****************************************************/
+void make_image(unsigned char *image, packet_shape *shape)
+{
+  size_t n = shape_size(shape)/shape_elem_size(shape), ii, row, col;
+  uint32_t seed = 1;
+  double v;
+
+  for (ii = 0; ii < n; ii++) {
+    row = ii / shape->width;
+    col = ii % shape->width;
+    seed = seed*1664525u + 1013904223u;
+    v = (row % 64 < 8) ? 0 : 100*sin(col/50.)*cos(row/70.) + (seed >> 24)/16.;
+    switch (shape->elem_type) {
+      case ELEM_U8:
+        image[ii] = (uint8_t)(v + 128);
+        break;
+      case ELEM_U16:
+        ((uint16_t *)image)[ii] = (uint16_t)(100*v + 32768);
+        break;
+      case ELEM_F32:
+        ((float *)image)[ii] = v;
+        break;
+      default:
+        ((double *)image)[ii] = v;
+        break;
+    }
+  }
+}
+
+/*******************************************************
+ * Compress the image runs times, then decompress it
+ * runs times and compare it with the original. Sets
+ * the ratio and the throughputs in GB/s of image data.
+ * Returns 0 if the image did not come back unchanged.
+ * ****************************************************/
+int run_bench(int mode, unsigned char *image, size_t size, size_t elem, int runs,\
+              int nthreads, double *ratio, double *zrate, double *rate)
+{
+  size_t wire = 0, off, len, ii;
+  uint64_t start, elapsed;
+  unsigned char *out, *chunk;
+  uint32_t word;
+  compressor z;
+  comp_ctx c;
+  int run, ok = 1;
+
+  compressor_init(&z,mode,nthreads,size);
+  comp_ctx_init(&c,mode);
+  out = (unsigned char *)Malloc(size ? size : 1);
+
+  start = get_time_ns();
+  for (run = 0; run < runs; run++) {
+    compressor_start(&z,image,size,elem);
+    wire = compressor_wait(&z);
+  }
+  elapsed = get_time_ns() - start;
+  *zrate = elapsed ? (double)runs*size/elapsed : 0;
+  *ratio = wire ? (double)size/wire : 0;
+
+  start = get_time_ns();
+  for (run = 0; run < runs && ok; run++) {
+    memset(out,0xa5,size); // nothing left over from the previous run
+    for (ii = 0, off = 0; off < size && ok; ii++, off += len) {
+      len = (size-off > COMP_CHUNK) ? COMP_CHUNK : size-off;
+      chunk = z.out + ii*(COMP_CHUNK_HDR + COMP_CHUNK);
+      memcpy(&word,chunk,COMP_CHUNK_HDR);
+      word = ntohl(word);
+      ok = (word & COMP_LEN_MASK) + COMP_CHUNK_HDR == z.lens[ii] &&
+           decompress_chunk(&c,elem,chunk+COMP_CHUNK_HDR,word & COMP_LEN_MASK,\
+                            word & (COMP_STORED | COMP_TILES),out+off,len);
+    }
+  }
+  elapsed = get_time_ns() - start;
+  *rate = elapsed ? (double)runs*size/elapsed : 0;
+  ok = ok && memcmp(out,image,size) == 0;
+
+  Free(out);
+  comp_ctx_free(&c);
+  compressor_free(&z);
+  return ok;
+}
+
+void print_usage()
+{
+  fprintf(stderr, "Usage: ./bench_compress [-options]\n");
+  fprintf(stderr, "Options:\n");
+  fprintf(stderr, "  -k <int> number of timed runs per mode (default=4)\n");
+  fprintf(stderr, "  -S <str> image shape, <channels>x<width>x<height>[:u8|u16|f32|f64]\n");
+  fprintf(stderr, "           (default=1x2048x2047:f32)\n");
+  fprintf(stderr, "  -j <int> compression threads (default=%d)\n",DEFAULT_COMP_THREADS);
+  fprintf(stderr, "  -h       print usage\n");
+}
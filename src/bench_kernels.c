@@ -0,0 +1,127 @@
+/***************************************************************************
+ * Benchmark of the image processing kernels. Each registered kernel is run
+ * over a synthetic image with every instruction set the CPU has, out of
+ * place, and reports its throughput (GB/s of image data read) and the
+ * speedup over the portable C version. Every run is also checked against
+ * the C version, out of place and in place as the server runs it.
+ *
+ * Author: Aleksander Bapst
+ * ************************************************************************/
+
+#include "kernels.h"
+
+double run_bench(kernel *k, int isa, packet_shape *shape, void *in, void *out, int runs);
+void print_usage();
+
+int main(int argc, char **argv)
+{
+  int opt, isa, best, ok, runs = 4, failed = 0;
+  packet_shape shape = LEGACY_SHAPE;
+  char *only = NULL, name[64];
+  size_t size, ii;
+  uint32_t seed = 1;
+  float *image;
+  void *ref, *out, *copy;
+  double rate, base;
+  kernel *k;
+
+  while ((opt = getopt(argc, argv, "k:S:K:h")) != -1) {
+    switch(opt) {
+      case 'k':
+        runs = atoi(optarg);
+        if (runs < 1)
+          runs = 1;
+        break;
+      case 'S':
+        if (!shape_parse(optarg,&shape) || shape.elem_type != ELEM_F32) {
+          fprintf(stderr,"Invalid f32 shape: %s\n",optarg);
+          exit(0);
+        }
+        break;
+      case 'K':
+        only = optarg;
+        break;
+      case 'h':
+      default:
+        print_usage();
+        exit(0);
+    }
+  }
+
+  // values in [-1000, 1000), one in 16 of them zero and one in 4096 NaN
+  // (not the first, which would make the range of its channel NaN)
+  size = shape_size(&shape);
+  image = (float *)Malloc(size);
+  for (ii = 0; ii < size/sizeof(float); ii++) {
+    seed = seed*1664525u + 1013904223u;
+    image[ii] = ((seed >> 8) & 15) ? (int)(seed >> 8)/8388.608f - 1000.f : 0.f;
+    if (ii > 0 && (seed >> 20) == 0)
+      image[ii] = NAN;
+  }
+  ref = Malloc(size);
+  out = Malloc(size);
+  copy = Malloc(size);
+  best = kernel_isa_best();
+  shape_print(&shape,name,sizeof(name));
+
+  printf("----------------------------------------------------------------\n");
+  printf("Kernel benchmark: %d runs over a %s image (%.2f MB)\n",\
+         runs,name,size/MEGABYTE);
+  printf("Best instruction set: %s\n",kernel_isa_name(best));
+  printf("----------------------------------------------------------------\n");
+  printf("kernel     | isa    | throughput (GB/s) | speedup | check\n");
+
+  for (k = kernel_first(); k; k = k->next) {
+    if ((only && strcmp(k->name,only) != 0) || !k->accepts(&shape))
+      continue;
+    kernel_run(k,KERNEL_SCALAR,&shape,image,ref);
+    base = 0;
+    for (isa = KERNEL_SCALAR; isa <= best; isa++) {
+      if (!k->run[isa])
+        continue;
+      rate = run_bench(k,isa,&shape,image,out,runs);
+      if (isa == KERNEL_SCALAR)
+        base = rate;
+      memcpy(copy,image,size);
+      kernel_run(k,isa,&shape,copy,copy);
+      ok = k->same(&shape,ref,out) && k->same(&shape,ref,copy);
+      failed += !ok;
+      printf("%-10s | %-6s | %17.2f | %7.2f | %s\n",k->name,kernel_isa_name(isa),\
+             rate,base ? rate/base : 0,ok ? "ok" : "MISMATCH");
+    }
+  }
+  printf("----------------------------------------------------------------\n");
+
+  Free(copy);
+  Free(out);
+  Free(ref);
+  Free(image);
+  exit(failed ? 1 : 0);
+}
+
+/*******************************************************
+ * Run the kernel runs times out of place and return its
+ * throughput in GB/s of image data read
+ * ****************************************************/
+double run_bench(kernel *k, int isa, packet_shape *shape, void *in, void *out, int runs)
+{
+  uint64_t start, elapsed;
+  int ii;
+
+  kernel_run(k,isa,shape,in,out); // warm up, fault in out
+  start = get_time_ns();
+  for (ii = 0; ii < runs; ii++)
+    kernel_run(k,isa,shape,in,out);
+  elapsed = get_time_ns() - start;
+  return elapsed ? (double)runs*shape_size(shape)/elapsed : 0;
+}
+
+void print_usage()
+{
+  fprintf(stderr, "Usage: ./bench_kernels [-options]\n");
+  fprintf(stderr, "Options:\n");
+  fprintf(stderr, "  -k <int> number of timed runs per kernel and instruction set (default=4)\n");
+  fprintf(stderr, "  -S <str> image shape, <channels>x<width>x<height>:f32 (default=legacy)\n");
+  fprintf(stderr, "  -K <str> only benchmark this kernel\n");
+  fprintf(stderr, "  -h       print usage\n");
+}
@@ -0,0 +1,139 @@
+/***************************************************************************
+ * Benchmark of the Rio receive path. A sender thread streams packets over
+ * a loopback TCP connection and the receiver reads them with Rio_readnb()
+ * in PACKET_CHUNK requests, as the server does, once through the 8 KB
+ * internal buffer and once with the direct large-read path. Reports the
+ * throughput and the number of read()/recv() calls per packet.
+ *
+ * Author: Aleksander Bapst
+ * ************************************************************************/
+
+#include "ring_buffer.h"
+
+typedef struct {
+  int fd;
+  int npackets;
+  size_t packet_size;
+} bench_args;
+
+void *sender_job(void *varargp);
+void run_bench(const char *mode, size_t direct_min, int npackets,\
+               size_t packet_size, int sockbuf);
+void print_usage();
+
+int main(int argc, char **argv)
+{
+  int opt, npackets = 8, sockbuf = 0;
+  size_t packet_size = LEGACY_PAYLOAD + PACKET_TRAILER;
+
+  while ((opt = getopt(argc, argv, "k:p:s:h")) != -1) {
+    switch(opt) {
+      case 'k':
+        npackets = atoi(optarg);
+        break;
+      case 'p':
+        packet_size = (size_t)atoi(optarg) << 20;
+        break;
+      case 's':
+        sockbuf = atoi(optarg)*1024;
+        break;
+      case 'h':
+      default:
+        print_usage();
+        exit(0);
+    }
+  }
+
+  printf("----------------------------------------------------------------\n");
+  printf("Rio receive benchmark: %d packets of %.2f MB, %d KB reads\n",\
+         npackets,packet_size/MEGABYTE,PACKET_CHUNK/1024);
+  if (sockbuf > 0)
+    printf("Socket buffer size: %d KB\n",sockbuf/1024);
+  printf("----------------------------------------------------------------\n");
+  printf("mode      | throughput (MB/s) | syscalls/packet | KB/syscall\n");
+
+  run_bench("buffered",(size_t)-1,npackets,packet_size,sockbuf);
+  run_bench("direct",RIO_BUFSIZE,npackets,packet_size,sockbuf);
+  printf("----------------------------------------------------------------\n");
+
+  exit(0);
+}
+
+/*******************************************************
+ * Receive npackets over a fresh loopback connection
+ * with the given rio_direct_min and print the results
+ * ****************************************************/
+void run_bench(const char *mode, size_t direct_min, int npackets,\
+               size_t packet_size, int sockbuf)
+{
+  int listenfd, connfd, ii;
+  size_t off, len;
+  time_t start_t, elapsed_t;
+  char port[NI_MAXSERV];
+  char *packet = (char *)Malloc(packet_size);
+  struct sockaddr_storage addr;
+  socklen_t addrlen = sizeof(addr);
+  struct timeval tv;
+  pthread_t tid;
+  bench_args args;
+  rio_t rio;
+
+  /* Listen on an ephemeral port and connect to it */
+  listenfd = Open_listenfd("0",sockbuf);
+  if (getsockname(listenfd,(SA *)&addr,&addrlen) < 0)
+    unix_error("getsockname error");
+  Getnameinfo((SA *)&addr,addrlen,NULL,0,port,sizeof(port),NI_NUMERICSERV);
+  args.fd = Open_clientfd("localhost",port,(SA *)&addr,sockbuf);
+  args.npackets = npackets;
+  args.packet_size = packet_size;
+  connfd = Accept(listenfd,NULL,NULL);
+  Close(listenfd);
+
+  rio_direct_min = direct_min;
+  Rio_readinitb(&rio,connfd);
+
+  start_t = get_time_ms(&tv);
+  Pthread_create(&tid, NULL, sender_job, &args);
+  for (ii = 0; ii < npackets; ii++) {
+    for (off = 0; off < packet_size; off += len) {
+      len = (packet_size-off > PACKET_CHUNK) ? PACKET_CHUNK : packet_size-off;
+      if (Rio_readnb(&rio,packet+off,len) != len)
+        app_error("short read");
+    }
+  }
+  elapsed_t = get_time_ms(&tv) - start_t;
+  pthread_join(tid,NULL);
+
+  printf("%-9s | %17.1f | %15.1f | %10.1f\n",mode,\
+         (elapsed_t == 0) ? 0. : npackets*packet_size/MEGABYTE/(elapsed_t/1000.),\
+         rio.rio_nread/(double)npackets,\
+         npackets*packet_size/1024./rio.rio_nread);
+
+  rio_direct_min = RIO_BUFSIZE;
+  Close(args.fd);
+  Close(connfd);
+  Free(packet);
+}
+
+void *sender_job(void *varargp)
+{
+  bench_args *args = (bench_args *)varargp;
+  char *packet = (char *)Malloc(args->packet_size);
+  int ii;
+
+  memset(packet,0xab,args->packet_size);
+  for (ii = 0; ii < args->npackets; ii++)
+    Rio_writen(args->fd,packet,args->packet_size);
+  Free(packet);
+  return NULL;
+}
+
+void print_usage()
+{
+  fprintf(stderr, "Usage: ./bench_rio [-options]\n");
+  fprintf(stderr, "Options:\n");
+  fprintf(stderr, "  -k <int> number of packets to send (default=8)\n");
+  fprintf(stderr, "  -p <int> packet size in MB (default=size of a legacy packet)\n");
+  fprintf(stderr, "  -s <int> socket buffer size in KB (default=system)\n");
+  fprintf(stderr, "  -h       print usage\n");
+}
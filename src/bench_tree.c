@@ -0,0 +1,101 @@
+/***************************************************************************
+ * Benchmark of packet verification with the tree checksum. A packet is
+ * signed once, then verified with packet_checksum() as the server does,
+ * with 1, 2, 4, ... hashing threads. Reports the verification throughput
+ * and the speedup over one thread, next to the sequential MD5 and CRC32C
+ * digests, and checks that every thread count verifies the signature.
+ *
+ * Author: Aleksander Bapst
+ * ************************************************************************/
+
+#include "ring_buffer.h"
+
+double run_bench(buf_item *item, int algo, int npackets);
+void print_usage();
+
+int main(int argc, char **argv)
+{
+  int opt, nthreads, npackets = 8, ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+  int max_threads = (ncpus < 4) ? 4 : ncpus;
+  size_t packet_size = LEGACY_PAYLOAD;
+  double rate, base = 0;
+  buf_item item;
+  size_t ii;
+
+  while ((opt = getopt(argc, argv, "k:p:t:h")) != -1) {
+    switch(opt) {
+      case 'k':
+        npackets = atoi(optarg);
+        break;
+      case 'p':
+        packet_size = (size_t)atoi(optarg) << 20;
+        break;
+      case 't':
+        max_threads = atoi(optarg);
+        break;
+      case 'h':
+      default:
+        print_usage();
+        exit(0);
+    }
+  }
+
+  memset(&item,0,sizeof(item));
+  item.size = packet_size;
+  item.data = (unsigned char *)Malloc(packet_size);
+  for (ii = 0; ii < packet_size; ii++)
+    item.data[ii] = (ii*2654435761u) >> 24;
+  item.id = 1;
+
+  printf("----------------------------------------------------------------\n");
+  printf("Verification benchmark: %d packets of %.2f MB, %d KB leaves\n",\
+         npackets,packet_size/MEGABYTE,TREE_LEAF/1024);
+  printf("CPUs online: %d\n",ncpus);
+  printf("----------------------------------------------------------------\n");
+  printf("checksum | threads | throughput (GB/s) | speedup\n");
+
+  printf("%-8s | %7d | %17.2f |\n","md5",1,run_bench(&item,CSUM_MD5,npackets));
+  printf("%-8s | %7d | %17.2f |\n","crc32c",1,run_bench(&item,CSUM_CRC32C,npackets));
+  for (nthreads = 1; nthreads <= max_threads; nthreads *= 2) {
+    checksum_threads(nthreads);
+    rate = run_bench(&item,CSUM_TREE,npackets);
+    if (nthreads == 1)
+      base = rate;
+    printf("%-8s | %7d | %17.2f | %7.2f\n","tree",nthreads,rate,base ? rate/base : 0);
+    if (nthreads < max_threads && nthreads*2 > max_threads)
+      nthreads = max_threads/2; // end on max_threads
+  }
+  printf("----------------------------------------------------------------\n");
+
+  Free(item.data);
+  exit(0);
+}
+
+/*******************************************************
+ * Sign the packet, then verify it npackets times and
+ * return the verification throughput in GB/s
+ * ****************************************************/
+double run_bench(buf_item *item, int algo, int npackets)
+{
+  uint64_t start, elapsed;
+  int ii;
+
+  packet_checksum(item,algo);
+  start = get_time_ns();
+  for (ii = 0; ii < npackets; ii++) {
+    if (!packet_checksum(item,algo))
+      app_error("checksum mismatch");
+  }
+  elapsed = get_time_ns() - start;
+  return elapsed ? (double)npackets*item->size/elapsed : 0;
+}
+
+void print_usage()
+{
+  fprintf(stderr, "Usage: ./bench_tree [-options]\n");
+  fprintf(stderr, "Options:\n");
+  fprintf(stderr, "  -k <int> number of packets to verify per run (default=8)\n");
+  fprintf(stderr, "  -p <int> packet size in MB (default=size of a legacy packet)\n");
+  fprintf(stderr, "  -t <int> most hashing threads (default=CPUs online, at least 4)\n");
+  fprintf(stderr, "  -h       print usage\n");
+}
@@ -0,0 +1,496 @@
+/******************************************
+ * Packet integrity checks.
+ *
+ * MD5 comes from OpenSSL, XXH3 from
+ * libxxhash (when built with HAVE_XXHASH)
+ * and CRC32C is implemented here. On CPUs
+ * with SSE4.2 and PCLMULQDQ the CRC runs
+ * three independent crc32 instruction
+ * streams over adjacent blocks to hide the
+ * instruction latency, and stitches the
+ * partial CRCs together with a carry-less
+ * multiply. Other CPUs use a table.
+ *
+ * A single MD5 chain is bound to one core,
+ * so the tree digest splits the data into
+ * TREE_LEAF leaves, hashes them on a shared
+ * pool of threads (the caller included) and
+ * digests the leaf digests in order into a
+ * root. Leaf boundaries are fixed offsets
+ * of the stream, so the root does not depend
+ * on how the data is split into updates;
+ * only updates spanning whole leaves run in
+ * parallel.
+ *
+ * Author: Aleksander Bapst
+ * ****************************************/
+#include "checksum.h"
+#include "safe_wrappers.h"
+#include <string.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <nmmintrin.h>
+#include <wmmintrin.h>
+
+#define CRC32C_POLY 0x82f63b78 // reflected Castagnoli polynomial
+#define CRC_BLOCK 4096 // bytes per stream in the 3-way loop
+
+static const char *csum_names[CSUM_COUNT] = {"none","md5","crc32c","xxh3","tree"};
+
+static uint32_t crc_table[256];
+static uint32_t crc_shift_k; // x^(8*CRC_BLOCK-33) mod P
+static int crc_hw; // use the SSE4.2/PCLMUL path
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+
+/* Leaves of one tree update, hashed by the pool and the caller */
+typedef struct tree_job {
+  const unsigned char *data;
+  unsigned char *digests; // MD5_DIGEST_LENGTH bytes per leaf
+  int nleaves;
+  atomic_int next; // next leaf to hash
+  int helpers, max_helpers; // pool threads working on it
+  struct tree_job *link;
+} tree_job;
+
+static pthread_mutex_t tree_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t tree_posted = PTHREAD_COND_INITIALIZER; // a job was posted
+static pthread_cond_t tree_left = PTHREAD_COND_INITIALIZER; // a helper left its job
+static tree_job *tree_jobs = NULL; // jobs with leaves left, newest first
+static int tree_nthreads = 0; // threads per update, the caller included
+static int tree_pool = 0; // pool threads started
+static pthread_once_t tree_once = PTHREAD_ONCE_INIT;
+
+/******************************************************
+ * Multiply two reflected polynomials modulo P
+ * ****************************************************/
+static uint32_t crc_multmodp(uint32_t a, uint32_t b)
+{
+  uint32_t m = 1u << 31, p = 0;
+
+  while (m) {
+    if (a & m)
+      p ^= b;
+    m >>= 1;
+    b = (b & 1) ? (b >> 1) ^ CRC32C_POLY : b >> 1;
+  }
+  return p;
+}
+
+/******************************************************
+ * x^n modulo P, reflected
+ * ****************************************************/
+static uint32_t crc_xpow(uint64_t n)
+{
+  uint32_t result = 1u << 31, base = 1u << 30; // x^0, x^1
+
+  while (n) {
+    if (n & 1)
+      result = crc_multmodp(result,base);
+    base = crc_multmodp(base,base);
+    n >>= 1;
+  }
+  return result;
+}
+
+/******************************************************
+ * Build the fallback table and detect the CPU features
+ * ****************************************************/
+static void crc32c_setup()
+{
+  uint32_t ii, jj, crc;
+
+  for (ii = 0; ii < 256; ii++) {
+    crc = ii;
+    for (jj = 0; jj < 8; jj++)
+      crc = (crc & 1) ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+    crc_table[ii] = crc;
+  }
+  crc_shift_k = crc_xpow(8*CRC_BLOCK-33);
+
+  __builtin_cpu_init();
+  crc_hw = __builtin_cpu_supports("sse4.2") && __builtin_cpu_supports("pclmul");
+}
+
+static uint32_t crc32c_sw(uint32_t crc, const unsigned char *p, size_t length)
+{
+  while (length--)
+    crc = (crc >> 8) ^ crc_table[(crc ^ *p++) & 0xff];
+  return crc;
+}
+
+/******************************************************
+ * Advance a CRC register over CRC_BLOCK zero bytes:
+ * clmul by x^(8n-33) followed by a crc32 reduction
+ * (which multiplies by x^33) gives crc * x^(8n) mod P
+ * ****************************************************/
+__attribute__((target("sse4.2,pclmul")))
+static inline uint32_t crc32c_shift(uint32_t crc)
+{
+  __m128i prod = _mm_clmulepi64_si128(_mm_cvtsi32_si128(crc),\
+                                      _mm_cvtsi32_si128(crc_shift_k),0);
+  return _mm_crc32_u64(0,_mm_cvtsi128_si64(prod));
+}
+
+__attribute__((target("sse4.2,pclmul")))
+static uint32_t crc32c_hw(uint32_t crc, const unsigned char *p, size_t length)
+{
+  uint64_t crc0, crc1, crc2, word;
+  size_t ii;
+
+  // align to 8 bytes
+  while (length > 0 && ((uintptr_t)p & 7)) {
+    crc = _mm_crc32_u8(crc,*p++);
+    length--;
+  }
+
+  // three independent streams over adjacent blocks
+  while (length >= 3*CRC_BLOCK) {
+    crc0 = crc;
+    crc1 = 0;
+    crc2 = 0;
+    for (ii = 0; ii < CRC_BLOCK; ii += 8) {
+      memcpy(&word,p+ii,8);
+      crc0 = _mm_crc32_u64(crc0,word);
+      memcpy(&word,p+CRC_BLOCK+ii,8);
+      crc1 = _mm_crc32_u64(crc1,word);
+      memcpy(&word,p+2*CRC_BLOCK+ii,8);
+      crc2 = _mm_crc32_u64(crc2,word);
+    }
+    crc = crc32c_shift(crc32c_shift((uint32_t)crc0) ^ (uint32_t)crc1) ^ (uint32_t)crc2;
+    p += 3*CRC_BLOCK;
+    length -= 3*CRC_BLOCK;
+  }
+
+  crc0 = crc;
+  while (length >= 8) {
+    memcpy(&word,p,8);
+    crc0 = _mm_crc32_u64(crc0,word);
+    p += 8;
+    length -= 8;
+  }
+  crc = (uint32_t)crc0;
+  while (length-- > 0)
+    crc = _mm_crc32_u8(crc,*p++);
+  return crc;
+}
+
+/******************************************************
+ * Update a CRC32C value with more data. Start from 0
+ * and pass the previous result to continue a stream.
+ * ****************************************************/
+uint32_t crc32c(uint32_t crc, const void *data, size_t length)
+{
+  pthread_once(&crc_once,crc32c_setup);
+
+  crc = ~crc;
+  if (crc_hw)
+    crc = crc32c_hw(crc,data,length);
+  else
+    crc = crc32c_sw(crc,data,length);
+  return ~crc;
+}
+
+/******************************************************
+ * Hash the leaves of a job until none are left
+ * ****************************************************/
+static void tree_hash_leaves(tree_job *j)
+{
+  int ii;
+
+  while ((ii = atomic_fetch_add(&j->next,1)) < j->nleaves)
+    MD5(j->data + (size_t)ii*TREE_LEAF,TREE_LEAF,j->digests + ii*MD5_DIGEST_LENGTH);
+}
+
+// remove a job from the list, if it is still there (under tree_lock)
+static void tree_unlink(tree_job *j)
+{
+  tree_job **pp;
+
+  for (pp = &tree_jobs; *pp; pp = &(*pp)->link) {
+    if (*pp == j) {
+      *pp = j->link;
+      break;
+    }
+  }
+}
+
+/******************************************************
+ * Pool threads: help with the newest job that can use
+ * another thread
+ * ****************************************************/
+static void *tree_job_thread(void *vargp)
+{
+  tree_job *j;
+
+  Pthread_detach(Pthread_self());
+  pthread_mutex_lock(&tree_lock);
+  for (;;) {
+    for (j = tree_jobs; j && j->helpers >= j->max_helpers; j = j->link)
+      ;
+    if (!j) {
+      pthread_cond_wait(&tree_posted,&tree_lock);
+      continue;
+    }
+    j->helpers++;
+    pthread_mutex_unlock(&tree_lock);
+    tree_hash_leaves(j);
+    pthread_mutex_lock(&tree_lock);
+    tree_unlink(j); // every leaf is taken
+    j->helpers--;
+    pthread_cond_broadcast(&tree_left);
+  }
+  return NULL;
+}
+
+/******************************************************
+ * Hash tree digest leaves with nthreads threads, the
+ * caller included (default: one per online CPU). The
+ * pool grows as needed and is shared by all callers.
+ * ****************************************************/
+void checksum_threads(int nthreads)
+{
+  pthread_t tid;
+
+  pthread_mutex_lock(&tree_lock);
+  tree_nthreads = (nthreads < 1) ? 1 : nthreads;
+  for (; tree_pool < tree_nthreads-1; tree_pool++)
+    Pthread_create(&tid,NULL,tree_job_thread,NULL);
+  pthread_mutex_unlock(&tree_lock);
+}
+
+static void tree_setup()
+{
+  if (tree_nthreads == 0)
+    checksum_threads(sysconf(_SC_NPROCESSORS_ONLN));
+}
+
+/******************************************************
+ * Digest n whole leaves at data into digests
+ * ****************************************************/
+static void tree_leaves(const unsigned char *data, int n, unsigned char *digests)
+{
+  tree_job j;
+  int posted = 0;
+
+  pthread_once(&tree_once,tree_setup);
+  j.data = data;
+  j.digests = digests;
+  j.nleaves = n;
+  atomic_init(&j.next,0);
+  j.helpers = 0;
+
+  if (n > 1) {
+    pthread_mutex_lock(&tree_lock);
+    j.max_helpers = (tree_nthreads-1 < n-1) ? tree_nthreads-1 : n-1;
+    if (j.max_helpers > 0) {
+      j.link = tree_jobs;
+      tree_jobs = &j;
+      posted = 1;
+      pthread_cond_broadcast(&tree_posted);
+    }
+    pthread_mutex_unlock(&tree_lock);
+  }
+
+  tree_hash_leaves(&j);
+  if (posted) {
+    pthread_mutex_lock(&tree_lock);
+    tree_unlink(&j);
+    while (j.helpers > 0) // still hashing their last leaf
+      pthread_cond_wait(&tree_left,&tree_lock);
+    pthread_mutex_unlock(&tree_lock);
+  }
+}
+
+// close the leaf being filled and add its digest to the root
+static void tree_close_leaf(checksum_ctx *ctx)
+{
+  unsigned char digest[MD5_DIGEST_LENGTH];
+
+  MD5_Final(digest,&ctx->u.tree.leaf);
+  MD5_Update(&ctx->u.tree.root,digest,MD5_DIGEST_LENGTH);
+  MD5_Init(&ctx->u.tree.leaf);
+  ctx->u.tree.fill = 0;
+}
+
+static void tree_update(checksum_ctx *ctx, const unsigned char *p, size_t length)
+{
+  unsigned char digests[TREE_BATCH*MD5_DIGEST_LENGTH];
+  size_t n;
+
+  /* Top up a partial leaf */
+  if (ctx->u.tree.fill > 0) {
+    n = TREE_LEAF - ctx->u.tree.fill;
+    if (n > length)
+      n = length;
+    MD5_Update(&ctx->u.tree.leaf,p,n);
+    ctx->u.tree.fill += n;
+    p += n;
+    length -= n;
+    if (ctx->u.tree.fill == TREE_LEAF)
+      tree_close_leaf(ctx);
+  }
+
+  /* Whole leaves in parallel */
+  while (length >= TREE_LEAF) {
+    n = length/TREE_LEAF;
+    if (n > TREE_BATCH)
+      n = TREE_BATCH;
+    tree_leaves(p,n,digests);
+    MD5_Update(&ctx->u.tree.root,digests,n*MD5_DIGEST_LENGTH);
+    p += n*TREE_LEAF;
+    length -= n*TREE_LEAF;
+  }
+
+  if (length > 0) {
+    MD5_Update(&ctx->u.tree.leaf,p,length);
+    ctx->u.tree.fill += length;
+  }
+}
+
+/******************************************************
+ * Map an algorithm name to its CSUM_* id, -1 if unknown
+ * ****************************************************/
+int checksum_parse(const char *name)
+{
+  int ii;
+
+  for (ii = 0; ii < CSUM_COUNT; ii++) {
+    if (!strcmp(name,csum_names[ii]))
+      return ii;
+  }
+  return -1;
+}
+
+const char *checksum_name(int algo)
+{
+  if (algo < 0 || algo >= CSUM_COUNT)
+    return "unknown";
+  return csum_names[algo];
+}
+
+/******************************************************
+ * Returns 1 if the algorithm was compiled in
+ * ****************************************************/
+int checksum_available(int algo)
+{
+  switch (algo) {
+    case CSUM_NONE:
+    case CSUM_MD5:
+    case CSUM_CRC32C:
+    case CSUM_TREE:
+      return 1;
+#ifdef HAVE_XXHASH
+    case CSUM_XXH3:
+      return 1;
+#endif
+    default:
+      return 0;
+  }
+}
+
+/******************************************************
+ * Length of the digest in bytes
+ * ****************************************************/
+int checksum_length(int algo)
+{
+  switch (algo) {
+    case CSUM_MD5:
+    case CSUM_TREE:
+      return MD5_DIGEST_LENGTH;
+    case CSUM_CRC32C:
+      return sizeof(uint32_t);
+    case CSUM_XXH3:
+      return sizeof(uint64_t);
+    default:
+      return 0;
+  }
+}
+
+/******************************************************
+ * Returns 1 if the algorithm is fastest given all of
+ * the image data in one update rather than chunk by
+ * chunk as it moves (its leaves are then hashed in
+ * parallel)
+ * ****************************************************/
+int checksum_batched(int algo)
+{
+  return algo == CSUM_TREE;
+}
+
+void checksum_init(checksum_ctx *ctx, int algo)
+{
+  ctx->algo = algo;
+  switch (algo) {
+    case CSUM_MD5:
+      MD5_Init(&ctx->u.md5);
+      break;
+    case CSUM_CRC32C:
+      ctx->u.crc = 0;
+      break;
+    case CSUM_TREE:
+      MD5_Init(&ctx->u.tree.root);
+      MD5_Init(&ctx->u.tree.leaf);
+      ctx->u.tree.fill = 0;
+      break;
+#ifdef HAVE_XXHASH
+    case CSUM_XXH3:
+      ctx->u.xxh3 = XXH3_createState();
+      XXH3_64bits_reset(ctx->u.xxh3);
+      break;
+#endif
+  }
+}
+
+void checksum_update(checksum_ctx *ctx, const void *data, size_t length)
+{
+  switch (ctx->algo) {
+    case CSUM_MD5:
+      MD5_Update(&ctx->u.md5,data,length);
+      break;
+    case CSUM_CRC32C:
+      ctx->u.crc = crc32c(ctx->u.crc,data,length);
+      break;
+    case CSUM_TREE:
+      tree_update(ctx,data,length);
+      break;
+#ifdef HAVE_XXHASH
+    case CSUM_XXH3:
+      XXH3_64bits_update(ctx->u.xxh3,data,length);
+      break;
+#endif
+  }
+}
+
+/******************************************************
+ * Write the digest into CSUM_MAX_LENGTH bytes, zero
+ * padded, and release the context
+ * ****************************************************/
+void checksum_final(checksum_ctx *ctx, unsigned char *digest)
+{
+  int ii;
+
+  memset(digest,0,CSUM_MAX_LENGTH);
+  switch (ctx->algo) {
+    case CSUM_MD5:
+      MD5_Final(digest,&ctx->u.md5);
+      break;
+    case CSUM_CRC32C:
+      for (ii = 0; ii < 4; ii++) // big endian
+        digest[ii] = (ctx->u.crc >> (24-8*ii)) & 0xff;
+      break;
+    case CSUM_TREE:
+      if (ctx->u.tree.fill > 0)
+        tree_close_leaf(ctx);
+      MD5_Final(digest,&ctx->u.tree.root);
+      break;
+#ifdef HAVE_XXHASH
+    case CSUM_XXH3: {
+      XXH64_hash_t h = XXH3_64bits_digest(ctx->u.xxh3);
+      for (ii = 0; ii < 8; ii++) // big endian
+        digest[ii] = (h >> (56-8*ii)) & 0xff;
+      XXH3_freeState(ctx->u.xxh3);
+      break;
+    }
+#endif
+  }
+}
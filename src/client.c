@@ -5,27 +5,114 @@
  * space so it queues the packets in a ring buffer while processing. If the
  * buffer is full and there is no space available, the server read thread
  * blocks and the client is unable to send anything until a spot opens up.
+ * By default the server grants the client a window of credits, one per
+ * slot it has reserved, and the client streams packets as long as it has
+ * credit instead of waiting for an acknowledgement before each packet.
+ * When both run on the same host (client and server -x), the image data
+ * is copied straight into the server's ring slots in shared memory and
+ * only the control messages go over the connection.
+ * With -K, each packet is striped across several parallel connections to
+ * the server (one sender thread each), which helps when a single TCP
+ * stream cannot fill the link. With -Z, the image data is shuffled and
+ * compressed by a pool of threads, for links slower than the CPUs. With
+ * -E, 4 KB tiles holding a single value are left out of the stream. With
+ * -R, each packet is followed by the CRC32C of each of its chunks, and the
+ * chunks the server finds corrupt are sent again instead of the packet
+ * being dropped. With -u, the server processes our packets before those
+ * of bulk clients; -w weighs our share of its workers and slots against
+ * the other clients of our class.
  *
  * Author: Aleksander Bapst
  **************************************************************************/
 
 #include "ring_buffer.h"
+#include "protocol.h"
+#include "sender.h"
+#include "fair_queue.h"
+#include <sys/resource.h>
 
 /* Function Declarations */
+void send_packet(proto_conn *conn, buf_item *packet, int id, int slot);
+void push_slot(int slot);
+int pop_slot();
+void print_sent(int ii, int npackets, size_t packet_size, float packet_bw);
+void send_chunks(proto_conn *conn, buf_item *packet);
+int resend_chunks(proto_conn *conn, buf_item *packet, frame_hdr *hdr, uint32_t *words);
+int read_bandwidth(proto_conn *conn, buf_item *packet, float *bw);
+void open_streams(char *host_ip, char *port, uint64_t session, size_t size);
+void close_streams();
+void *stream_job(void *vargp);
+void synth_image(buf_item *packet);
+double cpu_time();
 void print_usage();
 
-int use_checksum = 0;
+int checksum_algo = CSUM_NONE;
+int hash_threads = 0; // threads hashing tree digest leaves, 0 = one per CPU
+int ordered = 0;
+int urgent = 0; // ask to be served before bulk clients
+int share = 1; // weight against the other clients of our class
+int text_protocol = 0;
+int window = DEFAULT_WINDOW;
+int sockbuf = 0; // socket buffer size in bytes, 0 = system default
+int send_mode = SEND_COPY;
+char *image_file = NULL;
+packet_sender sender;
+packet_shape shape = LEGACY_SHAPE;
+int use_shm = 0;
+
+/* Slots reserved by the server for our next packets (shared memory) */
+int *slots;
+int slot_head = 0, slot_count = 0, slot_cap = 0;
+
+/* Extra connections a packet is striped across, each with a sender
+ * thread that sends its stripe of the packet posted in `striped` */
+typedef struct {
+  int fd, index;
+  proto_conn conn;
+  packet_sender sender;
+  pthread_t tid;
+  sem_t go, done;
+} stripe_stream;
+
+/* Compression of the image data */
+int compress_mode = COMP_NONE;
+int comp_threads = DEFAULT_COMP_THREADS;
+int elide_tiles = 0;
+double raw_sent = 0, wire_sent = 0; // bytes of the packets sent
+
+/* Chunk repair */
+int repair = 0;
+size_t repair_chunk = 0; // chunk size the server accepted, 0 = no repair
+uint32_t *chunk_sums; // CRC32C of each chunk of the packet just sent
+long chunks_resent = 0;
+
+/* Per-stage latency histograms, printed when the client finishes */
+#define STAGE_COMPRESS 0 // compressing a packet (-Z)
+#define STAGE_SEND     1 // writing a packet to the socket(s), compression included
+#define STAGE_WAIT     2 // blocked on the server: ACK, credit or bandwidth report
+#define NSTAGES        3
+lat_hist stages[NSTAGES];
+
+int nstreams = 1; // connections per packet, 1 = no striping
+stripe_stream streams[MAX_STREAMS];
+buf_item *striped; // packet being striped, NULL = stop
 
 int main(int argc, char **argv)
 {
   int clientfd, ii, opt, err_flag = 0, npackets = DEFAULT_NPACKETS;
+  int sent = 0, credits = 0, delay_ms = 0, type;
+  uint32_t value, words[MAX_CREDIT_SLOTS+1];
   float total_size, packet_bw;
   float avg_bw, total_bw = 0;
-  size_t packet_size = sizeof(buf_item);
+  double cpu_t;
+  size_t packet_size;
   time_t start_t;
-  char *host_ip, *port, msg[MAXLINE];
+  uint64_t transfer_t, stage_t;
+  char *host_ip, *port, shape_str[64], comp_str[64];
   buf_item *packet = (buf_item *)Malloc(sizeof(buf_item));
-  rio_t rio_server;
+  proto_conn conn;
+  hello_msg hello;
+  frame_hdr hdr;
   struct timeval tv;
 
   struct sockaddr_storage servaddr;
@@ -44,25 +131,129 @@ int main(int argc, char **argv)
   port = argv[2];
 
   /* Parse optional args */
-  while ((opt = getopt(argc, argv, "n:ch")) != -1) {
+  while ((opt = getopt(argc, argv, "n:W:d:c:s:f:S:K:Z:j:T:w:EhoRtuxz")) != -1) {
     switch(opt) {
       case 'n':
         npackets = atoi(optarg);
         break;
+      case 'W':
+        window = atoi(optarg);
+        if (window < 0)
+          window = 0;
+        break;
+      case 'w':
+        share = atoi(optarg);
+        if (share < 1)
+          share = 1;
+        if (share > FQ_MAX_SHARE)
+          share = FQ_MAX_SHARE;
+        break;
+      case 'd':
+        delay_ms = atoi(optarg);
+        break;
       case 'c':
-        use_checksum = 1;
+        checksum_algo = checksum_parse(optarg);
+        if (checksum_algo < 0) {
+          fprintf(stderr,"Unknown checksum: %s\n",optarg);
+          exit(0);
+        }
+        if (!checksum_available(checksum_algo)) {
+          fprintf(stderr,"Checksum algorithm unavailable: %s was not compiled in\n",optarg);
+          exit(0);
+        }
+        break;
+      case 'T':
+        hash_threads = atoi(optarg);
+        if (hash_threads < 1)
+          hash_threads = 1;
+        checksum_threads(hash_threads);
+        break;
+      case 's':
+        sockbuf = atoi(optarg)*1024;
+        break;
+      case 'f':
+        send_mode = SEND_SENDFILE;
+        image_file = optarg;
+        break;
+      case 'S':
+        if (!shape_parse(optarg,&shape)) {
+          fprintf(stderr,"Invalid packet shape: %s\n",optarg);
+          exit(0);
+        }
+        break;
+      case 'Z':
+        compress_mode = compress_parse(optarg);
+        if (compress_mode < 0 || !compress_available(COMP_CODEC(compress_mode))) {
+          fprintf(stderr,"Unsupported compression: %s\n",optarg);
+          exit(0);
+        }
+        break;
+      case 'j':
+        comp_threads = atoi(optarg);
+        if (comp_threads < 1)
+          comp_threads = 1;
+        break;
+      case 'E':
+        elide_tiles = 1;
+        break;
+      case 'K':
+        nstreams = atoi(optarg);
+        if (nstreams < 1)
+          nstreams = 1;
+        if (nstreams > MAX_STREAMS)
+          nstreams = MAX_STREAMS;
         break;
       case 'h':
         print_usage();
         exit(0);
+      case 'o':
+        ordered = 1;
+        break;
+      case 'R':
+        repair = 1;
+        break;
+      case 't':
+        text_protocol = 1;
+        break;
+      case 'u':
+        urgent = 1;
+        break;
+      case 'x':
+        use_shm = 1;
+        break;
+      case 'z':
+        send_mode = SEND_ZEROCOPY;
+        break;
       default:
         continue;
     }
   }
 
+  /* Image data of the packets, the rest of the packet is its trailer */
+  packet->shape = shape;
+  packet->size = shape_size(&shape);
+  packet_size = packet->size + PACKET_TRAILER;
+  if (text_protocol && packet->size != LEGACY_PAYLOAD) {
+    fprintf(stderr,"The text protocol only sends %.2f MB packets\n",LEGACY_PAYLOAD/MEGABYTE);
+    exit(0);
+  }
+  if (text_protocol && use_shm) {
+    fprintf(stderr,"The text protocol cannot use shared memory\n");
+    exit(0);
+  }
+  if (PACKET_DESC_SIZE + packet_size > UINT32_MAX) {
+    fprintf(stderr,"Packets are limited to 4 GB\n");
+    exit(0);
+  }
+  packet->data = (packet->size > 0) ? (unsigned char *)Malloc(packet->size) : NULL;
+  shape_print(&shape,shape_str,sizeof(shape_str));
+
   /* Open connection to server */
-  clientfd = Open_clientfd(host_ip, port, (SA *)&servaddr);
-  Rio_readinitb(&rio_server, clientfd);
+  clientfd = Open_clientfd(host_ip, port, (SA *)&servaddr, sockbuf);
+  proto_init(&conn,clientfd,!text_protocol);
+  conn.delay_ms = delay_ms;
+  if (!sender_init(&sender,clientfd,send_mode,image_file,packet->size))
+    send_mode = SEND_COPY;
 
   Getnameinfo((SA *)&servaddr, servlen,
               host_name, MAXLINE,
@@ -71,61 +262,224 @@ int main(int argc, char **argv)
   printf("----------------------------------------------------------------\n");
   printf("Opened connection with %s at (%s, %s)\n",\
          host_name,host_ip,host_service);
-  if (use_checksum)
-    printf("[Using MD5 checksum]\n");
+  if (ordered)
+    printf("[in-order processing]");
+  if (urgent)
+    printf("[urgent]");
+  if (text_protocol)
+    printf("[text protocol]");
+  if (send_mode != SEND_COPY)
+    printf("[%s transmit]",sender_name(send_mode));
+  if (ordered || urgent || text_protocol || send_mode != SEND_COPY)
+    printf("\n");
   printf("----------------------------------------------------------------\n");
-  printf("Sending %d packets...\n",npackets);
+  printf("Sending %d packets of %s (%.2f MB)...\n",npackets,shape_str,\
+         packet->size/MEGABYTE);
 
-  /* 1. Send clock time in ms to server so it can compute clock bias */
-  sprintf(msg,"%ld",get_time_ms(&tv));
-  Rio_writen(clientfd,msg,MAXLINE);
+  /* 1. Send clock time in ms to server so it can compute clock bias, and
+   *    tell it how many packets to expect and whether they must be
+   *    processed in order */
+  hello.npackets = npackets;
+  hello.packet_size = packet_size;
+  hello.window = window;
+  hello.checksum = checksum_algo;
+  hello.streams = nstreams;
+  if (elide_tiles)
+    compress_mode |= COMP_SPARSE;
+  hello.compress = compress_mode;
+  hello.repair = repair ? chunk_size(packet->size) : 0;
+  hello.priority = urgent ? FQ_URGENT : FQ_BULK;
+  hello.share = share;
 
-  /* 2. Tell server how many packets to expect */
-  sprintf(msg,"%d",npackets);
-  Rio_writen(clientfd,msg,MAXLINE);
+  /* the text protocol only knows MD5 */
+  if (text_protocol && checksum_algo != CSUM_NONE)
+    checksum_algo = hello.checksum = CSUM_MD5;
+  proto_send_hello(&conn,&hello,(ordered ? FLAG_ORDERED : 0) | (use_shm ? FLAG_SHM : 0),\
+                   get_time_ms(&tv));
 
-  /* 3. Send packets to the destination */
-  for (ii = 0; ii < npackets; ii++) {
+  /* 2. Wait for the server to accept the connection settings */
+  if (!proto_read_welcome(&conn,&hello,&hdr)) {
+    fprintf(stderr,"Server did not accept the handshake (try -t for the text protocol)\n");
+    Free(packet->data);
+    Free(packet);
+    Close(clientfd);
+    exit(0);
+  }
 
-    packet->id = ii; // assign unique id to packet
+  /* Sign packets with the checksum the server asked for */
+  if (conn.binary) {
+    if (hello.packet_size < packet_size) {
+      fprintf(stderr,"Server only accepts packets of up to %.2f MB\n",\
+              (hello.packet_size - PACKET_TRAILER)/MEGABYTE);
+      Free(packet->data);
+      Free(packet);
+      Close(clientfd);
+      exit(0);
+    }
+    if (!checksum_available(hello.checksum)) {
+      fprintf(stderr,"Server asked for checksum %s, algorithm unavailable: not compiled in\n",\
+              checksum_name(hello.checksum));
+      Free(packet->data);
+      Free(packet);
+      Close(clientfd);
+      exit(0);
+    }
+    checksum_algo = hello.checksum;
 
-    if (use_checksum)
-      md5checksum((char *)packet,sizeof(buf_item)); // set checksum
+    /* Older servers and those taking packets in arrival order send 0
+     * or a bulk share of 1, servers that do not let us be urgent (-U)
+     * send the bulk class */
+    if ((urgent && hello.priority != FQ_URGENT) || (share > 1 && hello.share != (uint32_t)share))
+      fprintf(stderr,"Server did not grant the class and share asked for, sending as a %s client, share %u\n",\
+              fq_class_name(hello.priority),hello.share ? hello.share : 1);
+    else if (urgent || share > 1)
+      printf("Served as a%s client, share %d\n",urgent ? "n urgent" : " bulk",share);
+  }
 
-    /* Tell server a packet is coming */
-    strncpy(msg,"CLIENT_READY",MAXLINE);
-    Rio_writen(clientfd,msg,MAXLINE);
+  /* Write into the server's ring slots if it shares them */
+  if (use_shm) {
+    if (!(hdr.flags & FLAG_SHM) ||
+        !sender_attach_shm(&sender,hello.shm_id,hello.packet_size-PACKET_TRAILER)) {
+      fprintf(stderr,"Server does not share its ring storage (start it with -x "\
+              "on this host), sending over the socket\n");
+      use_shm = 0;
+    } else {
+      printf("Writing packets into the server's shared ring storage\n");
+      slot_cap = (hello.window > 0) ? hello.window : 1;
+      slots = (int *)Malloc(slot_cap*sizeof(int));
+    }
+  }
+  if (checksum_algo == CSUM_TREE)
+    printf("Using tree checksum, %d hashing threads\n",\
+           hash_threads ? hash_threads : (int)sysconf(_SC_NPROCESSORS_ONLN));
+  else if (checksum_algo != CSUM_NONE)
+    printf("Using %s checksum\n",checksum_name(checksum_algo));
 
-    /* Listen for acknowledgement from server */
-    Rio_readnb(&rio_server,msg,MAXLINE);
-    if (!strcmp(msg,"ACK")) {
+  /* Open the extra streams the server accepted (none from older servers) */
+  if (nstreams > 1) {
+    if (!conn.binary || use_shm || hello.streams < 2) {
+      fprintf(stderr,"Server does not stripe packets, using a single connection\n");
+      nstreams = 1;
+    } else {
+      nstreams = hello.streams;
+      open_streams(host_ip,port,(uint64_t)hello.session_hi << 32 | hello.session,packet->size);
+      printf("Striping packets across %d connections\n",nstreams);
+    }
+  }
 
-      packet->timestamp = get_time_ms(&tv);
+  /* Compress if the server can decompress (older servers send 0) */
+  if (compress_mode != COMP_NONE) {
+    if (!conn.binary || use_shm || hello.compress == COMP_NONE) {
+      compress_print(compress_mode,comp_str,sizeof(comp_str));
+      fprintf(stderr,"Server does not accept compression (%s) here, sending uncompressed\n",\
+              comp_str);
+      compress_mode = COMP_NONE;
+    } else {
+      compress_mode = hello.compress;
+      sender_compress_init(&sender,compress_mode,comp_threads,packet->size);
+      if (!image_file)
+        synth_image(packet);
+      compress_print(compress_mode,comp_str,sizeof(comp_str));
+      printf("Compressing packets (%s) on %d threads\n",comp_str,comp_threads);
+    }
+  }
 
-      /* Send a packet to the server */
-      Rio_writen(clientfd, packet, sizeof(buf_item));
+  /* Send chunk CRCs if the server repairs packets (older servers send 0) */
+  if (repair) {
+    if (!conn.binary || use_shm || hello.repair == 0 ||
+        chunk_count(packet->size,hello.repair) > MAX_CHUNKS) {
+      fprintf(stderr,"Server does not repair chunks here, corrupt packets are dropped\n");
+    } else {
+      repair_chunk = hello.repair;
+      chunk_sums = (uint32_t *)Malloc(MAX_CHUNKS*sizeof(uint32_t));
+      printf("Chunk repair: %zu KB chunks\n",repair_chunk/1024);
+    }
+  }
 
-      /* Receive transmission bandwidth from server */
-      Rio_readnb(&rio_server,msg,MAXLINE);
-      packet_bw = atof(msg);
-      total_bw += packet_bw;
+  /* 3. Send packets to the destination */
+  lat_init(&stages[STAGE_COMPRESS],"compress");
+  lat_init(&stages[STAGE_SEND],"send");
+  lat_init(&stages[STAGE_WAIT],"wait");
+  transfer_t = get_time_ns();
+  cpu_t = cpu_time();
+  if (hello.window > 0) {
+    printf("Streaming with a window of %d credits\n",hello.window);
+
+    /* Send whenever we hold a credit, otherwise wait for the server to
+     * grant more credits or report the bandwidth of a packet */
+    for (ii = 0; ii < npackets; ) {
+      if (sent < npackets && credits > 0) {
+        stage_t = get_time_ns();
+        send_packet(&conn,packet,sent++,use_shm ? pop_slot() : -1);
+        send_chunks(&conn,packet);
+        lat_record(&stages[STAGE_SEND],get_time_ns() - stage_t);
+        credits--;
+        continue;
+      }
 
-      printf("  [%3d%%] -> sent packet | %.2f MB | %6.1f MB/s\n",\
-             100*(ii+1)/npackets,\
-             packet_size/MEGABYTE,\
-             packet_bw);
+      stage_t = get_time_ns();
+      type = proto_read_msg_words(&conn,&hdr,words,sizeof(words));
+      lat_record(&stages[STAGE_WAIT],get_time_ns() - stage_t);
+      if (type == MSG_CREDIT) {
+        credits += words[0];
+        if (use_shm) // the slots reserved for the new credits
+          for (value = 1; value <= words[0] && value <= MAX_CREDIT_SLOTS; value++)
+            push_slot(words[value]);
+      } else if (type == MSG_BANDWIDTH) {
+        packet_bw = proto_word_to_float(words[0]);
+        total_bw += packet_bw;
+        print_sent(ii++,npackets,packet_size,packet_bw);
+      } else if (type == MSG_NACK && repair_chunk) {
+        if (!resend_chunks(&conn,packet,&hdr,words)) {
+          err_flag = 1;
+          break;
+        }
       } else {
         err_flag = 1;
         break;
       }
+    }
+  } else {
+    for (ii = 0; ii < npackets; ii++) {
+
+      /* Tell server a packet is coming */
+      stage_t = get_time_ns();
+      proto_send_msg(&conn,MSG_READY);
+
+      /* Listen for acknowledgement from server, with our slot */
+      if (proto_read_msg(&conn,&hdr,&value) != MSG_ACK) {
+        err_flag = 1;
+        break;
+      }
+      lat_record(&stages[STAGE_WAIT],get_time_ns() - stage_t);
+
+      /* Send a packet to the server */
+      stage_t = get_time_ns();
+      send_packet(&conn,packet,ii,use_shm ? (int)value : -1);
+      send_chunks(&conn,packet);
+      lat_record(&stages[STAGE_SEND],get_time_ns() - stage_t);
+
+      /* Receive transmission bandwidth from server */
+      stage_t = get_time_ns();
+      if (!read_bandwidth(&conn,packet,&packet_bw)) {
+        err_flag = 1;
+        break;
+      }
+      lat_record(&stages[STAGE_WAIT],get_time_ns() - stage_t);
+      total_bw += packet_bw;
+      print_sent(ii,npackets,packet_size,packet_bw);
+    }
   }
+  close_streams();
+  sender_close(&sender); // zerocopy sends are done with the packet
+  transfer_t = get_time_ns() - transfer_t;
+  cpu_t = cpu_time() - cpu_t;
 
   /* Tell the server there are no more packets to send */
-  strncpy(msg,"CLIENT_FINISHED",MAXLINE);
-  Rio_writen(clientfd,msg,MAXLINE);
+  proto_send_msg(&conn,MSG_FINISHED);
 
   /* Compute statistics */
-  total_size = ii*packet_size/MEGABYTE;
+  total_size = ii*(double)packet_size/MEGABYTE;
   avg_bw = (ii == 0) ? 0. : total_bw/ii;
 
   printf("----------------------------------------------------------------\n");
@@ -135,21 +489,343 @@ int main(int argc, char **argv)
             ii,npackets);
   else
     printf("%d/%d packets sent, closing connection with host.\n",ii,npackets);
-  printf("Total data sent: %.2f MB\n",total_size);
+  printf("Total data sent: %.2f MB",total_size);
+  if (nstreams > 1)
+    printf(" over %d connections",nstreams);
+  printf("\n");
   printf("Average bandwidth: %.1f MB/s\n",avg_bw);
+  printf("Throughput: %.1f MB/s",(transfer_t == 0) ? 0. : total_size/(transfer_t/1e9));
+  if (compress_mode != COMP_NONE && wire_sent > 0)
+    printf(" effective, %.1f MB/s on the wire\nCompression: %s, ratio %.2f (%.2f MB on the wire)",\
+           (transfer_t == 0) ? 0. : wire_sent/MEGABYTE/(transfer_t/1e9),comp_str,\
+           raw_sent/wire_sent,wire_sent/MEGABYTE);
+  printf("\n");
+  printf("CPU time: %.2f s (%.2f s/GB)\n",cpu_t,\
+         (total_size == 0) ? 0. : cpu_t/(total_size/1024.));
+  if (send_mode == SEND_ZEROCOPY && sender.zc_copied > 0)
+    printf("[%ld/%u zerocopy sends were copied by the kernel]\n",\
+           sender.zc_copied,sender.zc_done);
+  if (chunks_resent > 0)
+    printf("Chunk repair: %ld chunks resent (%.2f MB)\n",chunks_resent,\
+           chunks_resent*(double)repair_chunk/MEGABYTE);
   printf("Total time: %.1f s\n",(get_time_ms(&tv) - start_t)/1000.);
+  lat_print(stages,NSTAGES);
   printf("----------------------------------------------------------------\n");
 
+  Free(slots);
+  Free(chunk_sums);
+  Free(packet->data);
   Free(packet);
   Close(clientfd);
   exit(0);
 }
 
+/*******************************************************
+ * FIFO of the slots granted with our credits, in the
+ * order the server will expect the packets
+ * ****************************************************/
+void push_slot(int slot)
+{
+  if (slot_count == slot_cap)
+    app_error("shm error: more slots than credits");
+  slots[(slot_head+slot_count) % slot_cap] = slot;
+  slot_count++;
+}
+
+int pop_slot()
+{
+  int slot;
+
+  if (slot_count == 0)
+    app_error("shm error: credit without a slot");
+  slot = slots[slot_head];
+  slot_head = (slot_head+1) % slot_cap;
+  slot_count--;
+  return slot;
+}
+
+/*******************************************************
+ * Stamp a packet with its id and send time and send it
+ * to the server over the selected transmit path. The
+ * checksum is computed while the packet is being sent.
+ * With shared memory, `slot` is where the server wants
+ * the image data. A compressed packet is compressed
+ * first, its header announces the compressed size. A
+ * striped packet goes out over all streams at once:
+ * the header, first stripe and trailer on this
+ * connection, the other stripes on theirs.
+ * ****************************************************/
+void send_packet(proto_conn *conn, buf_item *packet, int id, int slot)
+{
+  struct timeval tv;
+  size_t off, len, wire;
+  uint64_t start;
+  int ii;
+
+  packet->id = id; // assign unique id to packet
+
+  packet->timestamp = get_time_ms(&tv);
+
+  raw_sent += packet->size + PACKET_TRAILER;
+  if (compress_mode != COMP_NONE) {
+    start = get_time_ns();
+    wire = sender_compress(&sender,packet,checksum_algo);
+    lat_record(&stages[STAGE_COMPRESS],get_time_ns() - start);
+    wire_sent += wire + PACKET_TRAILER;
+    proto_send_packet_hdr(conn,packet->id,&packet->shape,\
+                          FLAG_CSUM(checksum_algo) | FLAG_COMP,packet->timestamp,wire);
+    sender_send_compressed(&sender,packet,checksum_algo); // sets the checksum
+    return;
+  }
+
+  proto_send_packet_hdr(conn,packet->id,&packet->shape,\
+                        FLAG_CSUM(checksum_algo) | (use_shm ? FLAG_SHM : 0),\
+                        packet->timestamp,0);
+  if (nstreams == 1) {
+    sender_send(&sender,packet,checksum_algo,slot); // sets the checksum
+    return;
+  }
+
+  striped = packet;
+  for (ii = 1; ii < nstreams; ii++)
+    sem_post(&streams[ii].go);
+  proto_stripe(packet->size,nstreams,0,&off,&len);
+  sender_send_stripe(&sender,packet,off,len);
+  sender_send_trailer(&sender,packet,checksum_algo); // sets the checksum
+
+  /* The stripes must be out before the packet is reused */
+  for (ii = 1; ii < nstreams; ii++)
+    sem_wait(&streams[ii].done);
+}
+
+/*******************************************************
+ * Fill the packet with a synthetic image, a smooth
+ * field plus noise in the low bits like a SAR amplitude
+ * image, so that compression ratios mean something
+ * (the image file is used instead with -f). Like a
+ * geocoded swath, two corners are zero (no data).
+ * ****************************************************/
+void synth_image(buf_item *packet)
+{
+  size_t n = packet->size/shape_elem_size(&packet->shape), ii;
+  uint32_t seed = 12345, w = packet->shape.width ? packet->shape.width : 1;
+  uint32_t h = packet->shape.height ? packet->shape.height : 1, x, y;
+  double v;
+
+  for (ii = 0; ii < n; ii++) {
+    seed = seed*1664525 + 1013904223;
+    x = ii % w;
+    y = ii / w % h;
+    if (x < (uint64_t)(h-1-y)*w/(3*h) || x >= w - (uint64_t)y*w/(3*h)) {
+      memset(packet->data + ii*shape_elem_size(&packet->shape),0,shape_elem_size(&packet->shape));
+      continue;
+    }
+    // triangle waves across and down the image, plus up to 2% noise
+    v = 0.25 + abs((int)((ii % w)*13 % 2048) - 1024)/4096. +\
+        abs((int)((ii / w % h)*11 % 2048) - 1024)/4096. + (seed >> 8)/(double)(1 << 24)/50.;
+    switch (packet->shape.elem_type) {
+      case ELEM_U8:
+        packet->data[ii] = v*255;
+        break;
+      case ELEM_U16:
+        ((uint16_t *)packet->data)[ii] = v*65535;
+        break;
+      case ELEM_F32:
+        ((float *)packet->data)[ii] = v*1000;
+        break;
+      default:
+        ((double *)packet->data)[ii] = v*1000;
+        break;
+    }
+  }
+}
+
+/*******************************************************
+ * Open the extra streams of a striped session. Each
+ * joins the session with its index and gets a sender
+ * thread.
+ * ****************************************************/
+void open_streams(char *host_ip, char *port, uint64_t session, size_t size)
+{
+  struct sockaddr_storage addr;
+  stripe_stream *st;
+  int ii;
+
+  for (ii = 1; ii < nstreams; ii++) {
+    st = &streams[ii];
+    st->index = ii;
+    st->fd = Open_clientfd(host_ip,port,(SA *)&addr,sockbuf);
+    proto_init(&st->conn,st->fd,1);
+    proto_send_join(&st->conn,session,ii);
+    sender_init(&st->sender,st->fd,send_mode,image_file,size);
+    Sem_init(&st->go,0,0);
+    Sem_init(&st->done,0,0);
+    Pthread_create(&st->tid,NULL,stream_job,st);
+  }
+}
+
+/*******************************************************
+ * Stop the sender threads and close the extra streams
+ * ****************************************************/
+void close_streams()
+{
+  int ii;
+
+  striped = NULL;
+  for (ii = 1; ii < nstreams; ii++)
+    sem_post(&streams[ii].go);
+  for (ii = 1; ii < nstreams; ii++) {
+    pthread_join(streams[ii].tid,NULL);
+    sender_close(&streams[ii].sender);
+    proto_free(&streams[ii].conn);
+    Close(streams[ii].fd);
+  }
+}
+
+/*******************************************************
+ * Sender thread of an extra stream: sends its stripe of
+ * each packet posted to it
+ * ****************************************************/
+void *stream_job(void *vargp)
+{
+  stripe_stream *st = (stripe_stream *)vargp;
+  size_t off, len;
+
+  for (;;) {
+    sem_wait(&st->go);
+    if (striped == NULL)
+      return NULL;
+    proto_stripe(striped->size,nstreams,st->index,&off,&len);
+    sender_send_stripe(&st->sender,striped,off,len);
+    sem_post(&st->done);
+  }
+}
+
+/*******************************************************
+ * Chunk repair: follow a packet with the CRC32C of each
+ * of its chunks
+ * ****************************************************/
+void send_chunks(proto_conn *conn, buf_item *packet)
+{
+  if (repair_chunk == 0)
+    return;
+  sender_chunk_crcs(&sender,packet,repair_chunk,chunk_sums);
+  proto_send_chunks(conn,chunk_sums,chunk_count(packet->size,repair_chunk));
+}
+
+/*******************************************************
+ * Send the chunks of a packet a NACK asks for (their
+ * image data is the same for every id, or image id of
+ * the image file), as is, after a REPAIR header.
+ * Returns 0 if the NACK is malformed: not an id and
+ * whole (first chunk, count) pairs, or chunks the
+ * packet does not have.
+ * ****************************************************/
+int resend_chunks(proto_conn *conn, buf_item *packet, frame_hdr *hdr, uint32_t *words)
+{
+  int ii, nranges;
+  size_t off, end, length = 0;
+  buf_item item = *packet;
+
+  if (hdr->length < sizeof(uint32_t) || hdr->length % (2*sizeof(uint32_t)) != sizeof(uint32_t))
+    return 0;
+  nranges = (hdr->length/sizeof(uint32_t) - 1)/2;
+  if (nranges > MAX_NACK_RANGES)
+    return 0;
+  item.id = words[0];
+  for (ii = 0; ii < nranges; ii++) {
+    off = words[1+2*ii]*repair_chunk;
+    end = (words[1+2*ii] + words[2+2*ii])*repair_chunk;
+    if (off >= item.size || end <= off)
+      return 0;
+    length += ((end > item.size) ? item.size : end) - off;
+    chunks_resent += words[2+2*ii];
+  }
+
+  proto_send_repair_hdr(conn,item.id,length);
+  for (ii = 0; ii < nranges; ii++) {
+    off = words[1+2*ii]*repair_chunk;
+    end = (words[1+2*ii] + words[2+2*ii])*repair_chunk;
+    sender_send_stripe(&sender,&item,off,((end > item.size) ? item.size : end) - off);
+  }
+  return 1;
+}
+
+/*******************************************************
+ * Wait for the bandwidth the server measured for the
+ * packet just sent, resending the chunks it asks for
+ * in the meantime
+ * ****************************************************/
+int read_bandwidth(proto_conn *conn, buf_item *packet, float *bw)
+{
+  uint32_t words[MAX_CREDIT_SLOTS+1];
+  frame_hdr hdr;
+  int type;
+
+  if (repair_chunk == 0)
+    return proto_read_bandwidth(conn,bw);
+  while ((type = proto_read_msg_words(conn,&hdr,words,sizeof(words))) == MSG_NACK) {
+    if (!resend_chunks(conn,packet,&hdr,words))
+      return 0;
+  }
+  if (type != MSG_BANDWIDTH)
+    return 0;
+  *bw = proto_word_to_float(words[0]);
+  return 1;
+}
+
+void print_sent(int ii, int npackets, size_t packet_size, float packet_bw)
+{
+  printf("  [%3d%%] -> sent packet | %.2f MB | %6.1f MB/s\n",\
+         100*(ii+1)/npackets,\
+         packet_size/MEGABYTE,\
+         packet_bw);
+}
+
+/*******************************************************
+ * User + system CPU time of the process in seconds
+ * ****************************************************/
+double cpu_time()
+{
+  struct rusage ru;
+
+  getrusage(RUSAGE_SELF,&ru);
+  return ru.ru_utime.tv_sec + ru.ru_stime.tv_sec +\
+         (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec)/1e6;
+}
+
 void print_usage()
 {
   fprintf(stderr, "Usage: ./client <host_ip> <port> [-options]\n");
   fprintf(stderr, "Options:\n");
   fprintf(stderr, "  -n <int> number of packets to send (default=16)\n");
-  fprintf(stderr, "  -c       use MD5 checksumming of packets (warning: is slow)\n");
+  fprintf(stderr, "  -W <int> max packets in flight, 0 = wait for an ACK before each packet (default=4)\n");
+  fprintf(stderr, "  -w <int> share of the server's workers and slots against the other clients\n");
+  fprintf(stderr, "           of our class, up to %d (default=1)\n",FQ_MAX_SHARE);
+  fprintf(stderr, "  -d <int> simulate <int> ms of round-trip time by delaying server replies\n");
+  fprintf(stderr, "  -c <str> checksum packets with md5, crc32c, xxh3, tree\n");
+  fprintf(stderr, "           (parallel MD5 tree) or none (default=none)\n");
+  fprintf(stderr, "  -T <int> threads hashing the leaves of tree checksums (default=one per CPU)\n");
+  fprintf(stderr, "  -s <int> socket buffer size in KB (default=system)\n");
+  fprintf(stderr, "  -f <str> send image data straight from this file with sendfile()\n");
+  fprintf(stderr, "  -S <str> packet shape <channels>x<width>x<height>[:u8|u16|f32|f64]\n");
+  fprintf(stderr, "           (default=2x4096x4096:f32, a 128 MB SAR image)\n");
+  fprintf(stderr, "  -K <int> stripe each packet across <int> parallel connections, up to %d\n",\
+          MAX_STREAMS);
+  fprintf(stderr, "           (default=1, the server may accept fewer)\n");
+  fprintf(stderr, "  -Z <str> compress image data: <lz4|zstd>[:<level>][,<byte|bit|none> shuffle]\n");
+  fprintf(stderr, "           (default=no compression, byte shuffle)\n");
+  fprintf(stderr, "  -j <int> compression threads (default=%d)\n",DEFAULT_COMP_THREADS);
+  fprintf(stderr, "  -E       leave out 4 KB tiles holding a single value (zero padding,\n");
+  fprintf(stderr, "           masked regions), with or without -Z\n");
   fprintf(stderr, "  -h       print usage\n");
+  fprintf(stderr, "  -o       ask the server to process packets in the order they were sent\n");
+  fprintf(stderr, "  -R       send chunk CRCs so that the server asks for corrupt chunks again\n");
+  fprintf(stderr, "           instead of dropping the packet\n");
+  fprintf(stderr, "  -t       speak the legacy text protocol (for older servers)\n");
+  fprintf(stderr, "  -u       ask the server to process our packets before those of bulk\n");
+  fprintf(stderr, "           clients (latency-sensitive streams)\n");
+  fprintf(stderr, "  -x       write image data straight into the ring of a server on this\n");
+  fprintf(stderr, "           host (server -x), falls back to the socket otherwise\n");
+  fprintf(stderr, "  -z       send image data with MSG_ZEROCOPY instead of copying it\n");
 }
@@ -0,0 +1,597 @@
+/******************************************
+ * Image data compression.
+ *
+ * Float rasters compress poorly as they
+ * are: the exponent and high mantissa bytes
+ * of neighbouring pixels are alike, but
+ * they are interleaved with noisy low
+ * mantissa bytes. Shuffling the chunk first
+ * (all first bytes, then all second bytes,
+ * ... or the same per bit) puts the alike
+ * bytes next to each other, then LZ4 or
+ * zstd compresses the result. Chunks that
+ * do not shrink are stored as they are.
+ *
+ * Tiles holding a single value are found
+ * with SSE2 compares and replaced by that
+ * value (COMP_SPARSE), before any codec.
+ *
+ * LZ4 comes from liblz4 (HAVE_LZ4) and zstd
+ * from libzstd (HAVE_ZSTD), see the Makefile.
+ *
+ * Author: Aleksander Bapst
+ * ****************************************/
+#include "compress.h"
+#include <emmintrin.h>
+
+#ifdef HAVE_LZ4
+#include <lz4.h>
+#include <lz4hc.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#define CHUNK_SLOT (COMP_CHUNK_HDR + COMP_CHUNK) // room for one chunk on the wire
+
+static const char *codec_names[COMP_COUNT] = {"none","lz4","zstd"};
+static const char *shuffle_names[SHUF_COUNT] = {"none","byte","bit"};
+static const int default_levels[COMP_COUNT] = {0,1,3};
+static const int max_levels[COMP_COUNT] = {0,12,19};
+
+/******************************************************
+ * Parse <codec>[:<level>][,<shuffle>], e.g. lz4 or
+ * zstd:9,bit. The shuffle defaults to byte. Returns
+ * the mode, or -1 if it is not valid.
+ * ****************************************************/
+int compress_parse(const char *str)
+{
+  char name[16];
+  int codec, shuffle = SHUF_BYTE, level = 0, len;
+  const char *p;
+
+  len = strcspn(str,":,");
+  if (len >= (int)sizeof(name))
+    return -1;
+  memcpy(name,str,len);
+  name[len] = '\0';
+  for (codec = 0; codec < COMP_COUNT; codec++) {
+    if (!strcmp(name,codec_names[codec]))
+      break;
+  }
+  if (codec == COMP_COUNT)
+    return -1;
+
+  p = str + len;
+  if (*p == ':') {
+    level = atoi(++p);
+    if (level < 1 || level > max_levels[codec])
+      return -1;
+    p += strspn(p,"0123456789");
+  }
+  if (*p == ',') {
+    for (shuffle = 0; shuffle < SHUF_COUNT; shuffle++) {
+      if (!strcmp(p+1,shuffle_names[shuffle]))
+        break;
+    }
+    if (shuffle == SHUF_COUNT)
+      return -1;
+  } else if (*p != '\0') {
+    return -1;
+  }
+  if (codec == COMP_NONE)
+    return COMP_NONE;
+  return COMP_MODE(codec,shuffle,level ? level : default_levels[codec]);
+}
+
+const char *compress_name(int codec)
+{
+  if (codec < 0 || codec >= COMP_COUNT)
+    return "unknown";
+  return codec_names[codec];
+}
+
+/******************************************************
+ * Whether the codec was built in
+ * ****************************************************/
+int compress_available(int codec)
+{
+  switch (codec) {
+    case COMP_NONE:
+      return 1;
+#ifdef HAVE_LZ4
+    case COMP_LZ4:
+      return 1;
+#endif
+#ifdef HAVE_ZSTD
+    case COMP_ZSTD:
+      return 1;
+#endif
+    default:
+      return 0;
+  }
+}
+
+/******************************************************
+ * Server side of the negotiation: the mode the server
+ * agrees to for the one a client asked for, with the
+ * level brought into range. Tile elision is always
+ * accepted, the codec only if it and the shuffle are
+ * supported.
+ * ****************************************************/
+int compress_accept(int mode)
+{
+  int codec = COMP_CODEC(mode), level = COMP_LEVEL(mode), sparse = mode & COMP_SPARSE;
+
+  if (!compress_available(codec) || codec == COMP_NONE || COMP_SHUFFLE(mode) >= SHUF_COUNT)
+    return sparse;
+  if (level < 1)
+    level = default_levels[codec];
+  if (level > max_levels[codec])
+    level = max_levels[codec];
+  return COMP_MODE(codec,COMP_SHUFFLE(mode),level) | sparse;
+}
+
+void compress_print(int mode, char *str, size_t len)
+{
+  const char *tiles = (mode & COMP_SPARSE) ? ", tile elision" : "";
+
+  if (COMP_CODEC(mode) == COMP_NONE)
+    snprintf(str,len,"%s",(mode & COMP_SPARSE) ? "tile elision" : "none");
+  else if (COMP_SHUFFLE(mode) == SHUF_NONE)
+    snprintf(str,len,"%s level %d, no shuffle%s",compress_name(COMP_CODEC(mode)),\
+             COMP_LEVEL(mode),tiles);
+  else
+    snprintf(str,len,"%s level %d, %s shuffle%s",compress_name(COMP_CODEC(mode)),\
+             COMP_LEVEL(mode),shuffle_names[COMP_SHUFFLE(mode) % SHUF_COUNT],tiles);
+}
+
+/******************************************************
+ * Most bytes `size` bytes of image data take on the
+ * wire once compressed
+ * ****************************************************/
+size_t compress_bound(size_t size)
+{
+  return size + (size + COMP_CHUNK-1)/COMP_CHUNK*COMP_CHUNK_HDR;
+}
+
+/******************************************************
+ * Shuffles. A chunk of n elements of elem bytes is
+ * rearranged as elem planes of n bytes, byte k of
+ * every element in plane k. The bit shuffle further
+ * splits each plane into 8 runs of n/8 bytes, bit b
+ * of every byte in run b, which needs n to be a
+ * multiple of 8. Bytes past the last whole element
+ * (or group of 8) are left in place. Returns whether
+ * chunks of the mode are shuffled at all.
+ * ****************************************************/
+int compress_shuffles(int mode, size_t elem)
+{
+  return (COMP_SHUFFLE(mode) == SHUF_BYTE && elem > 1) || COMP_SHUFFLE(mode) == SHUF_BIT;
+}
+
+// transpose the 8x8 bit matrix of 8 bytes: bit b of byte i <-> bit i of byte b
+static uint64_t transpose8(uint64_t x)
+{
+  uint64_t t;
+
+  t = (x ^ (x >> 7)) & 0x00aa00aa00aa00aaULL;
+  x = x ^ t ^ (t << 7);
+  t = (x ^ (x >> 14)) & 0x0000cccc0000ccccULL;
+  x = x ^ t ^ (t << 14);
+  t = (x ^ (x >> 28)) & 0x00000000f0f0f0f0ULL;
+  return x ^ t ^ (t << 28);
+}
+
+static void shuffle(int type, size_t elem, const unsigned char *src, unsigned char *dst, size_t len)
+{
+  size_t n = len/elem, ii, kk, bb, ng;
+  uint64_t x;
+
+  if (type == SHUF_BIT) {
+    n -= n % 8;
+    ng = n/8;
+    for (kk = 0; kk < elem; kk++) {
+      for (ii = 0; ii < ng; ii++) {
+        for (x = 0, bb = 0; bb < 8; bb++)
+          x |= (uint64_t)src[(ii*8+bb)*elem+kk] << (8*bb);
+        x = transpose8(x);
+        for (bb = 0; bb < 8; bb++)
+          dst[kk*n + bb*ng + ii] = x >> (8*bb);
+      }
+    }
+  } else {
+    for (kk = 0; kk < elem; kk++) {
+      for (ii = 0; ii < n; ii++)
+        dst[kk*n + ii] = src[ii*elem + kk];
+    }
+  }
+  memcpy(dst+n*elem,src+n*elem,len-n*elem);
+}
+
+static void unshuffle(int type, size_t elem, const unsigned char *src, unsigned char *dst, size_t len)
+{
+  size_t n = len/elem, ii, kk, bb, ng;
+  uint64_t x;
+
+  if (type == SHUF_BIT) {
+    n -= n % 8;
+    ng = n/8;
+    for (kk = 0; kk < elem; kk++) {
+      for (ii = 0; ii < ng; ii++) {
+        for (x = 0, bb = 0; bb < 8; bb++)
+          x |= (uint64_t)src[kk*n + bb*ng + ii] << (8*bb);
+        x = transpose8(x);
+        for (bb = 0; bb < 8; bb++)
+          dst[(ii*8+bb)*elem+kk] = x >> (8*bb);
+      }
+    }
+  } else {
+    for (kk = 0; kk < elem; kk++) {
+      for (ii = 0; ii < n; ii++)
+        dst[ii*elem + kk] = src[kk*n + ii];
+    }
+  }
+  memcpy(dst+n*elem,src+n*elem,len-n*elem);
+}
+
+void comp_ctx_init(comp_ctx *c, int mode)
+{
+  c->mode = mode;
+  c->scratch = (unsigned char *)Malloc(COMP_CHUNK);
+  c->dense = (unsigned char *)Malloc(COMP_CHUNK);
+  c->cctx = c->dctx = NULL;
+}
+
+void comp_ctx_free(comp_ctx *c)
+{
+#ifdef HAVE_ZSTD
+  ZSTD_freeCCtx(c->cctx);
+  ZSTD_freeDCtx(c->dctx);
+#endif
+  Free(c->scratch);
+  Free(c->dense);
+  c->scratch = c->dense = NULL;
+}
+
+/******************************************************
+ * Shuffle and compress len bytes at src into at most
+ * len bytes at dst. Returns the payload length, with
+ * *stored set if it did not shrink and was copied.
+ * ****************************************************/
+static size_t encode(comp_ctx *c, size_t elem, const unsigned char *src, size_t len,\
+                     unsigned char *dst, int *stored)
+{
+  const unsigned char *in = src;
+  size_t zlen = 0;
+
+  if (len > 0 && compress_shuffles(c->mode,elem)) {
+    shuffle(COMP_SHUFFLE(c->mode),elem,src,c->scratch,len);
+    in = c->scratch;
+  }
+
+  switch (len > 0 ? COMP_CODEC(c->mode) : COMP_NONE) {
+#ifdef HAVE_LZ4
+    case COMP_LZ4:
+      if (COMP_LEVEL(c->mode) > 1)
+        zlen = LZ4_compress_HC((const char *)in,(char *)dst,len,len-1,COMP_LEVEL(c->mode));
+      else
+        zlen = LZ4_compress_default((const char *)in,(char *)dst,len,len-1);
+      break;
+#endif
+#ifdef HAVE_ZSTD
+    case COMP_ZSTD:
+      if (!c->cctx && !(c->cctx = ZSTD_createCCtx()))
+        app_error("zstd error: cannot create a compression context");
+      zlen = ZSTD_compressCCtx(c->cctx,dst,len-1,in,len,COMP_LEVEL(c->mode));
+      if (ZSTD_isError(zlen))
+        zlen = 0; // did not shrink
+      break;
+#endif
+    default:
+      break;
+  }
+
+  *stored = (zlen == 0 || zlen >= len);
+  if (*stored) {
+    memcpy(dst,in,len);
+    zlen = len;
+  }
+  return zlen;
+}
+
+/******************************************************
+ * Inverse of encode: the zlen byte payload at src back
+ * into the len bytes at dst. A stored payload may
+ * already be at dst (src == dst) if it needs no
+ * unshuffle. Returns 1 on success, 0 if the payload is
+ * corrupt.
+ * ****************************************************/
+static int decode(comp_ctx *c, size_t elem, const unsigned char *src, size_t zlen,\
+                  int stored, unsigned char *dst, size_t len)
+{
+  unsigned char *out = compress_shuffles(c->mode,elem) ? c->scratch : dst;
+  size_t n = 0;
+
+  if (stored) {
+    if (zlen != len)
+      return 0;
+    if (out == dst) {
+      if (src != dst)
+        memcpy(dst,src,len);
+      return 1;
+    }
+    unshuffle(COMP_SHUFFLE(c->mode),elem,src,dst,len);
+    return 1;
+  }
+
+  switch (COMP_CODEC(c->mode)) {
+#ifdef HAVE_LZ4
+    case COMP_LZ4:
+      n = LZ4_decompress_safe((const char *)src,(char *)out,zlen,len);
+      break;
+#endif
+#ifdef HAVE_ZSTD
+    case COMP_ZSTD:
+      if (!c->dctx && !(c->dctx = ZSTD_createDCtx()))
+        app_error("zstd error: cannot create a decompression context");
+      n = ZSTD_decompressDCtx(c->dctx,out,len,src,zlen);
+      break;
+#endif
+    default:
+      break;
+  }
+  if (n != len)
+    return 0;
+  if (out != dst)
+    unshuffle(COMP_SHUFFLE(c->mode),elem,out,dst,len);
+  return 1;
+}
+
+/******************************************************
+ * Whether the len bytes at p repeat one element of
+ * elem bytes, 16 bytes at a time with SSE2. The value
+ * is the first element.
+ * ****************************************************/
+static int tile_constant(const unsigned char *p, size_t len, size_t elem)
+{
+  unsigned char pat[16];
+  __m128i acc = _mm_setzero_si128(), v;
+  size_t off;
+
+  for (off = 0; off < 16; off += elem)
+    memcpy(pat+off,p,elem);
+  v = _mm_loadu_si128((const __m128i *)pat);
+  for (off = 0; off + 16 <= len; off += 16)
+    acc = _mm_or_si128(acc,_mm_xor_si128(_mm_loadu_si128((const __m128i *)(p+off)),v));
+  for (; off < len; off++) {
+    if (p[off] != pat[off % 16])
+      return 0;
+  }
+  return _mm_movemask_epi8(_mm_cmpeq_epi8(acc,_mm_setzero_si128())) == 0xffff;
+}
+
+// fill len bytes with one element: memset if its bytes are all alike
+static void fill_tile(unsigned char *dst, size_t len, const unsigned char *value, size_t elem)
+{
+  size_t n;
+
+  if (memcmp(value,value+1,elem-1) == 0) {
+    memset(dst,value[0],len);
+    return;
+  }
+  memcpy(dst,value,elem);
+  for (n = elem; n < len; n *= 2)
+    memcpy(dst+n,dst,(len-n < n) ? len-n : n);
+}
+
+/******************************************************
+ * Compress len (at most COMP_CHUNK) bytes of image
+ * data into a chunk at dst, which has room for
+ * COMP_CHUNK_HDR + COMP_CHUNK bytes. Returns the bytes
+ * of the chunk, header included.
+ * ****************************************************/
+size_t compress_chunk(comp_ctx *c, size_t elem, const unsigned char *src, size_t len,\
+                      unsigned char *dst)
+{
+  unsigned char *p = dst + COMP_CHUNK_HDR;
+  size_t ntiles = (len + COMP_TILE-1)/COMP_TILE, tt, tlen, nfill = 0, dense = 0, zlen;
+  uint64_t map = 0;
+  uint32_t word, flags = 0;
+  int stored;
+
+  /* Find the constant tiles, worth it if they save more than the map
+   * and their values take */
+  if (c->mode & COMP_SPARSE) {
+    for (tt = 0; tt < ntiles; tt++) {
+      tlen = (len - tt*COMP_TILE > COMP_TILE) ? COMP_TILE : len - tt*COMP_TILE;
+      if (tile_constant(src+tt*COMP_TILE,tlen,elem)) {
+        map |= (uint64_t)1 << tt;
+        nfill++;
+      } else {
+        dense += tlen;
+      }
+    }
+    if (map && 8 + nfill*elem >= len - dense)
+      map = 0;
+  }
+
+  if (map) {
+    flags = COMP_TILES;
+    word = htonl(map >> 32);
+    memcpy(p,&word,4);
+    word = htonl(map & 0xffffffff);
+    memcpy(p+4,&word,4);
+    p += 8;
+    for (tt = 0, dense = 0; tt < ntiles; tt++) {
+      tlen = (len - tt*COMP_TILE > COMP_TILE) ? COMP_TILE : len - tt*COMP_TILE;
+      if (map & ((uint64_t)1 << tt)) {
+        memcpy(p,src+tt*COMP_TILE,elem);
+        p += elem;
+      } else {
+        memcpy(c->dense+dense,src+tt*COMP_TILE,tlen);
+        dense += tlen;
+      }
+    }
+    zlen = encode(c,elem,c->dense,dense,p,&stored);
+  } else {
+    zlen = encode(c,elem,src,len,p,&stored);
+  }
+  if (stored)
+    flags |= COMP_STORED;
+  zlen += p - (dst + COMP_CHUNK_HDR);
+
+  word = htonl(flags | zlen);
+  memcpy(dst,&word,COMP_CHUNK_HDR);
+  return COMP_CHUNK_HDR + zlen;
+}
+
+/******************************************************
+ * Decompress the zlen byte payload of a chunk, whose
+ * header had `flags` (COMP_STORED, COMP_TILES), into
+ * the len bytes of image data at dst. A stored payload
+ * may already be at dst (src == dst) if it needs no
+ * unshuffle. Returns 1 on success, 0 if the payload is
+ * corrupt.
+ * ****************************************************/
+int decompress_chunk(comp_ctx *c, size_t elem, const unsigned char *src, size_t zlen,\
+                     uint32_t flags, unsigned char *dst, size_t len)
+{
+  size_t ntiles = (len + COMP_TILE-1)/COMP_TILE, tt, tlen, nfill = 0, dense = 0;
+  const unsigned char *fill;
+  uint32_t hi, lo;
+  uint64_t map;
+
+  if (!(flags & COMP_TILES))
+    return decode(c,elem,src,zlen,flags & COMP_STORED,dst,len);
+
+  if (zlen < 8)
+    return 0;
+  memcpy(&hi,src,4);
+  memcpy(&lo,src+4,4);
+  map = (uint64_t)ntohl(hi) << 32 | ntohl(lo);
+  if (ntiles < 64 && (map >> ntiles))
+    return 0;
+  for (tt = 0; tt < ntiles; tt++) {
+    tlen = (len - tt*COMP_TILE > COMP_TILE) ? COMP_TILE : len - tt*COMP_TILE;
+    if (map & ((uint64_t)1 << tt))
+      nfill++;
+    else
+      dense += tlen;
+  }
+  fill = src + 8;
+  if (8 + nfill*elem > zlen ||
+      !decode(c,elem,fill+nfill*elem,zlen-8-nfill*elem,flags & COMP_STORED,c->dense,dense))
+    return 0;
+
+  /* Expand: elided tiles from their value, the others from the rest */
+  for (tt = 0, dense = 0; tt < ntiles; tt++) {
+    tlen = (len - tt*COMP_TILE > COMP_TILE) ? COMP_TILE : len - tt*COMP_TILE;
+    if (map & ((uint64_t)1 << tt)) {
+      fill_tile(dst+tt*COMP_TILE,tlen,fill,elem);
+      fill += elem;
+    } else {
+      memcpy(dst+tt*COMP_TILE,c->dense+dense,tlen);
+      dense += tlen;
+    }
+  }
+  return 1;
+}
+
+/******************************************************
+ * Compression threads: each takes the next chunk of
+ * the packet until none are left
+ * ****************************************************/
+static void *compress_job(void *vargp)
+{
+  compressor *z = (compressor *)vargp;
+  size_t ii, off, nchunks;
+  comp_ctx c;
+
+  comp_ctx_init(&c,z->mode);
+  for (;;) {
+    sem_wait(&z->go);
+    if (z->stop)
+      break;
+    nchunks = (z->size + COMP_CHUNK-1)/COMP_CHUNK;
+    while ((ii = atomic_fetch_add(&z->next,1)) < nchunks) {
+      off = ii*COMP_CHUNK;
+      z->lens[ii] = compress_chunk(&c,z->elem,z->src+off,\
+                                   (z->size-off > COMP_CHUNK) ? COMP_CHUNK : z->size-off,\
+                                   z->out+ii*CHUNK_SLOT);
+    }
+    sem_post(&z->done);
+  }
+  comp_ctx_free(&c);
+  return NULL;
+}
+
+/******************************************************
+ * Start nthreads compression threads for packets of up
+ * to max_size bytes of image data
+ * ****************************************************/
+void compressor_init(compressor *z, int mode, int nthreads, size_t max_size)
+{
+  int ii;
+
+  memset(z,0,sizeof(compressor));
+  z->mode = mode;
+  z->nthreads = (nthreads < 1) ? 1 : nthreads;
+  z->max_chunks = (max_size + COMP_CHUNK-1)/COMP_CHUNK;
+  z->out = (unsigned char *)Malloc(z->max_chunks ? z->max_chunks*CHUNK_SLOT : 1);
+  z->lens = (size_t *)Malloc((z->max_chunks ? z->max_chunks : 1)*sizeof(size_t));
+  Sem_init(&z->go,0,0);
+  Sem_init(&z->done,0,0);
+  z->tids = (pthread_t *)Malloc(z->nthreads*sizeof(pthread_t));
+  for (ii = 0; ii < z->nthreads; ii++)
+    Pthread_create(&z->tids[ii],NULL,compress_job,z);
+}
+
+/******************************************************
+ * Have the threads compress size bytes at src, made of
+ * elem-byte elements. The caller may do other work
+ * (e.g. hash src) until compressor_wait.
+ * ****************************************************/
+void compressor_start(compressor *z, const unsigned char *src, size_t size, size_t elem)
+{
+  int ii;
+
+  if ((size + COMP_CHUNK-1)/COMP_CHUNK > z->max_chunks)
+    app_error("compression error: packet larger than the compressor was set up for");
+  z->src = src;
+  z->size = size;
+  z->elem = elem;
+  atomic_store(&z->next,0);
+  for (ii = 0; ii < z->nthreads; ii++)
+    sem_post(&z->go);
+}
+
+/******************************************************
+ * Wait for the chunks of the packet. Returns its bytes
+ * on the wire: chunk ii is at out + ii*(COMP_CHUNK_HDR
+ * + COMP_CHUNK) and takes lens[ii] bytes.
+ * ****************************************************/
+size_t compressor_wait(compressor *z)
+{
+  size_t ii, total = 0;
+
+  for (ii = 0; ii < (size_t)z->nthreads; ii++)
+    sem_wait(&z->done);
+  for (ii = 0; ii < (z->size + COMP_CHUNK-1)/COMP_CHUNK; ii++)
+    total += z->lens[ii];
+  return total;
+}
+
+void compressor_free(compressor *z)
+{
+  int ii;
+
+  z->stop = 1;
+  for (ii = 0; ii < z->nthreads; ii++)
+    sem_post(&z->go);
+  for (ii = 0; ii < z->nthreads; ii++)
+    pthread_join(z->tids[ii],NULL);
+  Free(z->tids);
+  Free(z->out);
+  Free(z->lens);
+}
@@ -0,0 +1,278 @@
+/******************************************
+ * Fair queue.
+ *
+ * Sits between the receive ring and the
+ * workers of the first pipeline stage, so
+ * that a fast bulk client cannot starve a
+ * slow one. The ring hands each slot to
+ * the queue as soon as it is committed or
+ * discarded (set_buf_sink), into one FIFO
+ * per client (flow), so a slot still being
+ * filled or repaired holds up no other
+ * client. The workers serve the flows by
+ * deficit round-robin: each round a flow
+ * may be served quantum bytes per unit of
+ * its share, so the bytes processed for
+ * each backlogged flow follow the shares
+ * whatever the packet sizes. Urgent flows
+ * are a strict-priority class, served
+ * before any bulk flow.
+ *
+ * The ring itself must be shared fairly
+ * too: a bulk flow may only hold its share
+ * of the slots (fq_may_reserve), counted
+ * among the bulk flows holding any, and
+ * one slot is kept back for urgent flows
+ * while one is connected. An urgent flow
+ * may hold its share counted among all the
+ * flows holding slots.
+ *
+ * Author: Aleksander Bapst
+ * ****************************************/
+#include "fair_queue.h"
+
+static void fq_deliver(void *arg, int slot);
+static void fq_push(fair_queue *fq, int slot);
+static int fq_ready(fair_queue *fq, fq_flow *f);
+static int fq_pick(fair_queue *fq, int *slot);
+
+/******************************************************
+ * Set up a fair queue over the slots of buf, serving
+ * quantum bytes per round and unit of share. The queue
+ * takes every slot of buf from then on.
+ * ****************************************************/
+void fq_init(fair_queue *fq, ring_buffer *buf, long quantum)
+{
+  int ii;
+
+  fq->buf = buf;
+  fq->quantum = (quantum < 1) ? 1 : quantum;
+  pthread_mutex_init(&fq->lock,NULL);
+  pthread_cond_init(&fq->cond,NULL);
+  fq->link = (int *)Malloc(buf->n_items*sizeof(int));
+  for (ii = 0; ii < FQ_NCLASSES; ii++) {
+    fq->first[ii] = fq->last[ii] = NULL;
+    atomic_init(&fq->flows[ii],0);
+    atomic_init(&fq->shares[ii],0);
+    lat_init(&fq->wait[ii],fq_class_name(ii));
+  }
+  fq_flow_init(&fq->anon,FQ_BULK,1,0);
+  atomic_init(&fq->queued,0);
+  set_buf_sink(buf,fq_deliver,fq);
+}
+
+void fq_free(fair_queue *fq)
+{
+  Free(fq->link);
+  pthread_mutex_destroy(&fq->lock);
+  pthread_cond_destroy(&fq->cond);
+}
+
+void fq_flow_init(fq_flow *f, int prio, int share, int ordered)
+{
+  f->prio = (prio == FQ_URGENT) ? FQ_URGENT : FQ_BULK;
+  f->share = (share < 1) ? 1 : (share > FQ_MAX_SHARE) ? FQ_MAX_SHARE : share;
+  f->ordered = ordered;
+  f->next_seq = 0;
+  f->deficit = 0;
+  f->head = f->tail = -1;
+  f->count = 0;
+  f->active = 0;
+  f->next_active = NULL;
+  atomic_init(&f->held,0);
+  atomic_init(&f->taken,0);
+}
+
+/* Count a connected flow, an urgent one keeps a slot back */
+void fq_join(fair_queue *fq, fq_flow *f)
+{
+  atomic_fetch_add(&fq->flows[f->prio],1);
+}
+
+/* The flow's connection is gone, it reserves no more slots */
+void fq_leave(fair_queue *fq, fq_flow *f)
+{
+  atomic_fetch_sub(&fq->flows[f->prio],1);
+}
+
+/******************************************************
+ * Slots the flow may hold now: its share of them among
+ * the flows holding slots and itself. A bulk flow only
+ * counts the bulk flows, and the slots not kept back;
+ * an urgent flow counts every flow, so it gets slots
+ * first but cannot take them all. At least one, so
+ * that every flow makes progress.
+ * ****************************************************/
+int fq_limit(fair_queue *fq, fq_flow *f)
+{
+  int n = fq->buf->n_items, shares, limit;
+
+  shares = atomic_load(&fq->shares[FQ_BULK]);
+  if (f->prio == FQ_URGENT)
+    shares += atomic_load(&fq->shares[FQ_URGENT]);
+  else if (atomic_load(&fq->flows[FQ_URGENT]) > 0)
+    n--;
+  if (atomic_load(&f->held) == 0)
+    shares += f->share;
+  limit = shares ? n*f->share/shares : n;
+  return (limit < 1) ? 1 : limit;
+}
+
+/* Whether the flow is below its share of the slots */
+int fq_may_reserve(fair_queue *fq, fq_flow *f)
+{
+  return atomic_load(&f->held) < fq_limit(fq,f);
+}
+
+/* A slot was reserved for the flow */
+void fq_hold(fair_queue *fq, fq_flow *f)
+{
+  if (atomic_fetch_add(&f->held,1) == 0)
+    atomic_fetch_add(&fq->shares[f->prio],f->share);
+}
+
+/* A slot of the flow left the pipeline */
+void fq_drop(fair_queue *fq, fq_flow *f)
+{
+  if (atomic_fetch_sub(&f->held,1) == 1)
+    atomic_fetch_sub(&fq->shares[f->prio],f->share);
+}
+
+/******************************************************
+ * Take the next packet to process, blocking while there
+ * is none. Discarded slots are returned too, check
+ * buf->state[*slot] before processing.
+ * ****************************************************/
+buf_item *fq_take(fair_queue *fq, int *slot)
+{
+  pthread_mutex_lock(&fq->lock);
+  while (!fq_pick(fq,slot))
+    pthread_cond_wait(&fq->cond,&fq->lock);
+  if (fq->first[FQ_URGENT] || fq->first[FQ_BULK]) // more to take, e.g. the
+    pthread_cond_signal(&fq->cond);               // next of an ordered flow
+  pthread_mutex_unlock(&fq->lock);
+  return fq->buf->data[*slot];
+}
+
+const char *fq_class_name(int prio)
+{
+  return (prio == FQ_URGENT) ? "urgent" : "bulk";
+}
+
+/* The ring finished a slot (see set_buf_sink) */
+static void fq_deliver(void *arg, int slot)
+{
+  fair_queue *fq = (fair_queue *)arg;
+
+  pthread_mutex_lock(&fq->lock);
+  fq_push(fq,slot);
+  pthread_cond_signal(&fq->cond);
+  pthread_mutex_unlock(&fq->lock);
+}
+
+/******************************************************
+ * Queue a finished slot in its flow, with the lock
+ * held: at the end, or in tag.seq order if the flow is
+ * ordered, as a repaired packet may be finished after
+ * its successors. A flow whose next slot can be served
+ * now joins the end of the round of its class.
+ * ****************************************************/
+static void fq_push(fair_queue *fq, int slot)
+{
+  fq_flow *f = (fq_flow *)fq->buf->tag[slot].owner;
+  slot_tag *tag = fq->buf->tag;
+  int *pp;
+
+  if (!f)
+    f = &fq->anon;
+  if (f->count == 0 || !f->ordered || tag[f->tail].seq < tag[slot].seq) {
+    fq->link[slot] = -1;
+    if (f->count == 0)
+      f->head = slot;
+    else
+      fq->link[f->tail] = slot;
+    f->tail = slot;
+  } else {
+    for (pp = &f->head; tag[*pp].seq < tag[slot].seq; pp = &fq->link[*pp])
+      ;
+    fq->link[slot] = *pp;
+    *pp = slot;
+  }
+  f->count++;
+  atomic_fetch_add(&fq->queued,1);
+
+  if (!f->active && fq_ready(fq,f)) {
+    f->active = 1;
+    f->next_active = NULL;
+    if (fq->last[f->prio])
+      fq->last[f->prio]->next_active = f;
+    else
+      fq->first[f->prio] = f;
+    fq->last[f->prio] = f;
+  }
+}
+
+/* Whether the flow has a slot that may be served now, with the lock held */
+static int fq_ready(fair_queue *fq, fq_flow *f)
+{
+  return f->count > 0 && (!f->ordered || fq->buf->tag[f->head].seq == f->next_seq);
+}
+
+/******************************************************
+ * Deficit round-robin over the flows of the highest
+ * class with a packet queued, with the lock held. The
+ * flow at the head of the round is served while its
+ * deficit covers its next packet (discarded slots cost
+ * nothing), else it is given its quantum and goes to
+ * the end of the round. A flow leaves the round when
+ * it has no slot left to serve now. Returns 0 if there
+ * is none.
+ * ****************************************************/
+static int fq_pick(fair_queue *fq, int *slot)
+{
+  ring_buffer *buf = fq->buf;
+  fq_flow *f;
+  long cost, q;
+  int c;
+  uint64_t now = get_time_ns();
+
+  for (c = FQ_NCLASSES-1; c >= 0; c--) {
+    while ((f = fq->first[c])) {
+      cost = (buf->state[f->head] == SLOT_READY) ? (long)buf->data[f->head]->size : 0;
+      if (cost > f->deficit) {
+        q = fq->quantum*f->share;
+        if (!f->next_active) { // alone in its class, skip to the round it can go
+          f->deficit += (cost - f->deficit + q - 1)/q*q;
+          continue;
+        }
+        f->deficit += q; // to the end of the round
+        fq->first[c] = f->next_active;
+        fq->last[c]->next_active = f;
+        fq->last[c] = f;
+        f->next_active = NULL;
+        continue;
+      }
+
+      *slot = f->head;
+      f->head = fq->link[*slot];
+      f->deficit -= cost;
+      f->next_seq = buf->tag[*slot].seq + 1;
+      if (--f->count == 0)
+        f->tail = -1;
+      if (!fq_ready(fq,f)) { // leaves the round, with no credit saved
+        f->deficit = 0;
+        f->active = 0;
+        fq->first[c] = f->next_active;
+        if (!fq->first[c])
+          fq->last[c] = NULL;
+        f->next_active = NULL;
+      }
+      atomic_fetch_sub(&fq->queued,1);
+      atomic_fetch_add_explicit(&f->taken,1,memory_order_relaxed);
+      if (cost > 0)
+        lat_record(&fq->wait[c],now - buf->data[*slot]->ready_ns);
+      return 1;
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,879 @@
+/******************************************
+ * Image processing kernels.
+ *
+ * The workers can run a kernel over the
+ * image data of each packet instead of
+ * only simulating the cost of processing.
+ * Kernels are registered by name (plugins
+ * register their own) and each has a
+ * portable C version plus AVX2 and
+ * AVX-512 versions where they pay off,
+ * picked at run time from what the CPU
+ * has. They work on f32 images, e.g. the
+ * legacy 2x4096x4096 SAR packet:
+ *
+ *   magphase   magnitude and phase of the
+ *              complex image in the two
+ *              channels (I, Q)
+ *   decimate2  2x2 box average
+ *   decimate4  4x4 box average
+ *   stats      min, max, mean and a 256 bin
+ *              histogram of each channel
+ *   quantize   each channel scaled from its
+ *              [min, max] to uint16
+ *
+ * Every kernel runs in place: the product
+ * is never written ahead of the input that
+ * is still to be read. The vector versions
+ * add in the same order as the C ones, so
+ * they agree bit for bit except for the
+ * mean, the magnitude (FMA) and the phase,
+ * which uses a polynomial arctangent
+ * (Abramowitz and Stegun 4.4.49) instead of
+ * atan2f.
+ *
+ * Author: Aleksander Bapst
+ * ****************************************/
+#include "kernels.h"
+#include <math.h>
+#include <float.h>
+#include <immintrin.h>
+
+#define STATS_BLOCK 1024 // floats summed in single precision at a time
+#define HIST_BLOCK  1024 // bins computed before they are counted
+
+static kernel *kernels = NULL, **kernels_tail = &kernels;
+static pthread_mutex_t kernels_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t kernels_once = PTHREAD_ONCE_INIT;
+static int isa_best = KERNEL_SCALAR;
+
+static const char *isa_names[KERNEL_NISA] = {"scalar","avx2","avx512"};
+
+/* atan(a) = a*(1 + c[0]a^2 + c[1]a^4 + ... + c[7]a^16) on [0, 1], error 2e-8 */
+static const float atan_c[8] = {
+  -0.3333314528f, 0.1999355085f, -0.1420889944f, 0.1065626393f,
+  -0.0752896400f, 0.0429096138f, -0.0161657367f, 0.0028662257f
+};
+
+static size_t plane_size(const packet_shape *s)
+{
+  return (size_t)s->width*s->height;
+}
+
+/*******************************************************
+ * Magnitude and phase: channel 0 is the real part and
+ * channel 1 the imaginary part of each pixel, they are
+ * replaced by its magnitude and phase (radians)
+ * ****************************************************/
+static int magphase_accepts(const packet_shape *s)
+{
+  return s->elem_type == ELEM_F32 && s->channels == 2;
+}
+
+static size_t magphase_size(const packet_shape *s)
+{
+  return shape_size((packet_shape *)s);
+}
+
+static void magphase_span(const float *re, const float *im, float *mag, float *ph,\
+                          size_t from, size_t n)
+{
+  size_t ii;
+  float x, y;
+
+  for (ii = from; ii < n; ii++) {
+    x = re[ii];
+    y = im[ii];
+    mag[ii] = sqrtf(x*x + y*y);
+    ph[ii] = atan2f(y,x);
+  }
+}
+
+static void magphase_scalar(const packet_shape *s, const void *in, void *out)
+{
+  size_t n = plane_size(s);
+
+  magphase_span((const float *)in,(const float *)in + n,(float *)out,(float *)out + n,0,n);
+}
+
+__attribute__((target("avx2,fma")))
+static inline __m256 atan2_avx2(__m256 y, __m256 x)
+{
+  const __m256 sign = _mm256_set1_ps(-0.f);
+  __m256 ax = _mm256_andnot_ps(sign,x), ay = _mm256_andnot_ps(sign,y);
+  __m256 hi = _mm256_max_ps(_mm256_max_ps(ax,ay),_mm256_set1_ps(FLT_MIN));
+  __m256 a = _mm256_div_ps(_mm256_min_ps(ax,ay),hi), a2 = _mm256_mul_ps(a,a);
+  __m256 r = _mm256_set1_ps(atan_c[7]);
+  int ii;
+
+  for (ii = 6; ii >= 0; ii--)
+    r = _mm256_fmadd_ps(r,a2,_mm256_set1_ps(atan_c[ii]));
+  r = _mm256_mul_ps(_mm256_fmadd_ps(r,a2,_mm256_set1_ps(1.f)),a);
+  // octant: |y| > |x|, then x < 0 (sign bit, so that -0 gives pi), then y's sign
+  r = _mm256_blendv_ps(r,_mm256_sub_ps(_mm256_set1_ps((float)M_PI_2),r),\
+                       _mm256_cmp_ps(ay,ax,_CMP_GT_OQ));
+  r = _mm256_blendv_ps(r,_mm256_sub_ps(_mm256_set1_ps((float)M_PI),r),x);
+  return _mm256_or_ps(r,_mm256_and_ps(y,sign));
+}
+
+__attribute__((target("avx2,fma")))
+static void magphase_avx2(const packet_shape *s, const void *in, void *out)
+{
+  size_t n = plane_size(s), ii;
+  const float *re = (const float *)in, *im = re + n;
+  float *mag = (float *)out, *ph = mag + n;
+  __m256 x, y;
+
+  for (ii = 0; ii + 8 <= n; ii += 8) {
+    x = _mm256_loadu_ps(re+ii);
+    y = _mm256_loadu_ps(im+ii);
+    _mm256_storeu_ps(mag+ii,_mm256_sqrt_ps(_mm256_fmadd_ps(x,x,_mm256_mul_ps(y,y))));
+    _mm256_storeu_ps(ph+ii,atan2_avx2(y,x));
+  }
+  magphase_span(re,im,mag,ph,ii,n);
+}
+
+__attribute__((target("avx512f")))
+static inline __m512 atan2_avx512(__m512 y, __m512 x)
+{
+  const __m512i sign = _mm512_set1_epi32(0x80000000);
+  __m512 ax = _mm512_abs_ps(x), ay = _mm512_abs_ps(y);
+  __m512 hi = _mm512_max_ps(_mm512_max_ps(ax,ay),_mm512_set1_ps(FLT_MIN));
+  __m512 a = _mm512_div_ps(_mm512_min_ps(ax,ay),hi), a2 = _mm512_mul_ps(a,a);
+  __m512 r = _mm512_set1_ps(atan_c[7]);
+  int ii;
+
+  for (ii = 6; ii >= 0; ii--)
+    r = _mm512_fmadd_ps(r,a2,_mm512_set1_ps(atan_c[ii]));
+  r = _mm512_mul_ps(_mm512_fmadd_ps(r,a2,_mm512_set1_ps(1.f)),a);
+  r = _mm512_mask_sub_ps(r,_mm512_cmp_ps_mask(ay,ax,_CMP_GT_OQ),\
+                         _mm512_set1_ps((float)M_PI_2),r);
+  r = _mm512_mask_sub_ps(r,_mm512_test_epi32_mask(_mm512_castps_si512(x),sign),\
+                         _mm512_set1_ps((float)M_PI),r);
+  return _mm512_castsi512_ps(_mm512_or_si512(_mm512_castps_si512(r),\
+                             _mm512_and_si512(_mm512_castps_si512(y),sign)));
+}
+
+__attribute__((target("avx512f")))
+static void magphase_avx512(const packet_shape *s, const void *in, void *out)
+{
+  size_t n = plane_size(s), ii;
+  const float *re = (const float *)in, *im = re + n;
+  float *mag = (float *)out, *ph = mag + n;
+  __m512 x, y;
+
+  for (ii = 0; ii + 16 <= n; ii += 16) {
+    x = _mm512_loadu_ps(re+ii);
+    y = _mm512_loadu_ps(im+ii);
+    _mm512_storeu_ps(mag+ii,_mm512_sqrt_ps(_mm512_fmadd_ps(x,x,_mm512_mul_ps(y,y))));
+    _mm512_storeu_ps(ph+ii,atan2_avx512(y,x));
+  }
+  magphase_span(re,im,mag,ph,ii,n);
+}
+
+// magnitudes to within 1e-6 (relative), phases to within 1e-5 rad
+static int magphase_same(const packet_shape *s, const void *a, const void *b)
+{
+  size_t n = plane_size(s), ii;
+  const float *pa = (const float *)a, *pb = (const float *)b;
+
+  for (ii = 0; ii < n; ii++) {
+    if (fabsf(pa[ii] - pb[ii]) > 1e-6f*fabsf(pa[ii]) + FLT_MIN ||
+        fabsf(pa[n+ii] - pb[n+ii]) > 1e-5f)
+      return 0;
+  }
+  return 1;
+}
+
+/*******************************************************
+ * Decimation by f in both directions: each output pixel
+ * is the mean of an f x f box, channel after channel
+ * (the last width % f columns and height % f rows are
+ * dropped). Columns of the box are summed first, then
+ * the column sums in pairs.
+ * ****************************************************/
+static int decimate_accepts(const packet_shape *s)
+{
+  return s->elem_type == ELEM_F32;
+}
+
+static size_t decimate2_size(const packet_shape *s)
+{
+  return (size_t)s->channels*(s->width/2)*(s->height/2)*sizeof(float);
+}
+
+static size_t decimate4_size(const packet_shape *s)
+{
+  return (size_t)s->channels*(s->width/4)*(s->height/4)*sizeof(float);
+}
+
+static void decimate2_shape(const packet_shape *s, packet_shape *out)
+{
+  *out = *s;
+  out->width /= 2;
+  out->height /= 2;
+}
+
+static void decimate4_shape(const packet_shape *s, packet_shape *out)
+{
+  *out = *s;
+  out->width /= 4;
+  out->height /= 4;
+}
+
+/* Output pixels [from, ow) of a row from the f rows at src, w apart */
+typedef void (*decimate_row)(const float *src, size_t w, float *dst, size_t from, size_t ow);
+
+static void decimate(const packet_shape *s, const void *in, void *out, int f, decimate_row row)
+{
+  size_t w = s->width, h = s->height, ow = w/f, oh = h/f, c, y;
+  float *dst = (float *)out;
+
+  for (c = 0; c < s->channels; c++) {
+    for (y = 0; y < oh; y++, dst += ow)
+      row((const float *)in + (c*h + y*f)*w,w,dst,0,ow);
+  }
+}
+
+static void row2_scalar(const float *src, size_t w, float *dst, size_t from, size_t ow)
+{
+  size_t x;
+
+  for (x = from; x < ow; x++)
+    dst[x] = ((src[2*x] + src[w+2*x]) + (src[2*x+1] + src[w+2*x+1]))*0.25f;
+}
+
+static void row4_scalar(const float *src, size_t w, float *dst, size_t from, size_t ow)
+{
+  float col[4];
+  size_t x, j;
+
+  for (x = from; x < ow; x++) {
+    for (j = 0; j < 4; j++)
+      col[j] = (src[4*x+j] + src[w+4*x+j]) + (src[2*w+4*x+j] + src[3*w+4*x+j]);
+    dst[x] = ((col[0] + col[1]) + (col[2] + col[3]))*0.0625f;
+  }
+}
+
+static void decimate2_scalar(const packet_shape *s, const void *in, void *out)
+{
+  decimate(s,in,out,2,row2_scalar);
+}
+
+static void decimate4_scalar(const packet_shape *s, const void *in, void *out)
+{
+  decimate(s,in,out,4,row4_scalar);
+}
+
+__attribute__((target("avx2")))
+static void row2_avx2(const float *src, size_t w, float *dst, size_t from, size_t ow)
+{
+  __m256 c0, c1, sum;
+  size_t x;
+
+  for (x = from; x + 8 <= ow; x += 8) {
+    c0 = _mm256_add_ps(_mm256_loadu_ps(src+2*x),_mm256_loadu_ps(src+w+2*x));
+    c1 = _mm256_add_ps(_mm256_loadu_ps(src+2*x+8),_mm256_loadu_ps(src+w+2*x+8));
+    // hadd works within 128-bit lanes, put the pair sums back in order
+    sum = _mm256_castpd_ps(_mm256_permute4x64_pd(_mm256_castps_pd(_mm256_hadd_ps(c0,c1)),0xd8));
+    _mm256_storeu_ps(dst+x,_mm256_mul_ps(sum,_mm256_set1_ps(0.25f)));
+  }
+  row2_scalar(src,w,dst,x,ow);
+}
+
+__attribute__((target("avx2")))
+static inline __m256 col4_avx2(const float *p, size_t w)
+{
+  return _mm256_add_ps(_mm256_add_ps(_mm256_loadu_ps(p),_mm256_loadu_ps(p+w)),\
+                       _mm256_add_ps(_mm256_loadu_ps(p+2*w),_mm256_loadu_ps(p+3*w)));
+}
+
+__attribute__((target("avx2")))
+static void row4_avx2(const float *src, size_t w, float *dst, size_t from, size_t ow)
+{
+  const __m256i order = _mm256_setr_epi32(0,4,1,5,2,6,3,7);
+  __m256 pairs0, pairs1, sum;
+  size_t x;
+
+  for (x = from; x + 8 <= ow; x += 8) {
+    pairs0 = _mm256_hadd_ps(col4_avx2(src+4*x,w),col4_avx2(src+4*x+8,w));
+    pairs1 = _mm256_hadd_ps(col4_avx2(src+4*x+16,w),col4_avx2(src+4*x+24,w));
+    sum = _mm256_permutevar8x32_ps(_mm256_hadd_ps(pairs0,pairs1),order);
+    _mm256_storeu_ps(dst+x,_mm256_mul_ps(sum,_mm256_set1_ps(0.0625f)));
+  }
+  row4_scalar(src,w,dst,x,ow);
+}
+
+static void decimate2_avx2(const packet_shape *s, const void *in, void *out)
+{
+  decimate(s,in,out,2,row2_avx2);
+}
+
+static void decimate4_avx2(const packet_shape *s, const void *in, void *out)
+{
+  decimate(s,in,out,4,row4_avx2);
+}
+
+// sums of the adjacent pairs of the 32 floats in a, b, in order
+__attribute__((target("avx512f")))
+static inline __m512 pairs_avx512(__m512 a, __m512 b)
+{
+  const __m512i even = _mm512_setr_epi32(0,2,4,6,8,10,12,14,16,18,20,22,24,26,28,30);
+  const __m512i odd = _mm512_setr_epi32(1,3,5,7,9,11,13,15,17,19,21,23,25,27,29,31);
+
+  return _mm512_add_ps(_mm512_permutex2var_ps(a,even,b),_mm512_permutex2var_ps(a,odd,b));
+}
+
+__attribute__((target("avx512f")))
+static void row2_avx512(const float *src, size_t w, float *dst, size_t from, size_t ow)
+{
+  __m512 c0, c1;
+  size_t x;
+
+  for (x = from; x + 16 <= ow; x += 16) {
+    c0 = _mm512_add_ps(_mm512_loadu_ps(src+2*x),_mm512_loadu_ps(src+w+2*x));
+    c1 = _mm512_add_ps(_mm512_loadu_ps(src+2*x+16),_mm512_loadu_ps(src+w+2*x+16));
+    _mm512_storeu_ps(dst+x,_mm512_mul_ps(pairs_avx512(c0,c1),_mm512_set1_ps(0.25f)));
+  }
+  row2_scalar(src,w,dst,x,ow);
+}
+
+__attribute__((target("avx512f")))
+static inline __m512 col4_avx512(const float *p, size_t w)
+{
+  return _mm512_add_ps(_mm512_add_ps(_mm512_loadu_ps(p),_mm512_loadu_ps(p+w)),\
+                       _mm512_add_ps(_mm512_loadu_ps(p+2*w),_mm512_loadu_ps(p+3*w)));
+}
+
+__attribute__((target("avx512f")))
+static void row4_avx512(const float *src, size_t w, float *dst, size_t from, size_t ow)
+{
+  __m512 pairs0, pairs1;
+  size_t x;
+
+  for (x = from; x + 16 <= ow; x += 16) {
+    pairs0 = pairs_avx512(col4_avx512(src+4*x,w),col4_avx512(src+4*x+16,w));
+    pairs1 = pairs_avx512(col4_avx512(src+4*x+32,w),col4_avx512(src+4*x+48,w));
+    _mm512_storeu_ps(dst+x,_mm512_mul_ps(pairs_avx512(pairs0,pairs1),_mm512_set1_ps(0.0625f)));
+  }
+  row4_scalar(src,w,dst,x,ow);
+}
+
+static void decimate2_avx512(const packet_shape *s, const void *in, void *out)
+{
+  decimate(s,in,out,2,row2_avx512);
+}
+
+static void decimate4_avx512(const packet_shape *s, const void *in, void *out)
+{
+  decimate(s,in,out,4,row4_avx512);
+}
+
+static int decimate2_same(const packet_shape *s, const void *a, const void *b)
+{
+  return memcmp(a,b,decimate2_size(s)) == 0;
+}
+
+static int decimate4_same(const packet_shape *s, const void *a, const void *b)
+{
+  return memcmp(a,b,decimate4_size(s)) == 0;
+}
+
+/*******************************************************
+ * Range and sum of a channel, and its histogram over
+ * that range: bin (v - min)*scale, clamped to the last
+ * bin (which also takes NaNs). NaNs are left out of
+ * the range unless the first value is one, the vector
+ * versions too.
+ * ****************************************************/
+typedef void (*minmax_fn)(const float *p, size_t n, float *min, float *max, double *sum);
+typedef void (*hist_fn)(const float *p, size_t n, float min, float scale, uint32_t *hist);
+
+static void minmax_scalar(const float *p, size_t n, float *min, float *max, double *sum)
+{
+  float lo = p[0], hi = p[0];
+  double total = 0;
+  size_t ii;
+
+  for (ii = 0; ii < n; ii++) {
+    lo = (p[ii] < lo) ? p[ii] : lo;
+    hi = (p[ii] > hi) ? p[ii] : hi;
+    total += p[ii];
+  }
+  *min = lo;
+  *max = hi;
+  *sum = total;
+}
+
+// four histograms in turn, so that runs of one bin do not serialize
+static void hist_scalar(const float *p, size_t n, float min, float scale, uint32_t *hist)
+{
+  uint32_t h[4][KERNEL_HIST_BINS];
+  size_t ii;
+  float f;
+  int bin;
+
+  memset(h,0,sizeof(h));
+  for (ii = 0; ii < n; ii++) {
+    f = (p[ii] - min)*scale;
+    bin = (f < KERNEL_HIST_BINS) ? (int)f : KERNEL_HIST_BINS-1;
+    h[ii & 3][bin]++;
+  }
+  for (bin = 0; bin < KERNEL_HIST_BINS; bin++)
+    hist[bin] = h[0][bin] + h[1][bin] + h[2][bin] + h[3][bin];
+}
+
+__attribute__((target("avx2")))
+static void minmax_avx2(const float *p, size_t n, float *min, float *max, double *sum)
+{
+  __m256 lo = _mm256_set1_ps(p[0]), hi = lo, acc;
+  float l[8], h[8], s[8];
+  double total = 0;
+  size_t ii = 0, end;
+  int jj;
+
+  while (ii + 8 <= n) {
+    acc = _mm256_setzero_ps();
+    end = (n - ii > STATS_BLOCK) ? ii + STATS_BLOCK : n;
+    for (; ii + 8 <= end; ii += 8) {
+      __m256 v = _mm256_loadu_ps(p+ii);
+      lo = _mm256_min_ps(v,lo); // NaN v keeps lo, like the scalar compare
+      hi = _mm256_max_ps(v,hi);
+      acc = _mm256_add_ps(acc,v);
+    }
+    _mm256_storeu_ps(s,acc);
+    for (jj = 0; jj < 8; jj++)
+      total += s[jj];
+  }
+  _mm256_storeu_ps(l,lo);
+  _mm256_storeu_ps(h,hi);
+  for (jj = 1; jj < 8; jj++) {
+    l[0] = (l[jj] < l[0]) ? l[jj] : l[0];
+    h[0] = (h[jj] > h[0]) ? h[jj] : h[0];
+  }
+  for (; ii < n; ii++) {
+    l[0] = (p[ii] < l[0]) ? p[ii] : l[0];
+    h[0] = (p[ii] > h[0]) ? p[ii] : h[0];
+    total += p[ii];
+  }
+  *min = l[0];
+  *max = h[0];
+  *sum = total;
+}
+
+__attribute__((target("avx2")))
+static void hist_avx2(const float *p, size_t n, float min, float scale, uint32_t *hist)
+{
+  const __m256 vmin = _mm256_set1_ps(min), vscale = _mm256_set1_ps(scale);
+  const __m256i last = _mm256_set1_epi32(KERNEL_HIST_BINS-1);
+  uint32_t h[4][KERNEL_HIST_BINS], bins[HIST_BLOCK];
+  size_t ii, jj, end;
+
+  memset(h,0,sizeof(h));
+  for (ii = 0; ii + 8 <= n; ii = end) {
+    end = ii + ((n - ii < HIST_BLOCK) ? (n - ii) & ~(size_t)7 : HIST_BLOCK);
+    for (jj = ii; jj < end; jj += 8) {
+      // out of range and NaN convert to 0x80000000, the unsigned min clamps it
+      __m256 f = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(p+jj),vmin),vscale);
+      _mm256_storeu_si256((__m256i *)(bins+jj-ii),_mm256_min_epu32(_mm256_cvttps_epi32(f),last));
+    }
+    for (jj = 0; jj < end - ii; jj++)
+      h[jj & 3][bins[jj]]++;
+  }
+  hist_scalar(p+ii,n-ii,min,scale,hist);
+  for (jj = 0; jj < KERNEL_HIST_BINS; jj++)
+    hist[jj] += h[0][jj] + h[1][jj] + h[2][jj] + h[3][jj];
+}
+
+__attribute__((target("avx512f")))
+static void minmax_avx512(const float *p, size_t n, float *min, float *max, double *sum)
+{
+  __m512 lo = _mm512_set1_ps(p[0]), hi = lo, acc;
+  float l, h;
+  double total = 0;
+  size_t ii = 0, end;
+
+  while (ii + 16 <= n) {
+    acc = _mm512_setzero_ps();
+    end = (n - ii > STATS_BLOCK) ? ii + STATS_BLOCK : n;
+    for (; ii + 16 <= end; ii += 16) {
+      __m512 v = _mm512_loadu_ps(p+ii);
+      lo = _mm512_min_ps(v,lo); // NaN v keeps lo, like the scalar compare
+      hi = _mm512_max_ps(v,hi);
+      acc = _mm512_add_ps(acc,v);
+    }
+    total += _mm512_reduce_add_ps(acc);
+  }
+  l = _mm512_reduce_min_ps(lo);
+  h = _mm512_reduce_max_ps(hi);
+  for (; ii < n; ii++) {
+    l = (p[ii] < l) ? p[ii] : l;
+    h = (p[ii] > h) ? p[ii] : h;
+    total += p[ii];
+  }
+  *min = l;
+  *max = h;
+  *sum = total;
+}
+
+__attribute__((target("avx512f")))
+static void hist_avx512(const float *p, size_t n, float min, float scale, uint32_t *hist)
+{
+  const __m512 vmin = _mm512_set1_ps(min), vscale = _mm512_set1_ps(scale);
+  const __m512i last = _mm512_set1_epi32(KERNEL_HIST_BINS-1);
+  uint32_t h[4][KERNEL_HIST_BINS], bins[HIST_BLOCK];
+  size_t ii, jj, end;
+
+  memset(h,0,sizeof(h));
+  for (ii = 0; ii + 16 <= n; ii = end) {
+    end = ii + ((n - ii < HIST_BLOCK) ? (n - ii) & ~(size_t)15 : HIST_BLOCK);
+    for (jj = ii; jj < end; jj += 16) {
+      __m512 f = _mm512_mul_ps(_mm512_sub_ps(_mm512_loadu_ps(p+jj),vmin),vscale);
+      _mm512_storeu_si512(bins+jj-ii,_mm512_min_epu32(_mm512_cvttps_epi32(f),last));
+    }
+    for (jj = 0; jj < end - ii; jj++)
+      h[jj & 3][bins[jj]]++;
+  }
+  hist_scalar(p+ii,n-ii,min,scale,hist);
+  for (jj = 0; jj < KERNEL_HIST_BINS; jj++)
+    hist[jj] += h[0][jj] + h[1][jj] + h[2][jj] + h[3][jj];
+}
+
+static const minmax_fn minmax_isa[KERNEL_NISA] = {minmax_scalar,minmax_avx2,minmax_avx512};
+static const hist_fn hist_isa[KERNEL_NISA] = {hist_scalar,hist_avx2,hist_avx512};
+
+/* Factor from [min, max] to [0, top], 0 if the range is empty or infinite */
+static float range_scale(float min, float max, float top)
+{
+  float scale = top/(max - min);
+
+  return (max > min && isfinite(scale)) ? scale : 0.f;
+}
+
+/*******************************************************
+ * Statistics of each channel, written to out as an
+ * image_stats per channel once all are computed
+ * ****************************************************/
+static int stats_accepts(const packet_shape *s)
+{
+  return s->elem_type == ELEM_F32 && plane_size(s) > 0 &&
+         shape_size((packet_shape *)s) >= s->channels*sizeof(image_stats);
+}
+
+static size_t stats_size(const packet_shape *s)
+{
+  return s->channels*sizeof(image_stats);
+}
+
+// the image_stats as a row of bytes
+static void stats_shape(const packet_shape *s, packet_shape *out)
+{
+  packet_shape bytes = {1,s->channels*sizeof(image_stats),1,ELEM_U8};
+
+  *out = bytes;
+}
+
+static void stats(const packet_shape *s, const void *in, void *out, int isa)
+{
+  image_stats *st = (image_stats *)Malloc(stats_size(s));
+  size_t n = plane_size(s);
+  const float *p;
+  double sum;
+  uint32_t c;
+
+  for (c = 0; c < s->channels; c++) {
+    p = (const float *)in + c*n;
+    minmax_isa[isa](p,n,&st[c].min,&st[c].max,&sum);
+    st[c].mean = sum/n;
+    memset(st[c].hist,0,sizeof(st[c].hist));
+    hist_isa[isa](p,n,st[c].min,range_scale(st[c].min,st[c].max,KERNEL_HIST_BINS),st[c].hist);
+  }
+  memcpy(out,st,stats_size(s));
+  Free(st);
+}
+
+static void stats_scalar(const packet_shape *s, const void *in, void *out)
+{
+  stats(s,in,out,KERNEL_SCALAR);
+}
+
+static void stats_avx2(const packet_shape *s, const void *in, void *out)
+{
+  stats(s,in,out,KERNEL_AVX2);
+}
+
+static void stats_avx512(const packet_shape *s, const void *in, void *out)
+{
+  stats(s,in,out,KERNEL_AVX512);
+}
+
+// all but the mean exactly, it is summed in a different order
+// equal, or both NaN
+static int same_float(float a, float b)
+{
+  return a == b || (isnan(a) && isnan(b));
+}
+
+static int stats_same(const packet_shape *s, const void *a, const void *b)
+{
+  const image_stats *sa = (const image_stats *)a, *sb = (const image_stats *)b;
+  uint32_t c;
+
+  for (c = 0; c < s->channels; c++) {
+    if (!same_float(sa[c].min,sb[c].min) || !same_float(sa[c].max,sb[c].max) ||
+        memcmp(sa[c].hist,sb[c].hist,sizeof(sa[c].hist)) != 0 ||
+        fabs(sa[c].mean - sb[c].mean) > 1e-5*(fabs(sa[c].mean) + sa[c].max - sa[c].min))
+      return 0;
+  }
+  return 1;
+}
+
+/*******************************************************
+ * Quantization of each channel from its [min, max] to
+ * [0, 65535], rounded to nearest (even), into a uint16
+ * image of the same shape
+ * ****************************************************/
+typedef void (*quantize_fn)(const float *p, size_t n, float min, float scale, uint16_t *q);
+
+static int quantize_accepts(const packet_shape *s)
+{
+  return s->elem_type == ELEM_F32 && plane_size(s) > 0;
+}
+
+static size_t quantize_size(const packet_shape *s)
+{
+  return shape_size((packet_shape *)s)/2;
+}
+
+static void quantize_shape(const packet_shape *s, packet_shape *out)
+{
+  *out = *s;
+  out->elem_type = ELEM_U16;
+}
+
+static void quantize_span(const float *p, size_t n, float min, float scale, uint16_t *q)
+{
+  size_t ii;
+  float f;
+
+  for (ii = 0; ii < n; ii++) {
+    f = (p[ii] - min)*scale;
+    f = (f > 0.f) ? f : 0.f; // NaN too, like _mm_max_ps(f,0)
+    f = (f < 65535.f) ? f : 65535.f;
+    q[ii] = (uint16_t)lrintf(f);
+  }
+}
+
+__attribute__((target("avx2")))
+static void quantize_avx2(const float *p, size_t n, float min, float scale, uint16_t *q)
+{
+  const __m256 vmin = _mm256_set1_ps(min), vscale = _mm256_set1_ps(scale);
+  const __m256 zero = _mm256_setzero_ps(), top = _mm256_set1_ps(65535.f);
+  __m256i a, b;
+  size_t ii;
+
+  for (ii = 0; ii + 16 <= n; ii += 16) {
+    a = _mm256_cvtps_epi32(_mm256_min_ps(_mm256_max_ps(_mm256_mul_ps(\
+          _mm256_sub_ps(_mm256_loadu_ps(p+ii),vmin),vscale),zero),top));
+    b = _mm256_cvtps_epi32(_mm256_min_ps(_mm256_max_ps(_mm256_mul_ps(\
+          _mm256_sub_ps(_mm256_loadu_ps(p+ii+8),vmin),vscale),zero),top));
+    // packus interleaves the 128-bit lanes of a and b
+    _mm256_storeu_si256((__m256i *)(q+ii),_mm256_permute4x64_epi64(_mm256_packus_epi32(a,b),0xd8));
+  }
+  quantize_span(p+ii,n-ii,min,scale,q+ii);
+}
+
+__attribute__((target("avx512f")))
+static void quantize_avx512(const float *p, size_t n, float min, float scale, uint16_t *q)
+{
+  const __m512 vmin = _mm512_set1_ps(min), vscale = _mm512_set1_ps(scale);
+  const __m512 zero = _mm512_setzero_ps(), top = _mm512_set1_ps(65535.f);
+  __m512i v;
+  size_t ii;
+
+  for (ii = 0; ii + 16 <= n; ii += 16) {
+    v = _mm512_cvtps_epi32(_mm512_min_ps(_mm512_max_ps(_mm512_mul_ps(\
+          _mm512_sub_ps(_mm512_loadu_ps(p+ii),vmin),vscale),zero),top));
+    _mm256_storeu_si256((__m256i *)(q+ii),_mm512_cvtepi32_epi16(v));
+  }
+  quantize_span(p+ii,n-ii,min,scale,q+ii);
+}
+
+static const quantize_fn quantize_isa[KERNEL_NISA] = {quantize_span,quantize_avx2,quantize_avx512};
+
+// channel c goes to q + c*n, which is never past the floats still to read
+static void quantize(const packet_shape *s, const void *in, void *out, int isa)
+{
+  size_t n = plane_size(s);
+  const float *p;
+  float min, max;
+  double sum;
+  uint32_t c;
+
+  for (c = 0; c < s->channels; c++) {
+    p = (const float *)in + c*n;
+    minmax_isa[isa](p,n,&min,&max,&sum);
+    quantize_isa[isa](p,n,min,range_scale(min,max,65535.f),(uint16_t *)out + c*n);
+  }
+}
+
+static void quantize_scalar(const packet_shape *s, const void *in, void *out)
+{
+  quantize(s,in,out,KERNEL_SCALAR);
+}
+
+static void quantize_run_avx2(const packet_shape *s, const void *in, void *out)
+{
+  quantize(s,in,out,KERNEL_AVX2);
+}
+
+static void quantize_run_avx512(const packet_shape *s, const void *in, void *out)
+{
+  quantize(s,in,out,KERNEL_AVX512);
+}
+
+static int quantize_same(const packet_shape *s, const void *a, const void *b)
+{
+  return memcmp(a,b,quantize_size(s)) == 0;
+}
+
+/* Built in kernels, registered in this order */
+static kernel builtins[] = {
+  {"magphase","magnitude and phase of the complex image in 2 channels",\
+   magphase_accepts,magphase_size,NULL,magphase_same,\
+   {magphase_scalar,magphase_avx2,magphase_avx512},NULL},
+  {"decimate2","2x2 box average",\
+   decimate_accepts,decimate2_size,decimate2_shape,decimate2_same,\
+   {decimate2_scalar,decimate2_avx2,decimate2_avx512},NULL},
+  {"decimate4","4x4 box average",\
+   decimate_accepts,decimate4_size,decimate4_shape,decimate4_same,\
+   {decimate4_scalar,decimate4_avx2,decimate4_avx512},NULL},
+  {"stats","min, max, mean and histogram of each channel",\
+   stats_accepts,stats_size,stats_shape,stats_same,\
+   {stats_scalar,stats_avx2,stats_avx512},NULL},
+  {"quantize","each channel from its range to uint16",\
+   quantize_accepts,quantize_size,quantize_shape,quantize_same,\
+   {quantize_scalar,quantize_run_avx2,quantize_run_avx512},NULL},
+};
+
+/******************************************************
+ * Detect the CPU features and register the built in
+ * kernels
+ * ****************************************************/
+static void kernels_setup()
+{
+  size_t ii;
+
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512f"))
+    isa_best = KERNEL_AVX512;
+  else if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+    isa_best = KERNEL_AVX2;
+  for (ii = 0; ii < sizeof(builtins)/sizeof(builtins[0]); ii++) {
+    *kernels_tail = &builtins[ii];
+    kernels_tail = &builtins[ii].next;
+  }
+}
+
+/******************************************************
+ * Add a kernel, found by kernel_find from then on. The
+ * kernel must stay valid, its next field is ours.
+ * ****************************************************/
+void kernel_register(kernel *k)
+{
+  pthread_once(&kernels_once,kernels_setup);
+  pthread_mutex_lock(&kernels_lock);
+  k->next = NULL;
+  *kernels_tail = k;
+  kernels_tail = &k->next;
+  pthread_mutex_unlock(&kernels_lock);
+}
+
+kernel *kernel_find(const char *name)
+{
+  kernel *k;
+
+  pthread_once(&kernels_once,kernels_setup);
+  pthread_mutex_lock(&kernels_lock);
+  for (k = kernels; k && strcmp(k->name,name) != 0; k = k->next)
+    ;
+  pthread_mutex_unlock(&kernels_lock);
+  return k;
+}
+
+/******************************************************
+ * A kernel and the instruction set to run it with from
+ * "<name>[:scalar|avx2|avx512]", KERNEL_BEST if none is
+ * given. Returns NULL if either is unknown.
+ * ****************************************************/
+kernel *kernel_parse(const char *spec, int *isa)
+{
+  char name[64], *colon;
+
+  snprintf(name,sizeof(name),"%s",spec);
+  *isa = KERNEL_BEST;
+  if ((colon = strchr(name,':'))) {
+    *colon++ = '\0';
+    for (*isa = 0; *isa < KERNEL_NISA && strcmp(colon,isa_names[*isa]) != 0; (*isa)++)
+      ;
+    if (*isa == KERNEL_NISA)
+      return NULL;
+  }
+  return kernel_find(name);
+}
+
+/* The registered kernels, in order through their next fields */
+kernel *kernel_first()
+{
+  pthread_once(&kernels_once,kernels_setup);
+  return kernels;
+}
+
+int kernel_isa_best()
+{
+  pthread_once(&kernels_once,kernels_setup);
+  return isa_best;
+}
+
+const char *kernel_isa_name(int isa)
+{
+  return (isa >= 0 && isa < KERNEL_NISA) ? isa_names[isa] : "best";
+}
+
+/******************************************************
+ * The instruction set k runs with when asked for isa:
+ * the best one it implements that the CPU has, up to
+ * isa
+ * ****************************************************/
+int kernel_isa(const kernel *k, int isa)
+{
+  pthread_once(&kernels_once,kernels_setup);
+  if (isa < 0 || isa > isa_best)
+    isa = isa_best;
+  while (isa > KERNEL_SCALAR && !k->run[isa])
+    isa--;
+  return isa;
+}
+
+/* Shape of the product of k on image data of the given shape */
+void kernel_out_shape(const kernel *k, const packet_shape *shape, packet_shape *out)
+{
+  if (k->out_shape)
+    k->out_shape(shape,out);
+  else
+    *out = *shape;
+}
+
+/******************************************************
+ * Run k over image data of the given shape. Returns the
+ * instruction set used, or -1 if k does not take the
+ * shape.
+ * ****************************************************/
+int kernel_run(const kernel *k, int isa, const packet_shape *shape, const void *in, void *out)
+{
+  if (!k->accepts(shape))
+    return -1;
+  isa = kernel_isa(k,isa);
+  k->run[isa](shape,in,out);
+  return isa;
+}
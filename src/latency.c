@@ -0,0 +1,140 @@
+/******************************************
+ * Latency histograms.
+ *
+ * Timestamps come from CLOCK_MONOTONIC in
+ * ns, which the vDSO reads from the TSC
+ * without a system call. Latencies are
+ * counted in HDR-style log-linear buckets:
+ * fixed memory, no allocation, and the
+ * same relative precision for a 2 us
+ * enqueue as for a 2 s packet, so p99.9
+ * of any stage can be read off at the end.
+ *
+ * Author: Aleksander Bapst
+ * ****************************************/
+#include "latency.h"
+
+/******************************************************
+ * Monotonic time in ns
+ * ****************************************************/
+uint64_t get_time_ns()
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC,&ts);
+  return (uint64_t)ts.tv_sec*1000000000 + ts.tv_nsec;
+}
+
+void lat_init(lat_hist *h, const char *name)
+{
+  int ii;
+
+  h->name = name;
+  atomic_init(&h->count,0);
+  atomic_init(&h->sum,0);
+  atomic_init(&h->max,0);
+  for (ii = 0; ii < LAT_BUCKETS; ii++)
+    atomic_init(&h->buckets[ii],0);
+}
+
+// bucket of a value: LAT_SUB buckets of width 1 << (group-1) per group
+static int lat_bucket(uint64_t ns)
+{
+  int msb;
+
+  if (ns < LAT_SUB)
+    return ns;
+  msb = 63 - __builtin_clzll(ns);
+  if (msb >= LAT_MAX_SHIFT)
+    return LAT_BUCKETS-1;
+  return ((msb-LAT_SUB_SHIFT+1) << LAT_SUB_SHIFT) + (ns >> (msb-LAT_SUB_SHIFT)) - LAT_SUB;
+}
+
+// largest value counted in a bucket
+static uint64_t lat_bucket_value(int bucket)
+{
+  int group = bucket >> LAT_SUB_SHIFT, sub = bucket & (LAT_SUB-1);
+
+  if (group == 0)
+    return bucket;
+  return ((uint64_t)(LAT_SUB+sub+1) << (group-1)) - 1;
+}
+
+void lat_record(lat_hist *h, uint64_t ns)
+{
+  uint64_t max = atomic_load_explicit(&h->max,memory_order_relaxed);
+
+  atomic_fetch_add_explicit(&h->buckets[lat_bucket(ns)],1,memory_order_relaxed);
+  atomic_fetch_add_explicit(&h->count,1,memory_order_relaxed);
+  atomic_fetch_add_explicit(&h->sum,ns,memory_order_relaxed);
+  while (ns > max && !atomic_compare_exchange_weak(&h->max,&max,ns))
+    ;
+}
+
+/******************************************************
+ * Latency in ns that p percent of the recorded values
+ * do not exceed, to within the bucket precision
+ * ****************************************************/
+uint64_t lat_percentile(lat_hist *h, double p)
+{
+  uint64_t count = atomic_load(&h->count), seen = 0, rank, max = atomic_load(&h->max);
+  int ii;
+
+  if (count == 0)
+    return 0;
+  rank = (uint64_t)(p/100.*count + 0.5);
+  if (rank < 1)
+    rank = 1;
+  for (ii = 0; ii < LAT_BUCKETS; ii++) {
+    seen += atomic_load_explicit(&h->buckets[ii],memory_order_relaxed);
+    if (seen >= rank)
+      return (lat_bucket_value(ii) < max) ? lat_bucket_value(ii) : max;
+  }
+  return max;
+}
+
+/******************************************************
+ * Copy the bucket counts of a histogram that is still
+ * being recorded, so that figures derived from the
+ * copy agree with each other
+ * ****************************************************/
+void lat_snapshot(lat_hist *h, uint64_t *counts)
+{
+  int ii;
+
+  for (ii = 0; ii < LAT_BUCKETS; ii++)
+    counts[ii] = atomic_load_explicit(&h->buckets[ii],memory_order_relaxed);
+}
+
+/******************************************************
+ * Number of values of at most ns in a snapshot, to
+ * within the bucket precision (UINT64_MAX counts them
+ * all)
+ * ****************************************************/
+uint64_t lat_count_below(const uint64_t *counts, uint64_t ns)
+{
+  uint64_t seen = 0;
+  int ii;
+
+  for (ii = 0; ii < LAT_BUCKETS && lat_bucket_value(ii) <= ns; ii++)
+    seen += counts[ii];
+  return seen;
+}
+
+/******************************************************
+ * Print p50/p99/p99.9 and the max of n stages in us
+ * ****************************************************/
+void lat_print(lat_hist *hists, int n)
+{
+  int ii;
+
+  printf("%-14s %8s %10s %10s %10s %10s\n","Stage (us)","count","p50","p99","p99.9","max");
+  for (ii = 0; ii < n; ii++) {
+    if (atomic_load(&hists[ii].count) == 0)
+      continue;
+    printf("%-14s %8lu %10.1f %10.1f %10.1f %10.1f\n",hists[ii].name,\
+           atomic_load(&hists[ii].count),lat_percentile(&hists[ii],50)/1e3,\
+           lat_percentile(&hists[ii],99)/1e3,lat_percentile(&hists[ii],99.9)/1e3,\
+           atomic_load(&hists[ii].max)/1e3);
+  }
+}
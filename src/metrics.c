@@ -0,0 +1,173 @@
+/******************************************
+ * Metrics endpoint.
+ *
+ * Counters, gauges and latency histograms
+ * in the Prometheus text format, served
+ * over HTTP on a port of the loopback
+ * interface or on a Unix socket, so they
+ * are only visible from this host. The
+ * values are read with relaxed atomic
+ * loads when a page is built, nothing is
+ * locked on the packet path.
+ *
+ * Author: Aleksander Bapst
+ * ****************************************/
+#include "metrics.h"
+#include <stdarg.h>
+#include <sys/un.h>
+
+#define METRICS_PAGE 16384 // initial page size, grown as needed
+
+/* Upper bounds of the exported histogram buckets, in seconds */
+static const double hist_bounds[] = {
+  1e-6, 2.5e-6, 5e-6, 1e-5, 2.5e-5, 5e-5, 1e-4, 2.5e-4, 5e-4,
+  1e-3, 2.5e-3, 5e-3, 1e-2, 2.5e-2, 5e-2, 0.1, 0.25, 0.5, 1, 2.5, 5, 10
+};
+
+/******************************************************
+ * Listen for scrapers on addr: a port number on the
+ * loopback interface, or the path of a Unix socket if
+ * it contains a '/'. Returns -1 on error.
+ * ****************************************************/
+int metrics_listen(const char *addr)
+{
+  struct sockaddr_in in;
+  struct sockaddr_un un;
+  int fd, optval = 1;
+
+  if (strchr(addr,'/')) {
+    if (strlen(addr) >= sizeof(un.sun_path))
+      return -1;
+    memset(&un,0,sizeof(un));
+    un.sun_family = AF_UNIX;
+    strcpy(un.sun_path,addr);
+    unlink(addr); // left over from an earlier run
+    if ((fd = socket(AF_UNIX,SOCK_STREAM,0)) < 0)
+      return -1;
+    if (bind(fd,(SA *)&un,sizeof(un)) < 0 || listen(fd,LISTENQ) < 0) {
+      Close(fd);
+      return -1;
+    }
+    return fd;
+  }
+
+  memset(&in,0,sizeof(in));
+  in.sin_family = AF_INET;
+  in.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  in.sin_port = htons(atoi(addr));
+  if ((fd = socket(AF_INET,SOCK_STREAM,0)) < 0)
+    return -1;
+  Setsockopt(fd,SOL_SOCKET,SO_REUSEADDR,(const void *)&optval,sizeof(int));
+  if (bind(fd,(SA *)&in,sizeof(in)) < 0 || listen(fd,LISTENQ) < 0) {
+    Close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+void metrics_init(metrics_buf *m)
+{
+  m->cap = METRICS_PAGE;
+  m->data = (char *)Malloc(m->cap);
+  m->len = 0;
+}
+
+void metrics_free(metrics_buf *m)
+{
+  Free(m->data);
+  m->data = NULL;
+}
+
+static void metrics_printf(metrics_buf *m, const char *fmt, ...)
+{
+  va_list ap;
+  int n;
+
+  va_start(ap,fmt);
+  n = vsnprintf(m->data+m->len,m->cap-m->len,fmt,ap);
+  va_end(ap);
+  if (m->len + n >= m->cap) {
+    while (m->len + n >= m->cap)
+      m->cap *= 2;
+    if (!(m->data = (char *)realloc(m->data,m->cap)))
+      unix_error("realloc error");
+    va_start(ap,fmt);
+    vsnprintf(m->data+m->len,m->cap-m->len,fmt,ap);
+    va_end(ap);
+  }
+  m->len += n;
+}
+
+/******************************************************
+ * HELP and TYPE lines of a metric family
+ * ****************************************************/
+void metrics_family(metrics_buf *m, const char *name, const char *type, const char *help)
+{
+  metrics_printf(m,"# HELP %s %s\n# TYPE %s %s\n",name,help,name,type);
+}
+
+/******************************************************
+ * One sample, labels is e.g. `client="a:1"` or NULL
+ * ****************************************************/
+void metrics_value(metrics_buf *m, const char *name, const char *labels, double value)
+{
+  if (labels)
+    metrics_printf(m,"%s{%s} %.15g\n",name,labels,value);
+  else
+    metrics_printf(m,"%s %.15g\n",name,value);
+}
+
+/******************************************************
+ * A latency histogram as cumulative buckets in seconds
+ * plus its sum and count. The buckets and the count
+ * come from one snapshot, so that they never disagree
+ * while workers record.
+ * ****************************************************/
+void metrics_hist(metrics_buf *m, const char *name, const char *labels, lat_hist *h)
+{
+  const char *sep = labels ? "," : "";
+  uint64_t counts[LAT_BUCKETS], count;
+  size_t ii;
+
+  lat_snapshot(h,counts);
+  count = lat_count_below(counts,UINT64_MAX);
+  if (!labels)
+    labels = "";
+  for (ii = 0; ii < sizeof(hist_bounds)/sizeof(hist_bounds[0]); ii++)
+    metrics_printf(m,"%s_bucket{%s%sle=\"%g\"} %lu\n",name,labels,sep,hist_bounds[ii],\
+                   lat_count_below(counts,hist_bounds[ii]*1e9));
+  metrics_printf(m,"%s_bucket{%s%sle=\"+Inf\"} %lu\n",name,labels,sep,count);
+  metrics_printf(m,"%s_sum%s%s%s %.9f\n",name,*sep ? "{" : "",labels,*sep ? "}" : "",\
+                 atomic_load(&h->sum)/1e9);
+  metrics_printf(m,"%s_count%s%s%s %lu\n",name,*sep ? "{" : "",labels,*sep ? "}" : "",count);
+}
+
+/******************************************************
+ * Read a scraper's request, whatever it asks for, and
+ * answer with the page, which is then emptied. Errors
+ * only cost the scraper its answer.
+ * ****************************************************/
+void metrics_reply(metrics_buf *m, int connfd)
+{
+  struct timeval tv = {METRICS_TIMEOUT,0};
+  char req[MAXLINE], hdr[256];
+  size_t got = 0;
+  ssize_t n;
+  int len;
+
+  setsockopt(connfd,SOL_SOCKET,SO_RCVTIMEO,&tv,sizeof(tv));
+  setsockopt(connfd,SOL_SOCKET,SO_SNDTIMEO,&tv,sizeof(tv));
+  while (got < sizeof(req)-1 && (n = read(connfd,req+got,sizeof(req)-1-got)) > 0) {
+    got += n;
+    req[got] = '\0';
+    if (strstr(req,"\r\n\r\n") || strstr(req,"\n\n"))
+      break;
+  }
+
+  len = snprintf(hdr,sizeof(hdr),"HTTP/1.0 200 OK\r\n"\
+                 "Content-Type: text/plain; version=0.0.4\r\n"\
+                 "Content-Length: %zu\r\nConnection: close\r\n\r\n",m->len);
+  if (rio_writen(connfd,hdr,len) == len)
+    rio_writen(connfd,m->data,m->len);
+  m->len = 0;
+}
@@ -0,0 +1,206 @@
+/******************************************
+ * Processing pipeline.
+ *
+ * The packets go through a chain of stages,
+ * each with its own pool of workers taking
+ * them from its input ring. The first stage
+ * reads the ring the packets are received
+ * into; every later stage reads a ring
+ * chained to it (init_buf_chained), so a
+ * packet moves on by handing its slot to
+ * the next ring, never by copying it. The
+ * last stage releases the receive slot.
+ *
+ * Each stage counts the packets and bytes
+ * it processed and the time its workers
+ * spent busy and waiting, so the stage that
+ * limits throughput (the busiest) is the
+ * one to give more workers.
+ *
+ * The first stage may take the packets
+ * through a fair queue (fair_queue.c)
+ * rather than in the order they arrived.
+ *
+ * Author: Aleksander Bapst
+ * ****************************************/
+#include "pipeline.h"
+
+void pipeline_init(pipeline *p, ring_buffer *buf)
+{
+  p->buf = buf;
+  p->nstages = 0;
+  atomic_init(&p->inflight,0);
+}
+
+/******************************************************
+ * Append a stage that runs fn(item,arg) on each packet
+ * on n_workers threads, which the caller starts. Returns
+ * NULL if the pipeline already has MAX_STAGES stages.
+ * ****************************************************/
+stage *pipeline_add(pipeline *p, const char *name, stage_fn fn, void *arg, int n_workers)
+{
+  stage *s;
+
+  if (p->nstages == MAX_STAGES)
+    return NULL;
+  s = &p->stages[p->nstages];
+  snprintf(s->name,sizeof(s->name),"%s",name);
+  s->fn = fn;
+  s->arg = arg;
+  s->n_workers = (n_workers < 1) ? 1 : n_workers;
+  s->index = p->nstages;
+  s->in = p->nstages ? init_buf_chained(p->buf) : p->buf;
+  s->out = NULL;
+  s->fq = NULL;
+  s->pipe = p;
+  if (p->nstages)
+    p->stages[p->nstages-1].out = s->in;
+  atomic_init(&s->packets,0);
+  atomic_init(&s->bytes,0);
+  atomic_init(&s->busy_ns,0);
+  atomic_init(&s->idle_ns,0);
+  atomic_init(&s->active,0);
+  lat_init(&s->queue,s->name);
+  p->nstages++;
+  return s;
+}
+
+/* Workers of all stages */
+int pipeline_workers(pipeline *p)
+{
+  int ii, n = 0;
+
+  for (ii = 0; ii < p->nstages; ii++)
+    n += p->stages[ii].n_workers;
+  return n;
+}
+
+/******************************************************
+ * Packets in the pipeline: reserved or queued in the
+ * receive ring, or somewhere past the first stage
+ * ****************************************************/
+int pipeline_used(pipeline *p)
+{
+  int used = buf_used(p->buf) + atomic_load(&p->inflight);
+
+  if (p->nstages && p->stages[0].fq)
+    used += atomic_load(&p->stages[0].fq->queued);
+  return used;
+}
+
+/* Have the first stage take the packets through a fair queue */
+void pipeline_fair(pipeline *p, fair_queue *fq)
+{
+  if (p->nstages)
+    p->stages[0].fq = fq;
+}
+
+/* Free the rings chained to the receive ring */
+void pipeline_free(pipeline *p)
+{
+  int ii;
+
+  for (ii = 1; ii < p->nstages; ii++)
+    free_buf(p->stages[ii].in);
+  p->nstages = 0;
+}
+
+/******************************************************
+ * Take the next packet of the stage's input ring, or
+ * of its fair queue, blocking while there is none.
+ * The worker owns it until stage_pass. Discarded slots
+ * are returned too, check s->in->state[*slot] before
+ * processing.
+ * ****************************************************/
+buf_item *stage_take(stage *s, int *slot)
+{
+  uint64_t start = get_time_ns(), now;
+  buf_item *item = s->fq ? fq_take(s->fq,slot) : acquire_slot(s->in,slot);
+
+  now = get_time_ns();
+  atomic_fetch_add_explicit(&s->idle_ns,now - start,memory_order_relaxed);
+  atomic_fetch_add(&s->active,1);
+  if (s->index == 0)
+    atomic_fetch_add(&s->pipe->inflight,1);
+  if (s->in->state[*slot] == SLOT_READY)
+    lat_record(&s->queue,now - (s->index ? item->stage_ns : item->ready_ns));
+  return item;
+}
+
+/******************************************************
+ * Process a packet taken by stage_take, and return the
+ * time it took in ns
+ * ****************************************************/
+uint64_t stage_run(stage *s, buf_item *item)
+{
+  uint64_t start = get_time_ns(), ns;
+  size_t size = item->size; // the stage may turn the packet into a smaller one
+
+  s->fn(item,s->arg);
+  ns = get_time_ns() - start;
+  atomic_fetch_add_explicit(&s->busy_ns,ns,memory_order_relaxed);
+  atomic_fetch_add_explicit(&s->packets,1,memory_order_relaxed);
+  atomic_fetch_add_explicit(&s->bytes,size,memory_order_relaxed);
+  return ns;
+}
+
+/******************************************************
+ * Hand a taken packet to the next stage, or release its
+ * receive slot after the last one. Returns 1 if the
+ * packet left the pipeline.
+ * ****************************************************/
+int stage_pass(stage *s, int slot)
+{
+  if (s->out) {
+    s->in->data[slot]->stage_ns = get_time_ns();
+    pass_slot(s->in,slot,s->out);
+  } else {
+    release_slot(s->in,slot);
+    atomic_fetch_sub(&s->pipe->inflight,1);
+  }
+  atomic_fetch_sub(&s->active,1);
+  return !s->out;
+}
+
+/* Packets queued for or held by a stage */
+int stage_occupancy(stage *s)
+{
+  return buf_used(s->in) + atomic_load(&s->active);
+}
+
+/******************************************************
+ * Fraction of the time the workers of a stage were
+ * processing rather than waiting for a packet
+ * ****************************************************/
+double stage_busy(stage *s)
+{
+  uint64_t busy = atomic_load(&s->busy_ns), idle = atomic_load(&s->idle_ns);
+
+  return (busy + idle) ? (double)busy/(busy + idle) : 0;
+}
+
+/*********************************************************************
+ * Print the counters of each stage: the MB/s it can sustain with all
+ * of its workers busy, how busy they were and how long packets
+ * queued for it, then the busiest stage
+ * *******************************************************************/
+void pipeline_print(pipeline *p)
+{
+  uint64_t busy;
+  stage *s, *top = NULL;
+  int ii;
+
+  printf("Pipeline stage    workers    packets   capacity MB/s   busy  occupancy   queue p99 (us)\n");
+  for (ii = 0; ii < p->nstages; ii++) {
+    s = &p->stages[ii];
+    busy = atomic_load(&s->busy_ns);
+    printf("%-16s %8d %10lu %15.1f %5.1f%% %10d %16.1f\n",s->name,s->n_workers,\
+           atomic_load(&s->packets),\
+           busy ? atomic_load(&s->bytes)/MEGABYTE/(busy/1e9)*s->n_workers : 0,\
+           100*stage_busy(s),stage_occupancy(s),lat_percentile(&s->queue,99)/1e3);
+    if (!top || stage_busy(s) > stage_busy(top))
+      top = s;
+  }
+  if (top && p->nstages > 1)
+    printf("Bottleneck: %s, %.1f%% busy\n",top->name,100*stage_busy(top));
+}
@@ -0,0 +1,853 @@
+/******************************************
+ * Client/server wire protocol.
+ *
+ * Binary frames are a fixed FRAME_HDR_SIZE
+ * header:
+ *
+ *   0  magic     u16
+ *   2  version   u8
+ *   3  type      u8
+ *   4  flags     u16
+ *   6  reserved  u16
+ *   8  length    u32
+ *  12  seq       u32
+ *  16  timestamp i64
+ *
+ * followed by `length` bytes of payload. A
+ * connection in text mode uses the original
+ * MAXLINE-sized string messages instead.
+ *
+ * Since version 2 the payload of a PACKET
+ * frame starts with its shape (channels,
+ * width, height, element type as u32 words),
+ * then the image data and the packet trailer.
+ * Version 1 PACKET frames and text clients
+ * carry one legacy image with no shape.
+ * With FLAG_SHM the image data was written
+ * to the slot through shared memory and only
+ * the shape and trailer follow the header.
+ *
+ * With chunk repair, each packet is followed
+ * by a CHUNKS frame with the CRC32C of each
+ * of its chunks. The server answers a packet
+ * that arrived corrupt with a NACK naming
+ * the bad chunks, and the client sends them
+ * again after a REPAIR header, between its
+ * other frames.
+ *
+ * Author: Aleksander Bapst
+ * ****************************************/
+#include "protocol.h"
+#include <endian.h>
+#include <sys/uio.h>
+
+/******************************************************
+ * Wall clock time in ms, used to stamp control frames
+ * ****************************************************/
+static int64_t now_ms()
+{
+  struct timeval tv;
+
+  gettimeofday(&tv,NULL);
+  return (int64_t)tv.tv_sec*1000 + tv.tv_usec/1000;
+}
+
+/******************************************************
+ * Serialize a frame header into FRAME_HDR_SIZE bytes
+ * ****************************************************/
+void pack_frame_hdr(unsigned char *raw, frame_hdr *hdr)
+{
+  uint16_t u16;
+  uint32_t u32;
+  uint64_t u64;
+
+  u16 = htons(PROTO_MAGIC);
+  memcpy(raw,&u16,2);
+  raw[2] = hdr->version;
+  raw[3] = hdr->type;
+  u16 = htons(hdr->flags);
+  memcpy(raw+4,&u16,2);
+  memset(raw+6,0,2);
+  u32 = htonl(hdr->length);
+  memcpy(raw+8,&u32,4);
+  u32 = htonl(hdr->seq);
+  memcpy(raw+12,&u32,4);
+  u64 = htobe64((uint64_t)hdr->timestamp);
+  memcpy(raw+16,&u64,8);
+}
+
+/******************************************************
+ * Parse FRAME_HDR_SIZE bytes into a frame header.
+ * Returns 0 if the bytes do not start with the magic.
+ * ****************************************************/
+int unpack_frame_hdr(unsigned char *raw, frame_hdr *hdr)
+{
+  uint16_t u16;
+  uint32_t u32;
+  uint64_t u64;
+
+  memcpy(&u16,raw,2);
+  if (ntohs(u16) != PROTO_MAGIC)
+    return 0;
+  hdr->version = raw[2];
+  hdr->type = raw[3];
+  memcpy(&u16,raw+4,2);
+  hdr->flags = ntohs(u16);
+  memcpy(&u32,raw+8,4);
+  hdr->length = ntohl(u32);
+  memcpy(&u32,raw+12,4);
+  hdr->seq = ntohl(u32);
+  memcpy(&u64,raw+16,8);
+  hdr->timestamp = (int64_t)be64toh(u64);
+  return 1;
+}
+
+/******************************************************
+ * Write to the peer, or append to the output queue of a
+ * connection with queued writes (see proto_flush)
+ * ****************************************************/
+static void proto_write(proto_conn *c, void *data, size_t n)
+{
+  if (!c->queued) {
+    Rio_writen(c->fd,data,n);
+    return;
+  }
+
+  if (c->outlen + n > c->outcap) {
+    // compact first, then grow
+    memmove(c->out,c->out+c->outoff,c->outlen-c->outoff);
+    c->outlen -= c->outoff;
+    c->outoff = 0;
+    while (c->outlen + n > c->outcap)
+      c->outcap = c->outcap ? 2*c->outcap : 2*MAXLINE;
+    c->out = (unsigned char *)realloc(c->out,c->outcap);
+    if (!c->out)
+      unix_error("realloc error");
+  }
+  memcpy(c->out+c->outlen,data,n);
+  c->outlen += n;
+}
+
+/******************************************************
+ * Write a frame header and its payload together, in a
+ * single writev on blocking sockets, so that they go
+ * out in one segment rather than two
+ * ****************************************************/
+static void proto_write_frame(proto_conn *c, void *hdr, size_t nhdr, void *payload, size_t n)
+{
+  struct iovec iov[2];
+  ssize_t sent;
+  int ii = 0;
+
+  if (c->queued || n == 0) {
+    proto_write(c,hdr,nhdr);
+    if (n > 0)
+      proto_write(c,payload,n);
+    return;
+  }
+
+  iov[0].iov_base = hdr;
+  iov[0].iov_len = nhdr;
+  iov[1].iov_base = payload;
+  iov[1].iov_len = n;
+  while (ii < 2) {
+    if ((sent = writev(c->fd,iov+ii,2-ii)) < 0) {
+      if (errno == EINTR)
+        continue;
+      unix_error("writev error");
+    }
+    for (; ii < 2 && (size_t)sent >= iov[ii].iov_len; ii++)
+      sent -= iov[ii].iov_len;
+    if (ii < 2) {
+      iov[ii].iov_base = (char *)iov[ii].iov_base + sent;
+      iov[ii].iov_len -= sent;
+    }
+  }
+}
+
+/******************************************************
+ * Send a control frame and its (already packed)
+ * payload. Safe to call from several threads.
+ * ****************************************************/
+static void send_frame(proto_conn *c, int type, int flags,
+                       int64_t timestamp, void *payload, uint32_t length)
+{
+  unsigned char raw[FRAME_HDR_SIZE];
+  frame_hdr hdr;
+
+  hdr.version = PROTO_VERSION;
+  hdr.type = type;
+  hdr.flags = flags;
+  hdr.length = length;
+  hdr.timestamp = timestamp;
+
+  pthread_mutex_lock(&c->lock);
+  hdr.seq = c->seq++;
+  pack_frame_hdr(raw,&hdr);
+  proto_write_frame(c,raw,FRAME_HDR_SIZE,payload,length);
+  pthread_mutex_unlock(&c->lock);
+}
+
+/******************************************************
+ * Read the next frame header. Returns 1 on success,
+ * 0 on EOF and -1 on a malformed header.
+ * ****************************************************/
+static int read_frame_hdr(proto_conn *c, frame_hdr *hdr)
+{
+  unsigned char raw[FRAME_HDR_SIZE];
+  ssize_t nbytes;
+
+  nbytes = Rio_readnb(&c->rio,raw,FRAME_HDR_SIZE);
+  if (nbytes != FRAME_HDR_SIZE)
+    return 0;
+  if (!unpack_frame_hdr(raw,hdr))
+    return -1;
+
+  // simulated network delay: hold the frame until it is delay_ms old
+  if (c->delay_ms > 0 && hdr->timestamp > 0) {
+    int64_t wait_ms = hdr->timestamp + c->delay_ms - now_ms();
+    if (wait_ms > 0)
+      usleep(wait_ms*1000);
+  }
+  return 1;
+}
+
+/******************************************************
+ * Throw away `length` bytes of payload
+ * ****************************************************/
+static int skip_payload(proto_conn *c, uint32_t length)
+{
+  char discard[MAXBUF];
+  uint32_t n;
+
+  while (length > 0) {
+    n = (length < MAXBUF) ? length : MAXBUF;
+    if (Rio_readnb(&c->rio,discard,n) != n)
+      return 0;
+    length -= n;
+  }
+  return 1;
+}
+
+/******************************************************
+ * Decode up to `size` bytes of 32-bit payload words
+ * into `words`. Fields the peer did not send are left
+ * as 0.
+ * ****************************************************/
+static void unpack_words(unsigned char *raw, uint32_t length, uint32_t *words, size_t size)
+{
+  size_t ii, nwords = size/sizeof(uint32_t);
+
+  memset(words,0,size);
+  memcpy(words,raw,(length < size) ? length : size);
+  for (ii = 0; ii < nwords; ii++)
+    words[ii] = ntohl(words[ii]);
+}
+
+/******************************************************
+ * Parse the clock time and packet count messages of a
+ * legacy text client (2*MAXLINE bytes)
+ * ****************************************************/
+static void parse_text_hello(char *msg, hello_msg *hello, frame_hdr *hdr)
+{
+  int npackets, ordered = 0;
+
+  hdr->type = MSG_HELLO;
+  msg[MAXLINE-1] = 0;
+  hdr->timestamp = atol(msg);
+
+  msg += MAXLINE;
+  msg[MAXLINE-1] = 0;
+  if (sscanf(msg,"%d %d",&npackets,&ordered) < 1)
+    npackets = 0;
+  hello->npackets = npackets;
+  if (ordered)
+    hdr->flags |= FLAG_ORDERED;
+}
+
+/******************************************************
+ * Map a legacy text message (MAXLINE bytes) to a type
+ * ****************************************************/
+static int parse_text_msg(char *msg)
+{
+  msg[MAXLINE-1] = 0;
+  if (!strcmp(msg,TEXT_READY))
+    return MSG_READY;
+  else if (!strcmp(msg,TEXT_ACK))
+    return MSG_ACK;
+  else if (!strcmp(msg,TEXT_FINISHED))
+    return MSG_FINISHED;
+  return MSG_UNKNOWN;
+}
+
+/******************************************************
+ * Read up to `size` bytes of 32-bit payload words into
+ * `words` and throw away anything beyond that. Fields
+ * the peer did not send are left as 0.
+ * ****************************************************/
+static int read_words(proto_conn *c, uint32_t length, uint32_t *words, size_t size)
+{
+  unsigned char raw[MAXBUF];
+  uint32_t n;
+
+  n = (length < size) ? length : size;
+  if (Rio_readnb(&c->rio,raw,n) != n)
+    return 0;
+  unpack_words(raw,n,words,size);
+
+  return skip_payload(c,length-n);
+}
+
+static void send_words(proto_conn *c, int type, int flags, int64_t timestamp,
+                       uint32_t *words, size_t size)
+{
+  uint32_t raw[MAXBUF/sizeof(uint32_t)];
+  size_t ii, nwords = size/sizeof(uint32_t);
+
+  for (ii = 0; ii < nwords; ii++)
+    raw[ii] = htonl(words[ii]);
+  send_frame(c,type,flags,timestamp,raw,size);
+}
+
+/******************************************************
+ * Initialize one end of a connection
+ * ****************************************************/
+void proto_init(proto_conn *c, int fd, int binary)
+{
+  c->fd = fd;
+  c->binary = binary;
+  c->seq = 0;
+  c->delay_ms = 0;
+  c->queued = 0;
+  c->out = NULL;
+  c->outlen = c->outoff = c->outcap = 0;
+  pthread_mutex_init(&c->lock,NULL);
+  Rio_readinitb(&c->rio,fd);
+}
+
+/******************************************************
+ * Queue outgoing messages instead of writing them, for
+ * non-blocking sockets. The owner calls proto_flush
+ * when the socket is writable.
+ * ****************************************************/
+void proto_queue_writes(proto_conn *c)
+{
+  c->queued = 1;
+}
+
+/******************************************************
+ * Write as much of the output queue as the socket
+ * takes without blocking, also on blocking sockets
+ * (io_uring server backend). Returns the number of
+ * bytes still queued, or -1 if the connection failed.
+ * ****************************************************/
+ssize_t proto_flush(proto_conn *c)
+{
+  ssize_t n;
+
+  pthread_mutex_lock(&c->lock);
+  while (c->outoff < c->outlen) {
+    n = send(c->fd,c->out+c->outoff,c->outlen-c->outoff,MSG_DONTWAIT);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+        break;
+      pthread_mutex_unlock(&c->lock);
+      return -1;
+    }
+    c->outoff += n;
+  }
+  if (c->outoff == c->outlen)
+    c->outoff = c->outlen = 0;
+  n = c->outlen - c->outoff;
+  pthread_mutex_unlock(&c->lock);
+  return n;
+}
+
+/******************************************************
+ * Release the output queue and lock of a connection
+ * ****************************************************/
+void proto_free(proto_conn *c)
+{
+  Free(c->out);
+  c->out = NULL;
+  pthread_mutex_destroy(&c->lock);
+}
+
+/******************************************************
+ * Incremental parsing, for callers that collect input
+ * themselves (non-blocking sockets). Given the first
+ * `len` bytes of the next message, returns the total
+ * size of that message. Call again as more bytes come
+ * in until `len` reaches the returned size. Packet
+ * data is not included for MSG_PACKET frames, only
+ * their shape, nor the chunks of MSG_REPAIR frames.
+ * ****************************************************/
+size_t proto_msg_size(proto_conn *c, int hello, unsigned char *raw, size_t len)
+{
+  frame_hdr hdr;
+
+  if (!c->binary && !hello)
+    return MAXLINE;
+  if (len < FRAME_HDR_SIZE)
+    return FRAME_HDR_SIZE;
+  if (!unpack_frame_hdr(raw,&hdr))
+    return hello ? 2*MAXLINE : FRAME_HDR_SIZE; // legacy text hello
+  if (hdr.type == MSG_PACKET)
+    return FRAME_HDR_SIZE + ((hdr.version >= 2) ? PACKET_DESC_SIZE : 0);
+  if (hdr.type == MSG_REPAIR)
+    return FRAME_HDR_SIZE;
+  return FRAME_HDR_SIZE + hdr.length;
+}
+
+/******************************************************
+ * Parse a complete hello (see proto_msg_size), with
+ * the same results as proto_accept_hello
+ * ****************************************************/
+int proto_parse_hello(proto_conn *c, unsigned char *raw, hello_msg *hello, frame_hdr *hdr)
+{
+  memset(hdr,0,sizeof(frame_hdr));
+  memset(hello,0,sizeof(hello_msg));
+
+  if (unpack_frame_hdr(raw,hdr)) {
+    c->binary = 1;
+    if (hdr->type != MSG_HELLO)
+      return 0;
+    unpack_words(raw+FRAME_HDR_SIZE,hdr->length,(uint32_t *)hello,sizeof(hello_msg));
+    return 1;
+  }
+
+  c->binary = 0;
+  parse_text_hello((char *)raw,hello,hdr);
+  return 1;
+}
+
+/******************************************************
+ * Parse a complete control message (see proto_msg_size)
+ * and return its type, or -1 if it is malformed. The
+ * first payload word is stored in *value (if not NULL).
+ * ****************************************************/
+int proto_parse_msg(proto_conn *c, unsigned char *raw, frame_hdr *hdr, uint32_t *value)
+{
+  uint32_t word;
+
+  if (!c->binary) {
+    memset(hdr,0,sizeof(frame_hdr));
+    hdr->type = parse_text_msg((char *)raw);
+    return hdr->type;
+  }
+
+  if (!unpack_frame_hdr(raw,hdr))
+    return -1;
+  if (hdr->type != MSG_PACKET && hdr->type != MSG_REPAIR) {
+    unpack_words(raw+FRAME_HDR_SIZE,hdr->length,&word,sizeof(word));
+    if (value)
+      *value = word;
+  }
+  return hdr->type;
+}
+
+/******************************************************
+ * Get the shape of a packet from its complete header
+ * (see proto_msg_size), after proto_parse_msg returned
+ * MSG_PACKET (text mode: a bare packet). Returns 1 if
+ * the frame length matches the shape, else 0.
+ * ****************************************************/
+int proto_parse_packet(proto_conn *c, unsigned char *raw, frame_hdr *hdr, packet_shape *shape)
+{
+  packet_shape legacy = LEGACY_SHAPE;
+
+  if (!c->binary || hdr->version < 2) {
+    *shape = legacy;
+    return !c->binary || hdr->length == LEGACY_PAYLOAD + PACKET_TRAILER;
+  }
+
+  unpack_words(raw+FRAME_HDR_SIZE,PACKET_DESC_SIZE,(uint32_t *)shape,sizeof(packet_shape));
+  if (shape_size(shape) == SIZE_MAX)
+    return 0;
+  if (hdr->flags & FLAG_SHM)
+    return hdr->length == PACKET_DESC_SIZE + PACKET_TRAILER;
+  if (hdr->flags & FLAG_COMP)
+    return hdr->length >= PACKET_DESC_SIZE + PACKET_TRAILER &&
+           hdr->length - PACKET_DESC_SIZE - PACKET_TRAILER <= compress_bound(shape_size(shape));
+  return hdr->length == PACKET_DESC_SIZE + shape_size(shape) + PACKET_TRAILER;
+}
+
+/******************************************************
+ * Client side of the handshake: send the clock time,
+ * packet count and flags to the server
+ * ****************************************************/
+void proto_send_hello(proto_conn *c, hello_msg *hello, int flags, int64_t timestamp)
+{
+  char msg[MAXLINE];
+
+  if (c->binary) {
+    send_words(c,MSG_HELLO,flags,timestamp,(uint32_t *)hello,sizeof(hello_msg));
+    return;
+  }
+
+  /* 1. Send clock time in ms to server so it can compute clock bias */
+  memset(msg,0,MAXLINE);
+  sprintf(msg,"%ld",(long)timestamp);
+  proto_write(c,msg,MAXLINE);
+
+  /* 2. Tell server how many packets to expect and whether they must be
+   *    processed in order */
+  memset(msg,0,MAXLINE);
+  sprintf(msg,"%d %d",hello->npackets,(flags & FLAG_ORDERED) ? 1 : 0);
+  proto_write(c,msg,MAXLINE);
+}
+
+/******************************************************
+ * Server side of the handshake: detect whether the
+ * client speaks binary frames or legacy text and read
+ * its hello. The client's clock and flags are returned
+ * in hdr. Returns 1 on success, 0 on error/EOF.
+ * ****************************************************/
+int proto_accept_hello(proto_conn *c, hello_msg *hello, frame_hdr *hdr)
+{
+  char msg[2*MAXLINE];
+
+  memset(hdr,0,sizeof(frame_hdr));
+  memset(hello,0,sizeof(hello_msg));
+
+  if (Rio_readnb(&c->rio,msg,FRAME_HDR_SIZE) != FRAME_HDR_SIZE)
+    return 0;
+
+  if (unpack_frame_hdr((unsigned char *)msg,hdr)) {
+    c->binary = 1;
+    if (hdr->type != MSG_HELLO)
+      return 0;
+    return read_words(c,hdr->length,(uint32_t *)hello,sizeof(hello_msg));
+  }
+
+  /* Legacy text client: the header bytes were the start of the clock
+   * time message, read the rest of it and the packet count message */
+  c->binary = 0;
+  if (Rio_readnb(&c->rio,msg+FRAME_HDR_SIZE,2*MAXLINE-FRAME_HDR_SIZE) != 2*MAXLINE-FRAME_HDR_SIZE)
+    return 0;
+  parse_text_hello(msg,hello,hdr);
+  return 1;
+}
+
+/******************************************************
+ * Server reply to a binary hello with the settings it
+ * accepted. Text clients do not expect a reply.
+ * ****************************************************/
+void proto_send_welcome(proto_conn *c, hello_msg *hello, int flags)
+{
+  if (c->binary)
+    send_words(c,MSG_WELCOME,flags,now_ms(),(uint32_t *)hello,sizeof(hello_msg));
+}
+
+/******************************************************
+ * Client side: wait for the server's welcome. Returns
+ * 1 on success, 0 on error/EOF.
+ * ****************************************************/
+int proto_read_welcome(proto_conn *c, hello_msg *hello, frame_hdr *hdr)
+{
+  memset(hello,0,sizeof(hello_msg));
+  if (!c->binary)
+    return 1;
+  if (read_frame_hdr(c,hdr) != 1 || hdr->type != MSG_WELCOME)
+    return 0;
+  return read_words(c,hdr->length,(uint32_t *)hello,sizeof(hello_msg));
+}
+
+/******************************************************
+ * Send a control message without payload
+ * ****************************************************/
+void proto_send_msg(proto_conn *c, int type)
+{
+  char msg[MAXLINE];
+
+  if (c->binary) {
+    send_frame(c,type,0,now_ms(),NULL,0);
+    return;
+  }
+
+  memset(msg,0,MAXLINE);
+  switch (type) {
+    case MSG_READY:
+      strcpy(msg,TEXT_READY);
+      break;
+    case MSG_ACK:
+      strcpy(msg,TEXT_ACK);
+      break;
+    case MSG_FINISHED:
+      strcpy(msg,TEXT_FINISHED);
+      break;
+  }
+  proto_write(c,msg,MAXLINE);
+}
+
+/******************************************************
+ * Read the next control message and return its type,
+ * or -1 on EOF. For MSG_PACKET frames the packet
+ * itself is left on the socket for the caller. For any
+ * other frame the first payload word is stored in
+ * *value (if not NULL) and the rest is skipped.
+ * ****************************************************/
+int proto_read_msg(proto_conn *c, frame_hdr *hdr, uint32_t *value)
+{
+  uint32_t word;
+  int type;
+
+  type = proto_read_msg_words(c,hdr,&word,sizeof(word));
+  if (type >= 0 && value && hdr->type != MSG_PACKET)
+    *value = word;
+  return type;
+}
+
+/******************************************************
+ * Same as proto_read_msg, but stores up to `size`
+ * bytes of payload words (missing words read as 0)
+ * ****************************************************/
+int proto_read_msg_words(proto_conn *c, frame_hdr *hdr, uint32_t *words, size_t size)
+{
+  char msg[MAXLINE];
+
+  memset(words,0,size);
+  if (c->binary) {
+    if (read_frame_hdr(c,hdr) != 1)
+      return -1;
+    if (hdr->type != MSG_PACKET && !read_words(c,hdr->length,words,size))
+      return -1;
+    return hdr->type;
+  }
+
+  memset(hdr,0,sizeof(frame_hdr));
+  if (Rio_readnb(&c->rio,msg,MAXLINE) != MAXLINE)
+    return -1;
+  hdr->type = parse_text_msg(msg);
+  return hdr->type;
+}
+
+/******************************************************
+ * Acknowledge a READY. Binary clients are told the
+ * slot reserved for the packet, which only matters for
+ * the shared-memory transport.
+ * ****************************************************/
+void proto_send_ack(proto_conn *c, uint32_t slot)
+{
+  if (c->binary)
+    send_words(c,MSG_ACK,0,now_ms(),&slot,sizeof(slot));
+  else
+    proto_send_msg(c,MSG_ACK);
+}
+
+/******************************************************
+ * Announce a packet of the given shape, the caller
+ * sends its image data (unless FLAG_SHM is set) and
+ * trailer. With FLAG_COMP the image data takes `wire`
+ * bytes of compressed chunks. In text mode the packet
+ * goes out bare, so nothing is sent.
+ * ****************************************************/
+void proto_send_packet_hdr(proto_conn *c, uint32_t id, packet_shape *shape, int flags, int64_t timestamp,\
+                           size_t wire)
+{
+  unsigned char raw[FRAME_HDR_SIZE+PACKET_DESC_SIZE];
+  uint32_t words[PACKET_DESC_SIZE/4];
+  frame_hdr hdr;
+  int ii;
+
+  if (!c->binary)
+    return;
+
+  hdr.version = PROTO_VERSION;
+  hdr.type = MSG_PACKET;
+  hdr.flags = flags;
+  hdr.length = PACKET_DESC_SIZE + PACKET_TRAILER;
+  if (flags & FLAG_COMP)
+    hdr.length += wire;
+  else if (!(flags & FLAG_SHM))
+    hdr.length += shape_size(shape);
+  hdr.seq = id;
+  hdr.timestamp = timestamp;
+  pack_frame_hdr(raw,&hdr);
+  memcpy(words,shape,PACKET_DESC_SIZE);
+  for (ii = 0; ii < PACKET_DESC_SIZE/4; ii++)
+    words[ii] = htonl(words[ii]);
+  memcpy(raw+FRAME_HDR_SIZE,words,PACKET_DESC_SIZE);
+
+  pthread_mutex_lock(&c->lock);
+  proto_write(c,raw,sizeof(raw));
+  pthread_mutex_unlock(&c->lock);
+}
+
+/******************************************************
+ * Send the bandwidth measured for a packet in MB/s
+ * ****************************************************/
+void proto_send_bandwidth(proto_conn *c, uint32_t id, float bw)
+{
+  char msg[MAXLINE];
+  uint32_t word;
+
+  if (c->binary) {
+    memcpy(&word,&bw,sizeof(word));
+    send_words(c,MSG_BANDWIDTH,0,now_ms(),&word,sizeof(word));
+    return;
+  }
+
+  memset(msg,0,MAXLINE);
+  sprintf(msg,"%f",bw);
+  proto_write(c,msg,MAXLINE);
+}
+
+/******************************************************
+ * Read a bandwidth reply. Returns 1 on success, 0 on
+ * error/EOF.
+ * ****************************************************/
+int proto_read_bandwidth(proto_conn *c, float *bw)
+{
+  char msg[MAXLINE];
+  frame_hdr hdr;
+  uint32_t word;
+
+  if (c->binary) {
+    if (read_frame_hdr(c,&hdr) != 1 || hdr.type != MSG_BANDWIDTH)
+      return 0;
+    if (!read_words(c,hdr.length,&word,sizeof(word)))
+      return 0;
+    *bw = proto_word_to_float(word);
+    return 1;
+  }
+
+  if (Rio_readnb(&c->rio,msg,MAXLINE) != MAXLINE)
+    return 0;
+  msg[MAXLINE-1] = 0;
+  *bw = atof(msg);
+  return 1;
+}
+
+/******************************************************
+ * Grant the client `ncredits` more packets that it may
+ * send without waiting (binary protocol only). For the
+ * shared-memory transport the slots reserved for them
+ * (at most MAX_CREDIT_SLOTS) are listed too.
+ * ****************************************************/
+void proto_send_credit(proto_conn *c, uint32_t ncredits, uint32_t *slots)
+{
+  uint32_t words[MAX_CREDIT_SLOTS+1];
+
+  words[0] = ncredits;
+  if (!slots) {
+    send_words(c,MSG_CREDIT,0,now_ms(),words,sizeof(uint32_t));
+    return;
+  }
+  memcpy(words+1,slots,ncredits*sizeof(uint32_t));
+  send_words(c,MSG_CREDIT,0,now_ms(),words,(ncredits+1)*sizeof(uint32_t));
+}
+
+/******************************************************
+ * Chunk repair: send the CRC32C of each chunk of the
+ * packet just sent (at most MAX_CHUNKS)
+ * ****************************************************/
+void proto_send_chunks(proto_conn *c, uint32_t *crcs, int nchunks)
+{
+  send_words(c,MSG_CHUNKS,0,now_ms(),crcs,nchunks*sizeof(uint32_t));
+}
+
+/******************************************************
+ * Get the chunk CRCs from a complete CHUNKS frame (see
+ * proto_msg_size). Returns 1 if it holds nchunks.
+ * ****************************************************/
+int proto_parse_chunks(proto_conn *c, unsigned char *raw, frame_hdr *hdr, uint32_t *crcs, int nchunks)
+{
+  if (hdr->type != MSG_CHUNKS || hdr->length != nchunks*sizeof(uint32_t))
+    return 0;
+  unpack_words(raw+FRAME_HDR_SIZE,hdr->length,crcs,hdr->length);
+  return 1;
+}
+
+/******************************************************
+ * Ask for chunks of packet id again: nranges (first
+ * chunk, count) pairs, at most MAX_NACK_RANGES
+ * ****************************************************/
+void proto_send_nack(proto_conn *c, uint32_t id, uint32_t *ranges, int nranges)
+{
+  uint32_t words[2*MAX_NACK_RANGES+1];
+
+  words[0] = id;
+  memcpy(words+1,ranges,2*nranges*sizeof(uint32_t));
+  send_words(c,MSG_NACK,0,now_ms(),words,(2*nranges+1)*sizeof(uint32_t));
+}
+
+/******************************************************
+ * Announce `length` bytes of resent chunks of packet
+ * id, in the order of the NACK; the caller sends them
+ * ****************************************************/
+void proto_send_repair_hdr(proto_conn *c, uint32_t id, size_t length)
+{
+  unsigned char raw[FRAME_HDR_SIZE];
+  frame_hdr hdr;
+
+  hdr.version = PROTO_VERSION;
+  hdr.type = MSG_REPAIR;
+  hdr.flags = 0;
+  hdr.length = length;
+  hdr.seq = id;
+  hdr.timestamp = now_ms();
+  pack_frame_hdr(raw,&hdr);
+
+  pthread_mutex_lock(&c->lock);
+  proto_write(c,raw,sizeof(raw));
+  pthread_mutex_unlock(&c->lock);
+}
+
+/******************************************************
+ * Open an extra stream of a striped session: the
+ * first frame on the stream's connection
+ * ****************************************************/
+void proto_send_join(proto_conn *c, uint64_t session, uint32_t stream)
+{
+  uint32_t words[3] = {session & 0xffffffff, stream, session >> 32};
+
+  send_words(c,MSG_JOIN,0,now_ms(),words,sizeof(words));
+}
+
+/******************************************************
+ * Server side: parse the first message of a connection
+ * (see proto_msg_size) as a JOIN. Returns 0 if it is
+ * something else, e.g. a hello.
+ * ****************************************************/
+int proto_parse_join(proto_conn *c, unsigned char *raw, uint64_t *session, uint32_t *stream)
+{
+  uint32_t words[3];
+  frame_hdr hdr;
+
+  if (!unpack_frame_hdr(raw,&hdr) || hdr.type != MSG_JOIN)
+    return 0;
+  c->binary = 1;
+  unpack_words(raw+FRAME_HDR_SIZE,hdr.length,words,sizeof(words));
+  *session = (uint64_t)words[2] << 32 | words[0];
+  *stream = words[1];
+  return 1;
+}
+
+/******************************************************
+ * The part of a packet's image data of `size` bytes
+ * that stream `stream` of `streams` carries. Stream 0,
+ * the connection with the frames, also carries the
+ * PACKET header and the trailer. Stripes are whole
+ * pages, so the last ones may be short or empty.
+ * ****************************************************/
+void proto_stripe(size_t size, int streams, int stream, size_t *off, size_t *len)
+{
+  size_t unit = ((size + streams-1)/streams + 4095) & ~(size_t)4095;
+
+  *off = (stream*unit < size) ? stream*unit : size;
+  *len = (size - *off < unit) ? size - *off : unit;
+}
+
+/******************************************************
+ * Decode a float sent as a 32-bit payload word
+ * ****************************************************/
+float proto_word_to_float(uint32_t word)
+{
+  float f;
+
+  memcpy(&f,&word,sizeof(f));
+  return f;
+}
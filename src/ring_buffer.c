@@ -1,89 +1,598 @@
 /******************************************
  * Simple ring buffer implementation.
  *
+ * Two synchronization schemes are provided
+ * behind the same interface:
+ *
+ *  RING_LOCKFREE: multi-producer/multi-consumer
+ *    ring in the style of Vyukov's bounded
+ *    queue. Producers and consumers claim slots
+ *    with a CAS on head/tail and hand them over
+ *    through per-slot sequence numbers. Threads
+ *    only enter the kernel (futex) when the
+ *    ring is full or empty.
+ *
+ *  RING_MUTEX: the original mutex + counting
+ *    semaphore ring, kept for comparison.
+ *
  * Author: Aleksander Bapst
  * ****************************************/
 #include "ring_buffer.h"
+#include <sys/syscall.h>
+#include <linux/futex.h>
 
 /******************************************************
- * Allocate ring buffer memory and initialize fields
+ * Thin futex wrappers used by the lock-free ring
  * ****************************************************/
-ring_buffer *init_buf(int n_items)
+static void futex_wait(atomic_int *addr, int val)
+{
+  syscall(SYS_futex,addr,FUTEX_WAIT_PRIVATE,val,NULL,NULL,0);
+}
+
+static void futex_wake(atomic_int *addr)
+{
+  syscall(SYS_futex,addr,FUTEX_WAKE_PRIVATE,1,NULL,NULL,0);
+}
+
+/******************************************************
+ * Ring structure and slot bookkeeping, without items
+ * ****************************************************/
+static ring_buffer *alloc_ring(int n_items, int type)
 {
   int ii;
 
   // allocate ring buffer struct
   ring_buffer *buf = (ring_buffer *)Malloc(sizeof(ring_buffer) + n_items*sizeof(buf_item*));
   buf->n_items = n_items;
+  buf->type = type;
+  buf->src = NULL;
+  buf->origin = NULL;
+  buf->sink = NULL;
+  buf->sink_arg = NULL;
 
   // initialize semaphores and locks
   pthread_mutex_init(&buf->lock,NULL);
   Sem_init(&buf->countsem,0,0);
   Sem_init(&buf->spacesem,0,buf->n_items);
 
-  // initialize read and write index trackers
+  // initialize read, write and publish index trackers
   buf->read = 0;
   buf->write = 0;
+  buf->publish = 0;
+  buf->reclaim = 0;
+
+  // initialize lock-free positions, slot ii starts at sequence ii
+  atomic_init(&buf->head,0);
+  atomic_init(&buf->tail,0);
+  atomic_init(&buf->space_ev,0);
+  atomic_init(&buf->count_ev,0);
+  atomic_init(&buf->space_waiters,0);
+  atomic_init(&buf->count_waiters,0);
+  buf->seq = (atomic_ulong *)Malloc(buf->n_items*sizeof(atomic_ulong));
+
+  buf->state = (int *)Malloc(buf->n_items*sizeof(int));
+  buf->tag = (slot_tag *)Malloc(buf->n_items*sizeof(slot_tag));
+  for (ii = 0; ii < buf->n_items; ii++) {
+    buf->state[ii] = SLOT_FREE;
+    buf->tag[ii].owner = NULL;
+    buf->tag[ii].seq = 0;
+    atomic_init(&buf->seq[ii],ii);
+  }
+
+  return buf;
+}
+
+/******************************************************
+ * Allocate ring buffer memory and initialize fields
+ * ****************************************************/
+ring_buffer *init_buf(int n_items)
+{
+  return init_buf_type(n_items,RING_LOCKFREE,0);
+}
+
+/******************************************************
+ * `budget` bounds the memory of the packets held in
+ * the buffer, 0 for room for n_items legacy packets.
+ * Image data is allocated per packet from a slab pool
+ * with that budget, and each slot is guaranteed
+ * buf->max_payload bytes of it.
+ * ****************************************************/
+ring_buffer *init_buf_type(int n_items, int type, size_t budget)
+{
+  ring_buffer *buf = alloc_ring(n_items,type);
+  int ii;
+
+  // image data comes from the slab pool once a packet's size is known
+  slab_init(&buf->pool,budget ? budget : n_items*LEGACY_PAYLOAD);
+  buf->max_payload = slab_max_size(&buf->pool,n_items);
+  buf->arena.base = NULL;
 
   // Allocate buffer items
   for (ii = 0; ii < buf->n_items; ii++) {
     buf->data[ii] = (buf_item *)Malloc(sizeof(buf_item));
     buf->data[ii]->id = -1; // items initialized with id -1 (empty)
+    buf->data[ii]->data = NULL;
+    buf->data[ii]->cls = -1;
+    buf->data[ii]->size = 0;
   }
 
   return buf;
 }
 
+/******************************************************
+ * A ring that hands on packets of `src` without copying
+ * them: pass_slot moves a packet taken from src (or
+ * from another ring chained to it) into one of its
+ * slots, which then points at the src item. It has as
+ * many slots as src, so there is always room for every
+ * packet src holds. Releasing a slot of this ring
+ * releases the packet's slot of src.
+ * ****************************************************/
+ring_buffer *init_buf_chained(ring_buffer *src)
+{
+  ring_buffer *buf = alloc_ring(src->n_items,src->type);
+  int ii;
+
+  buf->src = src;
+  buf->origin = (int *)Malloc(buf->n_items*sizeof(int));
+  buf->max_payload = src->max_payload;
+  buf->arena.base = NULL;
+  for (ii = 0; ii < buf->n_items; ii++) {
+    buf->data[ii] = NULL;
+    buf->origin[ii] = -1;
+  }
+  return buf;
+}
+
 /*****************************************************
  * Free all the memory allocated to the ring buffer
  * ***************************************************/
 void destroy_buf(ring_buffer *buf)
+{
+  printf("\nSIGINT caught, deleting ring buffer\n");
+  free_buf(buf);
+}
+
+void free_buf(ring_buffer *buf)
 {
   int ii;
 
-  printf("\nSIGINT caught, deleting ring buffer\n");
-  for (ii = 0; ii < buf->n_items; ii++) {
-    Free(buf->data[ii]);
+  if (buf->src) { // the items are src's
+    Free(buf->origin);
+  } else {
+    for (ii = 0; ii < buf->n_items; ii++) {
+      if (buf->data[ii]->cls >= 0)
+        slab_free(&buf->pool,buf->data[ii]->data,buf->data[ii]->cls);
+      Free(buf->data[ii]);
+    }
+    slab_destroy(&buf->pool);
+    arena_destroy(&buf->arena);
   }
+  sem_destroy(&buf->countsem);
+  sem_destroy(&buf->spacesem);
+  pthread_mutex_destroy(&buf->lock);
+  Free(buf->state);
+  Free(buf->tag);
+  Free((void *)buf->seq);
   Free(buf);
 }
 
-void enqueue(ring_buffer *buf, buf_item *cache_buf)
+/******************************************************
+ * Claim the next free slot of the ring buffer, blocking
+ * until one opens up. Returns a pointer to the slot so
+ * that the caller can fill it in place, and stores the
+ * slot index in *slot for the matching commit/discard.
+ * The caller may tag the slot through buf->tag[*slot].
+ * Without `block`, returns NULL if the buffer is full.
+ * ****************************************************/
+static buf_item *lf_reserve_slot(ring_buffer *buf, int *slot, int block)
+{
+  unsigned long pos = atomic_load_explicit(&buf->head,memory_order_relaxed);
+  unsigned long seq;
+  long diff;
+  int ev;
+
+  while (1) {
+    *slot = pos % buf->n_items;
+    seq = atomic_load_explicit(&buf->seq[*slot],memory_order_acquire);
+    diff = (long)seq - (long)pos;
+
+    if (diff == 0) {
+      // slot is free at this lap, try to claim it
+      if (atomic_compare_exchange_weak(&buf->head,&pos,pos+1))
+        break;
+    } else if (diff < 0) {
+      // buffer is full, sleep until a consumer releases a slot
+      if (!block)
+        return NULL;
+      atomic_fetch_add(&buf->space_waiters,1);
+      ev = atomic_load(&buf->space_ev);
+      seq = atomic_load(&buf->seq[*slot]);
+      if ((long)seq - (long)pos < 0)
+        futex_wait(&buf->space_ev,ev);
+      atomic_fetch_sub(&buf->space_waiters,1);
+      pos = atomic_load_explicit(&buf->head,memory_order_relaxed);
+    } else {
+      // another producer got there first
+      pos = atomic_load_explicit(&buf->head,memory_order_relaxed);
+    }
+  }
+
+  buf->state[*slot] = SLOT_RESERVED;
+  buf->tag[*slot].owner = NULL;
+  return buf->data[*slot];
+}
+
+buf_item *reserve_slot(ring_buffer *buf, int *slot)
+{
+  if (buf->type == RING_LOCKFREE)
+    return lf_reserve_slot(buf,slot,1);
+
+  // wait until buffer opens up
+  sem_wait(&buf->spacesem);
+
+  pthread_mutex_lock(&buf->lock);
+  *slot = (buf->write++) & ((buf->n_items)-1);
+  buf->state[*slot] = SLOT_RESERVED;
+  buf->tag[*slot].owner = NULL;
+  pthread_mutex_unlock(&buf->lock);
+
+  return buf->data[*slot];
+}
+
+/******************************************************
+ * Like reserve_slot, but returns NULL instead of
+ * blocking when the buffer is full
+ * ****************************************************/
+buf_item *try_reserve_slot(ring_buffer *buf, int *slot)
 {
+  if (buf->type == RING_LOCKFREE)
+    return lf_reserve_slot(buf,slot,0);
+
+  if (sem_trywait(&buf->spacesem) < 0)
+    return NULL;
+
   pthread_mutex_lock(&buf->lock);
-  buf_item *item = buf->data[ (buf->write++) & ((buf->n_items)-1) ];
-  memcpy(item,cache_buf,sizeof(buf_item));
+  *slot = (buf->write++) & ((buf->n_items)-1);
+  buf->state[*slot] = SLOT_RESERVED;
+  buf->tag[*slot].owner = NULL;
   pthread_mutex_unlock(&buf->lock);
 
-  // increment the count of the number of items
-  sem_post(&buf->countsem);
+  return buf->data[*slot];
 }
 
 /******************************************************
- * Return a pointer to the next ring buffer item
+ * Back the image data of the slots with one arena (see
+ * arena.c) set up now, instead of allocating it from
+ * the slab pool packet by packet. Each slot owns
+ * max_payload bytes of the arena, so the memory is
+ * the same as a full pool of the largest packets.
  * ****************************************************/
-void dequeue(ring_buffer *buf)
+void init_buf_arena(ring_buffer *buf, int flags, int node)
+{
+  arena_init(&buf->arena,(size_t)buf->n_items*buf->max_payload,flags,node);
+}
+
+/******************************************************
+ * Hand each slot to sink(arg,slot) as soon as it is
+ * committed or discarded, instead of publishing the
+ * slots in reservation order for acquire_slot. A slot
+ * being filled then holds up no other, except the next
+ * reservation of that same slot, n_items later: keep
+ * slots reserved briefly. The sink owns the slot until
+ * it calls release_slot. Set it before any slot is
+ * reserved.
+ * ****************************************************/
+void set_buf_sink(ring_buffer *buf, slot_sink sink, void *arg)
+{
+  buf->sink = sink;
+  buf->sink_arg = arg;
+}
+
+/******************************************************
+ * Give a reserved slot image data for a packet of the
+ * given shape. Packets of up to buf->max_payload bytes
+ * always get it. Returns 0 if the pool is out of room.
+ * ****************************************************/
+int alloc_payload(ring_buffer *buf, int slot, packet_shape *shape)
+{
+  buf_item *item = buf->data[slot];
+
+  item->shape = *shape;
+  item->size = shape_size(shape);
+  item->data = NULL;
+  item->cls = -1;
+  if (item->size == 0) // metadata only
+    return 1;
+  if (buf->arena.base) {
+    if (item->size > buf->max_payload)
+      return 0;
+    item->data = buf->arena.base + (size_t)slot*buf->max_payload;
+    return 1;
+  }
+  item->data = slab_alloc(&buf->pool,item->size,&item->cls);
+  if (!item->data) {
+    item->cls = -1;
+    return 0;
+  }
+  return 1;
+}
+
+/******************************************************
+ * Hand a finished slot straight to the ring's sink,
+ * ahead of any older slot still being filled. It is
+ * taken as far as the ring is concerned: the lock-free
+ * sequence moves to pos+1 as if a consumer held it,
+ * and tail / read count it, so that release_slot and
+ * buf_used work as usual.
+ * ****************************************************/
+static void finish_sunk(ring_buffer *buf, int slot, int state)
+{
+  if (buf->type == RING_LOCKFREE) {
+    buf->state[slot] = state;
+    atomic_fetch_add(&buf->seq[slot],1);
+    atomic_fetch_add(&buf->tail,1);
+  } else {
+    pthread_mutex_lock(&buf->lock);
+    buf->state[slot] = state;
+    buf->read++;
+    pthread_mutex_unlock(&buf->lock);
+  }
+  buf->sink(buf->sink_arg,slot);
+}
+
+/******************************************************
+ * Mark a reserved slot as finished and hand every
+ * finished slot at the front of the reserved region to
+ * the consumer. Slots are published in reservation
+ * order, so a producer that finishes early never lets
+ * the consumer overtake a slot that is still filling.
+ * ****************************************************/
+static void finish_slot(ring_buffer *buf, int slot, int state)
+{
+  if (buf->sink) {
+    finish_sunk(buf,slot,state);
+    return;
+  }
+  if (buf->type == RING_LOCKFREE) {
+    // the slot sequence moves from pos to pos+1, which makes it
+    // visible to the consumer that dequeues position pos
+    buf->state[slot] = state;
+    atomic_fetch_add(&buf->seq[slot],1);
+    atomic_fetch_add(&buf->count_ev,1);
+    if (atomic_load(&buf->count_waiters) > 0)
+      futex_wake(&buf->count_ev);
+    return;
+  }
+
+  pthread_mutex_lock(&buf->lock);
+  buf->state[slot] = state;
+  while (buf->publish != buf->write &&
+         buf->state[buf->publish & ((buf->n_items)-1)] != SLOT_RESERVED) {
+    buf->publish++;
+    sem_post(&buf->countsem); // increment the count of the number of items
+  }
+  pthread_mutex_unlock(&buf->lock);
+}
+
+/******************************************************
+ * Publish a filled slot to the consumer
+ * ****************************************************/
+void commit_slot(ring_buffer *buf, int slot)
+{
+  finish_slot(buf,slot,SLOT_READY);
+}
+
+/******************************************************
+ * Give up a reserved slot without publishing its
+ * contents (e.g. bad checksum). The consumer skips it
+ * and returns the space to the buffer.
+ * ****************************************************/
+void discard_slot(ring_buffer *buf, int slot)
+{
+  finish_slot(buf,slot,SLOT_DISCARDED);
+}
+
+/******************************************************
+ * Copy an item into the next free slot of the buffer
+ * ****************************************************/
+void enqueue(ring_buffer *buf, buf_item *cache_buf)
+{
+  int slot;
+  buf_item *item = reserve_slot(buf,&slot);
+
+  if (!alloc_payload(buf,slot,&cache_buf->shape)) {
+    discard_slot(buf,slot);
+    return;
+  }
+  if (item->size > 0)
+    memcpy(item->data,cache_buf->data,item->size);
+  item->timestamp = cache_buf->timestamp;
+  memcpy(item->checksum,cache_buf->checksum,CSUM_MAX_LENGTH);
+  item->id = cache_buf->id;
+  commit_slot(buf,slot);
+}
+
+/******************************************************
+ * Claim the next published slot of the lock-free ring,
+ * sleeping while the buffer is empty.
+ * ****************************************************/
+static buf_item *lf_acquire_slot(ring_buffer *buf, int *slot)
 {
+  unsigned long pos = atomic_load_explicit(&buf->tail,memory_order_relaxed);
+  unsigned long seq;
+  long diff;
+  int ev;
+
+  while (1) {
+    *slot = pos % buf->n_items;
+    seq = atomic_load_explicit(&buf->seq[*slot],memory_order_acquire);
+    diff = (long)seq - (long)(pos+1);
+
+    if (diff == 0) {
+      // slot was committed at this lap, try to claim it
+      if (atomic_compare_exchange_weak(&buf->tail,&pos,pos+1))
+        return buf->data[*slot];
+    } else if (diff < 0) {
+      // nothing committed yet, sleep until a producer commits
+      atomic_fetch_add(&buf->count_waiters,1);
+      ev = atomic_load(&buf->count_ev);
+      seq = atomic_load(&buf->seq[*slot]);
+      if ((long)seq - (long)(pos+1) < 0)
+        futex_wait(&buf->count_ev,ev);
+      atomic_fetch_sub(&buf->count_waiters,1);
+      pos = atomic_load_explicit(&buf->tail,memory_order_relaxed);
+    } else {
+      // another consumer got there first
+      pos = atomic_load_explicit(&buf->tail,memory_order_relaxed);
+    }
+  }
+}
+
+/******************************************************
+ * Take the next published slot, blocking while the
+ * buffer is empty. The caller owns the slot until it
+ * calls release_slot. Discarded slots are returned too,
+ * check buf->state[*slot] before using the contents.
+ * ****************************************************/
+buf_item *acquire_slot(ring_buffer *buf, int *slot)
+{
+  if (buf->type == RING_LOCKFREE)
+    return lf_acquire_slot(buf,slot);
+
   // wait if there are no items in the buffer
   sem_wait(&buf->countsem);
 
   pthread_mutex_lock(&buf->lock);
-  buf_item *item = buf->data[ (buf->read++) & ((buf->n_items)-1) ];
+  *slot = (buf->read++) & ((buf->n_items)-1);
+  pthread_mutex_unlock(&buf->lock);
+
+  return buf->data[*slot];
+}
+
+/******************************************************
+ * Make a taken slot free for the producers again. The
+ * mutex ring reserves slots in index order, so consumed
+ * slots are given back in that order too: one released
+ * ahead of an older slot waits for it.
+ * ****************************************************/
+static void return_slot(ring_buffer *buf, int slot)
+{
+  unsigned long seq;
+
+  if (buf->type == RING_LOCKFREE) {
+    buf->state[slot] = SLOT_FREE;
+    // sequence is pos+1 while consumed, hand the slot to the
+    // producer of the next lap at pos+n_items
+    seq = atomic_load_explicit(&buf->seq[slot],memory_order_relaxed);
+    atomic_store_explicit(&buf->seq[slot],seq-1+buf->n_items,memory_order_release);
+    atomic_fetch_add(&buf->space_ev,1);
+    if (atomic_load(&buf->space_waiters) > 0)
+      futex_wake(&buf->space_ev);
+    return;
+  }
+
+  pthread_mutex_lock(&buf->lock);
+  buf->state[slot] = SLOT_FREE;
+  while (buf->reclaim != buf->read &&
+         buf->state[buf->reclaim & ((buf->n_items)-1)] == SLOT_FREE) {
+    buf->reclaim++;
+    sem_post(&buf->spacesem); // increment number of spaces in the buffer
+  }
   pthread_mutex_unlock(&buf->lock);
+}
 
-  process_item(item);
-  item->id = -1; // mark item as processed
+/******************************************************
+ * Return a consumed slot to the producers
+ * ****************************************************/
+void release_slot(ring_buffer *buf, int slot)
+{
+  if (buf->src) {
+    release_slot(buf->src,buf->origin[slot]);
+    buf->data[slot] = NULL;
+    return_slot(buf,slot);
+    return;
+  }
 
-  // increment number of spaces in the buffer
-  sem_post(&buf->spacesem);
+  buf->data[slot]->id = -1; // mark item as processed
+
+  // free the image data before the slot can be reserved again, so that
+  // every slot can always get max_payload bytes
+  if (buf->data[slot]->cls >= 0)
+    slab_free(&buf->pool,buf->data[slot]->data,buf->data[slot]->cls);
+  buf->data[slot]->data = NULL;
+  buf->data[slot]->cls = -1;
+  return_slot(buf,slot);
+}
+
+/******************************************************
+ * Hand the packet of a taken slot, with its state and
+ * tag, on to `to`, a ring chained to the ring that owns
+ * it. The slot of `buf` is given back if `buf` is
+ * chained too; if `buf` owns the packet, the slot stays
+ * taken until the packet is released from a chained
+ * ring.
+ * ****************************************************/
+void pass_slot(ring_buffer *buf, int slot, ring_buffer *to)
+{
+  int next;
+
+  reserve_slot(to,&next);
+  to->data[next] = buf->data[slot];
+  to->origin[next] = buf->src ? buf->origin[slot] : slot;
+  to->tag[next] = buf->tag[slot];
+  finish_slot(to,next,buf->state[slot]);
+  if (buf->src) {
+    buf->data[slot] = NULL;
+    return_slot(buf,slot);
+  }
+}
+
+/******************************************************
+ * Process the next ring buffer item and free its slot
+ * ****************************************************/
+void dequeue(ring_buffer *buf)
+{
+  int slot;
+  buf_item *item = acquire_slot(buf,&slot);
+
+  if (buf->state[slot] == SLOT_READY)
+    process_item(item,0);
+  release_slot(buf,slot);
+}
+
+/******************************************************
+ * Number of slots that are reserved or queued, i.e. not
+ * yet taken by a consumer
+ * ****************************************************/
+int buf_used(ring_buffer *buf)
+{
+  int used;
+
+  if (buf->type == RING_LOCKFREE)
+    return (int)(atomic_load(&buf->head) - atomic_load(&buf->tail));
+
+  pthread_mutex_lock(&buf->lock);
+  used = buf->write - buf->read;
+  pthread_mutex_unlock(&buf->lock);
+  return used;
 }
 
 /*********************************************************************
- * Simulate processing of a buffer item
+ * Simulate processing of a buffer item, keeping the CPU busy for
+ * us_per_mb microseconds per MB of image data
  * *******************************************************************/
-void process_item(buf_item *item)
+void process_item(buf_item *item, int us_per_mb)
 {
-  usleep(0);
+  uint64_t end;
+
+  if (us_per_mb <= 0) {
+    usleep(0);
+    return;
+  }
+  end = get_time_ns() + (uint64_t)(item->size/MEGABYTE*us_per_mb*1000);
+  while (get_time_ns() < end)
+    ;
 }
 
 /*********************************************************************
@@ -114,62 +623,480 @@ time_t get_time_ms(struct timeval *tv)
 }
 
 /*********************************************************************
- * Computes the MD5 checksum of a buffer item (with the checksum  and
- * timestamp fields set to 0), and updates the checksum field to the
+ * Size in bytes of the image data of a packet shape, SIZE_MAX if the
+ * shape is invalid or larger than any slab class
+ * *******************************************************************/
+static const size_t elem_sizes[ELEM_COUNT] = {1,2,4,8};
+static const char *elem_names[ELEM_COUNT] = {"u8","u16","f32","f64"};
+
+size_t shape_elem_size(packet_shape *shape)
+{
+  return (shape->elem_type < ELEM_COUNT) ? elem_sizes[shape->elem_type] : 1;
+}
+
+size_t shape_size(packet_shape *shape)
+{
+  unsigned __int128 size;
+
+  if (shape->elem_type >= ELEM_COUNT)
+    return SIZE_MAX;
+  size = (unsigned __int128)shape->channels*shape->width*shape->height*\
+         elem_sizes[shape->elem_type];
+  return (size > SLAB_CLASS_SIZE(SLAB_NCLASSES-1)) ? SIZE_MAX : (size_t)size;
+}
+
+/*********************************************************************
+ * Parse a shape written as <channels>x<width>x<height>[:<type>], e.g.
+ * 1x1024x1024:u16. The element type defaults to f32. Returns 1 on
+ * success.
+ * *******************************************************************/
+int shape_parse(const char *str, packet_shape *shape)
+{
+  char type[8] = "f32";
+  int ii;
+
+  if (sscanf(str,"%ux%ux%u:%7s",&shape->channels,&shape->width,\
+             &shape->height,type) < 3)
+    return 0;
+  for (ii = 0; ii < ELEM_COUNT; ii++) {
+    if (!strcmp(type,elem_names[ii])) {
+      shape->elem_type = ii;
+      return shape_size(shape) != SIZE_MAX;
+    }
+  }
+  return 0;
+}
+
+void shape_print(packet_shape *shape, char *str, size_t len)
+{
+  snprintf(str,len,"%ux%ux%u:%s",shape->channels,shape->width,shape->height,\
+           (shape->elem_type < ELEM_COUNT) ? elem_names[shape->elem_type] : "?");
+}
+
+/*********************************************************************
+ * Convert between a buf_item and its PACKET_TRAILER bytes on the
+ * wire. Fields are sent in host byte order, as the original struct.
+ * *******************************************************************/
+void pack_trailer(unsigned char *raw, buf_item *item)
+{
+  int64_t timestamp = item->timestamp;
+  int32_t id = item->id;
+
+  memset(raw,0,PACKET_TRAILER);
+  memcpy(raw,&timestamp,sizeof(timestamp));
+  memcpy(raw+TRAILER_CHECKSUM,item->checksum,CSUM_MAX_LENGTH);
+  memcpy(raw+TRAILER_ID,&id,sizeof(id));
+}
+
+void unpack_trailer(unsigned char *raw, buf_item *item)
+{
+  int64_t timestamp;
+  int32_t id;
+
+  memcpy(&timestamp,raw,sizeof(timestamp));
+  memcpy(item->checksum,raw+TRAILER_CHECKSUM,CSUM_MAX_LENGTH);
+  memcpy(&id,raw+TRAILER_ID,sizeof(id));
+  item->timestamp = timestamp;
+  item->id = id;
+}
+
+/***************************************************************
+ * Digest a packet trailer with the checksum and timestamp
+ * fields set to 0
+ * *************************************************************/
+void checksum_trailer(checksum_ctx *c, unsigned char *raw)
+{
+  unsigned char tail[PACKET_TRAILER];
+
+  memcpy(tail,raw,PACKET_TRAILER);
+  memset(tail,0,sizeof(int64_t));
+  memset(tail+TRAILER_CHECKSUM,0,CSUM_MAX_LENGTH);
+  checksum_update(c,tail,PACKET_TRAILER);
+}
+
+/*********************************************************************
+ * Computes the checksum of a packet (its image data followed by its
+ * trailer, with the checksum and timestamp fields set to 0) using the
+ * given CSUM_* algorithm, and updates the checksum field to the
  * checksum value. The original checksum is compared to the new one
- * and returns 1 if they match, else 0.
+ * and returns 1 if they match, else 0. CSUM_NONE always matches.
  *
- * Note: the MD5 hash is secure, but too slow for data transmission.
+ * Note: the MD5 hash is secure, but too slow for data transmission,
+ * prefer crc32c or xxh3.
  *********************************************************************/
-int md5checksum(char *item,size_t length)
+int packet_checksum(buf_item *item, int algo)
 {
-  int ii;
-  unsigned char new_checksum[MD5_DIGEST_LENGTH];
-  unsigned char old_checksum[MD5_DIGEST_LENGTH];
-  char *read_ptr = item;
-  MD5_CTX c;
+  unsigned char old_checksum[CSUM_MAX_LENGTH];
+  unsigned char raw[PACKET_TRAILER];
+  checksum_ctx c;
 
-  /* Save old checksum */
-  memcpy(old_checksum,((buf_item *)item)->checksum,MD5_DIGEST_LENGTH);
+  if (algo == CSUM_NONE)
+    return 1;
 
-  memset(((buf_item *)item)->checksum,0,MD5_DIGEST_LENGTH);
-  ((buf_item *)item)->timestamp = 0;
+  /* Save old checksum */
+  memcpy(old_checksum,item->checksum,CSUM_MAX_LENGTH);
 
   /* Digest the packet */
-  MD5_Init(&c);
-  while (length > 0) {
-   if (length > MAXLINE) {
-      MD5_Update(&c,read_ptr,MAXLINE);
+  checksum_init(&c,algo);
+  checksum_update(&c,item->data,item->size);
+  pack_trailer(raw,item);
+  checksum_trailer(&c,raw);
+  checksum_final(&c,item->checksum);
+
+  /* Compare old and new checksums */
+  return !memcmp(old_checksum,item->checksum,CSUM_MAX_LENGTH);
+}
+
+/***************************************************************
+ * Print the checksum field of a buffer item in hexadecimal
+ * *************************************************************/
+void print_checksum(buf_item *item, int algo)
+{
+  int ii;
+
+  printf("%s = ",checksum_name(algo));
+  for (ii = 0; ii < checksum_length(algo); ii++) {
+    printf("%02x",(unsigned char)item->checksum[ii]);
+  }
+  printf("\n");
+}
+
+/***************************************************************
+ * Start receiving a packet into item, whose image data must
+ * already be allocated. The packet is read incrementally with
+ * packet_rx_read, which suits non-blocking sockets, and each
+ * piece is hashed as soon as it has been read, while it is
+ * still in cache, so that the digest is ready when the last
+ * byte lands. A tree digest is computed in one go, on the
+ * hashing threads, once the packet is in.
+ * *************************************************************/
+void packet_rx_init(packet_rx *rx, buf_item *item, int algo)
+{
+  rx->item = item;
+  rx->off = 0;
+  rx->inplace = 0;
+  rx->algo = algo;
+  rx->wire = item->size;
+  rx->z = NULL;
+  rx->error = 0;
+  rx->csum_ns = 0;
+  if (algo != CSUM_NONE)
+    checksum_init(&rx->c,algo);
+}
+
+// hash received bytes, timing it for the latency statistics (batched
+// algorithms hash the image data in packet_rx_finish instead)
+static void rx_hash(packet_rx *rx, unsigned char *p, size_t n)
+{
+  uint64_t start;
+
+  if (checksum_batched(rx->algo))
+    return;
+  start = get_time_ns();
+
+  checksum_update(&rx->c,p,n);
+  rx->csum_ns += get_time_ns() - start;
+}
+
+/***************************************************************
+ * The image data was written into item->data by the sender
+ * (shared-memory transport), only the trailer is read. The
+ * data is hashed once the trailer is in, since the sender
+ * writes the trailer after the data.
+ * *************************************************************/
+void packet_rx_inplace(packet_rx *rx)
+{
+  rx->inplace = 1;
+  rx->off = rx->item->size;
+}
+
+/***************************************************************
+ * The image data is sent as `wire` bytes of compressed chunks
+ * (see compress.h). Each chunk is decompressed into item->data
+ * and hashed as soon as its payload is in, using z and the
+ * COMP_CHUNK bytes at zbuf to hold the payload. Corrupt data
+ * fails the packet in packet_rx_finish.
+ * *************************************************************/
+#define RX_CHUNK_HDR  0
+#define RX_CHUNK_DATA 1
+#define RX_SKIP       2
+
+static void rx_skip(packet_rx *rx)
+{
+  rx->error = 1;
+  rx->stage = RX_SKIP;
+  rx->start = rx->off;
+  rx->end = rx->wire;
+}
+
+void packet_rx_compressed(packet_rx *rx, comp_ctx *z, unsigned char *zbuf, size_t wire)
+{
+  rx->z = z;
+  rx->zbuf = zbuf;
+  rx->wire = wire;
+  rx->elem = shape_elem_size(&rx->item->shape);
+  rx->raw = 0;
+  rx->stage = RX_CHUNK_HDR;
+  rx->start = 0;
+  rx->end = COMP_CHUNK_HDR;
+  if (rx->item->size == 0 || rx->end > wire) {
+    rx_skip(rx);
+    rx->error = (rx->item->size > 0 || wire > 0);
+  }
+}
+
+// where the payload of the current chunk is read: stored payloads that
+// need no unshuffle go straight into the image data
+static unsigned char *rx_payload(packet_rx *rx)
+{
+  if (rx->flags == COMP_STORED && !compress_shuffles(rx->z->mode,rx->elem))
+    return rx->item->data + rx->raw;
+  return rx->zbuf;
+}
+
+// the part ending at rx->off is in: parse or decompress it
+static void rx_next_part(packet_rx *rx)
+{
+  size_t len, chunk = rx->item->size - rx->raw;
+  unsigned char *dst = rx->item->data + rx->raw;
+  uint32_t word;
+
+  if (chunk > COMP_CHUNK)
+    chunk = COMP_CHUNK;
+
+  if (rx->stage == RX_CHUNK_HDR) {
+    memcpy(&word,rx->zhdr,COMP_CHUNK_HDR);
+    word = ntohl(word);
+    rx->flags = word & (COMP_STORED | COMP_TILES);
+    len = word & COMP_LEN_MASK;
+    if ((rx->flags == COMP_STORED ? len != chunk : (len == 0 || len >= chunk)) ||
+        rx->end + len > rx->wire) {
+      rx_skip(rx);
+      return;
+    }
+    rx->stage = RX_CHUNK_DATA;
+    rx->start = rx->end;
+    rx->end += len;
+  } else if (rx->stage == RX_CHUNK_DATA) {
+    if (!decompress_chunk(rx->z,rx->elem,rx_payload(rx),rx->end - rx->start,rx->flags,\
+                          dst,chunk)) {
+      rx_skip(rx);
+      return;
+    }
+    if (rx->algo != CSUM_NONE)
+      rx_hash(rx,dst,chunk);
+    rx->raw += chunk;
+    if (rx->raw == rx->item->size) {
+      if (rx->end != rx->wire) // bytes after the last chunk
+        rx_skip(rx);
+      return;
+    }
+    rx->stage = RX_CHUNK_HDR;
+    rx->start = rx->end;
+    rx->end += COMP_CHUNK_HDR;
+    if (rx->end > rx->wire)
+      rx_skip(rx);
+  }
+}
+
+/***************************************************************
+ * Where the packet's bytes from offset off on go: sets *p and
+ * returns how many of them (at most max) can be received there
+ * in one piece, 0 once off is past the end. Receivers that keep
+ * several reads in flight (io_uring) plan them with this.
+ * *************************************************************/
+size_t packet_rx_span(packet_rx *rx, size_t off, unsigned char **p, size_t max)
+{
+  size_t wire = rx->wire, len;
+
+  if (off >= wire) {
+    *p = rx->trailer + (off - wire);
+    len = wire + PACKET_TRAILER - off;
+  } else if (!rx->z) {
+    *p = rx->item->data + off;
+    len = wire - off;
+  } else if (off >= rx->end) {
+    return 0; // chunk lengths are only known once their header is in
+  } else {
+    len = rx->end - off;
+    if (rx->stage == RX_CHUNK_HDR) {
+      *p = rx->zhdr + (off - rx->start);
+    } else if (rx->stage == RX_CHUNK_DATA) {
+      *p = rx_payload(rx) + (off - rx->start);
     } else {
-      MD5_Update(&c,read_ptr,length);
-      break;
+      *p = rx->zbuf;
+      if (len > COMP_CHUNK)
+        len = COMP_CHUNK;
     }
-    length -= MAXLINE;
-    read_ptr += MAXLINE;
   }
-  MD5_Final(new_checksum,&c);
+  return (len > max) ? max : len;
+}
 
-  /* Set new checksum */
-  memcpy(((buf_item *)item)->checksum,new_checksum,MD5_DIGEST_LENGTH);
+/***************************************************************
+ * Account for n bytes received at the current offset, where
+ * packet_rx_span pointed, and hash them
+ * *************************************************************/
+void packet_rx_advance(packet_rx *rx, size_t n)
+{
+  if (rx->z && rx->off < rx->wire) {
+    rx->off += n;
+    if (rx->off == rx->end && rx->stage != RX_SKIP)
+      rx_next_part(rx);
+    return;
+  }
+  if (!rx->z && rx->algo != CSUM_NONE && rx->off < rx->item->size)
+    rx_hash(rx,rx->item->data+rx->off,n);
+  rx->off += n;
+}
 
-  /* Compare old and new checksums */
-  for (ii = 0; ii < MD5_DIGEST_LENGTH; ii++) {
-    if (old_checksum[ii] != new_checksum[ii])
-      return 0;
+/***************************************************************
+ * Read up to max bytes of the packet from fd. Returns the
+ * result of read(): the number of bytes read, 0 on EOF or -1
+ * on error (including EAGAIN).
+ * *************************************************************/
+ssize_t packet_rx_read(packet_rx *rx, int fd, size_t max)
+{
+  unsigned char *p;
+  size_t len = packet_rx_span(rx,rx->off,&p,max);
+  ssize_t nbytes;
+
+  if ((nbytes = read(fd,p,len)) > 0)
+    packet_rx_advance(rx,nbytes);
+  return nbytes;
+}
+
+int packet_rx_done(packet_rx *rx)
+{
+  return rx->off == rx->wire + PACKET_TRAILER;
+}
+
+/***************************************************************
+ * Finish a packet: fill in the item fields sent in the trailer.
+ * Returns 1 if it is complete (and decompressed) and its
+ * checksum matches (always for CSUM_NONE), else 0.
+ * *************************************************************/
+int packet_rx_finish(packet_rx *rx)
+{
+  unsigned char digest[CSUM_MAX_LENGTH];
+  int done = packet_rx_done(rx);
+  uint64_t start;
+
+  if (done)
+    unpack_trailer(rx->trailer,rx->item);
+  done = done && !rx->error;
+  if (rx->algo == CSUM_NONE)
+    return done;
+
+  start = get_time_ns();
+  if (done && (rx->inplace || checksum_batched(rx->algo)))
+    checksum_update(&rx->c,rx->item->data,rx->item->size);
+  if (done)
+    checksum_trailer(&rx->c,rx->trailer);
+  checksum_final(&rx->c,digest); // also releases the context
+  rx->csum_ns += get_time_ns() - start;
+  return done && !memcmp(digest,rx->item->checksum,CSUM_MAX_LENGTH);
+}
+
+/***************************************************************
+ * Abandon a packet that will not be finished
+ * *************************************************************/
+void packet_rx_abort(packet_rx *rx)
+{
+  unsigned char digest[CSUM_MAX_LENGTH];
+
+  if (rx->algo != CSUM_NONE)
+    checksum_final(&rx->c,digest); // releases the context
+}
+
+/***************************************************************
+ * Write a packet to a connection, hashing each PACKET_CHUNK just
+ * before it is copied to the socket (a tree digest is computed
+ * up front, in parallel). The checksum lives in the trailer,
+ * which is filled in and sent last.
+ * *************************************************************/
+void write_packet(int fd, buf_item *item, int algo)
+{
+  unsigned char raw[PACKET_TRAILER];
+  int chunked = (algo != CSUM_NONE && !checksum_batched(algo));
+  size_t off, len;
+  checksum_ctx c;
+
+  if (algo != CSUM_NONE)
+    checksum_init(&c,algo);
+  if (algo != CSUM_NONE && !chunked)
+    checksum_update(&c,item->data,item->size);
+
+  for (off = 0; off < item->size; off += len) {
+    len = (item->size-off > PACKET_CHUNK) ? PACKET_CHUNK : item->size-off;
+    if (chunked)
+      checksum_update(&c,item->data+off,len);
+    Rio_writen(fd,item->data+off,len);
   }
-  return 1;
+
+  memset(item->checksum,0,CSUM_MAX_LENGTH);
+  pack_trailer(raw,item);
+  if (algo != CSUM_NONE) {
+    checksum_trailer(&c,raw);
+    checksum_final(&c,item->checksum);
+    pack_trailer(raw,item);
+  }
+  Rio_writen(fd,raw,PACKET_TRAILER);
 }
 
 /***************************************************************
- * Print the MD5 checksum field of a buffer item in hexadecimal
+ * Chunk repair: the image data of a packet is also covered by
+ * the CRC32C of each chunk of chunk_size(size) bytes (the last
+ * one may be shorter), so that a corrupted packet is patched by
+ * resending the chunks that differ instead of being dropped.
+ * Chunks are PACKET_CHUNK bytes, doubled until a packet has at
+ * most MAX_CHUNKS of them.
  * *************************************************************/
-void print_checksum(buf_item *item)
+size_t chunk_size(size_t size)
+{
+  size_t chunk = PACKET_CHUNK;
+
+  while ((size + chunk-1)/chunk > MAX_CHUNKS)
+    chunk *= 2;
+  return chunk;
+}
+
+int chunk_count(size_t size, size_t chunk)
+{
+  return (size + chunk-1)/chunk;
+}
+
+void chunk_crcs(const unsigned char *data, size_t size, size_t chunk, uint32_t *crcs)
 {
+  size_t off;
   int ii;
 
-  printf("MD5 = ");
-  for (ii = 0; ii < MD5_DIGEST_LENGTH; ii++) {
-    printf("%02x",(unsigned char)item->checksum[ii]);
+  for (ii = 0, off = 0; off < size; ii++, off += chunk)
+    crcs[ii] = crc32c(0,data+off,(size-off > chunk) ? chunk : size-off);
+}
+
+/***************************************************************
+ * Compare the chunks of the image data with their CRCs and list
+ * the runs of corrupt chunks as (first chunk, count) pairs in
+ * ranges. Runs past the first max_ranges are merged into the
+ * last one. Returns the number of ranges, 0 if all match.
+ * *************************************************************/
+int chunk_mismatches(const unsigned char *data, size_t size, size_t chunk, const uint32_t *crcs,\
+                     uint32_t *ranges, int max_ranges)
+{
+  int ii, n = chunk_count(size,chunk), nranges = 0;
+  size_t off;
+
+  for (ii = 0, off = 0; ii < n; ii++, off += chunk) {
+    if (crc32c(0,data+off,(size-off > chunk) ? chunk : size-off) == crcs[ii])
+      continue;
+    if (nranges > 0 && (ranges[2*nranges-2] + ranges[2*nranges-1] == (uint32_t)ii ||
+                        nranges == max_ranges)) {
+      ranges[2*nranges-1] = ii+1 - ranges[2*nranges-2];
+    } else {
+      ranges[2*nranges] = ii;
+      ranges[2*nranges+1] = 1;
+      nranges++;
+    }
   }
-  printf("\n");
+  return nranges;
 }
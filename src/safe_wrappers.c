@@ -1,9 +1,32 @@
 #include "safe_wrappers.h"
 
+/* Set the kernel send and receive buffer sizes of a socket. Must be done
+ * before connect()/listen() for the TCP window scale to take it into
+ * account. A size of 0 keeps the system default (autotuning).
+ */
+static void set_sockbuf(int fd, int sockbuf)
+{
+  if (sockbuf <= 0)
+    return;
+  Setsockopt(fd, SOL_SOCKET, SO_SNDBUF, (const void *)&sockbuf, sizeof(int));
+  Setsockopt(fd, SOL_SOCKET, SO_RCVBUF, (const void *)&sockbuf, sizeof(int));
+}
+
+/* Send small writes (control frames, packet headers) right away instead
+ * of holding them back until the previous segment is acknowledged
+ * (Nagle), which stalls every message behind the peer's delayed ACK.
+ */
+void set_nodelay(int fd)
+{
+  int one = 1;
+
+  Setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, (const void *)&one, sizeof(int));
+}
+
 /* Reentrant, protocol independent helper to establish connection with a
- * server.
+ * server. sockbuf is the socket buffer size in bytes, 0 for the default.
  */
-int open_clientfd(char *hostname, char *port, struct sockaddr *sa)
+int open_clientfd(char *hostname, char *port, struct sockaddr *sa, int sockbuf)
 {
   int clientfd;
   struct addrinfo hints, *listp, *p;
@@ -23,9 +46,12 @@ int open_clientfd(char *hostname, char *port, struct sockaddr *sa)
                  p->ai_protocol)) < 0)
       continue; /* Socket failed, try the next */
 
+    set_sockbuf(clientfd, sockbuf);
+
     /* Connect to the server */
     if (connect(clientfd, p->ai_addr, p->ai_addrlen) != -1) {
       *sa = *p->ai_addr; /* populate sockaddr */
+      set_nodelay(clientfd);
       break; /* Success */
     }
     Close(clientfd); /* Connect failed, try another */
@@ -40,9 +66,9 @@ int open_clientfd(char *hostname, char *port, struct sockaddr *sa)
 }
 
 /* Reentrant, protocol independent helper that opens and returns a
- * listening descriptor.
+ * listening descriptor. Accepted sockets inherit its buffer size.
  */
-int open_listenfd(char *port)
+int open_listenfd(char *port, int sockbuf)
 {
   struct addrinfo hints, *listp, *p;
   int listenfd, optval=1;
@@ -65,6 +91,7 @@ int open_listenfd(char *port)
     /* Eliminates "Address already in use" error from bind */
     Setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR,
       (const void *)&optval, sizeof(int));
+    set_sockbuf(listenfd, sockbuf);
 
     /* Bind the descriptor to the address */
     if (bind(listenfd, p->ai_addr, p->ai_addrlen) == 0)
@@ -190,6 +217,7 @@ static ssize_t rio_read(rio_t *rp, char *usrbuf, size_t n)
 
   while (rp->rio_cnt <= 0) { /* refill if buf is empty */
     rp->rio_cnt = read(rp->rio_fd, rp->rio_buf, sizeof(rp->rio_buf));
+    rp->rio_nread++;
     if (rp->rio_cnt < 0) {
       if (errno != EINTR) /* interrupted by sig handler return */
         return -1;
@@ -215,6 +243,34 @@ void rio_readinitb(rio_t *rp, int fd)
   rp->rio_fd = fd;
   rp->rio_cnt = 0;
   rp->rio_bufptr = rp->rio_buf;
+  rp->rio_nread = 0;
+}
+
+/*
+ * rio_readn_direct - read n bytes straight into usrbuf, without going
+ * through the internal buffer. recv(MSG_WAITALL) usually returns the
+ * whole request in one call; it comes back short on signals or EOF.
+ */
+static ssize_t rio_readn_direct(rio_t *rp, char *usrbuf, size_t n)
+{
+  size_t nleft = n;
+  ssize_t nread;
+
+  while (nleft > 0) {
+    nread = recv(rp->rio_fd, usrbuf, nleft, MSG_WAITALL);
+    if (nread < 0 && errno == ENOTSOCK)
+      nread = read(rp->rio_fd, usrbuf, nleft);
+    rp->rio_nread++;
+    if (nread < 0) {
+      if (errno != EINTR) /* interrupted by sig handler return */
+        return -1;
+      nread = 0;
+    } else if (nread == 0) /* EOF */
+      break;
+    nleft -= nread;
+    usrbuf += nread;
+  }
+  return (n - nleft);
 }
 
 /*
@@ -256,20 +312,20 @@ void Setsockopt(int s, int level, int optname, const void *optval, int optlen)
     unix_error("Setsockopt error");
 }
 
-int Open_clientfd(char *hostname, char *port, struct sockaddr *sa)
+int Open_clientfd(char *hostname, char *port, struct sockaddr *sa, int sockbuf)
 {
   int rc;
 
-  if ((rc = open_clientfd(hostname,port,sa)) < 0)
+  if ((rc = open_clientfd(hostname,port,sa,sockbuf)) < 0)
     unix_error("Open_clientfd error");
   return rc;
 }
 
-int Open_listenfd(char *port)
+int Open_listenfd(char *port, int sockbuf)
 {
   int rc;
 
-  if ((rc = open_listenfd(port)) < 0)
+  if ((rc = open_listenfd(port,sockbuf)) < 0)
     unix_error("Open_listenfd error");
   return rc;
 }
@@ -315,6 +371,22 @@ void Close(int fd)
     unix_error("Close error");
 }
 
+/* Fill buf with len bytes from the kernel's random source */
+void Getrandom(void *buf, size_t len)
+{
+  ssize_t n;
+  size_t got = 0;
+
+  while (got < len) {
+    if ((n = getrandom((char *)buf+got,len-got,0)) < 0) {
+      if (errno == EINTR)
+        continue;
+      unix_error("Getrandom error");
+    }
+    got += n;
+  }
+}
+
 void Fputs(const char *ptr, FILE *stream)
 {
   if (fputs(ptr, stream) == EOF)
@@ -350,12 +422,37 @@ ssize_t Rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen)
   return rc;
 }
 
-ssize_t Rio_readnb(rio_t *rp, void *usrbuf, size_t n)
+/*
+ * rio_readnb - robustly read n bytes (buffered). Requests of at least
+ * rio_direct_min bytes drain what is already buffered and read the rest
+ * directly into usrbuf, saving a copy and most of the read() calls.
+ */
+size_t rio_direct_min = RIO_BUFSIZE;
+
+ssize_t rio_readnb(rio_t *rp, void *usrbuf, size_t n)
 {
   size_t nleft = n;
   ssize_t nread;
   char *bufp = usrbuf;
 
+  if (n >= rio_direct_min) {
+    // rio_cnt is -1 after a failed read, nothing is buffered then
+    nread = 0;
+    if (rp->rio_cnt > 0)
+      nread = ((size_t)rp->rio_cnt < n) ? rp->rio_cnt : n;
+    memcpy(bufp, rp->rio_bufptr, nread);
+    rp->rio_bufptr += nread;
+    rp->rio_cnt -= nread;
+    nleft -= nread;
+    bufp += nread;
+    if (nleft > 0) {
+      if ((nread = rio_readn_direct(rp, bufp, nleft)) < 0)
+        return -1;
+      nleft -= nread;
+    }
+    return (n - nleft);
+  }
+
   while (nleft > 0) {
     if ((nread = rio_read(rp, bufp, nleft)) < 0)
       return -1;
@@ -367,6 +464,11 @@ ssize_t Rio_readnb(rio_t *rp, void *usrbuf, size_t n)
   return (n-nleft);
 }
 
+ssize_t Rio_readnb(rio_t *rp, void *usrbuf, size_t n)
+{
+  return rio_readnb(rp, usrbuf, n);
+}
+
 char *Fgets(char *ptr, int n, FILE *stream)
 {
   char *rptr;
@@ -0,0 +1,432 @@
+/******************************************
+ * Client packet transmit paths.
+ *
+ * The image data of a packet can reach the
+ * socket in three ways:
+ *
+ *  SEND_COPY: plain write(), the kernel
+ *    copies every byte into the socket.
+ *
+ *  SEND_ZEROCOPY: send(MSG_ZEROCOPY) pins the
+ *    packet pages instead of copying them.
+ *    The kernel reports on the socket error
+ *    queue when it is done with a range of
+ *    sends, and the buffer must not be freed
+ *    (or rewritten) before that.
+ *
+ *  SEND_SENDFILE: the image data comes from a
+ *    file and is handed from the page cache to
+ *    the socket with sendfile(). The file is
+ *    also mapped so that checksums can be
+ *    computed without reading it again.
+ *
+ *  SEND_SHM: the server is on this host and
+ *    exports its ring storage (see arena.c).
+ *    The image data is copied straight into
+ *    the slot the server reserved for the
+ *    packet, with no socket in the way. The
+ *    source is the packet buffer or the image
+ *    file.
+ *
+ * The packet trailer (timestamp, checksum,
+ * id) is always written to the socket, after
+ * the image data, which also tells a shared
+ * memory server that the data is in place.
+ *
+ * A packet striped across several connections
+ * is sent with one sender per connection:
+ * each sends its stripe, and the sender of the
+ * first connection signs the whole packet and
+ * sends the trailer.
+ *
+ * Compressed packets are compressed by a pool
+ * of threads (see compress.c) while the
+ * sender hashes the image data, and the
+ * chunks are then written to the socket.
+ *
+ * Author: Aleksander Bapst
+ * ****************************************/
+#include "sender.h"
+#include <poll.h>
+#include <sys/sendfile.h>
+#include <linux/errqueue.h>
+
+static const char *send_names[] = {"copy","zerocopy","sendfile","shm"};
+
+/******************************************************
+ * Reap zerocopy completions from the socket error
+ * queue. Blocks until at least one has arrived if
+ * wait is set. Each notification covers the range of
+ * send ids [ee_info, ee_data].
+ * ****************************************************/
+static void reap_zerocopy(packet_sender *s, int wait)
+{
+  char control[CMSG_SPACE(sizeof(struct sock_extended_err))*4];
+  struct msghdr msg;
+  struct cmsghdr *cm;
+  struct sock_extended_err *serr;
+  struct pollfd pfd;
+  uint32_t n;
+
+  while (1) {
+    memset(&msg,0,sizeof(msg));
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    if (recvmsg(s->fd,&msg,MSG_ERRQUEUE) < 0) {
+      if (errno == EINTR)
+        continue;
+      if (errno != EAGAIN && errno != EWOULDBLOCK)
+        unix_error("recvmsg error");
+      if (!wait)
+        return;
+
+      // nothing queued yet, errors are always reported as POLLERR
+      pfd.fd = s->fd;
+      pfd.events = 0;
+      if (poll(&pfd,1,-1) < 0 && errno != EINTR)
+        unix_error("poll error");
+      continue;
+    }
+
+    for (cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg,cm)) {
+      if (!((cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) ||
+            (cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR)))
+        continue;
+      serr = (struct sock_extended_err *)CMSG_DATA(cm);
+      if (serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+        continue;
+      n = serr->ee_data - serr->ee_info + 1;
+      s->zc_done += n;
+      if (serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+        s->zc_copied += n;
+    }
+    wait = 0; // got something, drain the rest without blocking
+  }
+}
+
+/******************************************************
+ * Send n bytes with MSG_ZEROCOPY. The kernel numbers
+ * every successful send call, short ones included.
+ * ****************************************************/
+static void send_zerocopy(packet_sender *s, char *p, size_t n)
+{
+  ssize_t nsent;
+
+  while (n > 0) {
+    nsent = send(s->fd,p,n,MSG_ZEROCOPY);
+    if (nsent < 0) {
+      if (errno == EINTR)
+        continue;
+      if (errno == ENOBUFS && s->zc_done != s->zc_next) {
+        reap_zerocopy(s,1); // too many pinned pages, wait for some
+        continue;
+      }
+      if (errno == ENOBUFS) { // nothing in flight to wait for, copy the rest
+        Rio_writen(s->fd,p,n);
+        break;
+      }
+      unix_error("send error");
+    }
+    s->zc_next++;
+    p += nsent;
+    n -= nsent;
+  }
+  reap_zerocopy(s,0);
+}
+
+/******************************************************
+ * Send n bytes of the image file starting at off
+ * ****************************************************/
+static void send_file(packet_sender *s, off_t off, size_t n)
+{
+  ssize_t nsent;
+
+  while (n > 0) {
+    nsent = sendfile(s->fd,s->src_fd,&off,n);
+    if (nsent < 0) {
+      if (errno == EINTR)
+        continue;
+      unix_error("sendfile error");
+    }
+    if (nsent == 0)
+      app_error("sendfile error: image file truncated");
+    n -= nsent;
+  }
+}
+
+/******************************************************
+ * The image data of a packet: its buffer, or image
+ * (id % nimages) of the image file at *file_off
+ * ****************************************************/
+static unsigned char *packet_body(packet_sender *s, buf_item *item, off_t *file_off)
+{
+  *file_off = 0;
+  if (s->src_fd < 0)
+    return item->data;
+  if (item->size != s->image_size)
+    app_error("sendfile error: packet size differs from the image size");
+  *file_off = (off_t)(item->id % s->nimages)*s->image_size;
+  return (unsigned char *)s->src_map + *file_off;
+}
+
+/******************************************************
+ * Fill in the checksum of a packet from the digest of
+ * its image data and send its trailer
+ * ****************************************************/
+static void send_trailer(packet_sender *s, buf_item *item, int algo, checksum_ctx *c)
+{
+  unsigned char raw[PACKET_TRAILER];
+
+  memset(item->checksum,0,CSUM_MAX_LENGTH);
+  pack_trailer(raw,item);
+  if (algo != CSUM_NONE) {
+    checksum_trailer(c,raw);
+    checksum_final(c,item->checksum);
+    pack_trailer(raw,item);
+  }
+  Rio_writen(s->fd,raw,PACKET_TRAILER);
+}
+
+/******************************************************
+ * Set up a transmit path on a connected socket. path
+ * is the image file for SEND_SENDFILE, which holds
+ * images of `size` bytes. Returns 0 (and falls back
+ * to SEND_COPY) if the mode is unavailable.
+ * ****************************************************/
+int sender_init(packet_sender *s, int fd, int mode, char *path, size_t size)
+{
+  int one = 1;
+  struct stat st;
+
+  memset(s,0,sizeof(packet_sender));
+  s->fd = fd;
+  s->src_fd = -1;
+  s->mode = SEND_COPY;
+
+  if (mode == SEND_ZEROCOPY) {
+    if (setsockopt(fd,SOL_SOCKET,SO_ZEROCOPY,&one,sizeof(one)) < 0) {
+      fprintf(stderr,"MSG_ZEROCOPY not supported: %s\n",strerror(errno));
+      return 0;
+    }
+  } else if (mode == SEND_SENDFILE) {
+    if ((s->src_fd = open(path,O_RDONLY)) < 0 || fstat(s->src_fd,&st) < 0) {
+      fprintf(stderr,"Cannot open image file %s: %s\n",path,strerror(errno));
+      if (s->src_fd >= 0)
+        Close(s->src_fd);
+      s->src_fd = -1;
+      return 0;
+    }
+    s->src_size = st.st_size;
+    s->image_size = size;
+    s->nimages = size ? s->src_size/size : 0;
+    if (s->nimages == 0) {
+      fprintf(stderr,"Image file %s is smaller than one image (%zu bytes)\n",\
+              path,size);
+      Close(s->src_fd);
+      s->src_fd = -1;
+      return 0;
+    }
+    s->src_map = mmap(NULL,s->src_size,PROT_READ,MAP_SHARED,s->src_fd,0);
+    if (s->src_map == MAP_FAILED)
+      unix_error("mmap error");
+  }
+  s->mode = mode;
+  return 1;
+}
+
+/******************************************************
+ * Switch to SEND_SHM after the server offered its
+ * shared ring storage in the handshake. An image file
+ * given to sender_init stays the source of the data.
+ * Returns 0 (and keeps the current mode) if the
+ * segment cannot be mapped.
+ * ****************************************************/
+int sender_attach_shm(packet_sender *s, unsigned int id, size_t slot_size)
+{
+  if (!arena_attach(&s->shm,id))
+    return 0;
+  s->slot_size = slot_size;
+  s->mode = SEND_SHM;
+  return 1;
+}
+
+/******************************************************
+ * Send the image data and trailer of a packet, with
+ * the checksum computed chunk by chunk as it is sent
+ * (a tree digest up front, in parallel).
+ * In SEND_SENDFILE mode (and SEND_SHM with an image
+ * file) the image data of packet id is image
+ * (id % nimages) of the file and the image data of
+ * item is not used. `slot` is the ring slot the server
+ * reserved for the packet, used by SEND_SHM only.
+ * ****************************************************/
+void sender_send(packet_sender *s, buf_item *item, int algo, int slot)
+{
+  unsigned char *body, *dst = NULL;
+  int chunked = (algo != CSUM_NONE && !checksum_batched(algo));
+  size_t off, len;
+  off_t file_off;
+  checksum_ctx c;
+
+  if (s->mode == SEND_COPY) {
+    write_packet(s->fd,item,algo);
+    return;
+  }
+
+  body = packet_body(s,item,&file_off);
+
+  if (s->mode == SEND_SHM) {
+    if (slot < 0 || (size_t)(slot+1)*s->slot_size > s->shm.size || item->size > s->slot_size)
+      app_error("shm error: packet does not fit its slot");
+    dst = s->shm.base + (size_t)slot*s->slot_size;
+  }
+
+  if (algo != CSUM_NONE)
+    checksum_init(&c,algo);
+  if (algo != CSUM_NONE && !chunked)
+    checksum_update(&c,body,item->size);
+
+  for (off = 0; off < item->size; off += len) {
+    len = (item->size-off > PACKET_CHUNK) ? PACKET_CHUNK : item->size-off;
+    if (chunked)
+      checksum_update(&c,body+off,len);
+    if (s->mode == SEND_SHM)
+      memcpy(dst+off,body+off,len);
+    else if (s->mode == SEND_ZEROCOPY)
+      send_zerocopy(s,(char *)body+off,len);
+    else
+      send_file(s,file_off+off,len);
+  }
+  send_trailer(s,item,algo,&c);
+}
+
+/******************************************************
+ * Striping: send bytes [off, off+len) of the image
+ * data of a packet, without trailer (any mode but
+ * SEND_SHM). Also resends chunks for chunk repair.
+ * ****************************************************/
+void sender_send_stripe(packet_sender *s, buf_item *item, size_t off, size_t len)
+{
+  unsigned char *body;
+  off_t file_off;
+  size_t n;
+
+  body = packet_body(s,item,&file_off);
+  for (; len > 0; off += n, len -= n) {
+    n = (len > PACKET_CHUNK) ? PACKET_CHUNK : len;
+    if (s->mode == SEND_ZEROCOPY)
+      send_zerocopy(s,(char *)body+off,n);
+    else if (s->mode == SEND_SENDFILE)
+      send_file(s,file_off+off,n);
+    else
+      Rio_writen(s->fd,body+off,n);
+  }
+}
+
+/******************************************************
+ * Striping: sign a packet and send its trailer, after
+ * its stripes. The checksum covers all of the image
+ * data, whichever connection it went out on.
+ * ****************************************************/
+void sender_send_trailer(packet_sender *s, buf_item *item, int algo)
+{
+  unsigned char *body;
+  off_t file_off;
+  size_t off, len, step;
+  checksum_ctx c;
+
+  body = packet_body(s,item,&file_off);
+  if (algo != CSUM_NONE) {
+    checksum_init(&c,algo);
+    step = checksum_batched(algo) ? item->size : PACKET_CHUNK;
+    for (off = 0; off < item->size; off += len) {
+      len = (item->size-off > step) ? step : item->size-off;
+      checksum_update(&c,body+off,len);
+    }
+  }
+  send_trailer(s,item,algo,&c);
+}
+
+/******************************************************
+ * Chunk repair: the CRC32C of each chunk of the image
+ * data of a packet, as the server should have it
+ * ****************************************************/
+void sender_chunk_crcs(packet_sender *s, buf_item *item, size_t chunk, uint32_t *crcs)
+{
+  off_t file_off;
+
+  chunk_crcs(packet_body(s,item,&file_off),item->size,chunk,crcs);
+}
+
+/******************************************************
+ * Compress the image data of packets of up to `size`
+ * bytes with `nthreads` threads
+ * ****************************************************/
+void sender_compress_init(packet_sender *s, int mode, int nthreads, size_t size)
+{
+  s->z = (compressor *)Malloc(sizeof(compressor));
+  compressor_init(s->z,mode,nthreads,size);
+}
+
+/******************************************************
+ * Compress a packet, hashing its image data meanwhile.
+ * Returns the bytes of image data it takes on the
+ * wire, to announce it before sender_send_compressed.
+ * ****************************************************/
+size_t sender_compress(packet_sender *s, buf_item *item, int algo)
+{
+  unsigned char *body;
+  off_t file_off;
+  size_t off, len, step;
+
+  body = packet_body(s,item,&file_off);
+  compressor_start(s->z,body,item->size,shape_elem_size(&item->shape));
+  if (algo != CSUM_NONE) {
+    checksum_init(&s->zsum,algo);
+    step = checksum_batched(algo) ? item->size : PACKET_CHUNK;
+    for (off = 0; off < item->size; off += len) {
+      len = (item->size-off > step) ? step : item->size-off;
+      checksum_update(&s->zsum,body+off,len);
+    }
+  }
+  return compressor_wait(s->z);
+}
+
+/******************************************************
+ * Send the chunks of the packet compressed last, then
+ * its trailer
+ * ****************************************************/
+void sender_send_compressed(packet_sender *s, buf_item *item, int algo)
+{
+  size_t ii, nchunks = (item->size + COMP_CHUNK-1)/COMP_CHUNK;
+
+  for (ii = 0; ii < nchunks; ii++)
+    Rio_writen(s->fd,s->z->out + ii*(COMP_CHUNK_HDR+COMP_CHUNK),s->z->lens[ii]);
+  send_trailer(s,item,algo,&s->zsum);
+}
+
+/******************************************************
+ * Wait for the kernel to let go of zerocopy buffers
+ * and unmap the image file
+ * ****************************************************/
+void sender_close(packet_sender *s)
+{
+  while (s->zc_done != s->zc_next)
+    reap_zerocopy(s,1);
+  if (s->src_map)
+    munmap(s->src_map,s->src_size);
+  arena_destroy(&s->shm);
+  if (s->src_fd >= 0)
+    Close(s->src_fd);
+  if (s->z) {
+    compressor_free(s->z);
+    Free(s->z);
+    s->z = NULL;
+  }
+}
+
+const char *sender_name(int mode)
+{
+  return send_names[mode];
+}
@@ -1,54 +1,426 @@
 /***************************************************************************
- * Server routine simulates processing of large image data packets from a
- * client. It implements a thread-safe ring buffer that can be accessed by 
- * multiple client read threads. When a client connects, the server starts
- * a new read thread that reads data packets into the ring buffer. If the
- * buffer is currently full, it blocks until a spot opens up. Processing is
- * handled by a concurrent processing thread that continuously reads and
- * processes packet items from the ring buffer,and blocks if the buffer is
- * empty. The server closes the read thread when it receives a message from
- * the client indicating that all packets have been sent. The processing
- * thread does not exit until a SIGINT (ctrl-c) has been received, which
- * exits the server program and frees the ring buffer memory.
+ * Server routine simulates processing of large image data packets from
+ * clients. It implements a thread-safe ring buffer that packets from all
+ * clients are read into. Connections are served by a small fixed pool of
+ * I/O threads, each running an epoll event loop over non-blocking sockets
+ * with a state machine per connection, so there is no limit on the number
+ * of clients. If the buffer is full, a connection waits for a slot to open
+ * up without holding up the other connections of its I/O thread.
+ * With -u the I/O threads use io_uring instead of epoll: they accept
+ * with a multishot accept, and receive each packet with a chain of linked
+ * reads straight into its slot, which are registered buffers when the ring
+ * storage is an arena.
+ * A client may stripe its packets across several connections (a session):
+ * each stream reads its stripe straight into the packet's slot, on
+ * whichever I/O thread serves it, and the connection that announced the
+ * packet publishes it once every stripe has landed.
+ * A client may also send the CRC32C of each chunk of its packets: a
+ * packet that fails its checksum then waits in its slot while the client
+ * resends only the corrupt chunks, instead of being dropped. With -F the
+ * server corrupts random bits of what it reads, to exercise this.
+ * Processing is handled by a pool of worker threads that each take packet
+ * items from the ring buffer and process them in parallel, and block while
+ * the buffer is empty. A client may ask for its packets to be processed in
+ * the order they were sent. The workers serve the clients fairly: each
+ * client's packets wait in a queue of their own, served by deficit
+ * round-robin weighted by the share the client asked for, and a client may
+ * ask to be urgent, i.e. served before any bulk client. A bulk client may
+ * only hold its share of the ring slots, so that a slow consumer does not
+ * let one sender take them all. The server closes a connection when it
+ * receives a message from the client indicating that all packets have
+ * been sent. The worker threads do not exit until a SIGINT (ctrl-c) has
+ * been received, which exits the server program and frees the ring buffer
+ * memory. The latency of each stage a packet goes through (wire, slot
+ * wait, checksum, enqueue, queue, processing) is kept in a histogram,
+ * printed when a client finishes and on SIGUSR1. With -e, they are served
+ * with the per-client counters and ring gauges in the Prometheus text
+ * format on a local port or Unix socket.
  *
  * Author: Aleksander Bapst
  * ************************************************************************/
 
 #include "ring_buffer.h"
+#include "protocol.h"
+#include "uring.h"
+#include "metrics.h"
+#include "kernels.h"
+#include "pipeline.h"
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#define MAX_EVENTS 64 // epoll events handled per wakeup
+#define READ_BUDGET 16 // reads per connection per wakeup, so none starves
+#define IN_SIZE (2*MAXLINE) // largest control message (legacy text hello)
+#define URING_ENTRIES 256 // io_uring submission queue size per I/O thread
+#define CHAIN_LENGTH 8 // linked reads submitted at once for a packet
+
+/* What an io_uring completion is for, in the low bits of its user_data
+ * (the rest is the client_state, or NULL) */
+#define OP_RECV   0 // a read of cs's input
+#define OP_POLL   1 // cs's socket became writable
+#define OP_ACCEPT 2 // the multishot accept accepted a connection
+#define OP_WAKE   3 // the eventfd was written, slots were released
+#define OP_TIMER  4 // the repair timer of the thread ran out
+#define OP_MASK   7
+
+/* Connection states */
+#define CONN_HELLO   0 // reading the handshake
+#define CONN_MSG     1 // reading a control message
+#define CONN_SLOT    2 // waiting for a free slot to acknowledge a READY
+#define CONN_PKT_HDR 3 // reading the PACKET frame that follows an ACK
+#define CONN_BODY    4 // reading a packet into its slot's image data
+#define CONN_STRIPES 5 // packet read, waiting for the session's other stripes
+#define CONN_STRIPE  6 // extra stream of a session: reading stripes
+#define CONN_CHUNKS  7 // packet read, reading the CHUNKS frame that follows
+#define CONN_REPAIR  8 // reading resent chunks into a packet waiting for them
+
+#define MAX_REPAIRS 3 // NACKs sent for a packet before it is dropped
+#define REPAIR_TIMEOUT_MS 1000 // time a packet may wait for chunks in its slot
+#define REPAIR_TICK_MS 100 // how often I/O threads look for overdue ones
+
+/* reserve_client_slot failures */
+#define RESERVE_FULL  -1 // the buffer is full
+#define RESERVE_SHARE -2 // the client holds its share of the slots
 
 /* Global pointer to ring buffer */
 ring_buffer *buf = NULL;
 
-/* Mutex protecting the number of active client threads */
+/* Mutex protecting the number of active clients */
 int nclients = 0;
+int idle = 1; // set once the idle message has been printed
 pthread_mutex_t nclients_lock;
 
+/* Per-client state of the packets in the pipeline: the client's flow in
+ * the fair queue and, if it asked for in-order processing, the order the
+ * workers of each pipeline stage follow: they wait until the stage's
+ * `next` reaches the sequence number of their slot. The state outlives the
+ * connection until the workers are done with its slots, and is freed by
+ * whoever sees every `next` reach `total` after `closed` is set. */
+typedef struct {
+  fq_flow flow; // first, the tag of the client's slots points to it
+  int ordered; // in-order processing was requested
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  long next[MAX_STAGES]; // sequence number of the next packet each stage processes
+  int closed; // the connection is gone and reserves no more slots
+  long total; // number of slots the connection reserved
+} client_order;
+
+/* Counters exported by the metrics endpoint, updated with relaxed atomic
+ * adds by the I/O thread of the connection */
+typedef struct {
+  atomic_long packets; // packets read, valid or not
+  atomic_long bytes; // their image data and trailers
+  atomic_long wire_bytes; // bytes they took on the wire (compression)
+  atomic_long csum_failures; // packets dropped for a bad checksum
+  atomic_long chunks_resent; // chunks asked for again (chunk repair)
+  atomic_long repaired; // packets published after chunks were resent
+} client_metrics;
+
+/* A packet that arrived with corrupt chunks, parked in its slot until the
+ * client has resent them. One that was not repaired in REPAIR_TIMEOUT_MS
+ * is dropped, but kept (with slot -1) until the chunks the client still
+ * owes us for it are read and thrown away. */
+typedef struct repair_pkt {
+  int slot; // -1 once dropped
+  buf_item *item;
+  int id; // of the packet, item is reused once it is dropped
+  size_t size; // its image data bytes
+  uint64_t deadline_ns; // when it is dropped if still corrupt
+  int algo; // its checksum, verified again once patched
+  uint32_t *crcs; // CRC32C of each of its chunks
+  uint32_t ranges[2*MAX_NACK_RANGES]; // (first chunk, count) asked for
+  int nranges;
+  int tries; // NACKs sent for it
+  long resent; // chunks asked for again so far
+  float bw; // bandwidth of its first arrival, MB/s
+  long wire; // bytes it took on the wire then
+  struct repair_pkt *next;
+} repair_pkt;
+
+typedef struct io_thread io_thread;
+typedef struct stripe_session stripe_session;
+
+/* Per-connection state, owned by one I/O thread */
+typedef struct client_state {
+  proto_conn conn;
+  io_thread *io;
+  int state; // CONN_*
+  uint32_t events; // epoll events currently registered
+  unsigned char in[IN_SIZE]; // control message being read
+  size_t inlen;
+
+  client_order *order; // set by the handshake, NULL for extra streams
+  long nreserved; // number of slots reserved for this client so far
+  int npackets;
+  int checksum; // CSUM_* algorithm agreed on in the handshake
+  int shm; // the client may write packets into its slots in shared memory
+  int comp; // COMP_MODE of the client's image data, COMP_NONE = as is
+  comp_ctx zctx; // decompression state, if comp is set
+  unsigned char *zbuf; // COMP_CHUNK bytes for compressed chunks
+  time_t start_t, clock_bias;
+  char peer[128]; // host:port, the client label of its metrics
+  client_metrics stats;
+  struct client_state *next_client; // registry of live connections
+
+  /* Credit based flow control (window > 0) */
+  int window; // max credits outstanding, 0 = stop-and-wait
+  int *credit_slots; // FIFO of slots reserved for granted credits
+  int credit_head, credit_count;
+  long granted;
+
+  /* Packet being received */
+  int slot; // -1 if none
+  frame_hdr hdr;
+  packet_rx rx;
+  int algo_ok; // the packet's checksum algorithm is supported
+
+  /* Chunk repair (repair > 0) */
+  size_t repair; // chunk size agreed on in the handshake, 0 = none
+  uint32_t *crcs; // MAX_CHUNKS, the CHUNKS of the packet being received
+  repair_pkt *repairs; // packets waiting for chunks to be resent
+  repair_pkt *fixing; // the one whose chunks are being read (CONN_REPAIR)
+  int fix_range; // range of it being read
+  size_t fix_off, fix_end; // part of that range left to read
+  unsigned char *scrap; // PACKET_CHUNK bytes the chunks of dropped packets go to
+  long chunks_resent, repaired;
+
+  /* Fault injection (-F) */
+  size_t fault_left; // bytes to read before the next bit flip
+  unsigned int fault_seed;
+  long faults;
+
+  /* Statistics */
+  int cnt, received;
+  long total_size;
+  long total_wire; // bytes on the wire, less than total_size if compressed
+  float total_bw;
+  uint64_t rx_start; // when the packet being received was announced (ns)
+  uint64_t slot_wait; // since when a slot is wanted (ns), 0 if none is
+  double first_ms; // receive time of the first packet
+  double steady_ms; // total receive time of the packets after it
+
+  int waiting; // queued on io->wait_head for a free slot
+  struct client_state *next_wait;
+
+  /* Striping, NULL session unless the client asked for it */
+  stripe_session *session;
+  int stream; // index in the session, 0 = the connection with the frames
+  unsigned char *stripe_data; // image data of the packet being striped
+  int stripe_slot; // its slot
+  size_t stripe_off, stripe_end; // part of it this stream has yet to read
+  long nstripes; // extra stream: packets whose stripe it has read
+
+  int mailed; // queued on io->mail_head by another connection
+  struct client_state *next_mail;
+
+  /* io_uring backend */
+  int nrecv; // reads in flight
+  int inflight; // reads and polls in flight, cs is freed once 0
+  int polling; // waiting for the socket to become writable
+  int closing; // shut down, closed when nothing is in flight
+} client_state;
+
+/* The connections a client stripes its packets across. Stream 0 reads
+ * the frames, starts each packet and finishes it once `left` reaches 0;
+ * the streams may be served by different I/O threads. */
+struct stripe_session {
+  pthread_mutex_t lock;
+  uint64_t id; // random token the streams join with
+  struct sockaddr_storage addr; // host of stream 0, the others must match it
+  int streams;
+  client_state *conns[MAX_STREAMS]; // NULL until joined and once closed
+  unsigned int joined; // bit mask of the streams that have joined
+  int refs; // connections attached
+  int lost; // an extra stream closed, no more packets can be received
+
+  /* Packet being received */
+  long started; // packets started by stream 0
+  unsigned char *data;
+  size_t size;
+  int slot;
+  int left; // streams still reading their stripe (stream 0: and trailer)
+  int orphan; // slot of a packet stream 0 gave up on, freed by the last
+              // connection to leave
+
+  stripe_session *next;
+};
+
+/* An I/O thread and the connections it serves */
+struct io_thread {
+  int epfd;
+  int evfd; // eventfd written by workers when a slot frees up
+  atomic_int nwaiting; // number of connections waiting for a slot
+  client_state *wait_head, *wait_tail; // FIFO of waiting connections
+  long nsyscalls; // system calls made by the thread for its connections
+  pthread_mutex_t mail_lock;
+  client_state *mail_head; // connections other threads woke up (striping)
+  int nparked; // packets its connections keep in their slot for repair
+#ifdef HAVE_IO_URING
+  uring ring; // instead of epfd with -u
+  int timer; // an OP_TIMER is in flight
+  struct __kernel_timespec tick; // REPAIR_TICK_MS, for OP_TIMER
+  int listenfd; // accepted on with a multishot accept
+  int fixed; // the ring storage is registered, slot i as buffer i
+#endif
+};
+
+/* Argument of a pipeline stage that runs a kernel */
+typedef struct {
+  kernel *k;
+  int isa;
+} stage_kernel;
+
+io_thread *io_threads = NULL;
+int n_io_threads = DEFAULT_NIOTHREADS;
+
 int verbose = 0;
-int use_checksum = 0;
+int checksum_algo = CSUM_NONE;
+int hash_threads = 0; // threads hashing tree digest leaves, 0 = one per CPU
+int ring_type = RING_LOCKFREE;
+int sockbuf = 0; // socket buffer size in bytes, 0 = system default
+int arena_flags = 0; // ARENA_* options for the ring storage
+int numa_node = -1; // NUMA node for ring storage and threads, -1 = any
+int use_arena = 0; // set by any of the arena options
+int use_uring = 0; // io_uring I/O threads instead of epoll
+int max_streams = DEFAULT_MAX_STREAMS; // most connections per striped client
+int process_cost = 0; // simulated processing in us per MB of image data
+kernel *proc_kernel = NULL; // kernel the workers run over each packet, NULL = none
+int proc_isa = KERNEL_BEST; // instruction set to run it with
+pipeline proc_pipe; // stages the packets go through once received
+char *stage_spec = NULL; // -g, NULL for one "process" stage of n_workers
+long fq_quantum = -1; // -Q in bytes per round and share, -1 = the largest packet
+char *urgent_hosts = NULL; // -U, addresses that may ask for the urgent class
+fair_queue fair_q;
+fair_queue *fq = NULL; // takes the packets by client, NULL = in ring order
+
+double fault_mb = 0; // flip a bit of the packets read every ~fault_mb MB, 0 = never
+atomic_long npackets_in; // packets received from all clients
+
+/* Latency histograms of the stages of a packet, over all clients */
+#define STAGE_WIRE    0 // packet header to the last byte in the slot
+#define STAGE_SLOT    1 // waiting for a free slot to reserve
+#define STAGE_CSUM    2 // hashing the packet, part of its wire time
+#define STAGE_ENQUEUE 3 // publishing it to the workers
+#define STAGE_QUEUE   4 // in the ring until the first pipeline stage takes it
+#define STAGE_PROCESS 5 // the work of a pipeline stage, once per stage
+#define NSTAGES       6
+lat_hist stages[NSTAGES];
+
+/* Metrics endpoint (-e): totals over all clients so far, and the live
+ * connections for the per-client counters */
+char *metrics_addr = NULL;
+int metrics_fd = -1;
+client_metrics totals;
+client_state *clients = NULL;
+pthread_mutex_t clients_lock = PTHREAD_MUTEX_INITIALIZER;
+int n_workers = DEFAULT_NWORKERS;
+
+/* Striped sessions, by id */
+stripe_session *sessions = NULL;
+pthread_mutex_t sessions_lock = PTHREAD_MUTEX_INITIALIZER;
 
 /* Function declarations */
-void *client_job(void *varargp);
-void *buffer_job();
+void *io_job(void *varargp);
+void open_client(int connfd, io_thread *io);
+client_state *new_client(int connfd, io_thread *io, const char *peer);
+int handle_input(client_state *cs);
+ssize_t next_input(client_state *cs, unsigned char **p);
+void got_input(client_state *cs, size_t n);
+int handle_msg(client_state *cs);
+int accept_client(client_state *cs);
+int start_packet(client_state *cs);
+void packet_in(client_state *cs);
+void finish_packet(client_state *cs);
+void publish_packet(client_state *cs, int slot, buf_item *item, int ok, float packet_bw,\
+                    long wire, long resent);
+int got_chunks(client_state *cs);
+void park_packet(client_state *cs, uint32_t *ranges, int nranges, float packet_bw);
+void nack_packet(client_state *cs, repair_pkt *rp, uint32_t *ranges, int nranges);
+int start_repair(client_state *cs);
+int next_fix_range(client_state *cs);
+void repair_done(client_state *cs);
+void expire_repairs(io_thread *io);
+void inject_faults(client_state *cs, unsigned char *p, size_t n);
+size_t fault_gap(client_state *cs);
+void ack_ready(client_state *cs);
+int grant_credits(client_state *cs);
+int reserve_client_slot(client_state *cs);
+int take_credit_slot(client_state *cs);
+void wait_for_slot(client_state *cs, int front);
+void stop_waiting(client_state *cs);
+void unlink_waiting(client_state *cs);
+void requeue_waiting(client_state *cs);
+void serve_waiting(io_thread *io);
+int sync_client(client_state *cs);
+void close_client(client_state *cs);
+int reading(client_state *cs);
+size_t input_span(client_state *cs, size_t ahead, unsigned char **p, int *slot);
+void open_session(client_state *cs, int streams);
+int join_session(client_state *cs, uint64_t id, uint32_t stream);
+int same_host(int fd, struct sockaddr_storage *addr);
+int urgent_host(int fd);
+int start_stripes(client_state *cs);
+int next_stripe(client_state *cs);
+int stripe_done(client_state *cs);
+int stripes_ready(client_state *cs);
+void leave_session(client_state *cs);
+void mail_client(client_state *cs);
+void serve_mail(io_thread *io);
+#ifdef HAVE_IO_URING
+int init_uring(io_thread *io, int listenfd);
+void *uring_job(void *varargp);
+void uring_sync(client_state *cs);
+void post_input(client_state *cs);
+void shut_client(client_state *cs);
+#endif
+void *worker_job(void *varargp);
+int parse_stages(char *spec);
+void process_stage(buf_item *item, void *arg);
+void kernel_stage(buf_item *item, void *arg);
+int run_kernel(buf_item *item, kernel *k, int isa);
+int order_done(client_order *order);
+void *stats_job(void *varargp);
+void *metrics_job(void *varargp);
+void build_metrics(metrics_buf *m);
+void pipeline_labels(stage *st, char *labels, size_t len);
+void count_packet(client_metrics *m, long bytes, long wire, int ok);
+void wake_io_threads();
+void print_idle();
 void close_openfds(int *clientfd, int *serverfd);
 void sigint_handler(int sig);
 void print_usage();
 
 int main(int argc, char **argv)
 {
-  int listenfd, *connfdp, opt, n_buf_items = DEFAULT_BUFFER_SIZE;
-  float packet_size = (float)sizeof(buf_item); // packet_size in bytes
+  int listenfd, opt, ii, jj, n_buf_items = DEFAULT_BUFFER_SIZE;
+  long nconnections = 0;
+  size_t budget = 0; // packet memory in bytes, 0 = n_buf_items legacy packets
   char *port;
-  socklen_t clientlen;
-  struct sockaddr_storage clientaddr; /* Enough space for any address */
+  struct epoll_event ev;
+  sigset_t usr1;
+  stage *st;
 
-  pthread_t tid[MAX_CLIENTS]; // Thread id
-  pthread_t tid_job; // Job processing thread
+  pthread_t tid_job; // Worker and I/O threads
 
   pthread_mutex_init(&nclients_lock,NULL);
+  setvbuf(stdout,NULL,_IOLBF,0); // a log file shows progress as it happens
 
   Signal(SIGINT, sigint_handler); /* ctrl-c */
+  Signal(SIGPIPE, SIG_IGN); /* clients that hang up are closed on EPIPE */
 
-  char client_hostname[MAXLINE], client_port[MAXLINE];
+  /* SIGUSR1 is only taken by stats_job, which prints the stage
+   * latencies; every thread created from here on blocks it */
+  sigemptyset(&usr1);
+  sigaddset(&usr1,SIGUSR1);
+  pthread_sigmask(SIG_BLOCK,&usr1,NULL);
+  lat_init(&stages[STAGE_WIRE],"wire");
+  lat_init(&stages[STAGE_SLOT],"slot wait");
+  lat_init(&stages[STAGE_CSUM],"checksum");
+  lat_init(&stages[STAGE_ENQUEUE],"enqueue");
+  lat_init(&stages[STAGE_QUEUE],"queue");
+  lat_init(&stages[STAGE_PROCESS],"process");
+  Pthread_create(&tid_job, NULL, stats_job, NULL);
 
   if (argc < 2) {
     print_usage();
@@ -59,233 +431,2474 @@ int main(int argc, char **argv)
   port = argv[1];
 
   /* Parse optional args */
-  while ((opt = getopt(argc, argv, "n:chv")) != -1) {
+  while ((opt = getopt(argc, argv, "n:w:i:c:s:M:H:N:K:e:p:k:g:Q:U:T:F:hmvPLxu")) != -1) {
     switch(opt) {
       case 'n':
         n_buf_items = atoi(optarg);
         break;
+      case 'w':
+        n_workers = atoi(optarg);
+        if (n_workers < 1)
+          n_workers = 1;
+        break;
+      case 'i':
+        n_io_threads = atoi(optarg);
+        if (n_io_threads < 1)
+          n_io_threads = 1;
+        break;
       case 'c':
-        use_checksum = 1;
+        checksum_algo = checksum_parse(optarg);
+        if (checksum_algo < 0) {
+          fprintf(stderr,"Unknown checksum: %s\n",optarg);
+          exit(0);
+        }
+        if (!checksum_available(checksum_algo)) {
+          fprintf(stderr,"Checksum algorithm unavailable: %s was not compiled in\n",optarg);
+          exit(0);
+        }
+        break;
+      case 'T':
+        hash_threads = atoi(optarg);
+        if (hash_threads < 1)
+          hash_threads = 1;
+        checksum_threads(hash_threads);
+        break;
+      case 's':
+        sockbuf = atoi(optarg)*1024;
+        break;
+      case 'M':
+        budget = (size_t)atol(optarg)*(1<<20);
+        break;
+      case 'K':
+        max_streams = atoi(optarg);
+        if (max_streams < 1)
+          max_streams = 1;
+        if (max_streams > MAX_STREAMS)
+          max_streams = MAX_STREAMS;
+        break;
+      case 'H':
+        if (arena_parse_pages(optarg) < 0) {
+          fprintf(stderr,"Unknown huge page type: %s\n",optarg);
+          exit(0);
+        }
+        arena_flags |= arena_parse_pages(optarg);
+        use_arena = 1;
+        break;
+      case 'N':
+        numa_node = atoi(optarg);
+        use_arena = 1;
+        break;
+      case 'P':
+        arena_flags |= ARENA_PREFAULT;
+        use_arena = 1;
+        break;
+      case 'L':
+        arena_flags |= ARENA_LOCK;
+        use_arena = 1;
+        break;
+      case 'x':
+        arena_flags |= ARENA_SHARED;
+        use_arena = 1;
+        break;
+      case 'u':
+        use_uring = 1;
+        break;
+      case 'e':
+        metrics_addr = optarg;
+        break;
+      case 'p':
+        process_cost = atoi(optarg);
+        break;
+      case 'k':
+        if (!(proc_kernel = kernel_parse(optarg,&proc_isa))) {
+          fprintf(stderr,"Unknown processing kernel: %s\n",optarg);
+          exit(0);
+        }
+        break;
+      case 'g':
+        stage_spec = optarg;
+        break;
+      case 'Q':
+        fq_quantum = atol(optarg)*1024;
+        if (fq_quantum < 0)
+          fq_quantum = 0;
+        break;
+      case 'U':
+        urgent_hosts = optarg;
+        break;
+      case 'F':
+        fault_mb = atof(optarg);
         break;
       case 'h':
         print_usage();
         exit(0);
+      case 'm':
+        ring_type = RING_MUTEX;
+        break;
       case 'v':
         verbose = 1;
         break;
       default:
         print_usage();
         continue;
-    } 
+    }
   }
 
+  /* Keep the server threads next to the ring storage */
+  if (numa_node >= 0 && !numa_bind_cpus(numa_node))
+    fprintf(stderr,"Cannot bind threads to the CPUs of NUMA node %d\n",numa_node);
+
   /* Initialize ring buffer */
-  buf = init_buf(n_buf_items);
+  buf = init_buf_type(n_buf_items,ring_type,budget);
+  if (use_arena)
+    init_buf_arena(buf,arena_flags,numa_node);
+
+  /* Pipeline stages, each with worker threads that grab the packets
+   * from its input ring as it gets filled */
+  pipeline_init(&proc_pipe,buf);
+  if (!stage_spec)
+    pipeline_add(&proc_pipe,"process",process_stage,NULL,n_workers);
+  else if (!parse_stages(stage_spec))
+    exit(0);
+  if (fq_quantum != 0) {
+    fq_init(&fair_q,buf,(fq_quantum < 0) ? (long)buf->max_payload : fq_quantum);
+    fq = &fair_q;
+    pipeline_fair(&proc_pipe,fq);
+  }
+  for (ii = 0; ii < proc_pipe.nstages; ii++) {
+    for (jj = 0; jj < proc_pipe.stages[ii].n_workers; jj++)
+      Pthread_create(&tid_job, NULL, worker_job, &proc_pipe.stages[ii]);
+  }
 
-  /* Processing thread that grabs items from ring
-   * buffer as it gets filled */
-  Pthread_create(&tid_job, NULL, buffer_job, NULL);
+  /* Listen for client requests, and for metrics scrapers */
+  listenfd = Open_listenfd(port,sockbuf);
+  if (metrics_addr) {
+    if ((metrics_fd = metrics_listen(metrics_addr)) < 0)
+      unix_error("Cannot listen for metrics");
+    Pthread_create(&tid_job, NULL, metrics_job, NULL);
+  }
 
-  /* Listen for client requests and create new threads when they arrive */
-  listenfd = Open_listenfd(port);
+  /* I/O threads, each with its own epoll set (or io_uring) and a wakeup
+   * eventfd */
+  io_threads = (io_thread *)Malloc(n_io_threads*sizeof(io_thread));
+  memset(io_threads,0,n_io_threads*sizeof(io_thread));
+#ifdef HAVE_IO_URING
+  for (ii = 0; use_uring && ii < n_io_threads; ii++) {
+    if (!init_uring(&io_threads[ii],listenfd)) {
+      fprintf(stderr,"io_uring is not available (%s), using epoll\n",strerror(errno));
+      while (--ii >= 0)
+        uring_exit(&io_threads[ii].ring);
+      use_uring = 0;
+    }
+  }
+#else
+  if (use_uring) {
+    fprintf(stderr,"Built without io_uring support, using epoll\n");
+    use_uring = 0;
+  }
+#endif
+  for (ii = 0; ii < n_io_threads; ii++) {
+    if ((io_threads[ii].evfd = eventfd(0,EFD_NONBLOCK)) < 0)
+      unix_error("eventfd error");
+    atomic_init(&io_threads[ii].nwaiting,0);
+    pthread_mutex_init(&io_threads[ii].mail_lock,NULL);
+    io_threads[ii].nparked = 0;
+#ifdef HAVE_IO_URING
+    if (use_uring) {
+      Pthread_create(&tid_job, NULL, uring_job, &io_threads[ii]);
+      continue;
+    }
+#endif
+    if ((io_threads[ii].epfd = epoll_create1(0)) < 0)
+      unix_error("epoll_create1 error");
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;
+    if (epoll_ctl(io_threads[ii].epfd,EPOLL_CTL_ADD,io_threads[ii].evfd,&ev) < 0)
+      unix_error("epoll_ctl error");
+    Pthread_create(&tid_job, NULL, io_job, &io_threads[ii]);
+  }
 
   printf("----------------------------------------------------------------\n");
   printf("Image processing server started, listening on port %s\n", port);
   printf("Server buffer capacity: %d packets\n",n_buf_items);
-  printf("Total buffer size: %.2f MB\n",n_buf_items*packet_size/(1<<20));
+  printf("Packet memory budget: %.2f MB\n",buf->pool.budget/MEGABYTE);
+  printf("Largest packet: %.2f MB\n",buf->max_payload/MEGABYTE);
+  if (use_arena)
+    arena_print(&buf->arena);
+  printf("Processing workers: %d",pipeline_workers(&proc_pipe));
+  if (process_cost > 0)
+    printf(", %d us per MB",process_cost);
+  if (proc_kernel)
+    printf(", %s kernel (%s)",proc_kernel->name,\
+           kernel_isa_name(kernel_isa(proc_kernel,proc_isa)));
+  printf("\n");
+  if (stage_spec) {
+    printf("Pipeline:");
+    for (ii = 0; ii < proc_pipe.nstages; ii++) {
+      st = &proc_pipe.stages[ii];
+      printf("%s %s (",ii ? " ->" : "",st->name);
+      if (st->fn == kernel_stage)
+        printf("%s, ",kernel_isa_name(kernel_isa(((stage_kernel *)st->arg)->k,\
+                                                 ((stage_kernel *)st->arg)->isa)));
+      printf("%d worker%s)",st->n_workers,(st->n_workers > 1) ? "s" : "");
+    }
+    printf("\n");
+  }
+  if (fq)
+    printf("Fair queuing: %.2f MB per round and share, urgent and bulk classes\n",\
+           fq->quantum/MEGABYTE);
+  printf("I/O threads: %d (%s)\n",n_io_threads,use_uring ? "io_uring" : "epoll");
+  if (max_streams > 1)
+    printf("Streams per client: up to %d\n",max_streams);
+  if (metrics_addr && strchr(metrics_addr,'/'))
+    printf("Metrics: unix socket %s\n",metrics_addr);
+  else if (metrics_addr)
+    printf("Metrics: http://127.0.0.1:%s/metrics\n",metrics_addr);
+  if (sockbuf > 0)
+    printf("Socket buffer size: %d KB\n",sockbuf/1024);
+  if (fault_mb > 0)
+    printf("Fault injection: a bit flipped every %.1f MB read on average\n",fault_mb);
   if (verbose)
     printf("[verbose mode]");
-  if (use_checksum)
-    printf("[Using MD5 checksum]");
-  if (verbose || use_checksum)
+  if (checksum_algo != CSUM_NONE)
+    printf("[Using %s checksum]",checksum_name(checksum_algo));
+  if (checksum_algo == CSUM_TREE)
+    printf("[%d hashing threads]",hash_threads ? hash_threads : (int)sysconf(_SC_NPROCESSORS_ONLN));
+  if (ring_type == RING_MUTEX)
+    printf("[mutex ring buffer]");
+  if (verbose || checksum_algo != CSUM_NONE || ring_type == RING_MUTEX)
     printf("\n");
   printf("----------------------------------------------------------------\n");
 
-  while(nclients < MAX_CLIENTS) {
-    clientlen = sizeof(struct sockaddr_storage);
-
-    // Allocate file descriptor to avoid race between threads and main routine
-    connfdp = Malloc(sizeof(int));
-    *connfdp = Accept(listenfd, (SA *)&clientaddr, &clientlen);
+  /* The io_uring threads accept connections themselves, otherwise hand
+   * new connections to the I/O threads in turn */
+  while (use_uring)
+    pause();
+  while (1)
+    open_client(Accept(listenfd,NULL,NULL),&io_threads[nconnections++ % n_io_threads]);
+  return 0;
+}
 
-    // Get client connection info for printing
-    Getnameinfo((SA *) &clientaddr, clientlen, client_hostname, MAXLINE,
-                client_port, MAXLINE, 0);
-    printf("Opened connection with (%s, %s)\n", client_hostname, client_port);
+/*******************************************************
+ * Announce a new connection and hand it to an I/O
+ * thread
+ * ****************************************************/
+void open_client(int connfd, io_thread *io)
+{
+  char client_hostname[MAXLINE], client_port[MAXLINE], peer[2*MAXLINE];
+  struct sockaddr_storage clientaddr; /* Enough space for any address */
+  socklen_t clientlen = sizeof(struct sockaddr_storage);
 
-    // Create listening thread that receives data
-    pthread_mutex_lock(&nclients_lock);
-    nclients++;
-    pthread_mutex_unlock(&nclients_lock);
-    Pthread_create(&tid[nclients], NULL, client_job, connfdp);
+  // Get client connection info for printing
+  if (getpeername(connfd,(SA *)&clientaddr,&clientlen) < 0) {
+    Close(connfd); // already gone
+    return;
   }
-  return 0;
+  Getnameinfo((SA *) &clientaddr, clientlen, client_hostname, MAXLINE,
+              client_port, MAXLINE, 0);
+  printf("Opened connection with (%s, %s)\n", client_hostname, client_port);
+  set_nodelay(connfd);
+
+  pthread_mutex_lock(&nclients_lock);
+  nclients++;
+  idle = 0;
+  pthread_mutex_unlock(&nclients_lock);
+  snprintf(peer,sizeof(peer),"%s:%s",client_hostname,client_port);
+  new_client(connfd,io,peer);
 }
 
 /*******************************************************
- * Thread routine that listens to messages from a client
- * and reads packets into the ring buffer. Blocks when
- * buffer is full and exits when it receives notification
- * from the client that all packets have been sent.
+ * Set up the state of a new connection from peer and
+ * add it to the epoll set of an I/O thread, or start
+ * reading it (io_uring, from the I/O thread itself)
  * ****************************************************/
-void *client_job(void *varargp)
+client_state *new_client(int connfd, io_thread *io, const char *peer)
 {
-  int connfd = *((int *)varargp);
-  int npackets, received = 0, cnt = 0, checksum = 1;
-  long total_size = 0;
-  time_t start_t, receive_t, clock_bias;
-  char msg[MAXLINE];
-  ssize_t nbytes;
-  buf_item *cache_buf = (buf_item *)Malloc(sizeof(buf_item));
-  float packet_bw, total_bw = 0.;
+  client_state *cs = (client_state *)Malloc(sizeof(client_state));
+  struct epoll_event ev;
   struct timeval tv;
+  int flags;
+
+  memset(cs,0,sizeof(client_state));
+  // io_uring waits for the socket itself, its reads must block
+  if (!use_uring && ((flags = fcntl(connfd,F_GETFL)) < 0 ||
+                     fcntl(connfd,F_SETFL,flags | O_NONBLOCK) < 0))
+    unix_error("fcntl error");
+
+  proto_init(&cs->conn,connfd,1);
+  proto_queue_writes(&cs->conn);
+  cs->io = io;
+  cs->state = CONN_HELLO;
+  cs->start_t = get_time_ms(&tv);
+  cs->slot = -1;
+  snprintf(cs->peer,sizeof(cs->peer),"%s",peer);
+  if (fault_mb > 0) {
+    cs->fault_seed = (unsigned int)get_time_ns() ^ connfd;
+    cs->fault_left = fault_gap(cs);
+  }
+  pthread_mutex_lock(&clients_lock);
+  cs->next_client = clients;
+  clients = cs;
+  pthread_mutex_unlock(&clients_lock);
+  if (use_uring) {
+    sync_client(cs);
+    return cs;
+  }
+
+  cs->events = EPOLLIN;
+  ev.events = cs->events;
+  ev.data.ptr = cs;
+  if (epoll_ctl(io->epfd,EPOLL_CTL_ADD,connfd,&ev) < 0)
+    unix_error("epoll_ctl error");
+  return cs;
+}
 
-  start_t = get_time_ms(&tv);
+/*******************************************************
+ * I/O thread routine. Reads client messages and packets
+ * as they arrive, writes queued replies when sockets
+ * become writable, and hands free slots to connections
+ * that wait for one.
+ * ****************************************************/
+void *io_job(void *varargp)
+{
+  io_thread *io = (io_thread *)varargp;
+  struct epoll_event events[MAX_EVENTS];
+  client_state *cs;
+  uint64_t count;
+  int ii, n;
 
   Pthread_detach(Pthread_self());
-  Free(varargp);
 
-  rio_t rio_client;
-  Rio_readinitb(&rio_client, connfd);
+  while (1) {
+    io->nsyscalls++;
+    if ((n = epoll_wait(io->epfd,events,MAX_EVENTS,io->nparked ? REPAIR_TICK_MS : -1)) < 0) {
+      if (errno == EINTR)
+        continue;
+      unix_error("epoll_wait error");
+    }
+
+    for (ii = 0; ii < n; ii++) {
+      cs = (client_state *)events[ii].data.ptr;
+      if (!cs) { // slots were released (served below) or mail came in
+        io->nsyscalls++;
+        if (read(io->evfd,&count,sizeof(count)) < 0 && errno != EAGAIN)
+          unix_error("eventfd read error");
+        serve_mail(io);
+        continue;
+      }
+
+      if ((events[ii].events & EPOLLIN) && !handle_input(cs)) {
+        close_client(cs);
+        continue;
+      }
+      // a hangup while we are not reading would be reported forever
+      if ((events[ii].events & (EPOLLERR | EPOLLHUP)) && !(cs->events & EPOLLIN)) {
+        close_client(cs);
+        continue;
+      }
+      if (!sync_client(cs))
+        close_client(cs);
+    }
 
-  /* 1. Read the client's wall time and compute the bias */
-  nbytes = Rio_readnb(&rio_client,msg,MAXLINE);
-  clock_bias = get_time_ms(&tv) - atol(msg); 
-  printf("Clock bias = %.3f s\n",clock_bias/1000.); 
+    if (atomic_load(&io->nwaiting) > 0)
+      serve_waiting(io);
+    if (io->nparked > 0)
+      expire_repairs(io);
+  }
+  return NULL;
+}
 
-  /* 2. Read how many packets to expect from the client */
-  nbytes = Rio_readnb(&rio_client,msg,MAXLINE);
-  npackets = atoi(msg);
-    
-  printf("Reading %d incoming packets...\n",npackets);
+/*******************************************************
+ * Read whatever the client has sent, up to READ_BUDGET
+ * reads. Control messages are collected in cs->in and
+ * packets are read straight into their reserved slot.
+ * Returns 0 if the connection should be closed.
+ * ****************************************************/
+int handle_input(client_state *cs)
+{
+  int budget;
+  unsigned char *p;
+  ssize_t len, nbytes;
 
-  /* 3. Read the packets from the client */
-  while ((nbytes = Rio_readnb(&rio_client,msg,MAXLINE)) > 0) { 
+  for (budget = READ_BUDGET; budget > 0; budget--) {
+    if ((len = next_input(cs,&p)) <= 0)
+      return len == 0; // leave input on the socket until we have a slot
 
-    // Check if the client is ready to send or is finished
-    if (!strcmp(msg,"CLIENT_FINISHED")) {
-      break;
-    } else if (strcmp(msg,"CLIENT_READY"))
+    cs->io->nsyscalls++;
+    nbytes = read(cs->conn.fd,p,len);
+    if (nbytes < 0 && errno == EINTR)
       continue;
+    if (nbytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+      return 1;
+    if (nbytes <= 0) {
+      if (cs->state == CONN_BODY)
+        fprintf(stderr,"  [%3d%%] -> Error: Packet has wrong size, closing connection with client\n",\
+                100*(cs->cnt+1)/cs->npackets);
+      return 0;
+    }
+    got_input(cs,nbytes);
+  }
+  // act on a message completed by the last read
+  return next_input(cs,&p) >= 0;
+}
 
-    sem_wait(&buf->spacesem); // wait until buffer opens up
+/*******************************************************
+ * Act on the complete messages received so far and
+ * find out where the next input goes: sets *p and
+ * returns the number of bytes to read there, 0 if
+ * nothing is read until a slot opens up, or -1 if the
+ * connection should be closed.
+ * ****************************************************/
+ssize_t next_input(client_state *cs, unsigned char **p)
+{
+  size_t need;
+  int slot, ret;
 
-    // Acknowledge client
-    strncpy(msg,"ACK",MAXLINE);
-    Rio_writen(connfd,msg,MAXLINE);
+  while (1) {
+    if (cs->state == CONN_SLOT)
+      return 0;
+    if (cs->state == CONN_STRIPES) {
+      if ((ret = stripes_ready(cs)) <= 0)
+        return ret;
+      packet_in(cs);
+      continue;
+    }
+    if (cs->state == CONN_STRIPE && cs->stripe_off == cs->stripe_end &&
+        (ret = next_stripe(cs)) <= 0)
+      return ret;
+    if (cs->state == CONN_BODY || cs->state == CONN_STRIPE || cs->state == CONN_REPAIR)
+      return input_span(cs,0,p,&slot);
 
-    // Read a packet from the client 
-    nbytes = Rio_readnb(&rio_client,cache_buf,sizeof(buf_item));
-    if (nbytes != sizeof(buf_item)) {
-      fprintf(stderr,"  [%3d%%] -> Error: Packet has wrong size, closing connection with client\n",100*(cnt+1)/npackets);
-      break;
+    need = proto_msg_size(&cs->conn,cs->state == CONN_HELLO,cs->in,cs->inlen);
+    if (need > IN_SIZE) {
+      fprintf(stderr,"Error: oversized message, closing connection with client\n");
+      return -1;
+    }
+    if (cs->inlen < need) {
+      *p = cs->in + cs->inlen;
+      return need - cs->inlen;
     }
+    if (!handle_msg(cs))
+      return -1;
+    cs->inlen = 0;
+  }
+}
+
+/*******************************************************
+ * Where input `ahead` bytes past the current position
+ * of a packet (or stripe) goes: sets *p and returns how
+ * many bytes, at most PACKET_CHUNK, go there in one
+ * piece, 0 at the end of the stripe or packet (or of
+ * what is known of a compressed one). *slot is the ring
+ * slot the bytes land in, -1 outside the image data.
+ * ****************************************************/
+size_t input_span(client_state *cs, size_t ahead, unsigned char **p, int *slot)
+{
+  unsigned char *data;
+  size_t off, len;
+
+  if (cs->state == CONN_REPAIR) {
+    off = cs->fix_off + ahead;
+    if (off >= cs->fix_end)
+      return 0;
+    len = (cs->fix_end-off > PACKET_CHUNK) ? PACKET_CHUNK : cs->fix_end-off;
+    *slot = cs->fixing->slot;
+    // dropped meanwhile, its chunks are thrown away
+    *p = (*slot < 0) ? cs->scrap : cs->fixing->item->data + off;
+    return len;
+  }
+  if (cs->stripe_off < cs->stripe_end) {
+    off = cs->stripe_off + ahead;
+    if (off >= cs->stripe_end)
+      return 0;
+    *p = cs->stripe_data + off;
+    *slot = cs->stripe_slot;
+    return (cs->stripe_end-off > PACKET_CHUNK) ? PACKET_CHUNK : cs->stripe_end-off;
+  }
+  off = cs->rx.off + ahead;
+  len = packet_rx_span(&cs->rx,off,p,PACKET_CHUNK);
+  data = cs->rx.item->data;
+  *slot = (len > 0 && *p >= data && *p < data + cs->rx.item->size) ? cs->slot : -1;
+  return len;
+}
+
+/*******************************************************
+ * Account for n bytes read where next_input pointed
+ * ****************************************************/
+void got_input(client_state *cs, size_t n)
+{
+  unsigned char *p;
+  int slot;
 
-    // Compute packet transmission time in ms
-    receive_t = get_time_ms(&tv) - cache_buf->timestamp - clock_bias;
+  if (cs->state != CONN_BODY && cs->state != CONN_STRIPE && cs->state != CONN_REPAIR) {
+    cs->inlen += n;
+    return;
+  }
+  // only image data is corrupted, a bad trailer is not repairable
+  if (fault_mb > 0 && input_span(cs,0,&p,&slot) > 0 && slot >= 0)
+    inject_faults(cs,p,n);
+  if (cs->state == CONN_REPAIR) {
+    cs->fix_off += n;
+    if (cs->fix_off == cs->fix_end && !next_fix_range(cs))
+      repair_done(cs);
+    return;
+  }
+  if (cs->stripe_off < cs->stripe_end) {
+    cs->stripe_off += n;
+    if (cs->stripe_off == cs->stripe_end && cs->state == CONN_STRIPE)
+      stripe_done(cs);
+    return;
+  }
+  packet_rx_advance(&cs->rx,n);
+  if (!packet_rx_done(&cs->rx))
+    return;
+  if (cs->session && !stripe_done(cs))
+    cs->state = CONN_STRIPES; // other streams are still reading
+  else
+    packet_in(cs);
+}
 
-    // Send the measured bandwidth back to the client
-    packet_bw = (receive_t == 0) ? 0. : nbytes/receive_t/1000.; // MB/s
-    sprintf(msg,"%f",packet_bw);
-    Rio_writen(connfd,msg,MAXLINE);
+/*******************************************************
+ * Act on a complete message in cs->in. Returns 0 if the
+ * connection should be closed.
+ * ****************************************************/
+int handle_msg(client_state *cs)
+{
+  int type, slot;
+  uint64_t session;
+  uint32_t stream;
 
-    total_bw += packet_bw;
-    total_size += nbytes;
-    cnt += 1;
+  if (cs->state == CONN_HELLO) {
+    if (proto_parse_join(&cs->conn,cs->in,&session,&stream))
+      return join_session(cs,session,stream);
+    return accept_client(cs);
+  }
 
-    if (use_checksum)
-      checksum = md5checksum((char *)cache_buf,sizeof(buf_item));
+  type = proto_parse_msg(&cs->conn,cs->in,&cs->hdr,NULL);
 
-    // Add received packet to ring buffer if checksum is correct
-    if (checksum){
-      enqueue(buf,cache_buf); // copy cache_buf into the main buffer
-      received += 1;
+  if (cs->state == CONN_PKT_HDR)
+    return type == MSG_PACKET && start_packet(cs);
+  if (cs->state == CONN_CHUNKS)
+    return got_chunks(cs);
 
-      /* Print packet information */
-      printf("  [%3d%%] -> received packet | %.2f MB | %6.1f MB/s\n",\
-             100*cnt/npackets,\
-             nbytes/MEGABYTE,\
-             packet_bw);
-      if (verbose)
-        print_buffer(buf); // Print current buffer state
+  // Check if the client is ready to send or is finished
+  if (type == MSG_FINISHED || type < 0) {
+    return 0;
+  } else if (type == MSG_REPAIR && cs->repair) {
+    return start_repair(cs);
+  } else if (type == MSG_READY && cs->window == 0) {
+    if ((slot = reserve_client_slot(cs)) < 0) {
+      cs->state = CONN_SLOT; // acknowledged once a slot opens up
+      wait_for_slot(cs,0);
     } else {
-      fprintf(stderr,"  [%3d%%] -> Error: invalid checksum in packet, skipping.\n",\
-             100*cnt/npackets);
-      sem_post(&buf->spacesem); // roll back the buf space semaphore
+      cs->slot = slot;
+      ack_ready(cs);
+    }
+  } else if (type == MSG_PACKET && cs->window > 0) {
+    // Packet sent against a credit, use the slot reserved for it
+    if ((cs->slot = take_credit_slot(cs)) < 0) {
+      fprintf(stderr,"Error: packet sent without credit, closing connection with client\n");
+      return 0;
+    }
+    if (!start_packet(cs))
+      return 0;
+    grant_credits(cs); // replace the credit that was used
+  }
+  return 1;
+}
+
+/*******************************************************
+ * Handle the client's hello: its wall time, the number
+ * of packets to expect and whether they must be
+ * processed in order. The protocol (binary frames or
+ * legacy text) was detected from the first bytes.
+ * ****************************************************/
+int accept_client(client_state *cs)
+{
+  int ordered;
+  char comp_str[64];
+  hello_msg hello;
+  frame_hdr hdr;
+  struct timeval tv;
+
+  if (!proto_parse_hello(&cs->conn,cs->in,&hello,&hdr)) {
+    fprintf(stderr,"Error: bad handshake, closing connection with client\n");
+    return 0;
+  }
+
+  /* Clients that do not describe their packets send legacy ones, which
+   * must fit in a slot */
+  if (!cs->conn.binary || hdr.version < 2)
+    hello.packet_size = LEGACY_PAYLOAD + PACKET_TRAILER;
+  if (hello.packet_size > buf->max_payload + PACKET_TRAILER) {
+    fprintf(stderr,"Error: packets of %.2f MB do not fit the buffer, closing connection with client\n",\
+            (hello.packet_size - PACKET_TRAILER)/MEGABYTE);
+    if (cs->conn.binary) { // tell the client what would have fit
+      hello.packet_size = buf->max_payload + PACKET_TRAILER;
+      proto_send_welcome(&cs->conn,&hello,hdr.flags);
+      proto_flush(&cs->conn);
     }
+    return 0;
   }
+  cs->npackets = hello.npackets;
+  ordered = (hdr.flags & FLAG_ORDERED) ? 1 : 0;
+  cs->clock_bias = get_time_ms(&tv) - hdr.timestamp;
+  printf("Clock bias = %.3f s%s\n",cs->clock_bias/1000.,\
+         cs->conn.binary ? "" : " [text protocol]");
 
-  total_bw = (cnt == 0) ? 0. : total_bw/cnt;
+  /* The class and share the client asked for, unless the packets are
+   * taken in ring order. Only the hosts of -U may jump the queue. */
+  if (hello.priority == FQ_URGENT && !urgent_host(cs->conn.fd))
+    hello.priority = FQ_BULK;
+  cs->order = (client_order *)Malloc(sizeof(client_order));
+  fq_flow_init(&cs->order->flow,fq ? hello.priority : FQ_BULK,fq ? hello.share : 1,ordered);
+  cs->order->ordered = ordered;
+  pthread_mutex_init(&cs->order->lock,NULL);
+  pthread_cond_init(&cs->order->cond,NULL);
+  memset(cs->order->next,0,sizeof(cs->order->next));
+  cs->order->closed = 0;
+  cs->order->total = 0;
+  if (fq)
+    fq_join(fq,&cs->order->flow);
 
-  printf("----------------------------------------------------------------\n");
-  if(received != cnt)
-    printf("WARNING: Some packets were not received!\n");
-  printf("%d/%d packets received, closing connection with client\n",\
-         received,npackets);
-  printf("Total data received: %.2f MB\n",total_size/MEGABYTE);
-  printf("Average bandwidth: %.1f MB/s\n",total_bw);
-  printf("Total time: %.1f s\n",(get_time_ms(&tv) - start_t)/1000.);
-  printf("----------------------------------------------------------------\n");
+  /* Local clients may write into the ring storage if it is shared */
+  cs->shm = cs->conn.binary && (hdr.flags & FLAG_SHM) && (buf->arena.flags & ARENA_SHARED);
 
-  if (received == 0)
-    printf("No packets in processing queue, waiting...\n");
+  /* Stripe packets across as many connections as the client asked for,
+   * up to -K; the shared-memory transport needs no sockets for them */
+  if (cs->conn.binary && !cs->shm && hello.streams > 1 && max_streams > 1)
+    open_session(cs,(hello.streams > max_streams) ? max_streams : hello.streams);
 
-  /* Signal that the thread is about to end */
-  pthread_mutex_lock(&nclients_lock);
-  nclients--;
-  pthread_mutex_unlock(&nclients_lock);
-  Free(cache_buf);
-  Close(connfd);
-  return NULL;
+  /* Decompress the image data straight into the slots if we know the
+   * client's codec, unless it is striped or in shared memory */
+  if (cs->conn.binary && !cs->shm && !cs->session)
+    cs->comp = compress_accept(hello.compress);
+  if (cs->comp != COMP_NONE) {
+    comp_ctx_init(&cs->zctx,cs->comp);
+    cs->zbuf = (unsigned char *)Malloc(COMP_CHUNK);
+  }
+
+  /* Never hand out more credits than there are slots in the buffer */
+  cs->window = (hello.window > buf->n_items) ? buf->n_items : hello.window;
+  if (cs->shm && cs->window > MAX_CREDIT_SLOTS)
+    cs->window = MAX_CREDIT_SLOTS;
+
+  /* Pick the checksum: legacy text clients only know MD5 and send it when
+   * the server was started with -c. Binary clients propose one, and get
+   * the server's choice if they proposed none or one we cannot verify. */
+  if (!cs->conn.binary)
+    cs->checksum = (checksum_algo != CSUM_NONE) ? CSUM_MD5 : CSUM_NONE;
+  else if (hello.checksum == CSUM_NONE || !checksum_available(hello.checksum))
+    cs->checksum = checksum_algo;
+  else
+    cs->checksum = hello.checksum;
+
+  /* Chunk repair needs the image data to come over the socket */
+  if (cs->conn.binary && !cs->shm && hello.repair > 0) {
+    cs->repair = hello.repair;
+    cs->crcs = (uint32_t *)Malloc(MAX_CHUNKS*sizeof(uint32_t));
+  }
+
+  printf("Reading %d incoming packets%s",cs->npackets,\
+         ordered ? " (in-order processing)" : "");
+  if (cs->window > 0)
+    printf(", window of %d credits",cs->window);
+  if (cs->checksum != CSUM_NONE)
+    printf(", %s checksum",checksum_name(cs->checksum));
+  if (cs->shm)
+    printf(", shared memory");
+  if (cs->session)
+    printf(", striped across %d streams",cs->session->streams);
+  if (cs->comp != COMP_NONE) {
+    compress_print(cs->comp,comp_str,sizeof(comp_str));
+    printf(", compressed (%s)",comp_str);
+  }
+  if (cs->repair)
+    printf(", chunk repair (%zu KB chunks)",cs->repair/1024);
+  if (fq)
+    printf(", %s class, share %d",fq_class_name(cs->order->flow.prio),cs->order->flow.share);
+  printf("...\n");
+
+  /* Tell a binary client which settings were accepted */
+  hello.packet_size = buf->max_payload + PACKET_TRAILER;
+  hello.window = cs->window;
+  hello.checksum = cs->checksum;
+  hello.shm_id = cs->shm ? buf->arena.shm_id : 0;
+  hello.streams = cs->session ? cs->session->streams : 1;
+  hello.session = cs->session ? cs->session->id & 0xffffffff : 0;
+  hello.session_hi = cs->session ? cs->session->id >> 32 : 0;
+  hello.compress = cs->comp;
+  hello.repair = cs->repair;
+  hello.priority = cs->order->flow.prio;
+  hello.share = cs->order->flow.share;
+  proto_send_welcome(&cs->conn,&hello,cs->shm ? hdr.flags : hdr.flags & ~FLAG_SHM);
+  cs->state = CONN_MSG;
+
+  /* Start granting credits */
+  if (cs->window > 0) {
+    cs->credit_slots = (int *)Malloc(cs->window*sizeof(int));
+    grant_credits(cs);
+  }
+  return 1;
 }
 
-/*******************************************************************
- * Thread routine that continuously reads items from the buffer 
- * and processes them. Handles different cases when buffer is empty.
- *******************************************************************/
-void *buffer_job() 
+/*******************************************************
+ * Tell a stop-and-wait client that its slot (cs->slot)
+ * is reserved and start waiting for the packet
+ * ****************************************************/
+void ack_ready(client_state *cs)
 {
-  Pthread_detach(Pthread_self());
-  int sval = buf->n_items, flag = 0;
+  proto_send_ack(&cs->conn,cs->slot);
+  if (cs->conn.binary) {
+    cs->state = CONN_PKT_HDR;
+  } else {
+    // text clients send the packet bare, its size was checked in the hello
+    memset(&cs->hdr,0,sizeof(frame_hdr));
+    start_packet(cs);
+  }
+}
 
-  while (1) {
+/*******************************************************
+ * Start reading a packet into cs->slot: give the slot
+ * image data for the shape announced in the header and
+ * verify the packet on the fly with the checksum agreed
+ * on in the handshake, which the packet must record.
+ * Returns 0 if the packet cannot be accepted.
+ * ****************************************************/
+int start_packet(client_state *cs)
+{
+  int algo = cs->checksum;
+  packet_shape shape;
 
-    /* What to do when buffer is empty */
-    while (sval == buf->n_items) {
-      if (!flag && nclients > 0) {
-        flag = 1; 
-      } else if (flag && nclients == 0) { 
-        printf("No packets in processing queue, waiting...\n"); 
-        flag = 0;
-      }
-      sem_getvalue(&buf->spacesem,&sval);
-    }
+  if (!proto_parse_packet(&cs->conn,cs->in,&cs->hdr,&shape)) {
+    fprintf(stderr,"  [%3d%%] -> Error: Packet has wrong size, closing connection with client\n",\
+            100*(cs->cnt+1)/cs->npackets);
+    return 0;
+  }
+  if ((cs->hdr.flags & FLAG_SHM) && !cs->shm) {
+    fprintf(stderr,"  [%3d%%] -> Error: shared memory packet without shared memory, closing connection with client\n",\
+            100*(cs->cnt+1)/cs->npackets);
+    return 0;
+  }
+  if ((cs->hdr.flags & FLAG_COMP) && cs->comp == COMP_NONE) {
+    fprintf(stderr,"  [%3d%%] -> Error: compressed packet without compression, closing connection with client\n",\
+            100*(cs->cnt+1)/cs->npackets);
+    return 0;
+  }
+  // a client (or corrupt flags) may not switch verification off or over
+  if (cs->conn.binary && FRAME_CSUM(cs->hdr.flags) != cs->checksum) {
+    fprintf(stderr,"  [%3d%%] -> Error: packet signed with %s instead of %s, closing connection with client\n",\
+            100*(cs->cnt+1)/cs->npackets,checksum_name(FRAME_CSUM(cs->hdr.flags)),\
+            checksum_name(cs->checksum));
+    return 0;
+  }
+  // never fails for packets that fit a slot, see init_buf_type
+  if (shape_size(&shape) > buf->max_payload || !alloc_payload(buf,cs->slot,&shape)) {
+    fprintf(stderr,"  [%3d%%] -> Error: Packet is too large, closing connection with client\n",\
+            100*(cs->cnt+1)/cs->npackets);
+    return 0;
+  }
+
+  cs->algo_ok = checksum_available(algo);
+  cs->rx_start = get_time_ns();
+  packet_rx_init(&cs->rx,buf->data[cs->slot],cs->algo_ok ? algo : CSUM_NONE);
+  if (cs->hdr.flags & FLAG_SHM)
+    packet_rx_inplace(&cs->rx); // only the trailer comes over the socket
+  if (cs->hdr.flags & FLAG_COMP)
+    packet_rx_compressed(&cs->rx,&cs->zctx,cs->zbuf,\
+                         cs->hdr.length - PACKET_DESC_SIZE - PACKET_TRAILER);
+  cs->state = CONN_BODY;
 
-    /* What to do when buffer has queued items */
-    while (sval < buf->n_items) {
-      dequeue(buf);
-      sem_getvalue(&buf->spacesem,&sval);
+  /* Striped: this connection reads stripe 0 and the trailer, the data is
+   * hashed once all stripes are in */
+  if (cs->session) {
+    if (!start_stripes(cs)) {
+      fprintf(stderr,"  [%3d%%] -> Error: a stream of the client was lost, closing connection with client\n",\
+              100*(cs->cnt+1)/cs->npackets);
+      packet_rx_abort(&cs->rx);
+      cs->state = CONN_MSG;
+      return 0;
     }
+    packet_rx_inplace(&cs->rx);
   }
-  return NULL;
+  return 1;
 }
 
-/************************************************
- * Close any open file descriptors
- * **********************************************/
-void close_openfds(int *clientfd, int *serverfd) 
+/*******************************************************
+ * A packet has been read completely: finish it, or
+ * read its chunk CRCs first if it may be repaired
+ * ****************************************************/
+void packet_in(client_state *cs)
 {
-  if (*clientfd >= 0)
-      Close(*clientfd);
-  if (*serverfd >= 0)
-      Close(*serverfd);
+  if (cs->repair)
+    cs->state = CONN_CHUNKS;
+  else
+    finish_packet(cs);
 }
 
-/********************************************
- * Free ring buffer memory upon exit (ctrl-c)
- * ******************************************/
-void sigint_handler(int sig)
+/*******************************************************
+ * Chunk repair: the CHUNKS frame that follows a packet.
+ * Returns 0 if the connection should be closed.
+ * ****************************************************/
+int got_chunks(client_state *cs)
+{
+  int nchunks = chunk_count(cs->rx.item->size,cs->repair);
+
+  if (nchunks > MAX_CHUNKS ||
+      !proto_parse_chunks(&cs->conn,cs->in,&cs->hdr,cs->crcs,nchunks)) {
+    fprintf(stderr,"  [%3d%%] -> Error: bad chunk checksums, closing connection with client\n",\
+            100*(cs->cnt+1)/cs->npackets);
+    return 0;
+  }
+  finish_packet(cs);
+  return 1;
+}
+
+/*******************************************************
+ * A packet has been read completely. Report its
+ * bandwidth to the client and publish it to the
+ * workers if the checksum is correct. With chunk
+ * repair, a packet that failed its checksum (or has
+ * none) is checked chunk by chunk, and waits in its
+ * slot for the corrupt chunks to be resent.
+ * ****************************************************/
+void finish_packet(client_state *cs)
+{
+  int checksum, nranges = 0;
+  buf_item *item = cs->rx.item;
+  size_t nbytes = item->size + PACKET_TRAILER;
+  uint32_t ranges[2*MAX_NACK_RANGES];
+  uint64_t receive_t;
+  float packet_bw;
+
+  checksum = packet_rx_finish(&cs->rx) && cs->algo_ok;
+
+  // Time spent receiving the packet into its slot, page faults included
+  receive_t = get_time_ns() - cs->rx_start;
+  if (cs->cnt == 0)
+    cs->first_ms = receive_t/1e6;
+  else
+    cs->steady_ms += receive_t/1e6;
+  lat_record(&stages[STAGE_WIRE],receive_t);
+  if (cs->rx.algo != CSUM_NONE)
+    lat_record(&stages[STAGE_CSUM],cs->rx.csum_ns);
+  packet_bw = (receive_t == 0) ? 0. : (float)nbytes*1000./receive_t; // MB/s
+
+  if (cs->repair && cs->algo_ok && (!checksum || cs->rx.algo == CSUM_NONE))
+    nranges = chunk_mismatches(item->data,item->size,cs->repair,cs->crcs,ranges,MAX_NACK_RANGES);
+  if (nranges > 0)
+    park_packet(cs,ranges,nranges,packet_bw);
+  else
+    publish_packet(cs,cs->slot,item,checksum,packet_bw,cs->rx.wire + PACKET_TRAILER,0);
+  cs->slot = -1;
+  cs->state = CONN_MSG;
+}
+
+/*******************************************************
+ * Send the bandwidth of a packet back to the client,
+ * count it and hand its slot to the workers if it is
+ * ok, else give the slot back
+ * ****************************************************/
+void publish_packet(client_state *cs, int slot, buf_item *item, int ok, float packet_bw,\
+                    long wire, long resent)
+{
+  size_t nbytes = item->size + PACKET_TRAILER;
+
+  proto_send_bandwidth(&cs->conn,item->id,packet_bw);
+
+  cs->total_bw += packet_bw;
+  cs->total_size += nbytes;
+  cs->total_wire += wire;
+  cs->cnt += 1;
+  atomic_fetch_add(&npackets_in,1);
+  count_packet(&cs->stats,nbytes,wire,ok);
+  count_packet(&totals,nbytes,wire,ok);
+
+  // Publish received packet to the consumer if checksum is correct
+  if (ok){
+    item->ready_ns = get_time_ns();
+    commit_slot(buf,slot);
+    lat_record(&stages[STAGE_ENQUEUE],get_time_ns() - item->ready_ns);
+    cs->received += 1;
+
+    /* Print packet information */
+    printf("  [%3d%%] -> received packet | %.2f MB | %6.1f MB/s",\
+           100*cs->cnt/cs->npackets,\
+           nbytes/MEGABYTE,\
+           packet_bw);
+    if (resent > 0)
+      printf(" | repaired, %ld chunks resent",resent);
+    printf("\n");
+    if (verbose)
+      print_buffer(buf); // Print current buffer state
+  } else {
+    fprintf(stderr,"  [%3d%%] -> Error: invalid checksum in packet, skipping.\n",\
+           100*cs->cnt/cs->npackets);
+    discard_slot(buf,slot); // hand the slot back without processing it
+  }
+}
+
+/*******************************************************
+ * Keep a packet with corrupt chunks in its slot and ask
+ * the client for them again
+ * ****************************************************/
+void park_packet(client_state *cs, uint32_t *ranges, int nranges, float packet_bw)
+{
+  repair_pkt *rp = (repair_pkt *)Malloc(sizeof(repair_pkt));
+  int nchunks = chunk_count(cs->rx.item->size,cs->repair);
+
+  rp->slot = cs->slot;
+  rp->item = cs->rx.item;
+  rp->id = rp->item->id;
+  rp->size = rp->item->size;
+  rp->deadline_ns = get_time_ns() + (uint64_t)REPAIR_TIMEOUT_MS*1000000;
+  rp->algo = cs->rx.algo;
+  rp->crcs = (uint32_t *)Malloc(nchunks*sizeof(uint32_t));
+  memcpy(rp->crcs,cs->crcs,nchunks*sizeof(uint32_t));
+  rp->tries = 0;
+  rp->resent = 0;
+  rp->bw = packet_bw;
+  rp->wire = cs->rx.wire + PACKET_TRAILER;
+  rp->next = cs->repairs;
+  cs->repairs = rp;
+  cs->io->nparked++;
+  nack_packet(cs,rp,ranges,nranges);
+}
+
+void nack_packet(client_state *cs, repair_pkt *rp, uint32_t *ranges, int nranges)
+{
+  long nchunks = 0;
+  int ii;
+
+  for (ii = 0; ii < nranges; ii++)
+    nchunks += ranges[2*ii+1];
+  memcpy(rp->ranges,ranges,2*nranges*sizeof(uint32_t));
+  rp->nranges = nranges;
+  rp->tries++;
+  rp->resent += nchunks;
+  cs->chunks_resent += nchunks;
+  atomic_fetch_add_explicit(&cs->stats.chunks_resent,nchunks,memory_order_relaxed);
+  atomic_fetch_add_explicit(&totals.chunks_resent,nchunks,memory_order_relaxed);
+  proto_send_nack(&cs->conn,rp->id,ranges,nranges);
+  if (verbose)
+    printf("  [%3d%%] -> %ld corrupt chunks in packet %d, asking for them again\n",\
+           100*cs->cnt/cs->npackets,nchunks,rp->id);
+}
+
+/*******************************************************
+ * A REPAIR frame: read the chunks that follow into the
+ * packet waiting for them. Returns 0 if the connection
+ * should be closed.
+ * ****************************************************/
+int start_repair(client_state *cs)
+{
+  repair_pkt *rp;
+  size_t length = 0, off, end;
+  int ii;
+
+  for (rp = cs->repairs; rp && (uint32_t)rp->id != cs->hdr.seq; rp = rp->next)
+    ;
+  for (ii = 0; rp && ii < rp->nranges; ii++) {
+    off = rp->ranges[2*ii]*cs->repair;
+    end = (rp->ranges[2*ii] + rp->ranges[2*ii+1])*cs->repair;
+    length += ((end > rp->size) ? rp->size : end) - off;
+  }
+  if (!rp || length != cs->hdr.length) {
+    fprintf(stderr,"Error: unexpected chunks, closing connection with client\n");
+    return 0;
+  }
+  cs->fixing = rp;
+  cs->fix_range = -1;
+  cs->state = CONN_REPAIR;
+  if (!next_fix_range(cs))
+    repair_done(cs); // nothing to read
+  return 1;
+}
+
+/*******************************************************
+ * Move on to the next range of the packet being
+ * repaired. Returns 0 once all have been read.
+ * ****************************************************/
+int next_fix_range(client_state *cs)
+{
+  repair_pkt *rp = cs->fixing;
+  size_t end;
+
+  if (++cs->fix_range == rp->nranges)
+    return 0;
+  cs->fix_off = rp->ranges[2*cs->fix_range]*cs->repair;
+  end = (rp->ranges[2*cs->fix_range] + rp->ranges[2*cs->fix_range+1])*cs->repair;
+  cs->fix_end = (end > rp->size) ? rp->size : end;
+  return 1;
+}
+
+/*******************************************************
+ * The resent chunks of a packet are in: check its
+ * chunks (and checksum) again, and publish it, ask for
+ * what is still corrupt, or drop it after MAX_REPAIRS
+ * tries or REPAIR_TIMEOUT_MS. Forget it if it was
+ * dropped while the chunks were on their way.
+ * ****************************************************/
+void repair_done(client_state *cs)
 {
+  repair_pkt *rp = cs->fixing, **pp;
+  uint32_t ranges[2*MAX_NACK_RANGES];
+  int nranges = 0, ok;
+
+  cs->fixing = NULL;
+  cs->state = CONN_MSG;
+  if (rp->slot >= 0)
+    nranges = chunk_mismatches(rp->item->data,rp->size,cs->repair,rp->crcs,\
+                               ranges,MAX_NACK_RANGES);
+  if (nranges > 0 && rp->tries < MAX_REPAIRS && get_time_ns() < rp->deadline_ns) {
+    nack_packet(cs,rp,ranges,nranges);
+    return;
+  }
+
+  for (pp = &cs->repairs; *pp != rp; pp = &(*pp)->next)
+    ;
+  *pp = rp->next;
+  if (rp->slot < 0) {
+    Free(rp);
+    return;
+  }
+  cs->io->nparked--;
+  ok = (nranges == 0) && packet_checksum(rp->item,rp->algo);
+  if (ok) {
+    cs->repaired++;
+    atomic_fetch_add_explicit(&cs->stats.repaired,1,memory_order_relaxed);
+    atomic_fetch_add_explicit(&totals.repaired,1,memory_order_relaxed);
+  }
+  publish_packet(cs,rp->slot,rp->item,ok,rp->bw,rp->wire,rp->resent);
+  Free(rp->crcs);
+  Free(rp);
+}
+
+/*******************************************************
+ * Drop the packets of the thread's connections that
+ * were not repaired in REPAIR_TIMEOUT_MS, so that a
+ * client that does not resend its chunks does not keep
+ * the slots: the ring reserves them in order, and the
+ * slot of a parked packet holds up the reservation one
+ * lap later. Connections that dropped some are mailed
+ * to send the replies.
+ * ****************************************************/
+void expire_repairs(io_thread *io)
+{
+  uint64_t now = get_time_ns();
+  client_state *cs;
+  repair_pkt *rp;
+  int dropped;
+
+  pthread_mutex_lock(&clients_lock);
+  for (cs = clients; cs; cs = cs->next_client) {
+    if (cs->io != io)
+      continue;
+    dropped = 0;
+    for (rp = cs->repairs; rp; rp = rp->next) {
+      if (rp->slot < 0 || rp == cs->fixing || now < rp->deadline_ns)
+        continue;
+      fprintf(stderr,"  [%3d%%] -> Error: packet %d not repaired in %d ms, skipping.\n",\
+              100*(cs->cnt+1)/cs->npackets,rp->id,REPAIR_TIMEOUT_MS);
+      publish_packet(cs,rp->slot,rp->item,0,rp->bw,rp->wire,rp->resent);
+      rp->slot = -1;
+      rp->item = NULL;
+      Free(rp->crcs);
+      rp->crcs = NULL;
+      io->nparked--;
+      dropped = 1;
+    }
+    if (dropped && !cs->scrap)
+      cs->scrap = (unsigned char *)Malloc(PACKET_CHUNK);
+    if (dropped)
+      mail_client(cs);
+  }
+  pthread_mutex_unlock(&clients_lock);
+}
+
+/*******************************************************
+ * Fault injection (-F): flip a random bit of the n
+ * bytes just read at p whenever the countdown to the
+ * next flip runs out
+ * ****************************************************/
+void inject_faults(client_state *cs, unsigned char *p, size_t n)
+{
+  size_t off = 0;
+
+  while (cs->fault_left < n - off) {
+    off += cs->fault_left;
+    p[off] ^= 1 << (rand_r(&cs->fault_seed) % 8);
+    cs->faults++;
+    cs->fault_left = fault_gap(cs);
+  }
+  cs->fault_left -= n - off;
+}
+
+/* Bytes until the next bit flip, fault_mb MB on average */
+size_t fault_gap(client_state *cs)
+{
+  return (size_t)((double)rand_r(&cs->fault_seed)/RAND_MAX*2*fault_mb*MEGABYTE);
+}
+
+/*******************************************************
+ * Grant a windowed client credits until it holds
+ * `window` of them or has been granted one per packet.
+ * Each credit is backed by a slot reserved in advance.
+ * If the buffer ran out of slots or the client holds
+ * its share of them, the connection waits for one to
+ * open up, else it stops waiting. Returns RESERVE_FULL
+ * or RESERVE_SHARE if it had to stop short, else 0.
+ * ****************************************************/
+int grant_credits(client_state *cs)
+{
+  int slot = 0, ncredits = 0;
+  uint32_t slots[MAX_CREDIT_SLOTS];
+
+  while (cs->credit_count < cs->window && cs->granted < cs->npackets) {
+    if ((slot = reserve_client_slot(cs)) < 0)
+      break;
+    cs->credit_slots[(cs->credit_head+cs->credit_count) % cs->window] = slot;
+    cs->credit_count++;
+    cs->granted++;
+    if (cs->shm) // window <= MAX_CREDIT_SLOTS
+      slots[ncredits] = slot;
+    ncredits++;
+  }
+  if (ncredits > 0)
+    proto_send_credit(&cs->conn,ncredits,cs->shm ? slots : NULL);
+  if (slot < 0) {
+    wait_for_slot(cs,0);
+    return slot;
+  }
+  stop_waiting(cs);
+  return 0;
+}
+
+/*******************************************************
+ * Reserve a ring buffer slot for a client and tag it
+ * with the client's flow. Returns RESERVE_FULL if the
+ * buffer is full, RESERVE_SHARE if the client already
+ * holds its share of the slots.
+ * ****************************************************/
+int reserve_client_slot(client_state *cs)
+{
+  int slot;
+
+  if (!cs->slot_wait)
+    cs->slot_wait = get_time_ns();
+  if (fq && cs->order && !fq_may_reserve(fq,&cs->order->flow))
+    return RESERVE_SHARE;
+  if (!try_reserve_slot(buf,&slot))
+    return RESERVE_FULL;
+  lat_record(&stages[STAGE_SLOT],get_time_ns() - cs->slot_wait);
+  cs->slot_wait = 0;
+  if (fq && cs->order)
+    fq_hold(fq,&cs->order->flow);
+  buf->tag[slot].owner = cs->order;
+  buf->tag[slot].seq = cs->nreserved++;
+  return slot;
+}
+
+/*******************************************************
+ * Pop the slot reserved for the oldest granted credit.
+ * Returns -1 if the client has no credit left.
+ * ****************************************************/
+int take_credit_slot(client_state *cs)
+{
+  int slot;
+
+  if (cs->credit_count == 0)
+    return -1;
+  slot = cs->credit_slots[cs->credit_head];
+  cs->credit_head = (cs->credit_head+1) % cs->window;
+  cs->credit_count--;
+  return slot;
+}
+
+/*******************************************************
+ * Queue a connection until a slot opens up. It stays
+ * counted in nwaiting until it gets one, so a worker
+ * releasing a slot after any failed reserve wakes the
+ * I/O thread. A slot released between the caller's
+ * reserve and this call is caught by the retry after
+ * the round of events.
+ * ****************************************************/
+void wait_for_slot(client_state *cs, int front)
+{
+  io_thread *io = cs->io;
+
+  if (cs->waiting)
+    return;
+  cs->waiting = 1;
+  cs->next_wait = NULL;
+  if (!io->wait_head) {
+    io->wait_head = io->wait_tail = cs;
+  } else if (front) {
+    cs->next_wait = io->wait_head;
+    io->wait_head = cs;
+  } else {
+    io->wait_tail->next_wait = cs;
+    io->wait_tail = cs;
+  }
+  atomic_fetch_add(&io->nwaiting,1);
+}
+
+void stop_waiting(client_state *cs)
+{
+  if (!cs->waiting)
+    return;
+  unlink_waiting(cs);
+  cs->waiting = 0;
+  atomic_fetch_sub(&cs->io->nwaiting,1);
+}
+
+/* Take a waiting connection out of the line, it stays counted */
+void unlink_waiting(client_state *cs)
+{
+  io_thread *io = cs->io;
+  client_state **pp, *prev = NULL;
+
+  for (pp = &io->wait_head; *pp != cs; pp = &(*pp)->next_wait)
+    prev = *pp;
+  *pp = cs->next_wait;
+  if (io->wait_tail == cs)
+    io->wait_tail = prev;
+}
+
+/* Send a waiting connection to the back of the line */
+void requeue_waiting(client_state *cs)
+{
+  io_thread *io = cs->io;
+
+  if (!cs->waiting || io->wait_tail == cs)
+    return;
+  unlink_waiting(cs);
+  cs->next_wait = NULL;
+  io->wait_tail->next_wait = cs;
+  io->wait_tail = cs;
+}
+
+/*******************************************************
+ * Hand free slots to waiting connections in turn until
+ * the buffer is full again. Connections that hold their
+ * share of the slots go to the back of the line, each
+ * is tried once. A connection leaves the line only once
+ * it got its slots, so that a slot released while we
+ * retry still wakes us.
+ * ****************************************************/
+void serve_waiting(io_thread *io)
+{
+  client_state *cs;
+  int slot = 0, n = atomic_load(&io->nwaiting);
+
+  while (slot != RESERVE_FULL && n-- > 0 && (cs = io->wait_head)) {
+    if (cs->state == CONN_SLOT) {
+      if ((slot = reserve_client_slot(cs)) >= 0) {
+        stop_waiting(cs);
+        cs->slot = slot;
+        ack_ready(cs);
+      }
+    } else if (cs->window > 0) {
+      slot = grant_credits(cs);
+    } else {
+      slot = 0;
+      stop_waiting(cs);
+    }
+    if (slot == RESERVE_SHARE) // a full buffer keeps its place in line instead
+      requeue_waiting(cs);
+    if (!sync_client(cs))
+      close_client(cs);
+  }
+}
+
+/*******************************************************
+ * Send queued replies and update the epoll events of a
+ * connection to match its state. Returns 0 if the
+ * connection failed.
+ * ****************************************************/
+int sync_client(client_state *cs)
+{
+  struct epoll_event ev;
+  ssize_t queued;
+  uint32_t events = 0;
+
+#ifdef HAVE_IO_URING
+  if (use_uring) { // failures are handled there
+    uring_sync(cs);
+    return 1;
+  }
+#endif
+  if (cs->conn.outlen > cs->conn.outoff)
+    cs->io->nsyscalls++;
+  if ((queued = proto_flush(&cs->conn)) < 0)
+    return 0;
+  if (reading(cs))
+    events |= EPOLLIN;
+  if (queued > 0)
+    events |= EPOLLOUT;
+
+  if (events != cs->events) {
+    cs->events = events;
+    ev.events = events;
+    ev.data.ptr = cs;
+    cs->io->nsyscalls++;
+    if (epoll_ctl(cs->io->epfd,EPOLL_CTL_MOD,cs->conn.fd,&ev) < 0)
+      unix_error("epoll_ctl error");
+  }
+  return 1;
+}
+
+/*******************************************************
+ * Close a connection, give back the slots it holds and
+ * print its statistics
+ * ****************************************************/
+void close_client(client_state *cs)
+{
+  struct timeval tv;
+  time_t elapsed_t;
+  client_state **pp;
+  repair_pkt *rp;
+  int slot, done;
+  float total_bw;
+  char comp_str[64];
+
+  stop_waiting(cs);
+  if (!use_uring && epoll_ctl(cs->io->epfd,EPOLL_CTL_DEL,cs->conn.fd,NULL) < 0)
+    unix_error("epoll_ctl error");
+  if (cs->session)
+    leave_session(cs); // may take over the slot of a partial packet
+  pthread_mutex_lock(&cs->io->mail_lock);
+  if (cs->mailed) {
+    for (pp = &cs->io->mail_head; *pp != cs; pp = &(*pp)->next_mail)
+      ;
+    *pp = cs->next_mail;
+  }
+  pthread_mutex_unlock(&cs->io->mail_lock);
+
+  /* Give back the slot of a partial packet, those of packets waiting for
+   * chunks and those of unused credits */
+  if (cs->state == CONN_BODY || cs->state == CONN_STRIPES || cs->state == CONN_CHUNKS)
+    packet_rx_abort(&cs->rx);
+  if (cs->slot >= 0)
+    discard_slot(buf,cs->slot);
+  while ((rp = cs->repairs)) {
+    cs->repairs = rp->next;
+    if (rp->slot >= 0) {
+      discard_slot(buf,rp->slot);
+      cs->io->nparked--;
+    }
+    Free(rp->crcs);
+    Free(rp);
+  }
+  Free(cs->crcs);
+  Free(cs->scrap);
+  while ((slot = take_credit_slot(cs)) >= 0)
+    discard_slot(buf,slot);
+  Free(cs->credit_slots);
+
+  total_bw = (cs->cnt == 0) ? 0. : cs->total_bw/cs->cnt;
+
+  if (cs->stream > 0) {
+    printf("Closed stream %d of a striped client after %ld stripes\n",\
+           cs->stream,cs->nstripes);
+  } else {
+    printf("----------------------------------------------------------------\n");
+    if(cs->received != cs->cnt)
+      printf("WARNING: Some packets were not received!\n");
+    printf("%d/%d packets received, closing connection with client\n",\
+           cs->received,cs->npackets);
+    printf("Total data received: %.2f MB\n",cs->total_size/MEGABYTE);
+    printf("Average bandwidth: %.1f MB/s (mean of the packet rates)\n",total_bw);
+    elapsed_t = get_time_ms(&tv) - cs->start_t;
+    printf("Throughput: %.1f MB/s (total data over connection time)\n",\
+           (elapsed_t == 0) ? 0. : cs->total_size/MEGABYTE/(elapsed_t/1000.));
+    if (cs->cnt > 1)
+      printf("Receive time: first packet %.1f ms, steady state %.1f ms\n",\
+             cs->first_ms,cs->steady_ms/(cs->cnt-1));
+    if (cs->comp != COMP_NONE && cs->total_wire > 0) {
+      compress_print(cs->comp,comp_str,sizeof(comp_str));
+      printf("Compression: %s, ratio %.2f (%.2f MB on the wire), %.1f MB/s effective\n",\
+             comp_str,(double)cs->total_size/cs->total_wire,cs->total_wire/MEGABYTE,\
+             cs->total_size/MEGABYTE/((cs->first_ms + cs->steady_ms)/1000.));
+    }
+    if (cs->chunks_resent > 0)
+      printf("Chunk repair: %ld packets repaired, %ld chunks resent\n",\
+             cs->repaired,cs->chunks_resent);
+    if (cs->faults > 0)
+      printf("Fault injection: %ld bits flipped\n",cs->faults);
+    printf("Total time: %.1f s\n",elapsed_t/1000.);
+    printf("Packet stages, all clients:\n");
+    lat_print(stages,NSTAGES);
+    if (proc_pipe.nstages > 1)
+      pipeline_print(&proc_pipe);
+    if (fq && atomic_load(&fq->wait[FQ_URGENT].count) > 0) {
+      printf("Queue time by class, all clients:\n");
+      lat_print(fq->wait,FQ_NCLASSES);
+    }
+    printf("----------------------------------------------------------------\n");
+  }
+
+  /* The workers free the ordering state once they are done with our
+   * slots, unless they already are. The other clients' shares of the
+   * slots grow if we were urgent. */
+  if (cs->order) {
+    if (fq) {
+      fq_leave(fq,&cs->order->flow);
+      wake_io_threads();
+    }
+    pthread_mutex_lock(&cs->order->lock);
+    cs->order->closed = 1;
+    cs->order->total = cs->nreserved;
+    done = order_done(cs->order);
+    pthread_mutex_unlock(&cs->order->lock);
+    if (done) {
+      pthread_mutex_destroy(&cs->order->lock);
+      pthread_cond_destroy(&cs->order->cond);
+      Free(cs->order);
+    }
+  }
+
+  pthread_mutex_lock(&clients_lock);
+  for (pp = &clients; *pp != cs; pp = &(*pp)->next_client)
+    ;
+  *pp = cs->next_client;
+  pthread_mutex_unlock(&clients_lock);
+
+  if (cs->comp != COMP_NONE) {
+    comp_ctx_free(&cs->zctx);
+    Free(cs->zbuf);
+  }
+  Close(cs->conn.fd);
+  proto_free(&cs->conn);
+  Free(cs);
+
+  /* Signal that the connection has ended */
+  pthread_mutex_lock(&nclients_lock);
+  nclients--;
+  pthread_mutex_unlock(&nclients_lock);
+  print_idle();
+}
+
+
+/*******************************************************
+ * Whether a connection wants input now
+ * ****************************************************/
+int reading(client_state *cs)
+{
+  if (cs->state == CONN_SLOT || cs->state == CONN_STRIPES)
+    return 0;
+  return cs->state != CONN_STRIPE || cs->stripe_off < cs->stripe_end;
+}
+
+/*******************************************************
+ * Start a striped session for a client that asked for
+ * `streams` connections, this one being stream 0. The
+ * others join with the session id from the WELCOME, a
+ * random 64-bit token so that it cannot be guessed.
+ * ****************************************************/
+void open_session(client_state *cs, int streams)
+{
+  stripe_session *s = (stripe_session *)Malloc(sizeof(stripe_session)), *t;
+  socklen_t len = sizeof(s->addr);
+
+  memset(s,0,sizeof(stripe_session));
+  pthread_mutex_init(&s->lock,NULL);
+  s->streams = streams;
+  s->conns[0] = cs;
+  s->joined = 1;
+  s->refs = 1;
+  s->orphan = -1;
+  if (getpeername(cs->conn.fd,(SA *)&s->addr,&len) < 0)
+    s->addr.ss_family = AF_UNSPEC; // no stream can join
+
+  pthread_mutex_lock(&sessions_lock);
+  do {
+    Getrandom(&s->id,sizeof(s->id));
+    for (t = sessions; t && t->id != s->id; t = t->next)
+      ;
+  } while (t || s->id == 0);
+  s->next = sessions;
+  sessions = s;
+  pthread_mutex_unlock(&sessions_lock);
+  cs->session = s;
+}
+
+/*******************************************************
+ * Whether the peer of a connection is on the host
+ * whose address is addr (any port)
+ * ****************************************************/
+int same_host(int fd, struct sockaddr_storage *addr)
+{
+  struct sockaddr_storage peer;
+  socklen_t len = sizeof(peer);
+
+  if (getpeername(fd,(SA *)&peer,&len) < 0 || peer.ss_family != addr->ss_family)
+    return 0;
+  if (peer.ss_family == AF_INET)
+    return ((struct sockaddr_in *)&peer)->sin_addr.s_addr ==
+           ((struct sockaddr_in *)addr)->sin_addr.s_addr;
+  if (peer.ss_family == AF_INET6)
+    return memcmp(&((struct sockaddr_in6 *)&peer)->sin6_addr,\
+                  &((struct sockaddr_in6 *)addr)->sin6_addr,sizeof(struct in6_addr)) == 0;
+  return 0;
+}
+
+/*******************************************************
+ * Whether the peer of a connection may ask for the
+ * urgent class: its numeric address is in the -U list
+ * (IPv4-mapped IPv6 peers match their IPv4 address),
+ * or the list is "any"
+ * ****************************************************/
+int urgent_host(int fd)
+{
+  struct sockaddr_storage peer;
+  socklen_t len = sizeof(peer);
+  char host[NI_MAXHOST], *addr = host;
+  const char *p = urgent_hosts;
+  size_t n;
+
+  if (!urgent_hosts)
+    return 0;
+  if (!strcmp(urgent_hosts,"any"))
+    return 1;
+  if (getpeername(fd,(SA *)&peer,&len) < 0 ||
+      getnameinfo((SA *)&peer,len,host,sizeof(host),NULL,0,NI_NUMERICHOST) != 0)
+    return 0;
+  if (!strncmp(addr,"::ffff:",7) && strchr(addr,'.'))
+    addr += 7;
+
+  n = strlen(addr);
+  while (*p) {
+    if (!strncmp(p,addr,n) && (p[n] == ',' || p[n] == '\0'))
+      return 1;
+    p += strcspn(p,",");
+    p += (*p == ',');
+  }
+  return 0;
+}
+
+/*******************************************************
+ * Attach a new connection to a session as its stream
+ * number `stream`. Returns 0 if there is no such
+ * session, the stream is taken or the connection does
+ * not come from the host of stream 0.
+ * ****************************************************/
+int join_session(client_state *cs, uint64_t id, uint32_t stream)
+{
+  stripe_session *s;
+  int ok;
+
+  pthread_mutex_lock(&sessions_lock);
+  for (s = sessions; s && s->id != id; s = s->next)
+    ;
+  if (s)
+    pthread_mutex_lock(&s->lock); // before it can be freed
+  pthread_mutex_unlock(&sessions_lock);
+  if (!s) {
+    fprintf(stderr,"Error: no such session to join, closing connection with client\n");
+    return 0;
+  }
+
+  if (!same_host(cs->conn.fd,&s->addr)) {
+    pthread_mutex_unlock(&s->lock);
+    fprintf(stderr,"Error: %s tried to join a session of another host, closing connection with client\n",\
+            cs->peer);
+    return 0;
+  }
+  ok = stream > 0 && stream < (uint32_t)s->streams && !(s->joined & (1u << stream)) &&
+       s->conns[0];
+  if (ok) {
+    s->joined |= 1u << stream;
+    s->conns[stream] = cs;
+    s->refs++;
+    cs->session = s;
+    cs->stream = stream;
+    cs->state = CONN_STRIPE;
+  }
+  pthread_mutex_unlock(&s->lock);
+
+  if (!ok)
+    fprintf(stderr,"Error: cannot join stream %u of the session, closing connection with client\n",\
+            stream);
+  else
+    printf("Joined as stream %u of a session\n",stream);
+  return ok;
+}
+
+/*******************************************************
+ * Stream 0 has announced a packet: let the other
+ * streams read their stripes into its slot, and read
+ * stripe 0 here. Returns 0 if a stream was lost.
+ * ****************************************************/
+int start_stripes(client_state *cs)
+{
+  stripe_session *s = cs->session;
+  buf_item *item = buf->data[cs->slot];
+  size_t off, len;
+  int ii;
+
+  pthread_mutex_lock(&s->lock);
+  if (s->lost) {
+    pthread_mutex_unlock(&s->lock);
+    return 0;
+  }
+  s->data = item->data;
+  s->size = item->size;
+  s->slot = cs->slot;
+  s->left = s->streams;
+  s->started++;
+  for (ii = 1; ii < s->streams; ii++)
+    if (s->conns[ii])
+      mail_client(s->conns[ii]);
+  pthread_mutex_unlock(&s->lock);
+
+  proto_stripe(item->size,s->streams,0,&off,&len);
+  cs->stripe_data = item->data;
+  cs->stripe_slot = cs->slot;
+  cs->stripe_off = off;
+  cs->stripe_end = off + len;
+  return 1;
+}
+
+/*******************************************************
+ * Extra stream: pick up its stripe of the packet stream
+ * 0 started, if it has not read it yet. Returns 1 if
+ * there is a stripe to read, 0 if not (yet), -1 once
+ * stream 0 is gone.
+ * ****************************************************/
+int next_stripe(client_state *cs)
+{
+  stripe_session *s = cs->session;
+  size_t off, len = 0;
+  int ret = 0;
+
+  pthread_mutex_lock(&s->lock);
+  if (!s->conns[0]) {
+    ret = -1;
+  } else if (s->started > cs->nstripes) {
+    proto_stripe(s->size,s->streams,cs->stream,&off,&len);
+    cs->stripe_data = s->data;
+    cs->stripe_slot = s->slot;
+    cs->stripe_off = off;
+    cs->stripe_end = off + len;
+    ret = 1;
+  }
+  pthread_mutex_unlock(&s->lock);
+
+  if (ret == 1 && len == 0) { // small packet, nothing for this stream
+    stripe_done(cs);
+    ret = 0;
+  }
+  return ret;
+}
+
+/*******************************************************
+ * A stream has read its part of the packet. Returns 1
+ * if it was the last one; an extra stream then wakes
+ * up stream 0 to finish the packet.
+ * ****************************************************/
+int stripe_done(client_state *cs)
+{
+  stripe_session *s = cs->session;
+  int last;
+
+  pthread_mutex_lock(&s->lock);
+  last = (--s->left == 0);
+  if (cs->stream > 0) {
+    cs->nstripes++;
+    if (last && s->conns[0])
+      mail_client(s->conns[0]);
+  }
+  pthread_mutex_unlock(&s->lock);
+  return last;
+}
+
+/*******************************************************
+ * Stream 0, waiting in CONN_STRIPES: returns 1 once all
+ * stripes are in, 0 while they are not, -1 if a stream
+ * was lost before its stripe was
+ * ****************************************************/
+int stripes_ready(client_state *cs)
+{
+  stripe_session *s = cs->session;
+  int ret;
+
+  pthread_mutex_lock(&s->lock);
+  ret = (s->left == 0) ? 1 : s->lost ? -1 : 0;
+  pthread_mutex_unlock(&s->lock);
+  if (ret < 0)
+    fprintf(stderr,"  [%3d%%] -> Error: a stream of the client was lost, closing connection with client\n",\
+            100*(cs->cnt+1)/cs->npackets);
+  return ret;
+}
+
+/*******************************************************
+ * Detach a closing connection from its session. When
+ * stream 0 goes the others are told to close; if it
+ * goes in the middle of a packet, its slot is only
+ * given back by the last connection to leave, since
+ * stripes may still be landing in it.
+ * ****************************************************/
+void leave_session(client_state *cs)
+{
+  stripe_session *s = cs->session, **pp;
+  int ii, refs;
+
+  pthread_mutex_lock(&sessions_lock);
+  pthread_mutex_lock(&s->lock);
+  s->conns[cs->stream] = NULL;
+  if (cs->stream == 0) {
+    if (cs->state == CONN_BODY || cs->state == CONN_STRIPES) {
+      s->orphan = cs->slot;
+      cs->slot = -1;
+    }
+    for (ii = 1; ii < s->streams; ii++)
+      if (s->conns[ii])
+        mail_client(s->conns[ii]);
+  } else {
+    s->lost = 1;
+    if (s->conns[0])
+      mail_client(s->conns[0]);
+  }
+  refs = --s->refs;
+  pthread_mutex_unlock(&s->lock);
+  if (refs == 0) {
+    for (pp = &sessions; *pp != s; pp = &(*pp)->next)
+      ;
+    *pp = s->next;
+  }
+  pthread_mutex_unlock(&sessions_lock);
+
+  cs->session = NULL;
+  if (refs == 0) {
+    if (s->orphan >= 0)
+      discard_slot(buf,s->orphan);
+    pthread_mutex_destroy(&s->lock);
+    Free(s);
+  }
+}
+
+/*******************************************************
+ * Wake up a connection of another (or this) I/O thread:
+ * its thread runs it again from serve_mail. Callers
+ * hold the lock of the connection's session, which
+ * keeps it from closing meanwhile.
+ * ****************************************************/
+void mail_client(client_state *cs)
+{
+  io_thread *io = cs->io;
+  uint64_t one = 1;
+
+  pthread_mutex_lock(&io->mail_lock);
+  if (!cs->mailed) {
+    cs->mailed = 1;
+    cs->next_mail = io->mail_head;
+    io->mail_head = cs;
+  }
+  pthread_mutex_unlock(&io->mail_lock);
+  if (write(io->evfd,&one,sizeof(one)) < 0 && errno != EAGAIN)
+    unix_error("eventfd write error");
+}
+
+void serve_mail(io_thread *io)
+{
+  client_state *cs;
+  unsigned char *p;
+
+  while (1) {
+    pthread_mutex_lock(&io->mail_lock);
+    if ((cs = io->mail_head)) {
+      io->mail_head = cs->next_mail;
+      cs->mailed = 0;
+    }
+    pthread_mutex_unlock(&io->mail_lock);
+    if (!cs)
+      return;
+
+    // epoll only reads on events, act on the news here
+    if (!use_uring && next_input(cs,&p) < 0)
+      close_client(cs);
+    else if (!sync_client(cs))
+      close_client(cs);
+  }
+}
+
+#ifdef HAVE_IO_URING
+/*******************************************************
+ * Set up the io_uring of an I/O thread: register the
+ * ring storage, if it is an arena, so that packets are
+ * read into slots with READ_FIXED and their pages are
+ * not pinned on every read, and arm a multishot accept
+ * on the listening socket. Returns 0 if io_uring is not
+ * available.
+ * ****************************************************/
+int init_uring(io_thread *io, int listenfd)
+{
+  struct io_uring_sqe *sqe;
+  struct iovec *iov;
+  int ii;
+
+  if (!uring_init(&io->ring,URING_ENTRIES))
+    return 0;
+
+  if (buf->arena.base && buf->max_payload > 0) {
+    iov = (struct iovec *)Malloc(buf->n_items*sizeof(struct iovec));
+    for (ii = 0; ii < buf->n_items; ii++) {
+      iov[ii].iov_base = buf->arena.base + (size_t)ii*buf->max_payload;
+      iov[ii].iov_len = buf->max_payload;
+    }
+    io->fixed = uring_register_buffers(&io->ring,iov,buf->n_items);
+    if (!io->fixed && io == io_threads)
+      fprintf(stderr,"Cannot register the ring storage with io_uring: %s\n",strerror(errno));
+    Free(iov);
+  }
+
+  io->timer = 0;
+  io->tick.tv_sec = REPAIR_TICK_MS/1000;
+  io->tick.tv_nsec = (REPAIR_TICK_MS%1000)*1000000L;
+
+  // the accepted connections are this thread's
+  io->listenfd = listenfd;
+  sqe = uring_get_sqe(&io->ring);
+  uring_prep_multishot_accept(sqe,listenfd);
+  sqe->user_data = OP_ACCEPT;
+  return 1;
+}
+
+/*******************************************************
+ * io_uring I/O thread routine. Each connection has at
+ * most one read or chain of reads in flight, and a poll
+ * while replies are queued; every submission and wait
+ * is a single io_uring_enter.
+ * ****************************************************/
+void *uring_job(void *varargp)
+{
+  io_thread *io = (io_thread *)varargp;
+  struct io_uring_sqe *sqe;
+  struct io_uring_cqe *cqe;
+  client_state *cs;
+  uint64_t count;
+  unsigned flags;
+  int op, res;
+
+  Pthread_detach(Pthread_self());
+
+  sqe = uring_get_sqe(&io->ring);
+  uring_prep_poll(sqe,io->evfd,POLLIN);
+  sqe->user_data = OP_WAKE;
+
+  while (1) {
+    io->nsyscalls++;
+    uring_submit(&io->ring,1);
+
+    while ((cqe = uring_peek_cqe(&io->ring))) {
+      cs = (client_state *)(uintptr_t)(cqe->user_data & ~(uint64_t)OP_MASK);
+      op = cqe->user_data & OP_MASK;
+      res = cqe->res;
+      flags = cqe->flags;
+      uring_cqe_seen(&io->ring);
+
+      switch (op) {
+        case OP_RECV:
+          cs->nrecv--;
+          cs->inflight--;
+          // -ECANCELED: a read before it in the chain came up short
+          if (!cs->closing && res > 0) {
+            got_input(cs,res);
+          } else if (!cs->closing && res != -ECANCELED) {
+            if (cs->state == CONN_BODY)
+              fprintf(stderr,"  [%3d%%] -> Error: Packet has wrong size, closing connection with client\n",\
+                      100*(cs->cnt+1)/cs->npackets);
+            shut_client(cs);
+          }
+          uring_sync(cs);
+          break;
+        case OP_POLL:
+          cs->polling = 0;
+          cs->inflight--;
+          uring_sync(cs);
+          break;
+        case OP_ACCEPT:
+          if (res >= 0)
+            open_client(res,io);
+          if (!(flags & IORING_CQE_F_MORE)) { // no longer armed
+            if (res == -EINVAL)
+              app_error("io_uring error: multishot accept needs Linux 5.19");
+            sqe = uring_get_sqe(&io->ring);
+            uring_prep_multishot_accept(sqe,io->listenfd);
+            sqe->user_data = OP_ACCEPT;
+          }
+          break;
+        case OP_TIMER: // overdue repairs are dropped below
+          io->timer = 0;
+          break;
+        case OP_WAKE: // slots were released (served below) or mail came in
+          io->nsyscalls++;
+          if (read(io->evfd,&count,sizeof(count)) < 0 && errno != EAGAIN)
+            unix_error("eventfd read error");
+          serve_mail(io);
+          sqe = uring_get_sqe(&io->ring);
+          uring_prep_poll(sqe,io->evfd,POLLIN);
+          sqe->user_data = OP_WAKE;
+          break;
+      }
+    }
+
+    if (atomic_load(&io->nwaiting) > 0)
+      serve_waiting(io);
+    if (io->nparked > 0)
+      expire_repairs(io);
+    if (io->nparked > 0 && !io->timer) { // look again in REPAIR_TICK_MS
+      io->timer = 1;
+      sqe = uring_get_sqe(&io->ring);
+      uring_prep_timeout(sqe,&io->tick);
+      sqe->user_data = OP_TIMER;
+    }
+  }
+  return NULL;
+}
+
+/*******************************************************
+ * io_uring counterpart of sync_client: read on if no
+ * read is in flight, send queued replies and poll for
+ * the rest, and close the connection once it is shut
+ * down and nothing refers to it any more
+ * ****************************************************/
+void uring_sync(client_state *cs)
+{
+  struct io_uring_sqe *sqe;
+  ssize_t queued = 0;
+
+  if (!cs->closing && cs->nrecv == 0)
+    post_input(cs);
+
+  if (!cs->closing && cs->conn.outlen > cs->conn.outoff) {
+    cs->io->nsyscalls++;
+    if ((queued = proto_flush(&cs->conn)) < 0)
+      shut_client(cs);
+  }
+  if (!cs->closing && queued > 0 && !cs->polling) {
+    sqe = uring_get_sqe(&cs->io->ring);
+    uring_prep_poll(sqe,cs->conn.fd,POLLOUT);
+    sqe->user_data = (uintptr_t)cs | OP_POLL;
+    cs->polling = 1;
+    cs->inflight++;
+  }
+
+  if (cs->closing && cs->inflight == 0)
+    close_client(cs);
+}
+
+/*******************************************************
+ * Queue the next read of a connection. A packet body
+ * (or stripe) is read as a chain of up to CHAIN_LENGTH
+ * linked reads of PACKET_CHUNK, ending with the
+ * trailer, each hashed
+ * when it completes. A read that comes up short fails
+ * the rest of the chain, which is then queued again
+ * from where it stopped. Control messages are read one
+ * at a time with MSG_WAITALL.
+ * ****************************************************/
+void post_input(client_state *cs)
+{
+  io_thread *io = cs->io;
+  struct io_uring_sqe *sqe = NULL;
+  unsigned char *p;
+  ssize_t len;
+  size_t off;
+  int body, slot;
+
+  if ((len = next_input(cs,&p)) < 0) {
+    shut_client(cs);
+    return;
+  }
+  // nothing to read until a slot opens up or mail comes in
+  if (len == 0)
+    return;
+
+  body = (cs->state == CONN_BODY || cs->state == CONN_STRIPE || cs->state == CONN_REPAIR);
+  slot = -1;
+  if (body)
+    input_span(cs,0,&p,&slot);
+  off = 0;
+  while (len > 0 && cs->nrecv < CHAIN_LENGTH) {
+    if (sqe)
+      sqe->flags |= IOSQE_IO_LINK;
+    sqe = uring_get_sqe(&io->ring);
+    if (slot >= 0 && io->fixed)
+      uring_prep_read_fixed(sqe,cs->conn.fd,p,len,slot);
+    else
+      uring_prep_recv(sqe,cs->conn.fd,p,len,MSG_WAITALL);
+    sqe->user_data = (uintptr_t)cs | OP_RECV;
+    cs->nrecv++;
+    cs->inflight++;
+
+    if (!body)
+      break;
+    off += len;
+    len = input_span(cs,off,&p,&slot);
+  }
+}
+
+/*******************************************************
+ * Stop serving a connection. Reads in flight complete
+ * when the socket is shut down; uring_sync closes it
+ * after the last one.
+ * ****************************************************/
+void shut_client(client_state *cs)
+{
+  if (cs->closing)
+    return;
+  cs->closing = 1;
+  cs->io->nsyscalls++;
+  shutdown(cs->conn.fd,SHUT_RDWR);
+}
+#endif
+
+/*******************************************************************
+ * Worker thread routine that takes items from the buffer and
+ * processes them. Blocks while the buffer is empty. Packets from a
+ * client that asked for in-order processing wait for their
+ * predecessor to finish; since each client's slots are taken in
+ * order (the fair queue holds a slot back until its predecessor was
+ * taken) the predecessor is always already held by another worker.
+ *******************************************************************/
+void *worker_job(void *varargp)
+{
+  stage *st = (stage *)varargp;
+  int slot, done, left;
+  buf_item *item;
+  client_order *order;
+  long seq;
+
+  Pthread_detach(Pthread_self());
+
+  while (1) {
+    item = stage_take(st,&slot);
+    order = (client_order *)st->in->tag[slot].owner;
+    seq = st->in->tag[slot].seq;
+    if (st->index == 0 && st->in->state[slot] == SLOT_READY)
+      lat_record(&stages[STAGE_QUEUE],get_time_ns() - item->ready_ns);
+
+    if (order && order->ordered) {
+      pthread_mutex_lock(&order->lock);
+      while (order->next[st->index] != seq)
+        pthread_cond_wait(&order->cond,&order->lock);
+      pthread_mutex_unlock(&order->lock);
+    }
+
+    if (st->in->state[slot] == SLOT_READY)
+      lat_record(&stages[STAGE_PROCESS],stage_run(st,item));
+
+    // passed on before the client's next packet may be, so that the
+    // next stage gets them in order too
+    left = stage_pass(st,slot);
+    if (left && fq && order)
+      fq_drop(fq,&order->flow);
+
+    if (order) {
+      pthread_mutex_lock(&order->lock);
+      order->next[st->index]++;
+      done = order_done(order);
+      pthread_cond_broadcast(&order->cond);
+      pthread_mutex_unlock(&order->lock);
+      if (done) { // last slot of a closed connection
+        pthread_mutex_destroy(&order->lock);
+        pthread_cond_destroy(&order->cond);
+        Free(order);
+      }
+    }
+
+    if (left) {
+      wake_io_threads();
+      print_idle();
+    }
+  }
+  return NULL;
+}
+
+/*******************************************************************
+ * Whether every stage is done with all the slots of a closed
+ * connection, with the order lock held
+ *******************************************************************/
+int order_done(client_order *order)
+{
+  int ii;
+
+  for (ii = 0; ii < proc_pipe.nstages; ii++) {
+    if (order->next[ii] != order->total)
+      return 0;
+  }
+  return order->closed;
+}
+
+/*******************************************************************
+ * Build the pipeline from -g: stages separated by commas, each
+ * "process" (the -k kernel and -p cost) or a kernel, as
+ * <name>[:isa][=workers]. Returns 0 if the spec is invalid.
+ *******************************************************************/
+int parse_stages(char *spec)
+{
+  char *name, *eq, *save;
+  stage_kernel *sk;
+  stage *st;
+  int workers;
+
+  for (name = strtok_r(spec,",",&save); name; name = strtok_r(NULL,",",&save)) {
+    workers = 1;
+    if ((eq = strchr(name,'='))) {
+      *eq = '\0';
+      workers = atoi(eq+1);
+    }
+    if (!strcmp(name,"process")) {
+      st = pipeline_add(&proc_pipe,name,process_stage,NULL,workers);
+    } else {
+      sk = (stage_kernel *)Malloc(sizeof(stage_kernel));
+      if (!(sk->k = kernel_parse(name,&sk->isa))) {
+        fprintf(stderr,"Unknown pipeline stage: %s\n",name);
+        Free(sk);
+        return 0;
+      }
+      st = pipeline_add(&proc_pipe,sk->k->name,kernel_stage,sk,workers);
+    }
+    if (!st) {
+      fprintf(stderr,"Too many pipeline stages, at most %d\n",MAX_STAGES);
+      return 0;
+    }
+  }
+  return proc_pipe.nstages > 0;
+}
+
+/*******************************************************************
+ * The "process" stage: the -k kernel, and the simulated -p cost of
+ * the packet as received. Packets the kernel does not take get the
+ * simulated cost only.
+ *******************************************************************/
+void process_stage(buf_item *item, void *arg)
+{
+  int takes = proc_kernel && proc_kernel->accepts(&item->shape);
+
+  if (!takes || process_cost > 0)
+    process_item(item,process_cost);
+  if (takes)
+    run_kernel(item,proc_kernel,proc_isa);
+}
+
+/* A kernel stage, packets the kernel does not take pass through */
+void kernel_stage(buf_item *item, void *arg)
+{
+  stage_kernel *sk = (stage_kernel *)arg;
+
+  run_kernel(item,sk->k,sk->isa);
+}
+
+/*******************************************************************
+ * Run a kernel in place over a packet, which then has the shape of
+ * the product. Returns 0 if the kernel does not take the packet.
+ *******************************************************************/
+int run_kernel(buf_item *item, kernel *k, int isa)
+{
+  if (kernel_run(k,isa,&item->shape,item->data,item->data) < 0)
+    return 0;
+  kernel_out_shape(k,&item->shape,&item->shape);
+  item->size = shape_size(&item->shape);
+  return 1;
+}
+
+/*******************************************************************
+ * Print the stage latencies whenever the server gets a SIGUSR1,
+ * which every other thread blocks
+ *******************************************************************/
+void *stats_job(void *varargp)
+{
+  sigset_t usr1;
+  int sig;
+
+  Pthread_detach(Pthread_self());
+  sigemptyset(&usr1);
+  sigaddset(&usr1,SIGUSR1);
+  while (sigwait(&usr1,&sig) == 0) {
+    printf("----------------------------------------------------------------\n");
+    printf("Packet stages, all clients:\n");
+    lat_print(stages,NSTAGES);
+    if (proc_pipe.nstages > 1)
+      pipeline_print(&proc_pipe);
+    printf("----------------------------------------------------------------\n");
+  }
+  return NULL;
+}
+
+/*******************************************************************
+ * Count a packet read by a connection, in its counters or the
+ * totals. Relaxed atomics: the metrics thread only needs each
+ * counter to be consistent with itself.
+ *******************************************************************/
+void count_packet(client_metrics *m, long bytes, long wire, int ok)
+{
+  atomic_fetch_add_explicit(&m->packets,1,memory_order_relaxed);
+  atomic_fetch_add_explicit(&m->bytes,bytes,memory_order_relaxed);
+  atomic_fetch_add_explicit(&m->wire_bytes,wire,memory_order_relaxed);
+  if (!ok)
+    atomic_fetch_add_explicit(&m->csum_failures,1,memory_order_relaxed);
+}
+
+/*******************************************************************
+ * Serve the metrics page to each scraper that connects (-e)
+ *******************************************************************/
+void *metrics_job(void *varargp)
+{
+  metrics_buf m;
+  int connfd;
+
+  Pthread_detach(Pthread_self());
+  metrics_init(&m);
+  while (1) {
+    if ((connfd = accept(metrics_fd,NULL,NULL)) < 0)
+      continue;
+    build_metrics(&m);
+    metrics_reply(&m,connfd);
+    Close(connfd);
+  }
+  return NULL;
+}
+
+/*******************************************************************
+ * The metrics page: totals and per-client counters, ring and
+ * worker gauges, and the stage latency histograms
+ *******************************************************************/
+void build_metrics(metrics_buf *m)
+{
+  static const char *stage_labels[NSTAGES] = {
+    "wire","slot_wait","checksum","enqueue","queue","process"
+  };
+  char labels[192];
+  client_state *cs;
+  stage *st;
+  long nwaiting = 0;
+  uint64_t idle_ns = 0;
+  int ii;
+
+  metrics_family(m,"server_packets_received_total","counter","Packets read from all clients.");
+  metrics_value(m,"server_packets_received_total",NULL,atomic_load(&totals.packets));
+  metrics_family(m,"server_bytes_received_total","counter","Bytes of packets read from all clients.");
+  metrics_value(m,"server_bytes_received_total",NULL,atomic_load(&totals.bytes));
+  metrics_family(m,"server_wire_bytes_received_total","counter",\
+                 "Bytes the packets took on the wire, fewer if compressed.");
+  metrics_value(m,"server_wire_bytes_received_total",NULL,atomic_load(&totals.wire_bytes));
+  metrics_family(m,"server_checksum_failures_total","counter","Packets dropped for a bad checksum.");
+  metrics_value(m,"server_checksum_failures_total",NULL,atomic_load(&totals.csum_failures));
+  metrics_family(m,"server_chunks_resent_total","counter",\
+                 "Chunks of corrupt packets the clients were asked to resend.");
+  metrics_value(m,"server_chunks_resent_total",NULL,atomic_load(&totals.chunks_resent));
+  metrics_family(m,"server_packets_repaired_total","counter",\
+                 "Packets published after their corrupt chunks were resent.");
+  metrics_value(m,"server_packets_repaired_total",NULL,atomic_load(&totals.repaired));
+
+  /* Per client, for the connections open now */
+  pthread_mutex_lock(&clients_lock);
+  metrics_family(m,"server_client_packets_received_total","counter","Packets read from a client.");
+  for (cs = clients; cs; cs = cs->next_client) {
+    snprintf(labels,sizeof(labels),"client=\"%s\"",cs->peer);
+    metrics_value(m,"server_client_packets_received_total",labels,atomic_load(&cs->stats.packets));
+  }
+  metrics_family(m,"server_client_bytes_received_total","counter","Bytes of packets read from a client.");
+  for (cs = clients; cs; cs = cs->next_client) {
+    snprintf(labels,sizeof(labels),"client=\"%s\"",cs->peer);
+    metrics_value(m,"server_client_bytes_received_total",labels,atomic_load(&cs->stats.bytes));
+  }
+  metrics_family(m,"server_client_checksum_failures_total","counter",\
+                 "Packets from a client dropped for a bad checksum.");
+  for (cs = clients; cs; cs = cs->next_client) {
+    snprintf(labels,sizeof(labels),"client=\"%s\"",cs->peer);
+    metrics_value(m,"server_client_checksum_failures_total",labels,\
+                  atomic_load(&cs->stats.csum_failures));
+  }
+  metrics_family(m,"server_client_chunks_resent_total","counter",\
+                 "Chunks of corrupt packets a client was asked to resend.");
+  for (cs = clients; cs; cs = cs->next_client) {
+    snprintf(labels,sizeof(labels),"client=\"%s\"",cs->peer);
+    metrics_value(m,"server_client_chunks_resent_total",labels,\
+                  atomic_load(&cs->stats.chunks_resent));
+  }
+  metrics_family(m,"server_client_slots_held","gauge",\
+                 "Ring slots reserved for a client and not yet released.");
+  for (cs = clients; cs; cs = cs->next_client) {
+    if (!cs->order)
+      continue;
+    snprintf(labels,sizeof(labels),"client=\"%s\",class=\"%s\"",cs->peer,\
+             fq_class_name(cs->order->flow.prio));
+    metrics_value(m,"server_client_slots_held",labels,atomic_load(&cs->order->flow.held));
+  }
+  if (fq) {
+    metrics_family(m,"server_client_slot_share","gauge",\
+                   "Ring slots a client may hold now (fair queuing).");
+    for (cs = clients; cs; cs = cs->next_client) {
+      if (!cs->order)
+        continue;
+      snprintf(labels,sizeof(labels),"client=\"%s\",class=\"%s\"",cs->peer,\
+               fq_class_name(cs->order->flow.prio));
+      metrics_value(m,"server_client_slot_share",labels,fq_limit(fq,&cs->order->flow));
+    }
+  }
+  pthread_mutex_unlock(&clients_lock);
+
+  if (fq) {
+    metrics_family(m,"server_fair_queue_packets","gauge",\
+                   "Packets taken from the ring into the per-client queues, not yet by a worker.");
+    metrics_value(m,"server_fair_queue_packets",NULL,atomic_load(&fq->queued));
+    metrics_family(m,"server_fair_queue_seconds","histogram",\
+                   "Time packets waited for a worker since they were committed, by class.");
+    for (ii = 0; ii < FQ_NCLASSES; ii++) {
+      snprintf(labels,sizeof(labels),"class=\"%s\"",fq_class_name(ii));
+      metrics_hist(m,"server_fair_queue_seconds",labels,&fq->wait[ii]);
+    }
+  }
+
+  metrics_family(m,"server_clients","gauge","Connected clients.");
+  metrics_value(m,"server_clients",NULL,nclients);
+  metrics_family(m,"server_ring_slots","gauge","Slots in the ring buffer.");
+  metrics_value(m,"server_ring_slots",NULL,buf->n_items);
+  metrics_family(m,"server_ring_slots_used","gauge","Slots reserved or holding a packet.");
+  metrics_value(m,"server_ring_slots_used",NULL,buf_used(buf));
+  for (ii = 0; ii < n_io_threads; ii++)
+    nwaiting += atomic_load(&io_threads[ii].nwaiting);
+  metrics_family(m,"server_connections_waiting","gauge","Connections waiting for a free slot.");
+  metrics_value(m,"server_connections_waiting",NULL,nwaiting);
+  metrics_family(m,"server_slot_wait_seconds_total","counter",\
+                 "Time connections spent waiting for a free slot.");
+  metrics_value(m,"server_slot_wait_seconds_total",NULL,\
+                atomic_load(&stages[STAGE_SLOT].sum)/1e9);
+  metrics_family(m,"server_workers","gauge","Processing worker threads.");
+  metrics_value(m,"server_workers",NULL,pipeline_workers(&proc_pipe));
+  for (ii = 0; ii < proc_pipe.nstages; ii++)
+    idle_ns += atomic_load(&proc_pipe.stages[ii].idle_ns);
+  metrics_family(m,"server_worker_idle_seconds_total","counter",\
+                 "Time workers spent waiting for a packet.");
+  metrics_value(m,"server_worker_idle_seconds_total",NULL,idle_ns/1e9);
+
+  /* Per pipeline stage */
+  metrics_family(m,"server_pipeline_workers","gauge","Worker threads of a pipeline stage.");
+  for (ii = 0; ii < proc_pipe.nstages; ii++) {
+    st = &proc_pipe.stages[ii];
+    pipeline_labels(st,labels,sizeof(labels));
+    metrics_value(m,"server_pipeline_workers",labels,st->n_workers);
+  }
+  metrics_family(m,"server_pipeline_occupancy","gauge",\
+                 "Packets queued for or held by a pipeline stage.");
+  for (ii = 0; ii < proc_pipe.nstages; ii++) {
+    st = &proc_pipe.stages[ii];
+    pipeline_labels(st,labels,sizeof(labels));
+    metrics_value(m,"server_pipeline_occupancy",labels,stage_occupancy(st));
+  }
+  metrics_family(m,"server_pipeline_packets_total","counter","Packets a pipeline stage processed.");
+  for (ii = 0; ii < proc_pipe.nstages; ii++) {
+    st = &proc_pipe.stages[ii];
+    pipeline_labels(st,labels,sizeof(labels));
+    metrics_value(m,"server_pipeline_packets_total",labels,atomic_load(&st->packets));
+  }
+  metrics_family(m,"server_pipeline_bytes_total","counter",\
+                 "Bytes of image data a pipeline stage processed.");
+  for (ii = 0; ii < proc_pipe.nstages; ii++) {
+    st = &proc_pipe.stages[ii];
+    pipeline_labels(st,labels,sizeof(labels));
+    metrics_value(m,"server_pipeline_bytes_total",labels,atomic_load(&st->bytes));
+  }
+  metrics_family(m,"server_pipeline_busy_seconds_total","counter",\
+                 "Time the workers of a pipeline stage spent processing.");
+  for (ii = 0; ii < proc_pipe.nstages; ii++) {
+    st = &proc_pipe.stages[ii];
+    pipeline_labels(st,labels,sizeof(labels));
+    metrics_value(m,"server_pipeline_busy_seconds_total",labels,atomic_load(&st->busy_ns)/1e9);
+  }
+  metrics_family(m,"server_pipeline_idle_seconds_total","counter",\
+                 "Time the workers of a pipeline stage spent waiting for a packet.");
+  for (ii = 0; ii < proc_pipe.nstages; ii++) {
+    st = &proc_pipe.stages[ii];
+    pipeline_labels(st,labels,sizeof(labels));
+    metrics_value(m,"server_pipeline_idle_seconds_total",labels,atomic_load(&st->idle_ns)/1e9);
+  }
+  metrics_family(m,"server_pipeline_queue_seconds","histogram",\
+                 "Time packets waited in the input ring of a pipeline stage.");
+  for (ii = 0; ii < proc_pipe.nstages; ii++) {
+    st = &proc_pipe.stages[ii];
+    pipeline_labels(st,labels,sizeof(labels));
+    metrics_hist(m,"server_pipeline_queue_seconds",labels,&st->queue);
+  }
+
+  metrics_family(m,"server_stage_latency_seconds","histogram",\
+                 "Latency of each stage a packet goes through.");
+  for (ii = 0; ii < NSTAGES; ii++) {
+    snprintf(labels,sizeof(labels),"stage=\"%s\"",stage_labels[ii]);
+    metrics_hist(m,"server_stage_latency_seconds",labels,&stages[ii]);
+  }
+}
+
+/* Labels of a pipeline stage, by name and position */
+void pipeline_labels(stage *st, char *labels, size_t len)
+{
+  snprintf(labels,len,"stage=\"%s\",position=\"%d\"",st->name,st->index);
+}
+
+/*******************************************************************
+ * Tell the I/O threads that have connections waiting for a slot
+ * that one has been released
+ *******************************************************************/
+void wake_io_threads()
+{
+  uint64_t one = 1;
+  int ii;
+
+  atomic_thread_fence(memory_order_seq_cst); // see the waiter or be seen by it
+  for (ii = 0; ii < n_io_threads; ii++) {
+    if (atomic_load(&io_threads[ii].nwaiting) > 0 &&
+        write(io_threads[ii].evfd,&one,sizeof(one)) < 0 && errno != EAGAIN)
+      unix_error("eventfd write error");
+  }
+}
+
+/*******************************************************************
+ * Let the user know when the server has gone idle, i.e. there are
+ * no connected clients and no packets left in the buffer
+ *******************************************************************/
+void print_idle()
+{
+  pthread_mutex_lock(&nclients_lock);
+  if (!idle && nclients == 0 && pipeline_used(&proc_pipe) == 0) {
+    printf("No packets in processing queue, waiting...\n");
+    idle = 1;
+  }
+  pthread_mutex_unlock(&nclients_lock);
+}
+
+/************************************************
+ * Close any open file descriptors
+ * **********************************************/
+void close_openfds(int *clientfd, int *serverfd)
+{
+  if (*clientfd >= 0)
+      Close(*clientfd);
+  if (*serverfd >= 0)
+      Close(*serverfd);
+}
+
+/********************************************
+ * Free ring buffer memory upon exit (ctrl-c),
+ * after reporting the system calls the I/O
+ * threads made per packet. The workers still
+ * wait in the fair queue and the stage rings,
+ * which are left alone: destroying a condition
+ * a thread waits on blocks until it wakes.
+ * ******************************************/
+void sigint_handler(int sig)
+{
+  long nsyscalls = 0, npackets = atomic_load(&npackets_in);
+  int ii;
+
+  for (ii = 0; io_threads && ii < n_io_threads; ii++)
+    nsyscalls += io_threads[ii].nsyscalls;
+  if (npackets > 0)
+    printf("\nI/O system calls: %ld for %ld packets, %.1f per packet\n",\
+           nsyscalls,npackets,(double)nsyscalls/npackets);
   destroy_buf(buf);
   exit(0);
 }
@@ -295,7 +2908,44 @@ void print_usage()
   fprintf(stderr, "Usage: ./server <port> [-options]\n");
   fprintf(stderr, "Options:\n");
   fprintf(stderr, "  -n <int> number of packets that can be held in buffer (default=8)\n");
-  fprintf(stderr, "  -c       use MD5 checksumming on packets (warning: is slow)\n");
+  fprintf(stderr, "  -w <int> number of processing worker threads (default=1)\n");
+  fprintf(stderr, "  -i <int> number of I/O threads serving client connections (default=1)\n");
+  fprintf(stderr, "  -c <str> checksum to ask clients for: md5, crc32c, xxh3, tree\n");
+  fprintf(stderr, "           (parallel MD5 tree) or none (default=none)\n");
+  fprintf(stderr, "  -T <int> threads hashing the leaves of tree checksums (default=one per CPU)\n");
+  fprintf(stderr, "  -s <int> socket buffer size in KB (default=system)\n");
+  fprintf(stderr, "  -M <int> memory for packets in the buffer in MB (default=room for n legacy\n");
+  fprintf(stderr, "           128 MB packets), larger packets than 1/n of it are refused\n");
+  fprintf(stderr, "  -H <str> back the ring storage with huge pages: hugetlb or thp\n");
+  fprintf(stderr, "  -N <int> bind the ring storage and server threads to this NUMA node\n");
+  fprintf(stderr, "           (the NIC's is in /sys/class/net/<if>/device/numa_node)\n");
+  fprintf(stderr, "  -K <int> most connections a client may stripe each packet across, 1 = no\n");
+  fprintf(stderr, "           striping (default=%d)\n",DEFAULT_MAX_STREAMS);
+  fprintf(stderr, "  -p <int> simulated processing cost in us of CPU time per MB of image\n");
+  fprintf(stderr, "           data (default=0)\n");
+  fprintf(stderr, "  -k <str> run a kernel over the image data of each f32 packet, as\n");
+  fprintf(stderr, "           <name>[:scalar|avx2|avx512] (default=the best ISA the CPU has):\n");
+  fprintf(stderr, "           magphase, decimate2, decimate4, stats, quantize\n");
+  fprintf(stderr, "  -g <str> processing pipeline: stages separated by commas, each the\n");
+  fprintf(stderr, "           -k/-p work (\"process\") or a kernel, as <name>[:isa][=workers]\n");
+  fprintf(stderr, "           (default=process=<-w>)\n");
+  fprintf(stderr, "  -Q <int> fair queuing quantum in KB served per round and unit of a\n");
+  fprintf(stderr, "           client's share, 0 = take packets in arrival order and let any\n");
+  fprintf(stderr, "           client hold every slot (default=largest packet)\n");
+  fprintf(stderr, "  -U <str> let clients at these numeric addresses, separated by commas,\n");
+  fprintf(stderr, "           ask for the urgent class, or any client with \"any\"\n");
+  fprintf(stderr, "           (default=none, every client is bulk)\n");
+  fprintf(stderr, "  -e <str> serve Prometheus metrics on this port of 127.0.0.1, or on a\n");
+  fprintf(stderr, "           Unix socket if it is a path\n");
+  fprintf(stderr, "  -F <num> fault injection: flip a random bit of the image data read\n");
+  fprintf(stderr, "           every <num> MB on average (default=off)\n");
   fprintf(stderr, "  -h       usage\n");
+  fprintf(stderr, "  -m       use the mutex/semaphore ring buffer instead of the lock-free one\n");
   fprintf(stderr, "  -v       print buffer contents after enqueuing each packet\n");
+  fprintf(stderr, "  -P       pre-fault the ring storage at startup\n");
+  fprintf(stderr, "  -L       lock the ring storage in memory (mlock)\n");
+  fprintf(stderr, "  -x       share the ring storage with clients on this host (client -x)\n");
+  fprintf(stderr, "  -u       serve connections with io_uring instead of epoll\n");
+  fprintf(stderr, "           (-H, -N, -P, -L and -x put the ring storage in one arena of\n");
+  fprintf(stderr, "           n x largest packet bytes instead of allocating per packet)\n");
 }
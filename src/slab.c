@@ -0,0 +1,133 @@
+/******************************************
+ * Size-classed slab pool.
+ *
+ * Packet payloads are allocated from power-
+ * of-two size classes, so a 4 MB optical
+ * chip uses a 4 MB buffer while a 128 MB SAR
+ * image uses a 128 MB one. Buffers are only
+ * allocated when first needed and go back to
+ * a free list of their class when released,
+ * so steady traffic reuses warm memory. When
+ * the budget is reached, free buffers of
+ * other classes are given back to the system
+ * to make room.
+ *
+ * Author: Aleksander Bapst
+ * ****************************************/
+#include "slab.h"
+
+void slab_init(slab_pool *pool, size_t budget)
+{
+  int ii;
+
+  pthread_mutex_init(&pool->lock,NULL);
+  pool->budget = budget;
+  pool->allocated = 0;
+  pool->in_use = 0;
+  for (ii = 0; ii < SLAB_NCLASSES; ii++) {
+    pool->free[ii] = NULL;
+    pool->nfree[ii] = 0;
+  }
+}
+
+/******************************************************
+ * Give every free buffer back to the system
+ * ****************************************************/
+void slab_destroy(slab_pool *pool)
+{
+  void *p;
+  int ii;
+
+  for (ii = 0; ii < SLAB_NCLASSES; ii++) {
+    while ((p = pool->free[ii])) {
+      pool->free[ii] = *(void **)p;
+      Free(p);
+    }
+    pool->nfree[ii] = 0;
+  }
+  pthread_mutex_destroy(&pool->lock);
+}
+
+/******************************************************
+ * Smallest class that holds `size` bytes, -1 if the
+ * size is larger than the largest class
+ * ****************************************************/
+int slab_class(size_t size)
+{
+  int cls = 0;
+
+  while (cls < SLAB_NCLASSES && SLAB_CLASS_SIZE(cls) < size)
+    cls++;
+  return (cls < SLAB_NCLASSES) ? cls : -1;
+}
+
+/******************************************************
+ * Largest buffer size such that `nbufs` buffers of
+ * that size always fit in the budget together. An
+ * allocation of at most this size never fails while
+ * fewer than `nbufs` buffers are in use.
+ * ****************************************************/
+size_t slab_max_size(slab_pool *pool, int nbufs)
+{
+  size_t share = pool->budget/nbufs;
+  int cls = SLAB_NCLASSES-1;
+
+  while (cls >= 0 && SLAB_CLASS_SIZE(cls) > share)
+    cls--;
+  return (cls >= 0) ? SLAB_CLASS_SIZE(cls) : 0;
+}
+
+/******************************************************
+ * Allocate a buffer of at least `size` bytes and store
+ * its class in *cls for slab_free. Returns NULL if the
+ * budget does not allow it.
+ * ****************************************************/
+void *slab_alloc(slab_pool *pool, size_t size, int *cls)
+{
+  void *p = NULL;
+  size_t bytes;
+  int ii;
+
+  if ((*cls = slab_class(size)) < 0)
+    return NULL;
+  bytes = SLAB_CLASS_SIZE(*cls);
+
+  pthread_mutex_lock(&pool->lock);
+  if ((p = pool->free[*cls])) {
+    pool->free[*cls] = *(void **)p;
+    pool->nfree[*cls]--;
+  } else {
+    // make room by releasing idle buffers, largest classes first
+    for (ii = SLAB_NCLASSES-1; ii >= 0 && pool->allocated+bytes > pool->budget; ii--) {
+      while (pool->free[ii] && pool->allocated+bytes > pool->budget) {
+        p = pool->free[ii];
+        pool->free[ii] = *(void **)p;
+        pool->nfree[ii]--;
+        pool->allocated -= SLAB_CLASS_SIZE(ii);
+        Free(p);
+      }
+    }
+    p = NULL;
+    if (pool->allocated+bytes <= pool->budget) {
+      p = Malloc(bytes);
+      pool->allocated += bytes;
+    }
+  }
+  if (p)
+    pool->in_use += bytes;
+  pthread_mutex_unlock(&pool->lock);
+  return p;
+}
+
+/******************************************************
+ * Return a buffer to the free list of its class
+ * ****************************************************/
+void slab_free(slab_pool *pool, void *p, int cls)
+{
+  pthread_mutex_lock(&pool->lock);
+  *(void **)p = pool->free[cls];
+  pool->free[cls] = p;
+  pool->nfree[cls]++;
+  pool->in_use -= SLAB_CLASS_SIZE(cls);
+  pthread_mutex_unlock(&pool->lock);
+}
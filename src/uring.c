@@ -0,0 +1,215 @@
+/******************************************
+ * Minimal io_uring wrapper.
+ *
+ * Just enough of liburing for the server's
+ * io_uring backend, on top of the raw
+ * io_uring_setup/enter/register syscalls,
+ * so that it builds wherever the kernel
+ * headers are installed. The rings are
+ * shared with the kernel: we publish SQ tail
+ * and CQ head with release stores and read
+ * the kernel's SQ head and CQ tail with
+ * acquire loads.
+ *
+ * Built only with HAVE_IO_URING (see the
+ * Makefile).
+ *
+ * Author: Aleksander Bapst
+ * ****************************************/
+#include "uring.h"
+
+#ifdef HAVE_IO_URING
+#include <sys/syscall.h>
+
+/******************************************************
+ * Set up a ring with room for `entries` submissions.
+ * Returns 0 (with errno set) if io_uring is not
+ * available, e.g. disabled by kernel.io_uring_disabled.
+ * ****************************************************/
+int uring_init(uring *r, unsigned entries)
+{
+  struct io_uring_params p;
+  unsigned char *sq, *cq;
+
+  memset(r,0,sizeof(uring));
+  memset(&p,0,sizeof(p));
+  if ((r->fd = syscall(SYS_io_uring_setup,entries,&p)) < 0)
+    return 0;
+
+  r->sq_map_size = p.sq_off.array + p.sq_entries*sizeof(unsigned);
+  r->cq_map_size = p.cq_off.cqes + p.cq_entries*sizeof(struct io_uring_cqe);
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    if (r->cq_map_size > r->sq_map_size)
+      r->sq_map_size = r->cq_map_size;
+    r->cq_map_size = r->sq_map_size;
+  }
+
+  sq = mmap(NULL,r->sq_map_size,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_POPULATE,\
+            r->fd,IORING_OFF_SQ_RING);
+  if (sq == MAP_FAILED)
+    unix_error("mmap error");
+  cq = sq;
+  if (!(p.features & IORING_FEAT_SINGLE_MMAP)) {
+    cq = mmap(NULL,r->cq_map_size,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_POPULATE,\
+              r->fd,IORING_OFF_CQ_RING);
+    if (cq == MAP_FAILED)
+      unix_error("mmap error");
+  }
+  r->sq_map = sq;
+  r->cq_map = cq;
+
+  r->sqes = mmap(NULL,p.sq_entries*sizeof(struct io_uring_sqe),PROT_READ|PROT_WRITE,\
+                 MAP_SHARED|MAP_POPULATE,r->fd,IORING_OFF_SQES);
+  if (r->sqes == MAP_FAILED)
+    unix_error("mmap error");
+
+  r->sq_head = (atomic_uint *)(sq + p.sq_off.head);
+  r->sq_tail = (atomic_uint *)(sq + p.sq_off.tail);
+  r->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+  r->sq_array = (unsigned *)(sq + p.sq_off.array);
+  r->sq_entries = p.sq_entries;
+  r->sq_local_tail = atomic_load_explicit(r->sq_tail,memory_order_relaxed);
+
+  r->cq_head = (atomic_uint *)(cq + p.cq_off.head);
+  r->cq_tail = (atomic_uint *)(cq + p.cq_off.tail);
+  r->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+  r->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+  return 1;
+}
+
+void uring_exit(uring *r)
+{
+  munmap(r->sqes,r->sq_entries*sizeof(struct io_uring_sqe));
+  if (r->cq_map != r->sq_map)
+    munmap(r->cq_map,r->cq_map_size);
+  munmap(r->sq_map,r->sq_map_size);
+  Close(r->fd);
+}
+
+/******************************************************
+ * Next free submission entry, cleared. Submits what is
+ * queued first if the ring is full.
+ * ****************************************************/
+struct io_uring_sqe *uring_get_sqe(uring *r)
+{
+  struct io_uring_sqe *sqe;
+  unsigned head;
+
+  head = atomic_load_explicit(r->sq_head,memory_order_acquire);
+  if (r->sq_local_tail - head == r->sq_entries) {
+    uring_submit(r,0);
+    head = atomic_load_explicit(r->sq_head,memory_order_acquire);
+    if (r->sq_local_tail - head == r->sq_entries)
+      app_error("io_uring error: submission queue full");
+  }
+  sqe = &r->sqes[r->sq_local_tail & *r->sq_mask];
+  memset(sqe,0,sizeof(*sqe));
+  r->sq_array[r->sq_local_tail & *r->sq_mask] = r->sq_local_tail & *r->sq_mask;
+  r->sq_local_tail++;
+  return sqe;
+}
+
+/******************************************************
+ * Submit the queued entries and wait for at least
+ * `wait_nr` completions, in one system call. Returns
+ * the number of entries submitted.
+ * ****************************************************/
+int uring_submit(uring *r, unsigned wait_nr)
+{
+  unsigned tail = atomic_load_explicit(r->sq_tail,memory_order_relaxed);
+  unsigned nsubmit = r->sq_local_tail - tail;
+  int ret;
+
+  atomic_store_explicit(r->sq_tail,r->sq_local_tail,memory_order_release);
+  while ((ret = syscall(SYS_io_uring_enter,r->fd,nsubmit,wait_nr,\
+                        wait_nr ? IORING_ENTER_GETEVENTS : 0,NULL,0)) < 0) {
+    if (errno != EINTR && errno != EAGAIN && errno != EBUSY)
+      unix_error("io_uring_enter error");
+    if (errno != EINTR) // completions must be reaped first
+      return 0;
+  }
+  return ret;
+}
+
+/******************************************************
+ * Oldest unseen completion, NULL if there is none
+ * ****************************************************/
+struct io_uring_cqe *uring_peek_cqe(uring *r)
+{
+  unsigned head = atomic_load_explicit(r->cq_head,memory_order_relaxed);
+
+  if (head == atomic_load_explicit(r->cq_tail,memory_order_acquire))
+    return NULL;
+  return &r->cqes[head & *r->cq_mask];
+}
+
+void uring_cqe_seen(uring *r)
+{
+  unsigned head = atomic_load_explicit(r->cq_head,memory_order_relaxed);
+
+  atomic_store_explicit(r->cq_head,head+1,memory_order_release);
+}
+
+/******************************************************
+ * Pin `n` buffers for IORING_OP_READ_FIXED. Returns 0
+ * (with errno set) on failure, e.g. RLIMIT_MEMLOCK.
+ * ****************************************************/
+int uring_register_buffers(uring *r, struct iovec *iov, unsigned n)
+{
+  return syscall(SYS_io_uring_register,r->fd,IORING_REGISTER_BUFFERS,iov,n) == 0;
+}
+
+/******************************************************
+ * Preparation of the operations used by the server
+ * ****************************************************/
+void uring_prep_recv(struct io_uring_sqe *sqe, int fd, void *p, size_t len, int flags)
+{
+  sqe->opcode = IORING_OP_RECV;
+  sqe->fd = fd;
+  sqe->addr = (uintptr_t)p;
+  sqe->len = len;
+  sqe->msg_flags = flags;
+}
+
+void uring_prep_read_fixed(struct io_uring_sqe *sqe, int fd, void *p, size_t len, int buf_index)
+{
+  sqe->opcode = IORING_OP_READ_FIXED;
+  sqe->fd = fd;
+  sqe->addr = (uintptr_t)p;
+  sqe->len = len;
+  sqe->off = (uint64_t)-1; // current position, sockets have none
+  sqe->buf_index = buf_index;
+}
+
+void uring_prep_read(struct io_uring_sqe *sqe, int fd, void *p, size_t len)
+{
+  sqe->opcode = IORING_OP_READ;
+  sqe->fd = fd;
+  sqe->addr = (uintptr_t)p;
+  sqe->len = len;
+  sqe->off = (uint64_t)-1;
+}
+
+void uring_prep_poll(struct io_uring_sqe *sqe, int fd, unsigned events)
+{
+  sqe->opcode = IORING_OP_POLL_ADD;
+  sqe->fd = fd;
+  sqe->poll32_events = events;
+}
+
+void uring_prep_multishot_accept(struct io_uring_sqe *sqe, int fd)
+{
+  sqe->opcode = IORING_OP_ACCEPT;
+  sqe->fd = fd;
+  sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+}
+
+/* Completes with -ETIME once ts has passed, ts must live until then */
+void uring_prep_timeout(struct io_uring_sqe *sqe, struct __kernel_timespec *ts)
+{
+  sqe->opcode = IORING_OP_TIMEOUT;
+  sqe->fd = -1;
+  sqe->addr = (uintptr_t)ts;
+  sqe->len = 1;
+}
+#endif